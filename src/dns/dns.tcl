@@ -14,125 +14,506 @@ namespace eval vessel::dns {
 
         variable domain_store [dict create]
         
-        oo::class create transform {
+        oo::class create DNSServer {
 
-            constructor {} {
+            variable store [dict create]
+            variable udp_channel
+            variable tcp_server
+
+            # Responses generated while answering a batch of queries.  They
+            # are sent with one sendbatch call at the end of pkt_ready.
+            variable udp_batch
+            variable batching
+
+            # List of {ip port} pairs.  Names that aren't in the store are
+            # forwarded to each upstream in order until one answers.
+            variable upstreams
+            variable upstream_channel
+            variable upstream_timeout
+
+            # Forwarded queries waiting for an upstream answer keyed by the
+            # id used in the upstream query.
+            variable pending
+
+            # Queries received over tcp that are forwarded to the upstreams
+            # over tcp, since their answers may not fit in a udp response,
+            # keyed by the channel to the upstream.
+            variable tcp_pending
+
+            # Upstream responses keyed by {qname qtype}.  Each value is
+            # {expires stored raw_response}.
+            variable cache
+            variable max_cache_entries
+            variable max_cache_ttl
+
+            # Handle of the native udp worker pool or empty if udp is
+            # served from the event loop.
+            variable workers
+
+            constructor {port ip {worker_count 0}} {
+
+                set store [dict create]
+                set pending [dict create]
+                set tcp_pending [dict create]
+                set cache [dict create]
+                set upstreams {}
+                set upstream_channel {}
+                set upstream_timeout 2000
+                set max_cache_entries 4096
+                set max_cache_ttl 86400
+                set workers {}
+                set udp_channel {}
+                set udp_batch {}
+                set batching 0
+
+                if {$worker_count > 0} {
+                    #Native threads each with their own SO_REUSEPORT socket
+                    #answer udp queries from a copy of the store.
+                    set workers [vessel::dns::workers_start -myaddr $ip $port $worker_count $store]
+                } else {
+
+                    #Add support for listening on a specific ip
+                    #address
+                    set udp_channel [vessel::udp_open -myaddr $ip $port]
+                    fconfigure $udp_channel -translation binary -buffering none -blocking false
+                    fileevent $udp_channel readable [list [self] pkt_ready]
+                }
 
+                #Clients retry over tcp when a udp response is truncated
+                set tcp_server [vessel::dns::tcp_listen -myaddr $ip $port [list [self] tcp_query]]
             }
 
-            method initialize {handle mode} {
+            method set_upstreams {servers {timeout_ms 2000}} {
 
-                return "initialize clear finalize read write"
-            }
+                if {$workers ne {}} {
+                    return -code error -errorcode {DNS UPSTREAM UNSUPPORTED} \
+                        "Forwarding to upstream servers is not supported with native workers"
+                }
+
+                # servers is a list of ip or ip:port values
+                set upstreams {}
+                foreach server $servers {
+                    lassign [split $server :] upstream_ip upstream_port
+                    if {$upstream_port eq {}} {
+                        set upstream_port 53
+                    }
+                    lappend upstreams [list $upstream_ip $upstream_port]
+                }
+                set upstream_timeout $timeout_ms
 
-            method clear {} {
-                
+                if {$upstreams ne {} && $upstream_channel eq {}} {
+                    set upstream_channel [vessel::udp_open]
+                    fconfigure $upstream_channel -translation binary -buffering none -blocking false
+                    fileevent $upstream_channel readable [list [self] upstream_ready]
+                }
             }
 
-            method finalize {handle} {
+            method lookup {qname} {
+
+                #Returns a two element list of addresses and ttl
+                set addresses {}
+                set ttl 0
+                if {$qname ne {}} {
+                    set entry [dict getnull $store [string tolower $qname]]
+                    if {$entry ne {}} {
+                        lassign $entry addresses ttl
+                    }
+                }
 
+                return [list $addresses $ttl]
             }
 
-            method limit {handle} {
-                return 0
+            method is_local {query} {
+                return [expr {$upstreams eq {} ||
+                              [dict exists $store [string tolower [vessel::dns::query_get $query qname]]]}]
             }
 
-            method read {handle buffer} {
+            method cache_key {query transport} {
 
-                set query [vessel::dns::parse_query $buffer]
-                return $query
+                #Answers are only reused for clients that can receive them.
+                #Udp clients are keyed by the EDNS payload size they
+                #advertise since the upstream sized the answer for it.
+                set limit [expr {$transport eq {tcp} ? {tcp} : [vessel::dns::query_get $query edns_size]}]
+                return [list [string tolower [vessel::dns::query_get $query qname]] \
+                            [vessel::dns::query_get $query type] $limit]
             }
 
-            method write {handle buffer} {
+            method answers_query {info query} {
+                return [expr {[string tolower [dict get $info qname]] eq
+                              [string tolower [vessel::dns::query_get $query qname]] &&
+                              [dict get $info type] == [vessel::dns::query_get $query type]}]
+            }
+
+            method cache_lookup {key id} {
+
+                #Returns the cached response with the id replaced or an
+                #empty string if there is no live entry.
+                if {![dict exists $cache $key]} {
+                    return {}
+                }
 
-                if {![dict exists $buffer raw_query] ||
-                    ![dict exists $buffer address] ||
-                    ![dict exists $buffer ttl]} {
-                    return -code error -errorcode {DNS RESPONSE INVALID} \
-                        "writing response to dns channel must be a dict with 'raw_query', 'address' and 'ttl' keys"
+                lassign [dict get $cache $key] expires stored raw_response
+                set now [clock seconds]
+                if {$now >= $expires} {
+                    dict unset cache $key
+                    return {}
                 }
 
-                set addr [dict get $buffer address]
-                set ttl [dict get $buffer ttl]
-                set raw_query [dict get $buffer raw_query]
-                # buffer should be an ipv4 address string or an empty string
-                set response [vessel::dns::generate_A_response $addr $ttl $raw_query]
-                return $response
+                return [vessel::dns::age_response $raw_response $id [expr {$now - $stored}]]
             }
 
-            destructor {
+            method cache_store {key ttl raw_response} {
+
+                set ttl [expr {min($ttl, $max_cache_ttl)}]
+                if {$ttl <= 0} {
+                    return
+                }
+
+                set now [clock seconds]
+                if {[dict size $cache] >= $max_cache_entries} {
+                    dict for {cached_key entry} $cache {
+                        if {[lindex $entry 0] <= $now} {
+                            dict unset cache $cached_key
+                        }
+                    }
+
+                    if {[dict size $cache] >= $max_cache_entries} {
+                        #Drop the oldest entry
+                        dict unset cache [lindex [dict keys $cache] 0]
+                    }
+                }
 
-                puts "Transform destructor"
+                dict set cache $key [list [expr {$now + $ttl}] $now $raw_response]
             }
-        }
-        
-        oo::class create DNSServer {
 
-            variable store [dict create]
-            variable udp_channel
-            variable message_channel
+            method send_udp {host port raw_response} {
 
-            constructor {port ip} {
+                if {$batching} {
+                    lappend udp_batch [list $raw_response $host $port]
+                    return
+                }
 
-                #Add support for listening on a specific ip
-                #address
-                set udp_channel [vessel::udp_open -myaddr $ip $port]
-                fconfigure $udp_channel -translation binary -buffering none -blocking false
+                #A client that can't be sent to shouldn't stop the rest of
+                #the batch from being answered
+                catch {vessel::udp send $udp_channel $raw_response $host $port}
+            }
 
-                #TODO: Proper way to delete this
-                set dns_transform [vessel::dns::_::transform new]
-                set message_channel [chan push $udp_channel $dns_transform]
-                fileevent $udp_channel readable [list [self] pkt_ready]
+            method flush_udp {} {
 
+                #Datagrams that don't fit in the socket buffer are dropped
+                #like any other udp response would be.
+                catch {vessel::udp sendbatch $udp_channel $udp_batch}
+                set udp_batch {}
             }
 
             method pkt_ready {} {
 
-                #Callback method invoked when the udp channel has a packet ready
+                #Callback method invoked when the udp channel has packets ready.
+                #Every queued datagram is answered in one pass of the event loop.
+                if {[catch {vessel::udp recv $udp_channel} datagrams]} {
+                    return
+                }
+
+                set batching 1
+                try {
+                    foreach datagram $datagrams {
+                        my handle_query {*}$datagram
+                    }
+                } finally {
+                    set batching 0
+                    my flush_udp
+                }
+            }
+
+            method handle_query {raw_query host port} {
+
+                #The query is parsed once and the same object is passed back
+                #to the response generator.
+                if {[catch {vessel::dns::parse_query $raw_query} query]} {
+                    #Malformed packets are dropped
+                    return
+                }
 
-                #Read the packet
-                set pkt [read $message_channel]
+                if {![my is_local $query]} {
+                    my forward $query $host $port
+                    return
+                }
 
-                #Configure the channel for response
-                fconfigure $udp_channel -remote [fconfigure $udp_channel -peer]
+                if {[vessel::dns::query_get $query type] != 1} {
+                    #Only A records are stored locally
+                    my send_udp $host $port [vessel::dns::generate_error_response 0 $query]
+                    return
+                }
 
                 #Create the response from the stored entries
-                set address {}
-                set qname [dict getnull $pkt "qname"]
-                if {$qname ne {}} {
-                    set entry [dict getnull $store $qname]
-                    set address [lindex $entry 0]
-                    set ttl [lindex $entry 1]
+                lassign [my lookup [vessel::dns::query_get $query qname]] addresses ttl
+                my send_udp $host $port [vessel::dns::generate_A_response $addresses $ttl $query]
+            }
+
+            method forward {query host port} {
+
+                set key [my cache_key $query udp]
+                set client_id [vessel::dns::query_get $query id]
+
+                set cached_response [my cache_lookup $key $client_id]
+                if {$cached_response ne {}} {
+                    my send_udp $host $port $cached_response
+                    return
+                }
+
+                #Give the upstream query its own id so concurrent clients that
+                #happen to use the same id don't collide.
+                if {[dict size $pending] >= 0x10000} {
+                    my send_udp $host $port [vessel::dns::generate_error_response 2 $query]
+                    return
                 }
 
-                if {$ttl eq {}} {
-                    set ttl 0
+                set upstream_id [expr {int(rand() * 0x10000)}]
+                while {[dict exists $pending $upstream_id]} {
+                    set upstream_id [expr {($upstream_id + 1) & 0xffff}]
                 }
-                
-                set response [dict create]
-                dict set response address $address
-                dict set response raw_query [dict get $pkt raw_query]
-                dict set response ttl $ttl
 
-                #Respond
-                puts -nonewline $message_channel $response
-                flush $message_channel       
+                dict set pending $upstream_id [dict create host $host port $port client_id $client_id \
+                                                   query $query key $key upstream 0 timer {}]
+                my send_upstream $upstream_id
+            }
+
+            method send_upstream {upstream_id} {
+
+                set request [dict get $pending $upstream_id]
+                lassign [lindex $upstreams [dict get $request upstream]] upstream_ip upstream_port
+
+                set raw_query [vessel::dns::query_get [dict get $request query] raw_query]
+                set upstream_query [binary format S $upstream_id][string range $raw_query 2 end]
+
+                #Failures to send are handled the same as an upstream that doesn't answer
+                catch {vessel::udp send $upstream_channel $upstream_query $upstream_ip $upstream_port}
+
+                dict set pending $upstream_id timer \
+                    [after $upstream_timeout [list [self] upstream_failed $upstream_id]]
+            }
+
+            method upstream_failed {upstream_id} {
+
+                #Try the next upstream or tell the client the lookup failed.
+                if {![dict exists $pending $upstream_id]} {
+                    return
+                }
+
+                after cancel [dict get $pending $upstream_id timer]
+                set next_upstream [expr {[dict get $pending $upstream_id upstream] + 1}]
+                if {$next_upstream < [llength $upstreams]} {
+                    dict set pending $upstream_id upstream $next_upstream
+                    my send_upstream $upstream_id
+                    return
+                }
+
+                set request [dict get $pending $upstream_id]
+                dict unset pending $upstream_id
+                my send_udp [dict get $request host] [dict get $request port] \
+                    [vessel::dns::generate_error_response 2 [dict get $request query]]
+            }
+
+            method upstream_ready {} {
+
+                if {[catch {vessel::udp recv $upstream_channel} datagrams]} {
+                    return
+                }
+
+                foreach datagram $datagrams {
+                    my handle_upstream_response {*}$datagram
+                }
+            }
+
+            method handle_upstream_response {response host port} {
+
+                if {[catch {vessel::dns::parse_response $response} info]} {
+                    return
+                }
+
+                #Ignore late answers and answers that don't match what we asked
+                set upstream_id [dict get $info id]
+                if {![dict exists $pending $upstream_id]} {
+                    return
+                }
+
+                set request [dict get $pending $upstream_id]
+                set expected_upstream [lindex $upstreams [dict get $request upstream]]
+                if {[list $host $port] ne $expected_upstream ||
+                    ![my answers_query $info [dict get $request query]]} {
+                    return
+                }
+
+                #SERVFAIL and REFUSED are retried on the next upstream
+                if {[dict get $info rcode] in {2 5}} {
+                    my upstream_failed $upstream_id
+                    return
+                }
+
+                after cancel [dict get $request timer]
+                dict unset pending $upstream_id
+
+                if {![dict get $info tc] && [dict get $info ttl] >= 0} {
+                    my cache_store [dict get $request key] [dict get $info ttl] $response
+                }
+
+                my send_udp [dict get $request host] [dict get $request port] \
+                    [vessel::dns::age_response $response [dict get $request client_id] 0]
+            }
+
+            method tcp_query {raw_query connection} {
+
+                #Callback invoked by the tcp listener with a single framed query.
+                #Returns the raw response or nothing when the query is
+                #forwarded and answered later with tcp_reply.
+                set query [vessel::dns::parse_query $raw_query]
+
+                if {![my is_local $query]} {
+                    set cached_response [my cache_lookup [my cache_key $query tcp] [vessel::dns::query_get $query id]]
+                    if {$cached_response ne {}} {
+                        return $cached_response
+                    }
+                    return [my tcp_forward $query $connection 0]
+                }
+
+                if {[vessel::dns::query_get $query type] != 1} {
+                    return [vessel::dns::generate_error_response 0 $query]
+                }
+
+                lassign [my lookup [vessel::dns::query_get $query qname]] addresses ttl
+                return [vessel::dns::generate_A_response -tcp $addresses $ttl $query]
+            }
+
+            method tcp_forward {query connection upstream} {
+
+                #Sends the query to the upstream over tcp.  Returns SERVFAIL
+                #if no upstream is left or nothing if the query was sent.
+                while {$upstream < [llength $upstreams]} {
+                    lassign [lindex $upstreams $upstream] upstream_ip upstream_port
+                    if {![catch {socket -async $upstream_ip $upstream_port} channel]} {
+                        break
+                    }
+                    incr upstream
+                }
+                if {$upstream >= [llength $upstreams]} {
+                    return [vessel::dns::generate_error_response 2 $query]
+                }
+
+                fconfigure $channel -translation binary -blocking false -buffering none
+                set raw_query [vessel::dns::query_get $query raw_query]
+                if {[catch {puts -nonewline $channel [binary format S [string length $raw_query]]$raw_query}]} {
+                    close $channel
+                    return [my tcp_forward $query $connection [incr upstream]]
+                }
+
+                dict set tcp_pending $channel [dict create query $query connection $connection \
+                                                   upstream $upstream response {} \
+                                                   timer [after $upstream_timeout [list [self] tcp_upstream_done $channel {}]]]
+                fileevent $channel readable [list [self] tcp_upstream_readable $channel]
+                return {}
+            }
+
+            method tcp_upstream_readable {channel} {
+
+                if {[catch {read $channel} data] || ($data eq {} && [eof $channel])} {
+                    my tcp_upstream_done $channel {}
+                    return
+                }
+
+                set response [dict get $tcp_pending $channel response]$data
+                dict set tcp_pending $channel response $response
+                if {[binary scan $response Su length] && [string length $response] >= $length + 2} {
+                    my tcp_upstream_done $channel [string range $response 2 [expr {$length + 1}]]
+                }
+            }
+
+            method tcp_upstream_done {channel response} {
+
+                #Answers the client or tries the next upstream when the
+                #upstream failed, timed out or didn't answer the query.
+                if {![dict exists $tcp_pending $channel]} {
+                    return
+                }
+
+                set request [dict get $tcp_pending $channel]
+                dict unset tcp_pending $channel
+                after cancel [dict get $request timer]
+                catch {close $channel}
+
+                set query [dict get $request query]
+                if {[catch {vessel::dns::parse_response $response} info] ||
+                    [dict get $info rcode] in {2 5} ||
+                    ![my answers_query $info $query]} {
+                    set response [my tcp_forward $query [dict get $request connection] \
+                                      [expr {[dict get $request upstream] + 1}]]
+                    if {$response ne {}} {
+                        vessel::dns::tcp_reply $tcp_server [dict get $request connection] $response
+                    }
+                    return
+                }
+
+                if {![dict get $info tc] && [dict get $info ttl] >= 0} {
+                    my cache_store [my cache_key $query tcp] [dict get $info ttl] $response
+                }
+                vessel::dns::tcp_reply $tcp_server [dict get $request connection] $response
             }
 
             method add_lookup_mapping {name ip {ttl 0}} {
-                set store [dict set store $name [list $ip $ttl]]
+
+                #Replaces the addresses of the name.  ip can be a list of
+                #addresses which are returned as multiple A records.  Names
+                #are matched without regard to case.
+                dict set store [string tolower $name] [list $ip $ttl]
+                my update_workers
+            }
+
+            method remove_lookup_mapping {name} {
+                dict unset store [string tolower $name]
+                my update_workers
+            }
+
+            method update_workers {} {
+                if {$workers ne {}} {
+                    vessel::dns::workers_update $workers $store
+                }
+            }
+
+            method worker_stats {} {
+
+                #Returns a list of per worker counter dicts
+                if {$workers eq {}} {
+                    return {}
+                }
+                return [vessel::dns::workers_stats $workers]
             }
             
             destructor {
-                close $udp_channel
+                dict for {upstream_id request} $pending {
+                    after cancel [dict get $request timer]
+                }
+                dict for {channel request} $tcp_pending {
+                    after cancel [dict get $request timer]
+                    close $channel
+                }
+
+                if {$upstream_channel ne {}} {
+                    close $upstream_channel
+                }
+                vessel::dns::tcp_close $tcp_server
+                if {$workers ne {}} {
+                    vessel::dns::workers_stop $workers
+                }
+                if {$udp_channel ne {}} {
+                    close $udp_channel
+                }
             }
             
         }
     }
 
-    proc create_server {{port 53} {ip {0.0.0.0}}} {
+    proc create_server {{port 53} {ip {0.0.0.0}} {workers 0}} {
 
-        return [_::DNSServer new $port $ip]
+        return [_::DNSServer new $port $ip $workers]
     }
 }
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <arpa/inet.h>
 #include <array>
 #include <cerrno>
@@ -7,6 +8,7 @@
 #include <iostream>
 #include <netinet/in.h>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -17,8 +19,140 @@
 
 using namespace embdns;
 
+namespace
+{
+    const uint16_t SOA_RR_TYPE = 6;
+    const uint16_t OPT_RR_TYPE = 41;
+    const size_t A_RR_SIZE = 16; /**< Compressed name ptr, type, class, ttl, rdlength and ipv4 addr*/
+    const size_t OPT_RR_SIZE = 11; /**< Root name, type, payload size, extended rcode/flags and rdlength*/
+
+    uint16_t read_u16(const unsigned char* data, size_t size, size_t offset)
+    {
+        if(offset + 2 > size)
+        {
+            throw std::invalid_argument("dns packet truncated");
+        }
+
+        return (uint16_t)((data[offset] << 8) | data[offset + 1]);
+    }
+
+    uint32_t read_u32(const unsigned char* data, size_t size, size_t offset)
+    {
+        if(offset + 4 > size)
+        {
+            throw std::invalid_argument("dns packet truncated");
+        }
+
+        return ((uint32_t)data[offset] << 24) | ((uint32_t)data[offset + 1] << 16) |
+            ((uint32_t)data[offset + 2] << 8) | data[offset + 3];
+    }
+
+    /**
+     * Read the uncompressed name of the question section.
+     * @returns The offset one past the end of the name.
+     */
+    size_t read_qname(const unsigned char* data, size_t size, size_t offset, std::string& qname)
+    {
+        while(true)
+        {
+            if(offset >= size)
+            {
+                throw std::invalid_argument("dns packet truncated while reading qname");
+            }
+
+            size_t label_len = data[offset++];
+            if(label_len == 0)
+            {
+                return offset;
+            }
+
+            if((label_len & 0xc0) != 0 || offset + label_len > size)
+            {
+                throw std::invalid_argument("invalid label in qname");
+            }
+
+            if(qname.length() > 0)
+            {
+                qname.append(".");
+            }
+            qname.append((const char*)&data[offset], label_len);
+            offset += label_len;
+        }
+    }
+
+    /**
+     * Skip over a possibly compressed domain name.
+     * @returns The offset one past the end of the name.
+     */
+    size_t skip_name(const unsigned char* data, size_t size, size_t offset)
+    {
+        while(true)
+        {
+            if(offset >= size)
+            {
+                throw std::invalid_argument("dns packet truncated while reading name");
+            }
+
+            uint8_t label_len = data[offset];
+            if((label_len & 0xc0) == 0xc0)
+            {
+                /*A compression pointer always terminates the name*/
+                if(offset + 2 > size)
+                {
+                    throw std::invalid_argument("dns packet truncated while reading name");
+                }
+                return offset + 2;
+            }
+
+            offset++;
+            if(label_len == 0)
+            {
+                return offset;
+            }
+            offset += label_len;
+        }
+    }
+
+    /**
+     * Skip a resource record starting at offset.
+     * @returns The offset one past the end of the record.
+     */
+    size_t skip_rr(const unsigned char* data, size_t size, size_t offset)
+    {
+        offset = skip_name(data, size, offset);
+
+        /*type, class and ttl preceed the rdlength*/
+        uint16_t rdlength = read_u16(data, size, offset + 8);
+        offset += 10 + rdlength;
+        if(offset > size)
+        {
+            throw std::invalid_argument("dns packet truncated while reading record data");
+        }
+        return offset;
+    }
+
+    void write_u16(std::vector<uint8_t>& buf, size_t offset, uint16_t value)
+    {
+        buf[offset] = (value & 0xff00) >> 8;
+        buf[offset + 1] = value & 0x00ff;
+    }
+
+    void write_u32(std::vector<uint8_t>& buf, size_t offset, uint32_t value)
+    {
+        buf[offset] = (value >> 24) & 0xff;
+        buf[offset + 1] = (value >> 16) & 0xff;
+        buf[offset + 2] = (value >> 8) & 0xff;
+        buf[offset + 3] = value & 0xff;
+    }
+}
+
 dns_header::dns_header(const unsigned char* data, size_t size)
 {
+    if(size < SIZE)
+    {
+        throw std::invalid_argument("dns packet is smaller than a dns header");
+    }
+
     id = ntohs(*((uint16_t*)&data[0]));
 
     qr = data[2] & 0x80;
@@ -142,12 +276,12 @@ void dns_header::serialize(unsigned char* buf, size_t buf_size)
     buf[0] = (id & 0xff00) >> 8;
     buf[1] = id & 0x00ff;
     buf[2] |= (qr << 7);
-    buf[2] |= (opcode & 0x0f) << 6;
+    buf[2] |= (opcode & 0x0f) << 3;
     buf[2] |= aa << 2;
     buf[2] |= tc << 1;
     buf[2] |= rd << 0;
     buf[3] |= ra << 7;
-    buf[3] |= z << 6 & 0x07;
+    buf[3] |= (z & 0x07) << 4;
     buf[3] |= rcode & 0xf;
     buf[4] = (qdcount & 0xff00) >> 8;
     buf[5] = qdcount & 0x00ff;
@@ -177,26 +311,46 @@ const dns_header& dns_message::header() const
 }
 
 dns_query::dns_query(const unsigned char* data, size_t size)
-    : dns_message(data, size)
+    : dns_message(data, size),
+      qname(),
+      qtype(0),
+      qclass(0),
+      edns(false),
+      edns_udp_size(0),
+      question_end(0)
 {
-    size_t current_offset = dns_header::SIZE;
-    while(data[current_offset] != 0x0)
+    if(m_header.qdcount != 1)
     {
-        if(qname.length() > 0)
-        {
-            qname.append(".");
-        }
-        size_t label_len = data[current_offset++];
-        std::string label((char*)&data[current_offset], label_len);
-        qname.append(label);
-        current_offset += label_len;
+        throw std::invalid_argument("dns query must contain exactly one question");
     }
 
-    current_offset++;
-    qtype = ntohs(*((uint16_t*)&data[current_offset]));
+    size_t current_offset = read_qname(data, size, dns_header::SIZE, qname);
+    qtype = read_u16(data, size, current_offset);
+    current_offset += 2;
 
+    qclass = read_u16(data, size, current_offset);
     current_offset += 2;
-    qclass = ntohs(*((uint16_t*)&data[current_offset]));
+    question_end = current_offset;
+
+    /*Queries normally have no answer or authority records but skip them
+     * so we can find the OPT record in the additional section.*/
+    size_t records_to_skip = m_header.ancount + m_header.nscount;
+    for(size_t i = 0; i < records_to_skip; ++i)
+    {
+        current_offset = skip_rr(data, size, current_offset);
+    }
+
+    for(size_t i = 0; i < m_header.arcount; ++i)
+    {
+        size_t type_offset = skip_name(data, size, current_offset);
+        if(read_u16(data, size, type_offset) == OPT_RR_TYPE)
+        {
+            /*The class field of an OPT record is the requestor's udp payload size*/
+            edns = true;
+            edns_udp_size = read_u16(data, size, type_offset + 2);
+        }
+        current_offset = skip_rr(data, size, current_offset);
+    }
 }
 
 const std::vector<unsigned char>& dns_query::raw() const
@@ -204,17 +358,26 @@ const std::vector<unsigned char>& dns_query::raw() const
     return raw_bytes;
 }
 
+size_t dns_query::max_udp_response_size() const
+{
+    if(!edns || edns_udp_size <= dns_message::MAX_SIZE)
+    {
+        return dns_message::MAX_SIZE;
+    }
+
+    return std::min<size_t>(edns_udp_size, dns_message::MAX_EDNS_SIZE);
+}
+
 dns_A_response::dns_A_response(uint16_t id,
                                const std::string& name)
     : dns_message(),
       name(name),
-      addr(),
+      addrs(),
       ttl(0)
 {
-    memset(&addr, 0, sizeof(addr));
     //TODO: A few more of these values need to come from the request
     m_header.set_id(id)
-            .set_response(false)
+            .set_response(true)
             .set_opcode(0)
             .set_authoritative(false)
             .set_recursion_desired(false)
@@ -230,59 +393,127 @@ dns_A_response::dns_A_response(uint16_t id,
 
 dns_A_response::dns_A_response(uint16_t id,
                                const std::string& name,
-                               in_addr_t result_addr,
+                               const std::vector<in_addr_t>& result_addrs,
                                uint32_t ttl)
     : dns_A_response(id, name)
 {
-    this->addr = result_addr;
+    this->addrs = result_addrs;
     this->ttl = ttl;
 
-    //TODO: A few more of these values need to come from the request
-    m_header.set_response(true)
-            .set_authoritative(true)
-            .set_answer_count(1);
+    m_header.set_authoritative(true);
 }
 
-size_t dns_A_response::serialize(std::array<uint8_t, 512>& msg_buf,
-                                 const unsigned char* query, size_t query_size)
+size_t dns_A_response::serialize(std::vector<uint8_t>& msg_buf, size_t max_size,
+                                 const dns_query& query)
 {
-    size_t bytes_used = 0;
-    memset(msg_buf.data(), 0, msg_buf.size());
-    m_header.serialize(msg_buf.data(), dns_header::SIZE);
-    bytes_used = dns_header::SIZE;
-
-    for(int i = dns_header::SIZE; i < query_size; ++i)
+    const unsigned char* query_bytes = query.raw().data();
+    size_t question_size = query.question_end - dns_header::SIZE;
+    size_t opt_size = query.edns ? OPT_RR_SIZE : 0;
+    size_t fixed_size = dns_header::SIZE + question_size + opt_size;
+    if(fixed_size > max_size)
     {
-        msg_buf[bytes_used++] = query[i];
+        throw std::invalid_argument("dns question does not fit in the maximum response size");
     }
 
-    /*We currently only support one domain name lookup.  So we
-     * can hardcode this value*/
-    msg_buf[bytes_used++] = 0xc0;
-    msg_buf[bytes_used++] = 0x0c;
+    /*Only whole records are sent.  If every answer doesn't fit then the
+     * client is told to retry over tcp with the truncation bit.*/
+    size_t answer_count = std::min(addrs.size(), (max_size - fixed_size) / A_RR_SIZE);
+    m_header.set_recursion_desired(query.header().rd)
+            .set_answer_count((uint16_t)answer_count)
+            .set_truncation(answer_count < addrs.size())
+            .set_additional_records_count(query.edns ? 1 : 0);
 
-    msg_buf[bytes_used++] = 0x00; //A record
-    msg_buf[bytes_used++] = 0x01;
+    msg_buf.assign(fixed_size + (answer_count * A_RR_SIZE), 0);
+    m_header.serialize(msg_buf.data(), dns_header::SIZE);
+    size_t bytes_used = dns_header::SIZE;
 
-    msg_buf[bytes_used++] = 0x00; //INTERNET record
-    msg_buf[bytes_used++] = 0x01;
+    std::copy(query_bytes + dns_header::SIZE, query_bytes + query.question_end,
+              msg_buf.begin() + bytes_used);
+    bytes_used += question_size;
 
-    msg_buf[bytes_used++] = (ttl & 0xff << 24) >> 24;
-    msg_buf[bytes_used++] = (ttl & 0xff << 16) >> 16;
-    msg_buf[bytes_used++] = (ttl & 0xff << 8) >> 8;
-    msg_buf[bytes_used++] = (ttl & 0xff << 0) >> 0;
+    for(size_t i = 0; i < answer_count; ++i)
+    {
+        /*We currently only support one domain name lookup.  So we
+         * can hardcode the pointer to the qname.*/
+        write_u16(msg_buf, bytes_used, 0xc00c);
+        write_u16(msg_buf, bytes_used + 2, 0x0001); //A record
+        write_u16(msg_buf, bytes_used + 4, 0x0001); //INTERNET record
+        write_u32(msg_buf, bytes_used + 6, ttl);
+
+        /*We only support ipv4 for now*/
+        write_u16(msg_buf, bytes_used + 10, 0x0004); //rdlength
+
+        /*in_addr_t is already in network byte order*/
+        memcpy(&msg_buf[bytes_used + 12], &addrs[i], sizeof(in_addr_t));
+        bytes_used += A_RR_SIZE;
+    }
 
-    /*We only support ipv4 for now*/
-    msg_buf[bytes_used++] = 0x00; //rdlength
-    msg_buf[bytes_used++] = 0x04;
+    if(query.edns)
+    {
+        /*Root name followed by the OPT type and our own udp payload size.
+         * Extended rcode, version, flags and rdlength are all zero.*/
+        msg_buf[bytes_used] = 0x00;
+        write_u16(msg_buf, bytes_used + 1, OPT_RR_TYPE);
+        write_u16(msg_buf, bytes_used + 3, dns_message::MAX_EDNS_SIZE);
+        bytes_used += OPT_RR_SIZE;
+    }
 
-    msg_buf[bytes_used++] = (addr & (0xff << 0)) >> 0;
-    msg_buf[bytes_used++] = (addr & (0xff << 8)) >> 8;
-    msg_buf[bytes_used++] = (addr & (0xff << 16)) >> 16;
-    msg_buf[bytes_used++] = (addr & (0xff << 24)) >> 24;
     return bytes_used;
 }
 
+void dns_A_response::set_response_code(uint8_t rcode)
+{
+    m_header.set_response_code(rcode);
+}
+
+dns_response_info::dns_response_info(const unsigned char* data, size_t size)
+    : header(data, size),
+      qname(),
+      qtype(0),
+      has_ttl(false),
+      ttl(0)
+{
+    if(header.qdcount != 1)
+    {
+        throw std::invalid_argument("dns response must contain exactly one question");
+    }
+
+    size_t current_offset = read_qname(data, size, dns_header::SIZE, qname);
+    qtype = read_u16(data, size, current_offset);
+    current_offset += 4;
+
+    /*Positive responses are cached for the smallest answer ttl*/
+    for(size_t i = 0; i < header.ancount; ++i)
+    {
+        size_t type_offset = skip_name(data, size, current_offset);
+        uint32_t rr_ttl = read_u32(data, size, type_offset + 4);
+        ttl = has_ttl ? std::min(ttl, rr_ttl) : rr_ttl;
+        has_ttl = true;
+        current_offset = skip_rr(data, size, current_offset);
+    }
+
+    if(header.ancount > 0)
+    {
+        return;
+    }
+
+    /*Negative responses are cached for the smaller of the SOA ttl and
+     * the SOA minimum field (RFC 2308).*/
+    for(size_t i = 0; i < header.nscount; ++i)
+    {
+        size_t type_offset = skip_name(data, size, current_offset);
+        size_t rr_end = skip_rr(data, size, current_offset);
+        if(read_u16(data, size, type_offset) == SOA_RR_TYPE)
+        {
+            uint32_t soa_ttl = read_u32(data, size, type_offset + 4);
+            uint32_t soa_minimum = read_u32(data, size, rr_end - 4);
+            ttl = std::min(soa_ttl, soa_minimum);
+            has_ttl = true;
+            return;
+        }
+        current_offset = rr_end;
+    }
+}
 
 dns_query embdns::parse_packet(const uint8_t* pkt, size_t size)
 {
@@ -290,22 +521,80 @@ dns_query embdns::parse_packet(const uint8_t* pkt, size_t size)
 }
 
 
-size_t embdns::generate_response(std::array<uint8_t, dns_message::MAX_SIZE>& pkt_buf,
-                               dns_query& assoc_query)
+size_t embdns::generate_response(std::vector<uint8_t>& pkt_buf,
+                                 const dns_query& assoc_query,
+                                 size_t max_size)
 {
     dns_A_response response(assoc_query.header().id, assoc_query.qname);
-    return response.serialize(pkt_buf, assoc_query.raw().data(), assoc_query.raw().size());
+    return response.serialize(pkt_buf, max_size, assoc_query);
 }
 
-size_t embdns::generate_response(std::array<uint8_t, dns_message::MAX_SIZE>& pkt_buf,
-                               dns_query& assoc_query, /*Corresponding query*/
-                               const std::string& address,
-                               uint32_t ttl)
+size_t embdns::generate_response(std::vector<uint8_t>& pkt_buf,
+                                 const dns_query& assoc_query, /*Corresponding query*/
+                                 const std::vector<std::string>& addresses,
+                                 uint32_t ttl,
+                                 size_t max_size)
+{
+    std::vector<in_addr_t> net_addrs;
+    net_addrs.reserve(addresses.size());
+    for(const std::string& address : addresses)
+    {
+        in_addr net_addr;
+        if(inet_pton(AF_INET, address.c_str(), &net_addr) != 1)
+        {
+            throw std::invalid_argument("invalid ipv4 address: " + address);
+        }
+        net_addrs.push_back(net_addr.s_addr);
+    }
+
+    return generate_response(pkt_buf, assoc_query, net_addrs, ttl, max_size);
+}
+
+size_t embdns::generate_response(std::vector<uint8_t>& pkt_buf,
+                                 const dns_query& assoc_query,
+                                 const std::vector<in_addr_t>& addresses,
+                                 uint32_t ttl,
+                                 size_t max_size)
 {
-    in_addr_t net_addr = inet_addr(address.c_str());
     dns_A_response response(assoc_query.header().id, assoc_query.qname,
-                            net_addr, ttl);
-    return response.serialize(pkt_buf, assoc_query.raw().data(), assoc_query.raw().size());
+                            addresses, ttl);
+    return response.serialize(pkt_buf, max_size, assoc_query);
+}
+
+size_t embdns::generate_error_response(std::vector<uint8_t>& pkt_buf,
+                                       const dns_query& assoc_query,
+                                       uint8_t rcode)
+{
+    dns_A_response response(assoc_query.header().id, assoc_query.qname);
+    response.set_response_code(rcode);
+    return response.serialize(pkt_buf, assoc_query.max_udp_response_size(), assoc_query);
+}
+
+void embdns::age_response(std::vector<uint8_t>& pkt, uint16_t id, uint32_t elapsed)
+{
+    dns_header header(pkt.data(), pkt.size());
+    write_u16(pkt, 0, id);
+
+    size_t current_offset = dns_header::SIZE;
+    for(size_t i = 0; i < header.qdcount; ++i)
+    {
+        current_offset = skip_name(pkt.data(), pkt.size(), current_offset) + 4;
+    }
+
+    size_t record_count = header.ancount + header.nscount + header.arcount;
+    for(size_t i = 0; i < record_count; ++i)
+    {
+        size_t type_offset = skip_name(pkt.data(), pkt.size(), current_offset);
+        size_t rr_end = skip_rr(pkt.data(), pkt.size(), current_offset);
+
+        /*The ttl field of an OPT record holds flags*/
+        if(read_u16(pkt.data(), pkt.size(), type_offset) != OPT_RR_TYPE)
+        {
+            uint32_t rr_ttl = read_u32(pkt.data(), pkt.size(), type_offset + 4);
+            write_u32(pkt, type_offset + 4, rr_ttl > elapsed ? rr_ttl - elapsed : 0);
+        }
+        current_offset = rr_end;
+    }
 }
 
 /*TODO: Support SRV and TXT for service discovery and service
@@ -2,6 +2,7 @@
 #define EMBDNS_H
 
 #include <array>
+#include <netinet/in.h>
 #include <string>
 #include <sys/types.h>
 #include <vector>
@@ -60,7 +61,9 @@ namespace embdns {
     class dns_message
     {
     public:
-        static const int MAX_SIZE = 512;
+        static const int MAX_SIZE = 512; /**< Max udp message size without EDNS0*/
+        static const int MAX_EDNS_SIZE = 4096; /**< Largest udp payload we will advertise or send*/
+        static const int MAX_TCP_SIZE = 65535; /**< Max message size with the 2 byte tcp length prefix*/
     protected:
         std::vector<unsigned char> raw_bytes;
 
@@ -82,15 +85,30 @@ namespace embdns {
 
         uint16_t qclass; /**< Query class*/
 
+        bool edns; /**< True if the query contained an OPT pseudo record*/
+
+        uint16_t edns_udp_size; /**< UDP payload size advertised by the requestor's OPT record*/
+
+        size_t question_end; /**< Offset one past the end of the question section*/
+
+        /**
+         * @throws std::invalid_argument if the packet is truncated or malformed.
+         */
         dns_query(const unsigned char* data, size_t size);
 
         const std::vector<unsigned char>& raw() const;
+
+        /**
+         * The largest udp response the requestor can accept.  512 bytes unless
+         * the requestor negotiated a larger size with EDNS0.
+         */
+        size_t max_udp_response_size() const;
     };
 
     struct dns_A_response : public dns_message
     {
         std::string name;
-        in_addr_t addr;
+        std::vector<in_addr_t> addrs;
         uint32_t ttl;
 
         /**Empty response*/
@@ -99,22 +117,70 @@ namespace embdns {
 
         dns_A_response(uint16_t id,
                        const std::string& name,
-                       in_addr_t result_addr,
+                       const std::vector<in_addr_t>& result_addrs,
                        uint32_t ttl);
 
-        size_t serialize(std::array<uint8_t, 512>& msg_buf,
-                         const unsigned char* query, size_t query_size);
+        /**
+         * Serialize the response into msg_buf.  Answers that do not fit in max_size
+         * are dropped and the truncation bit is set so the client can retry over tcp.
+         */
+        size_t serialize(std::vector<uint8_t>& msg_buf, size_t max_size,
+                         const dns_query& query);
+
+        void set_response_code(uint8_t rcode);
     };
 
-    dns_query parse_packet(const uint8_t* pkt, size_t size);
+    /**
+     * Summary of a response received from an upstream server.  Used to
+     * match the response to the forwarded query and to decide how long
+     * it can be cached.
+     */
+    struct dns_response_info
+    {
+        dns_header header;
+        std::string qname;
+        uint16_t qtype;
+        bool has_ttl; /**< False if nothing in the response can be used as a cache ttl*/
+        uint32_t ttl; /**< Min answer ttl or the negative caching ttl from the authority SOA*/
+
+        /**
+         * @throws std::invalid_argument if the packet is truncated or malformed.
+         */
+        dns_response_info(const unsigned char* data, size_t size);
+    };
 
+    dns_query parse_packet(const uint8_t* pkt, size_t size);
 
-    size_t generate_response(std::array<uint8_t, dns_message::MAX_SIZE>& pkt_buf,
-                             dns_query& assoc_query);
 
-    size_t generate_response(std::array<uint8_t, dns_message::MAX_SIZE>& pkt_buf,
-                             dns_query& assoc_query, /*Corresponding query*/
-                             const std::string& address,
-                             uint32_t ttl);
+    size_t generate_response(std::vector<uint8_t>& pkt_buf,
+                             const dns_query& assoc_query,
+                             size_t max_size);
+
+    size_t generate_response(std::vector<uint8_t>& pkt_buf,
+                             const dns_query& assoc_query, /*Corresponding query*/
+                             const std::vector<std::string>& addresses,
+                             uint32_t ttl,
+                             size_t max_size);
+
+    size_t generate_response(std::vector<uint8_t>& pkt_buf,
+                             const dns_query& assoc_query,
+                             const std::vector<in_addr_t>& addresses,
+                             uint32_t ttl,
+                             size_t max_size);
+
+    /**
+     * Generate an empty response with the given rcode.  Used for SERVFAIL when
+     * no upstream answers and for empty answers to unsupported query types.
+     */
+    size_t generate_error_response(std::vector<uint8_t>& pkt_buf,
+                                   const dns_query& assoc_query,
+                                   uint8_t rcode);
+
+    /**
+     * Prepare a cached response for a new requestor by replacing the id and
+     * subtracting the time it has spent in the cache from every record ttl.
+     * @throws std::invalid_argument if the packet is truncated or malformed.
+     */
+    void age_response(std::vector<uint8_t>& pkt, uint16_t id, uint32_t elapsed);
 }
 #endif // EMBDNS_H
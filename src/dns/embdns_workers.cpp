@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "embdns.h"
+#include "embdns_workers.h"
+
+using namespace embdns;
+
+namespace
+{
+    const uint16_t A_RR_TYPE = 1;
+
+    int open_worker_socket(const std::string& ip, uint16_t port)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(sock == -1)
+        {
+            throw std::system_error(errno, std::system_category(), "socket");
+        }
+
+        /*FreeBSD only load balances between sockets with SO_REUSEPORT_LB.
+         * Plain SO_REUSEPORT delivers every datagram to the last socket bound.*/
+        int one = 1;
+#ifdef SO_REUSEPORT_LB
+        int reuse_option = SO_REUSEPORT_LB;
+#else
+        int reuse_option = SO_REUSEPORT;
+#endif
+        if(setsockopt(sock, SOL_SOCKET, reuse_option, &one, sizeof(one)) == -1)
+        {
+            int error = errno;
+            close(sock);
+            throw std::system_error(error, std::system_category(), "setsockopt reuseport");
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if(inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+        {
+            close(sock);
+            throw std::invalid_argument("invalid ipv4 address: " + ip);
+        }
+
+        if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            int error = errno;
+            close(sock);
+            throw std::system_error(error, std::system_category(), "bind");
+        }
+
+        int flags = fcntl(sock, F_GETFL);
+        if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            int error = errno;
+            close(sock);
+            throw std::system_error(error, std::system_category(), "fcntl");
+        }
+
+        return sock;
+    }
+}
+
+worker_pool::worker::worker(int sock)
+    : sock(sock),
+      thread(),
+      queries(0),
+      responses(0),
+      errors(0),
+      unknown(0)
+{}
+
+worker_pool::worker_pool(const std::string& ip, uint16_t port, size_t thread_count,
+                         std::shared_ptr<const record_table> table)
+    : m_workers(),
+      m_table(table),
+      m_wake_pipe{-1, -1},
+      m_running(true)
+{
+    if(pipe(m_wake_pipe) == -1)
+    {
+        throw std::system_error(errno, std::system_category(), "pipe");
+    }
+
+    try
+    {
+        for(size_t i = 0; i < thread_count; ++i)
+        {
+            m_workers.push_back(std::make_unique<worker>(open_worker_socket(ip, port)));
+        }
+    }
+    catch(...)
+    {
+        for(auto& w : m_workers)
+        {
+            close(w->sock);
+        }
+        close(m_wake_pipe[0]);
+        close(m_wake_pipe[1]);
+        throw;
+    }
+
+    /*All sockets are bound before any thread starts so a bind failure
+     * doesn't leave threads to clean up.  If a thread can't be started the
+     * destructor won't run, so the ones already running are stopped here.*/
+    try
+    {
+        for(auto& w : m_workers)
+        {
+            worker& current = *w;
+            current.thread = std::thread([this, &current]() { run(current); });
+        }
+    }
+    catch(...)
+    {
+        stop();
+        throw;
+    }
+}
+
+void worker_pool::run(worker& w)
+{
+    std::vector<uint8_t> query_buf(dns_message::MAX_EDNS_SIZE);
+    std::vector<uint8_t> response_buf;
+    response_buf.reserve(dns_message::MAX_EDNS_SIZE);
+    /*Names are stored in lower case.  The query keeps its own case for the
+     * question echoed in the response.*/
+    std::string name;
+
+    struct pollfd fds[2];
+    fds[0].fd = w.sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wake_pipe[0];
+    fds[1].events = POLLIN;
+
+    while(m_running.load(std::memory_order_relaxed))
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if(fds[1].revents)
+        {
+            break;
+        }
+
+        /*Drain the socket before polling again*/
+        while(true)
+        {
+            struct sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            ssize_t bytes = recvfrom(w.sock, query_buf.data(), query_buf.size(), 0,
+                                     (struct sockaddr*)&peer, &peer_len);
+            if(bytes == -1)
+            {
+                break;
+            }
+            w.queries.fetch_add(1, std::memory_order_relaxed);
+
+            size_t response_size = 0;
+            try
+            {
+                dns_query query(query_buf.data(), (size_t)bytes);
+                std::shared_ptr<const record_table> table = std::atomic_load(&m_table);
+                name.assign(query.qname);
+                std::transform(name.begin(), name.end(), name.begin(),
+                               [](unsigned char c) { return std::tolower(c); });
+                auto entry = table->records.find(name);
+                if(entry == table->records.end())
+                {
+                    w.unknown.fetch_add(1, std::memory_order_relaxed);
+                    response_size = generate_response(response_buf, query, query.max_udp_response_size());
+                }
+                else if(query.qtype != A_RR_TYPE)
+                {
+                    response_size = generate_error_response(response_buf, query, 0);
+                }
+                else
+                {
+                    response_size = generate_response(response_buf, query, entry->second.addrs,
+                                                      entry->second.ttl, query.max_udp_response_size());
+                }
+            }
+            catch(const std::invalid_argument&)
+            {
+                w.errors.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            if(sendto(w.sock, response_buf.data(), response_size, 0,
+                      (struct sockaddr*)&peer, peer_len) == -1)
+            {
+                w.errors.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            w.responses.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void worker_pool::update(std::shared_ptr<const record_table> table)
+{
+    std::atomic_store(&m_table, table);
+}
+
+std::vector<worker_stats> worker_pool::stats() const
+{
+    std::vector<worker_stats> result;
+    for(const auto& w : m_workers)
+    {
+        result.push_back({w->queries.load(), w->responses.load(),
+                          w->errors.load(), w->unknown.load()});
+    }
+    return result;
+}
+
+void worker_pool::stop()
+{
+    if(!m_running.exchange(false))
+    {
+        return;
+    }
+
+    /*Wakes every worker since nobody reads from the pipe*/
+    char wake = 0;
+    (void)write(m_wake_pipe[1], &wake, 1);
+
+    for(auto& w : m_workers)
+    {
+        if(w->thread.joinable())
+        {
+            w->thread.join();
+        }
+        close(w->sock);
+    }
+
+    close(m_wake_pipe[0]);
+    close(m_wake_pipe[1]);
+}
+
+worker_pool::~worker_pool()
+{
+    stop();
+}
@@ -0,0 +1,91 @@
+#ifndef EMBDNS_WORKERS_H
+#define EMBDNS_WORKERS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace embdns {
+
+    /**
+     * A set of A records.  Tables are never modified once they are published
+     * to the workers.  Updates are done by publishing a new table.
+     */
+    struct record_table
+    {
+        struct entry
+        {
+            std::vector<in_addr_t> addrs;
+            uint32_t ttl;
+        };
+
+        std::unordered_map<std::string, entry> records;
+    };
+
+    struct worker_stats
+    {
+        uint64_t queries; /**< Datagrams received*/
+        uint64_t responses; /**< Responses sent*/
+        uint64_t errors; /**< Malformed queries and failed sends*/
+        uint64_t unknown; /**< Queries for names that aren't in the table*/
+    };
+
+    /**
+     * @brief The worker_pool class answers udp queries from a record table on
+     * N threads.  Each thread owns a socket bound to the same address with
+     * SO_REUSEPORT so the kernel spreads queries across the threads.
+     */
+    class worker_pool
+    {
+        struct worker
+        {
+            int sock;
+            std::thread thread;
+            std::atomic<uint64_t> queries;
+            std::atomic<uint64_t> responses;
+            std::atomic<uint64_t> errors;
+            std::atomic<uint64_t> unknown;
+
+            worker(int sock);
+        };
+
+        std::vector<std::unique_ptr<worker>> m_workers;
+
+        /*Only accessed through std::atomic_load and std::atomic_store*/
+        std::shared_ptr<const record_table> m_table;
+
+        int m_wake_pipe[2];
+        std::atomic<bool> m_running;
+
+        void run(worker& w);
+
+    public:
+
+        /**
+         * @throws std::system_error if the sockets can't be created or bound.
+         */
+        worker_pool(const std::string& ip, uint16_t port, size_t thread_count,
+                    std::shared_ptr<const record_table> table);
+
+        worker_pool(const worker_pool&) = delete;
+
+        /**
+         * Publish a new table.  Queries already being answered finish with the
+         * old table.
+         */
+        void update(std::shared_ptr<const record_table> table);
+
+        std::vector<worker_stats> stats() const;
+
+        void stop();
+
+        ~worker_pool();
+    };
+}
+
+#endif // EMBDNS_WORKERS_H
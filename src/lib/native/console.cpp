@@ -0,0 +1,543 @@
+#include "console.h"
+#include "tcl_kqueue.h"
+#include "tcl_util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <tcl.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    /**
+     * @brief The ring_buffer class keeps the most recent output of a console.
+     * Older bytes are overwritten once the capacity is reached.
+     */
+    class ring_buffer
+    {
+        std::vector<char> m_buf;
+        size_t m_head; /**< Position of the next write*/
+        size_t m_size;
+
+    public:
+
+        ring_buffer(size_t capacity)
+            : m_buf(capacity),
+              m_head(0),
+              m_size(0)
+        {}
+
+        void append(const char* data, size_t len)
+        {
+            if(len >= m_buf.size())
+            {
+                /*Only the tail of a write larger than the buffer is kept*/
+                data += len - m_buf.size();
+                len = m_buf.size();
+            }
+
+            size_t first = std::min(len, m_buf.size() - m_head);
+            memcpy(m_buf.data() + m_head, data, first);
+            memcpy(m_buf.data(), data + first, len - first);
+            m_head = (m_head + len) % m_buf.size();
+            m_size = std::min(m_size + len, m_buf.size());
+        }
+
+        /**
+         * @brief contents Copy the buffered bytes, oldest first, to the end of out.
+         */
+        void contents(std::vector<char>& out) const
+        {
+            size_t start = (m_head + m_buf.size() - m_size) % m_buf.size();
+            size_t first = std::min(m_size, m_buf.size() - start);
+            out.insert(out.end(), m_buf.data() + start, m_buf.data() + start + first);
+            out.insert(out.end(), m_buf.data(), m_buf.data() + (m_size - first));
+        }
+    };
+
+    /**
+     * @brief The console_client struct is an attached reader.  Output that
+     * can't be written immediately is queued up to twice the scrollback
+     * size: the scrollback it is sent when it attaches and as much live
+     * output again.
+     */
+    struct console_client
+    {
+        fd_guard fd;
+        std::vector<char> out_buf;
+        bool write_pending;
+
+        console_client(int fd)
+            : fd(fd),
+              out_buf(),
+              write_pending(false)
+        {}
+    };
+
+    /**
+     * @brief The console_server class reads the master side of a container's
+     * pty into a ring buffer and serves it on a unix socket.  Every client that
+     * connects is sent the scrollback and then the live output.  Input from
+     * any client is written to the pty.  All io is done from the kqueue event
+     * source without calling into Tcl.
+     */
+    class console_server : public tcl_event_factory
+    {
+        static const size_t MAX_CLIENTS = 16;
+        static const size_t READ_SIZE = 16 * 1024;
+
+        Tcl_Interp* m_interp;
+        int m_master_fd;
+        fd_guard m_listen_fd;
+        std::string m_socket_path;
+        ring_buffer m_scrollback;
+        size_t m_max_backlog;
+        std::map<int, std::unique_ptr<console_client>> m_clients;
+        std::vector<char> m_read_buf;
+        bool m_reading_master;
+
+        int watch(int fd, short filter, u_short flags)
+        {
+            struct kevent event;
+            EV_SET(&event, fd, filter, flags, 0, 0, 0);
+            return Kqueue_Add_Event(m_interp, event, *this);
+        }
+
+        /**
+         * @return false if the client should be disconnected.
+         */
+        bool flush(console_client& client)
+        {
+            size_t sent = 0;
+            while(sent < client.out_buf.size())
+            {
+                ssize_t bytes = ::send(client.fd.fd, client.out_buf.data() + sent,
+                                       client.out_buf.size() - sent, 0);
+                if(bytes == -1)
+                {
+                    if(errno != EAGAIN)
+                    {
+                        return false;
+                    }
+
+                    if(!client.write_pending)
+                    {
+                        client.write_pending = true;
+                        watch(client.fd.fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT);
+                    }
+                    break;
+                }
+                sent += bytes;
+            }
+
+            client.out_buf.erase(client.out_buf.begin(), client.out_buf.begin() + sent);
+            return true;
+        }
+
+        void broadcast(const char* data, size_t len)
+        {
+            for(auto it = m_clients.begin(); it != m_clients.end();)
+            {
+                console_client& client = *it->second;
+
+                /*A client that can't keep up is disconnected instead of
+                 * buffering without bound*/
+                if(client.out_buf.size() + len > m_max_backlog)
+                {
+                    it = m_clients.erase(it);
+                    continue;
+                }
+
+                client.out_buf.insert(client.out_buf.end(), data, data + len);
+                if(!client.write_pending && !flush(client))
+                {
+                    it = m_clients.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+        }
+
+        void read_master()
+        {
+            while(true)
+            {
+                ssize_t bytes = ::read(m_master_fd, m_read_buf.data(), m_read_buf.size());
+                if(bytes > 0)
+                {
+                    m_scrollback.append(m_read_buf.data(), (size_t)bytes);
+                    broadcast(m_read_buf.data(), (size_t)bytes);
+                    continue;
+                }
+
+                if(bytes == -1 && (errno == EAGAIN || errno == EINTR))
+                {
+                    return;
+                }
+
+                /*EOF or EIO.  Nothing has the slave open anymore.  The scrollback
+                 * is still served until the console is closed.*/
+                watch(m_master_fd, EVFILT_READ, EV_DELETE);
+                m_reading_master = false;
+                return;
+            }
+        }
+
+        void accept_clients()
+        {
+            while(true)
+            {
+                int client_fd = ::accept(m_listen_fd.fd, nullptr, nullptr);
+                if(client_fd == -1)
+                {
+                    return;
+                }
+
+                fd_guard client(client_fd);
+                if(m_clients.size() >= MAX_CLIENTS)
+                {
+                    continue;
+                }
+
+                int flags = fcntl(client_fd, F_GETFL);
+                if(flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+                {
+                    continue;
+                }
+
+                auto new_client = std::make_unique<console_client>(client.release());
+                m_scrollback.contents(new_client->out_buf);
+                if(!flush(*new_client))
+                {
+                    continue;
+                }
+
+                watch(client_fd, EVFILT_READ, EV_ADD);
+                m_clients[client_fd] = std::move(new_client);
+            }
+        }
+
+        /**
+         * @return false if the client should be disconnected.
+         */
+        bool read_client(console_client& client)
+        {
+            while(true)
+            {
+                ssize_t bytes = ::recv(client.fd.fd, m_read_buf.data(), m_read_buf.size(), 0);
+                if(bytes == 0)
+                {
+                    return false;
+                }
+                else if(bytes == -1)
+                {
+                    return errno == EAGAIN;
+                }
+
+                /*Input is typed by an operator.  If the pty can't take it right
+                 * now it is dropped rather than queued.*/
+                (void)::write(m_master_fd, m_read_buf.data(), (size_t)bytes);
+            }
+        }
+
+    public:
+
+        console_server(Tcl_Interp* interp, int master_fd, int listen_fd,
+                       const std::string& socket_path, size_t scrollback_size)
+            : m_interp(interp),
+              m_master_fd(master_fd),
+              m_listen_fd(listen_fd),
+              m_socket_path(socket_path),
+              m_scrollback(scrollback_size),
+              m_max_backlog(2 * scrollback_size),
+              m_clients(),
+              m_read_buf(READ_SIZE),
+              m_reading_master(false)
+        {}
+
+        console_server(const console_server& other) = delete;
+
+        int start()
+        {
+            int tcl_error = watch(m_listen_fd.fd, EVFILT_READ, EV_ADD);
+            if(tcl_error) return tcl_error;
+
+            m_reading_master = true;
+            return watch(m_master_fd, EVFILT_READ, EV_ADD);
+        }
+
+        tcl_event_ptr create_tcl_event(const struct kevent& event) override
+        {
+            tcl_event_ptr no_event(nullptr, tclalloc_free<Tcl_Event>);
+
+            int fd = (int)event.ident;
+            if(fd == m_master_fd)
+            {
+                read_master();
+                return no_event;
+            }
+            else if(fd == m_listen_fd.fd)
+            {
+                accept_clients();
+                return no_event;
+            }
+
+            auto client_it = m_clients.find(fd);
+            if(client_it == m_clients.end())
+            {
+                return no_event;
+            }
+
+            console_client& client = *client_it->second;
+            bool keep_open = true;
+            if(event.filter == EVFILT_WRITE)
+            {
+                client.write_pending = false;
+                keep_open = flush(client);
+            }
+            else
+            {
+                keep_open = read_client(client);
+            }
+
+            if(!keep_open)
+            {
+                /*Closing the fd removes it from the kqueue*/
+                m_clients.erase(client_it);
+            }
+            return no_event;
+        }
+
+        /**
+         * @brief stop Stop watching the master.  The master channel belongs to
+         * the caller and stays open.  Client and listen sockets are removed
+         * from the kqueue when they are closed.
+         */
+        void stop()
+        {
+            if(m_reading_master)
+            {
+                watch(m_master_fd, EVFILT_READ, EV_DELETE);
+                m_reading_master = false;
+            }
+        }
+
+        ~console_server()
+        {
+            unlink(m_socket_path.c_str());
+        }
+    };
+
+    struct console_context
+    {
+        std::map<std::string, std::unique_ptr<console_server>> servers;
+        uint64_t next_id = 0;
+    };
+
+    console_context& get_context(Tcl_Interp* interp)
+    {
+        console_context* ctx = reinterpret_cast<console_context*>(Tcl_GetAssocData(interp, "ConsoleContext", nullptr));
+        return *ctx;
+    }
+
+    int make_unix_address(Tcl_Interp* interp, const char* path, struct sockaddr_un& addr)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof(addr.sun_path))
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Console socket path is too long: %s", path));
+            Tcl_SetErrorCode(interp, "CONSOLE", "PATH", nullptr);
+            return TCL_ERROR;
+        }
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::console::serve ?-scrollback bytes? master_chan socket_path
+     *
+     * Serves the output of the pty master on a unix socket.  The most recent
+     * bytes (64k by default) are kept for clients that attach later.
+     * @returns A handle that can be passed to vessel::console::close.
+     */
+    int Vessel_ConsoleServe(void *clientData, Tcl_Interp *interp,
+                            int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        int scrollback_size = 64 * 1024;
+        if(objc == 5 && std::string("-scrollback") == Tcl_GetString(objv[1]))
+        {
+            int tcl_error = Tcl_GetIntFromObj(interp, objv[2], &scrollback_size);
+            if(tcl_error) return tcl_error;
+
+            if(scrollback_size <= 0)
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid scrollback size: %d", scrollback_size));
+                return TCL_ERROR;
+            }
+            objc -= 2;
+            objv += 2;
+        }
+
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "?-scrollback bytes? master_chan socket_path");
+            return TCL_ERROR;
+        }
+
+        long master_handle = -1;
+        int tcl_error = vessel::get_handle_from_channel(interp, objv[1], master_handle);
+        if(tcl_error) return tcl_error;
+
+        const char* socket_path = Tcl_GetString(objv[2]);
+        struct sockaddr_un addr;
+        tcl_error = make_unix_address(interp, socket_path, addr);
+        if(tcl_error) return tcl_error;
+
+        fd_guard sock(socket(AF_UNIX, SOCK_STREAM, 0));
+        if(sock.fd == -1)
+        {
+            return syserror_result(interp, "CONSOLE", "SOCKET");
+        }
+
+        /*A socket left behind by a container that wasn't cleaned up*/
+        unlink(socket_path);
+
+        /*Only root can attach to the console.  The socket is created
+         * without group and other permissions so it is never reachable
+         * by them, even before the mode is set.*/
+        mode_t old_umask = umask(0177);
+        int bind_result = bind(sock.fd, (struct sockaddr*)&addr, sizeof(addr));
+        umask(old_umask);
+        if(bind_result == -1)
+        {
+            return syserror_result(interp, "CONSOLE", "BIND");
+        }
+
+        if(chmod(socket_path, 0600) == -1)
+        {
+            tcl_error = syserror_result(interp, "CONSOLE", "CHMOD");
+            unlink(socket_path);
+            return tcl_error;
+        }
+
+        if(listen(sock.fd, SOMAXCONN) == -1)
+        {
+            return syserror_result(interp, "CONSOLE", "LISTEN");
+        }
+
+        int fds[] = {sock.fd, (int)master_handle};
+        for(int fd : fds)
+        {
+            int flags = fcntl(fd, F_GETFL);
+            if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+            {
+                return syserror_result(interp, "CONSOLE", "NONBLOCK");
+            }
+        }
+
+        auto server = std::make_unique<console_server>(interp, (int)master_handle, sock.release(),
+                                                       socket_path, (size_t)scrollback_size);
+        tcl_error = server->start();
+        if(tcl_error) return tcl_error;
+
+        console_context& ctx = get_context(interp);
+        std::string handle = "console" + std::to_string(ctx.next_id++);
+        ctx.servers[handle] = std::move(server);
+
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.c_str(), handle.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::console::close handle
+     *
+     * Disconnects all clients and removes the socket.  The master channel is
+     * not closed.
+     */
+    int Vessel_ConsoleClose(void *clientData, Tcl_Interp *interp,
+                            int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        console_context& ctx = get_context(interp);
+        auto server_it = ctx.servers.find(Tcl_GetString(objv[1]));
+        if(server_it == ctx.servers.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown console: %s", Tcl_GetString(objv[1])));
+            return TCL_ERROR;
+        }
+
+        server_it->second->stop();
+        ctx.servers.erase(server_it);
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::console::connect socket_path
+     *
+     * @returns A channel connected to the console served at socket_path.
+     */
+    int Vessel_ConsoleConnect(void *clientData, Tcl_Interp *interp,
+                              int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "socket_path");
+            return TCL_ERROR;
+        }
+
+        struct sockaddr_un addr;
+        int tcl_error = make_unix_address(interp, Tcl_GetString(objv[1]), addr);
+        if(tcl_error) return tcl_error;
+
+        fd_guard sock(socket(AF_UNIX, SOCK_STREAM, 0));
+        if(sock.fd == -1)
+        {
+            return syserror_result(interp, "CONSOLE", "SOCKET");
+        }
+
+        if(connect(sock.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            return syserror_result(interp, "CONSOLE", "CONNECT");
+        }
+
+        Tcl_Channel chan = Tcl_MakeFileChannel((ClientData)(long)sock.fd, TCL_READABLE | TCL_WRITABLE);
+        if(chan == nullptr)
+        {
+            return TCL_ERROR;
+        }
+        sock.release();
+
+        Tcl_RegisterChannel(interp, chan);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_GetChannelName(chan), -1));
+        return TCL_OK;
+    }
+}
+
+int Vessel_ConsoleInit(Tcl_Interp* interp)
+{
+    Tcl_SetAssocData(interp, "ConsoleContext", vessel::cpp_delete_with_interp<console_context>, new console_context());
+    Tcl_CreateObjCommand(interp, "vessel::console::serve", Vessel_ConsoleServe, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::console::close", Vessel_ConsoleClose, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::console::connect", Vessel_ConsoleConnect, nullptr, nullptr);
+
+    return TCL_OK;
+}
@@ -0,0 +1,8 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <tcl.h>
+
+int Vessel_ConsoleInit(Tcl_Interp* interp);
+
+#endif // CONSOLE_H
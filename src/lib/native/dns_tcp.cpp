@@ -0,0 +1,615 @@
+#include "dns_tcp.h"
+#include "tcl_kqueue.h"
+#include "tcl_util.h"
+#include "../../dns/embdns.h"
+
+#include <arpa/inet.h>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <tcl.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    /**
+     * @brief The dns_tcp_connection struct holds the state of a single client
+     * connection.  DNS over tcp prefixes every message with a two byte length so
+     * we accumulate input until a complete message is available.
+     */
+    struct dns_tcp_connection
+    {
+        fd_guard fd;
+        uint64_t id; /**< Unlike the fd it is never reused*/
+        std::vector<uint8_t> in_buf;
+        std::vector<uint8_t> out_buf;
+        size_t deferred; /**< Queries the callback will answer with reply*/
+        bool eof; /**< The client shut down its side of the connection*/
+        bool closing; /**< A reply failed and the connection is shut down*/
+
+        dns_tcp_connection(int fd, uint64_t id)
+            : fd(fd),
+              id(id),
+              in_buf(),
+              out_buf(),
+              deferred(0),
+              eof(false),
+              closing(false)
+        {}
+
+        /**
+         * @brief finished A client that sent its queries and shut down its
+         * side is closed once every answer has been sent.
+         */
+        bool finished() const
+        {
+            return closing || (eof && deferred == 0 && out_buf.empty());
+        }
+    };
+
+    class dns_tcp_server;
+
+    /**
+     * @brief The dns_tcp_event struct is queued when the listening socket or a
+     * client connection is ready.  The server may have been closed by the time
+     * the event is processed so only a weak reference is held.
+     */
+    struct dns_tcp_event : public Tcl_Event
+    {
+        std::weak_ptr<dns_tcp_server> server;
+        struct kevent event;
+
+        static int event_proc(Tcl_Event *evPtr, int flags);
+
+        dns_tcp_event(std::weak_ptr<dns_tcp_server> server, const struct kevent& event)
+            : Tcl_Event(),
+              server(server),
+              event(event)
+        {
+            this->proc = event_proc;
+            this->nextPtr = nullptr;
+        }
+    };
+
+    /**
+     * @brief The dns_tcp_server class accepts dns over tcp connections and frames
+     * the queries.  Each query is passed to the callback prefix which returns the
+     * response bytes or answers later with reply.  All socket io is driven by the
+     * kqueue event source.
+     */
+    class dns_tcp_server : public tcl_event_factory,
+                           public std::enable_shared_from_this<dns_tcp_server>
+    {
+        static const size_t MAX_CONNECTIONS = 128;
+
+        Tcl_Interp* m_interp;
+        fd_guard m_listen_fd;
+        tclobj_ptr m_callback;
+        std::map<int, std::unique_ptr<dns_tcp_connection>> m_connections;
+        uint64_t m_next_connection_id;
+        bool m_closed;
+
+        int watch(int fd, short filter, u_short flags)
+        {
+            struct kevent event;
+            EV_SET(&event, fd, filter, flags, 0, 0, 0);
+            return Kqueue_Add_Event(m_interp, event, *this);
+        }
+
+        void close_connection(int fd)
+        {
+            /*Closing the fd removes it from the kqueue*/
+            m_connections.erase(fd);
+        }
+
+        void accept_connections()
+        {
+            while(true)
+            {
+                int client_fd = ::accept(m_listen_fd.fd, nullptr, nullptr);
+                if(client_fd == -1)
+                {
+                    /*EAGAIN or a connection which was reset before we accepted it*/
+                    return;
+                }
+
+                fd_guard client(client_fd);
+                if(m_connections.size() >= MAX_CONNECTIONS)
+                {
+                    continue;
+                }
+
+                int flags = fcntl(client_fd, F_GETFL);
+                if(flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+                {
+                    continue;
+                }
+
+                m_connections[client_fd] = std::make_unique<dns_tcp_connection>(client.release(),
+                                                                                m_next_connection_id++);
+                watch(client_fd, EVFILT_READ, EV_ADD);
+            }
+        }
+
+        /**
+         * @brief respond Evaluate the callback with a single query.
+         * @return false if the connection should be closed.  The connection
+         * must not be touched when the server was closed by the callback
+         * since closing it frees the connection.
+         */
+        bool respond(dns_tcp_connection& conn, const uint8_t* query, size_t query_size)
+        {
+            int callback_length = 0;
+            Tcl_Obj **callback_elements = nullptr;
+            int error = Tcl_ListObjGetElements(m_interp, m_callback.get(), &callback_length, &callback_elements);
+            if(error)
+            {
+                Tcl_BackgroundError(m_interp);
+                return false;
+            }
+
+            tclobj_ptr eval_params = create_tclobj_ptr(Tcl_NewListObj(callback_length, callback_elements));
+            Tcl_IncrRefCount(eval_params.get());
+
+            error = Tcl_ListObjAppendElement(m_interp, eval_params.get(),
+                                             Tcl_NewByteArrayObj(query, (int)query_size));
+            if(!error)
+            {
+                error = Tcl_ListObjAppendElement(m_interp, eval_params.get(),
+                                                 Tcl_NewWideIntObj((Tcl_WideInt)conn.id));
+            }
+            if(error)
+            {
+                Tcl_BackgroundError(m_interp);
+                return false;
+            }
+
+            error = Tcl_EvalObjEx(m_interp, eval_params.get(), TCL_EVAL_GLOBAL);
+            if(error)
+            {
+                Tcl_BackgroundError(m_interp);
+                return false;
+            }
+
+            if(m_closed)
+            {
+                /*The callback closed the server and conn with it*/
+                Tcl_ResetResult(m_interp);
+                return false;
+            }
+
+            int response_size = 0;
+            unsigned char* response = Tcl_GetByteArrayFromObj(Tcl_GetObjResult(m_interp), &response_size);
+            Tcl_ResetResult(m_interp);
+
+            if(response_size == 0)
+            {
+                /*Callback will reply later*/
+                ++conn.deferred;
+                return true;
+            }
+
+            return queue_response(conn, response, (size_t)response_size);
+        }
+
+        /**
+         * @return false if the connection should be closed.
+         */
+        bool queue_response(dns_tcp_connection& conn, const uint8_t* response, size_t response_size)
+        {
+            if(response_size > embdns::dns_message::MAX_TCP_SIZE)
+            {
+                return false;
+            }
+
+            conn.out_buf.push_back((response_size & 0xff00) >> 8);
+            conn.out_buf.push_back(response_size & 0x00ff);
+            conn.out_buf.insert(conn.out_buf.end(), response, response + response_size);
+            return true;
+        }
+
+        /**
+         * @return false if the connection should be closed.
+         */
+        bool flush(dns_tcp_connection& conn)
+        {
+            size_t sent = 0;
+            while(sent < conn.out_buf.size())
+            {
+                ssize_t bytes = ::send(conn.fd.fd, conn.out_buf.data() + sent,
+                                       conn.out_buf.size() - sent, 0);
+                if(bytes == -1)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if(errno != EAGAIN)
+                    {
+                        return false;
+                    }
+
+                    /*Finish the write when the socket drains*/
+                    watch(conn.fd.fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT);
+                    break;
+                }
+                sent += bytes;
+            }
+
+            conn.out_buf.erase(conn.out_buf.begin(), conn.out_buf.begin() + sent);
+            return true;
+        }
+
+        /**
+         * @return false if the connection should be closed.
+         */
+        bool read_connection(dns_tcp_connection& conn)
+        {
+            if(conn.closing)
+            {
+                return false;
+            }
+
+            std::array<uint8_t, 4096> buf;
+            while(!conn.eof)
+            {
+                ssize_t bytes = ::recv(conn.fd.fd, buf.data(), buf.size(), 0);
+                if(bytes == 0)
+                {
+                    /*The queries sent before the shutdown are still answered.
+                     * The read filter would fire on the eof forever.*/
+                    conn.eof = true;
+                    watch(conn.fd.fd, EVFILT_READ, EV_DELETE);
+                }
+                else if(bytes == -1)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if(errno != EAGAIN)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                else
+                {
+                    conn.in_buf.insert(conn.in_buf.end(), buf.data(), buf.data() + bytes);
+                }
+            }
+
+            size_t consumed = 0;
+            while(conn.in_buf.size() - consumed >= 2)
+            {
+                size_t msg_size = (conn.in_buf[consumed] << 8) | conn.in_buf[consumed + 1];
+                if(conn.in_buf.size() - consumed - 2 < msg_size)
+                {
+                    break;
+                }
+
+                /*conn is freed if the callback closed the server*/
+                if(!respond(conn, conn.in_buf.data() + consumed + 2, msg_size))
+                {
+                    return false;
+                }
+                consumed += 2 + msg_size;
+            }
+            conn.in_buf.erase(conn.in_buf.begin(), conn.in_buf.begin() + consumed);
+
+            return flush(conn) && !conn.finished();
+        }
+
+    public:
+
+        dns_tcp_server(Tcl_Interp* interp, int listen_fd, Tcl_Obj* callback)
+            : m_interp(interp),
+              m_listen_fd(listen_fd),
+              m_callback(create_tclobj_ptr(callback)),
+              m_connections(),
+              m_next_connection_id(0),
+              m_closed(false)
+        {
+            Tcl_IncrRefCount(callback);
+        }
+
+        dns_tcp_server(const dns_tcp_server& other) = delete;
+
+        int start()
+        {
+            return watch(m_listen_fd.fd, EVFILT_READ, EV_ADD);
+        }
+
+        void close()
+        {
+            m_closed = true;
+            m_connections.clear();
+            ::close(m_listen_fd.release());
+        }
+
+        /**
+         * @brief reply Send a response to a query the callback didn't answer
+         * when it was called.
+         * @return false if the connection has been closed since.
+         */
+        bool reply(uint64_t connection_id, const uint8_t* response, size_t response_size)
+        {
+            for(auto& conn_entry : m_connections)
+            {
+                dns_tcp_connection& conn = *conn_entry.second;
+                if(conn.id != connection_id)
+                {
+                    continue;
+                }
+
+                if(conn.deferred > 0)
+                {
+                    --conn.deferred;
+                }
+                if(!queue_response(conn, response, response_size) || !flush(conn))
+                {
+                    conn.closing = true;
+                    shutdown(conn.fd.fd, SHUT_RDWR);
+                }
+                if(conn.finished())
+                {
+                    /*The write event closes the connection.  It isn't freed
+                     * here in case the callback is replying and there is no
+                     * read event once the client's eof was seen.*/
+                    watch(conn.fd.fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT);
+                }
+                return true;
+            }
+            return false;
+        }
+
+        tcl_event_ptr create_tcl_event(const struct kevent& event) override
+        {
+            return alloc_tcl_event<dns_tcp_event>(weak_from_this(), event);
+        }
+
+        void handle_event(const struct kevent& event)
+        {
+            if(m_closed)
+            {
+                return;
+            }
+
+            int fd = (int)event.ident;
+            if(fd == m_listen_fd.fd)
+            {
+                accept_connections();
+                return;
+            }
+
+            auto conn_it = m_connections.find(fd);
+            if(conn_it == m_connections.end())
+            {
+                /*Connection was closed after this event was queued*/
+                return;
+            }
+
+            dns_tcp_connection& conn = *conn_it->second;
+            bool keep_open = true;
+            if(event.filter == EVFILT_WRITE)
+            {
+                keep_open = !conn.closing && flush(conn) && !conn.finished();
+            }
+            else
+            {
+                keep_open = read_connection(conn);
+            }
+
+            if(!keep_open && !m_closed)
+            {
+                close_connection(fd);
+            }
+        }
+
+        ~dns_tcp_server()
+        {}
+    };
+
+    int dns_tcp_event::event_proc(Tcl_Event *evPtr, int flags)
+    {
+        (void)flags;
+        placement_ptr<dns_tcp_event> _this = create_placement_ptr((dns_tcp_event*)(evPtr));
+
+        /*Keep the server alive while the callback runs in case the callback closes it*/
+        std::shared_ptr<dns_tcp_server> server = _this->server.lock();
+        if(server)
+        {
+            server->handle_event(_this->event);
+        }
+
+        return 1;
+    }
+
+    struct dns_tcp_context
+    {
+        std::map<std::string, std::shared_ptr<dns_tcp_server>> servers;
+        uint64_t next_id = 0;
+    };
+
+    dns_tcp_context& get_context(Tcl_Interp* interp)
+    {
+        dns_tcp_context* ctx = reinterpret_cast<dns_tcp_context*>(Tcl_GetAssocData(interp, "DNSTcpContext", nullptr));
+        return *ctx;
+    }
+
+    int open_listen_socket(Tcl_Interp* interp, const char* addr_string, uint16_t port, int& listen_fd)
+    {
+        fd_guard sock(socket(AF_INET, SOCK_STREAM, 0));
+        if(sock.fd == -1)
+        {
+            return syserror_result(interp, "DNS", "TCP", "SOCKET");
+        }
+
+        int one = 1;
+        if(setsockopt(sock.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+        {
+            return syserror_result(interp, "DNS", "TCP", "SOCKOPT");
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if(inet_pton(AF_INET, addr_string, &addr.sin_addr) != 1)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error parsing ip address: %s", addr_string));
+            return TCL_ERROR;
+        }
+
+        if(bind(sock.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            return syserror_result(interp, "DNS", "TCP", "BIND");
+        }
+
+        if(listen(sock.fd, SOMAXCONN) == -1)
+        {
+            return syserror_result(interp, "DNS", "TCP", "LISTEN");
+        }
+
+        int flags = fcntl(sock.fd, F_GETFL);
+        if(flags == -1 || fcntl(sock.fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            return syserror_result(interp, "DNS", "TCP", "NONBLOCK");
+        }
+
+        listen_fd = sock.release();
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::tcp_listen ?-myaddr ip? port callback_prefix
+     *
+     * The callback prefix is invoked with the raw query bytes and the id of the
+     * connection and returns the raw response bytes.  An empty string sends no
+     * response, eg when the query is answered later with tcp_reply.
+     * @returns A handle that can be passed to tcp_close.
+     */
+    int Vessel_DNSTcpListen(void *clientData, Tcl_Interp *interp,
+                            int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        const char* addr_string = "0.0.0.0";
+        if(objc == 5 && std::string("-myaddr") == Tcl_GetString(objv[1]))
+        {
+            addr_string = Tcl_GetString(objv[2]);
+            objc -= 2;
+            objv += 2;
+        }
+
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "?-myaddr ip? port callback_prefix");
+            return TCL_ERROR;
+        }
+
+        int port = 0;
+        int tcl_error = Tcl_GetIntFromObj(interp, objv[1], &port);
+        if(tcl_error) return tcl_error;
+
+        if(port < 0 || port > 0xffff)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid port: %d", port));
+            return TCL_ERROR;
+        }
+
+        int listen_fd = -1;
+        tcl_error = open_listen_socket(interp, addr_string, (uint16_t)port, listen_fd);
+        if(tcl_error) return tcl_error;
+
+        auto server = std::make_shared<dns_tcp_server>(interp, listen_fd, objv[2]);
+        tcl_error = server->start();
+        if(tcl_error) return tcl_error;
+
+        dns_tcp_context& ctx = get_context(interp);
+        std::string handle = "dnstcp" + std::to_string(ctx.next_id++);
+        ctx.servers[handle] = server;
+
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.c_str(), handle.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::tcp_reply handle connection response
+     *
+     * Sends the response to a query the callback returned no response for.
+     * @returns 1 or 0 if the connection was closed in the meantime.
+     */
+    int Vessel_DNSTcpReply(void *clientData, Tcl_Interp *interp,
+                           int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 4)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle connection response");
+            return TCL_ERROR;
+        }
+
+        dns_tcp_context& ctx = get_context(interp);
+        auto server_it = ctx.servers.find(Tcl_GetString(objv[1]));
+        if(server_it == ctx.servers.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown dns tcp server: %s", Tcl_GetString(objv[1])));
+            return TCL_ERROR;
+        }
+
+        Tcl_WideInt connection_id = 0;
+        int tcl_error = Tcl_GetWideIntFromObj(interp, objv[2], &connection_id);
+        if(tcl_error) return tcl_error;
+
+        int response_size = 0;
+        unsigned char* response = Tcl_GetByteArrayFromObj(objv[3], &response_size);
+        bool sent = server_it->second->reply((uint64_t)connection_id, response, (size_t)response_size);
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(sent));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::tcp_close handle
+     */
+    int Vessel_DNSTcpClose(void *clientData, Tcl_Interp *interp,
+                           int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        dns_tcp_context& ctx = get_context(interp);
+        auto server_it = ctx.servers.find(Tcl_GetString(objv[1]));
+        if(server_it == ctx.servers.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown dns tcp server: %s", Tcl_GetString(objv[1])));
+            return TCL_ERROR;
+        }
+
+        server_it->second->close();
+        ctx.servers.erase(server_it);
+        return TCL_OK;
+    }
+}
+
+int Vessel_DNSTcpInit(Tcl_Interp* interp)
+{
+    Tcl_SetAssocData(interp, "DNSTcpContext", vessel::cpp_delete_with_interp<dns_tcp_context>, new dns_tcp_context());
+    Tcl_CreateObjCommand(interp, "vessel::dns::tcp_listen", Vessel_DNSTcpListen, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::dns::tcp_reply", Vessel_DNSTcpReply, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::dns::tcp_close", Vessel_DNSTcpClose, nullptr, nullptr);
+
+    return TCL_OK;
+}
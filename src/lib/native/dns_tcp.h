@@ -0,0 +1,8 @@
+#ifndef DNS_TCP_H
+#define DNS_TCP_H
+
+#include <tcl.h>
+
+int Vessel_DNSTcpInit(Tcl_Interp* interp);
+
+#endif // DNS_TCP_H
@@ -0,0 +1,283 @@
+#include "dns_workers.h"
+#include "tcl_util.h"
+#include "../../dns/embdns_workers.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <tcl.h>
+
+using namespace vessel;
+
+namespace
+{
+    struct dns_workers_context
+    {
+        std::map<std::string, std::unique_ptr<embdns::worker_pool>> pools;
+        uint64_t next_id = 0;
+    };
+
+    dns_workers_context& get_context(Tcl_Interp* interp)
+    {
+        dns_workers_context* ctx = reinterpret_cast<dns_workers_context*>(Tcl_GetAssocData(interp, "DNSWorkersContext", nullptr));
+        return *ctx;
+    }
+
+    /**
+     * Convert a dict of name -> {address_list ttl} (the DNSServer store) to a
+     * record table.
+     */
+    int records_to_table(Tcl_Interp* interp, Tcl_Obj* records,
+                         std::shared_ptr<embdns::record_table>& table)
+    {
+        table = std::make_shared<embdns::record_table>();
+
+        Tcl_DictSearch search;
+        Tcl_Obj* name = nullptr;
+        Tcl_Obj* entry = nullptr;
+        int done = 0;
+        int tcl_error = Tcl_DictObjFirst(interp, records, &search, &name, &entry, &done);
+        if(tcl_error) return tcl_error;
+
+        for(; !done; Tcl_DictObjNext(&search, &name, &entry, &done))
+        {
+            int entry_length = 0;
+            Tcl_Obj** entry_elements = nullptr;
+            tcl_error = Tcl_ListObjGetElements(interp, entry, &entry_length, &entry_elements);
+            if(tcl_error || entry_length != 2)
+            {
+                Tcl_DictObjDone(&search);
+                if(!tcl_error)
+                {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("dns record must be a list of addresses and a ttl: %s",
+                                                           Tcl_GetString(entry)));
+                }
+                return TCL_ERROR;
+            }
+
+            embdns::record_table::entry record;
+            int ttl = 0;
+            tcl_error = Tcl_GetIntFromObj(interp, entry_elements[1], &ttl);
+            if(tcl_error)
+            {
+                Tcl_DictObjDone(&search);
+                return tcl_error;
+            }
+            record.ttl = (uint32_t)ttl;
+
+            int addr_count = 0;
+            Tcl_Obj** addr_objs = nullptr;
+            tcl_error = Tcl_ListObjGetElements(interp, entry_elements[0], &addr_count, &addr_objs);
+            if(tcl_error)
+            {
+                Tcl_DictObjDone(&search);
+                return tcl_error;
+            }
+
+            for(int i = 0; i < addr_count; ++i)
+            {
+                in_addr addr;
+                if(inet_pton(AF_INET, Tcl_GetString(addr_objs[i]), &addr) != 1)
+                {
+                    Tcl_DictObjDone(&search);
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error parsing ip address: %s",
+                                                           Tcl_GetString(addr_objs[i])));
+                    return TCL_ERROR;
+                }
+                record.addrs.push_back(addr.s_addr);
+            }
+
+            table->records[Tcl_GetString(name)] = std::move(record);
+        }
+
+        return TCL_OK;
+    }
+
+    int get_pool(Tcl_Interp* interp, Tcl_Obj* handle, embdns::worker_pool*& pool)
+    {
+        dns_workers_context& ctx = get_context(interp);
+        auto pool_it = ctx.pools.find(Tcl_GetString(handle));
+        if(pool_it == ctx.pools.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown dns worker pool: %s", Tcl_GetString(handle)));
+            return TCL_ERROR;
+        }
+
+        pool = pool_it->second.get();
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::workers_start ?-myaddr ip? port thread_count records
+     *
+     * records is a dict of name -> {address_list ttl}
+     * @returns A handle for the other workers_* commands
+     */
+    int Vessel_DNSWorkersStart(void *clientData, Tcl_Interp *interp,
+                               int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        std::string addr_string = "0.0.0.0";
+        if(objc == 6 && std::string("-myaddr") == Tcl_GetString(objv[1]))
+        {
+            addr_string = Tcl_GetString(objv[2]);
+            objc -= 2;
+            objv += 2;
+        }
+
+        if(objc != 4)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "?-myaddr ip? port thread_count records");
+            return TCL_ERROR;
+        }
+
+        int port = 0;
+        int tcl_error = Tcl_GetIntFromObj(interp, objv[1], &port);
+        if(tcl_error) return tcl_error;
+
+        if(port < 0 || port > 0xffff)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid port: %d", port));
+            return TCL_ERROR;
+        }
+
+        int thread_count = 0;
+        tcl_error = Tcl_GetIntFromObj(interp, objv[2], &thread_count);
+        if(tcl_error) return tcl_error;
+
+        if(thread_count < 1)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid worker count: %d", thread_count));
+            return TCL_ERROR;
+        }
+
+        std::shared_ptr<embdns::record_table> table;
+        tcl_error = records_to_table(interp, objv[3], table);
+        if(tcl_error) return tcl_error;
+
+        std::unique_ptr<embdns::worker_pool> pool;
+        try
+        {
+            pool = std::make_unique<embdns::worker_pool>(addr_string, (uint16_t)port,
+                                                         (size_t)thread_count, table);
+        }
+        catch(const std::system_error& e)
+        {
+            errno = e.code().value();
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error starting dns workers: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "WORKERS", Tcl_ErrnoId(), nullptr);
+            return TCL_ERROR;
+        }
+        catch(const std::invalid_argument& e)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error starting dns workers: %s", e.what()));
+            return TCL_ERROR;
+        }
+
+        dns_workers_context& ctx = get_context(interp);
+        std::string handle = "dnsworkers" + std::to_string(ctx.next_id++);
+        ctx.pools[handle] = std::move(pool);
+
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.c_str(), handle.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::workers_update handle records
+     */
+    int Vessel_DNSWorkersUpdate(void *clientData, Tcl_Interp *interp,
+                                int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle records");
+            return TCL_ERROR;
+        }
+
+        embdns::worker_pool* pool = nullptr;
+        int tcl_error = get_pool(interp, objv[1], pool);
+        if(tcl_error) return tcl_error;
+
+        std::shared_ptr<embdns::record_table> table;
+        tcl_error = records_to_table(interp, objv[2], table);
+        if(tcl_error) return tcl_error;
+
+        pool->update(table);
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::workers_stats handle
+     * @returns A list with a dict of counters for each worker
+     */
+    int Vessel_DNSWorkersStats(void *clientData, Tcl_Interp *interp,
+                               int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        embdns::worker_pool* pool = nullptr;
+        int tcl_error = get_pool(interp, objv[1], pool);
+        if(tcl_error) return tcl_error;
+
+        Tcl_Obj* stats_list = Tcl_NewListObj(0, nullptr);
+        for(const embdns::worker_stats& stats : pool->stats())
+        {
+            Tcl_Obj* stats_dict = Tcl_NewDictObj();
+            Tcl_DictObjPut(interp, stats_dict, Tcl_NewStringObj("queries", -1),
+                           Tcl_NewWideIntObj((Tcl_WideInt)stats.queries));
+            Tcl_DictObjPut(interp, stats_dict, Tcl_NewStringObj("responses", -1),
+                           Tcl_NewWideIntObj((Tcl_WideInt)stats.responses));
+            Tcl_DictObjPut(interp, stats_dict, Tcl_NewStringObj("errors", -1),
+                           Tcl_NewWideIntObj((Tcl_WideInt)stats.errors));
+            Tcl_DictObjPut(interp, stats_dict, Tcl_NewStringObj("unknown", -1),
+                           Tcl_NewWideIntObj((Tcl_WideInt)stats.unknown));
+            Tcl_ListObjAppendElement(interp, stats_list, stats_dict);
+        }
+
+        Tcl_SetObjResult(interp, stats_list);
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::dns::workers_stop handle
+     */
+    int Vessel_DNSWorkersStop(void *clientData, Tcl_Interp *interp,
+                              int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        embdns::worker_pool* pool = nullptr;
+        int tcl_error = get_pool(interp, objv[1], pool);
+        if(tcl_error) return tcl_error;
+
+        /*Joins the worker threads*/
+        get_context(interp).pools.erase(Tcl_GetString(objv[1]));
+        return TCL_OK;
+    }
+}
+
+int Vessel_DNSWorkersInit(Tcl_Interp* interp)
+{
+    Tcl_SetAssocData(interp, "DNSWorkersContext", vessel::cpp_delete_with_interp<dns_workers_context>,
+                     new dns_workers_context());
+    Tcl_CreateObjCommand(interp, "vessel::dns::workers_start", Vessel_DNSWorkersStart, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::dns::workers_update", Vessel_DNSWorkersUpdate, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::dns::workers_stats", Vessel_DNSWorkersStats, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::dns::workers_stop", Vessel_DNSWorkersStop, nullptr, nullptr);
+
+    return TCL_OK;
+}
@@ -0,0 +1,8 @@
+#ifndef DNS_WORKERS_H
+#define DNS_WORKERS_H
+
+#include <tcl.h>
+
+int Vessel_DNSWorkersInit(Tcl_Interp* interp);
+
+#endif // DNS_WORKERS_H
@@ -0,0 +1,233 @@
+#include "hardlinks.h"
+#include "tcl_util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fts.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    /**
+     * @brief The paths of an inode in the change set
+     */
+    struct inode_paths
+    {
+        ino_t inode;
+        nlink_t links;
+        std::string changed_path;
+        std::vector<std::string> paths;
+    };
+
+    /**
+     * @brief The change set of a layer keyed by inode.  Inodes with a single
+     * link only need the path from the diff.  Inodes with more links need
+     * every path in the dataset which is found by walking the mountpoint.
+     */
+    class changeset
+    {
+        std::vector<inode_paths> m_inodes;
+        std::unordered_map<ino_t, std::size_t> m_index;
+        std::size_t m_missing_links;
+
+    public:
+        changeset()
+            : m_inodes(),
+              m_index(),
+              m_missing_links(0)
+        {}
+
+        void add_changed(const std::string& path, const struct stat& sb)
+        {
+            auto found = m_index.find(sb.st_ino);
+            if(found != m_index.end())
+            {
+                return;
+            }
+
+            m_index.emplace(sb.st_ino, m_inodes.size());
+            if(is_linked(sb))
+            {
+                /*All of the paths are added by the walk including this one*/
+                m_inodes.push_back({sb.st_ino, sb.st_nlink, path, {}});
+                m_missing_links += sb.st_nlink;
+            }
+            else
+            {
+                m_inodes.push_back({sb.st_ino, sb.st_nlink, path, {path}});
+            }
+        }
+
+        void add_link(const char* path, const struct stat& sb)
+        {
+            auto found = m_index.find(sb.st_ino);
+            if(found == m_index.end())
+            {
+                return;
+            }
+
+            inode_paths& inode = m_inodes[found->second];
+            if(inode.paths.size() < inode.links)
+            {
+                inode.paths.emplace_back(path);
+                --m_missing_links;
+            }
+        }
+
+        /**
+         * @brief Directories can't be hardlinked, their link count is the
+         * number of subdirectories.
+         */
+        static bool is_linked(const struct stat& sb)
+        {
+            return !S_ISDIR(sb.st_mode) && sb.st_nlink > 1;
+        }
+
+        std::size_t missing_links() const
+        {
+            return m_missing_links;
+        }
+
+        Tcl_Obj* to_dict() const
+        {
+            Tcl_Obj* dict = Tcl_NewDictObj();
+            for(const inode_paths& inode : m_inodes)
+            {
+                Tcl_Obj* paths = Tcl_NewListObj(0, nullptr);
+
+                /*The walk only misses the changed path if it is below another mount*/
+                const std::vector<std::string> changed{inode.changed_path};
+                for(const std::string& path : inode.paths.empty() ? changed : inode.paths)
+                {
+                    Tcl_ListObjAppendElement(nullptr, paths,
+                                             Tcl_NewStringObj(path.c_str(), path.size()));
+                }
+                Tcl_DictObjPut(nullptr, dict, Tcl_NewWideIntObj(inode.inode), paths);
+            }
+            return dict;
+        }
+    };
+
+    int path_error(Tcl_Interp* interp, const char* operation, const char* path)
+    {
+        int error = errno;
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s %s: %s", operation, path, Tcl_ErrnoMsg(error)));
+        Tcl_SetErrorCode(interp, "VESSEL", "HARDLINKS", Tcl_ErrnoId(), nullptr);
+        return TCL_ERROR;
+    }
+
+    /**
+     * @brief Walks the mountpoint until every path of the linked inodes in
+     * the change set has been found.  Other file systems mounted below the
+     * mountpoint aren't part of the dataset so they aren't walked.
+     */
+    int find_links(Tcl_Interp* interp, const std::string& mountpoint, changeset& changes)
+    {
+        char* roots[] = {const_cast<char*>(mountpoint.c_str()), nullptr};
+        FTS* fts = fts_open(roots, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR, nullptr);
+        if(fts == nullptr)
+        {
+            return path_error(interp, "fts_open", mountpoint.c_str());
+        }
+
+        int tcl_error = TCL_OK;
+        FTSENT* entry = nullptr;
+        errno = 0;
+        while(changes.missing_links() > 0 && (entry = fts_read(fts)) != nullptr)
+        {
+            switch(entry->fts_info)
+            {
+            case FTS_F:
+            case FTS_SL:
+            case FTS_SLNONE:
+            case FTS_DEFAULT:
+                if(changeset::is_linked(*entry->fts_statp))
+                {
+                    changes.add_link(entry->fts_path, *entry->fts_statp);
+                }
+                break;
+            case FTS_DNR:
+            case FTS_ERR:
+            case FTS_NS:
+                errno = entry->fts_errno;
+                tcl_error = path_error(interp, "fts_read", entry->fts_path);
+                break;
+            default:
+                break;
+            }
+
+            if(tcl_error)
+            {
+                break;
+            }
+        }
+
+        if(tcl_error == TCL_OK && entry == nullptr && errno != 0)
+        {
+            tcl_error = path_error(interp, "fts_read", mountpoint.c_str());
+        }
+
+        fts_close(fts);
+        return tcl_error;
+    }
+
+    /**
+     * @brief vessel::fs::hardlinks mountpoint paths
+     *
+     * Returns a dict of inode to the list of paths of the inode for the
+     * changed paths.  zfs diff only reports one path of an inode with
+     * several links so the other paths are found below the mountpoint.
+     */
+    int hardlinks_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "mountpoint paths");
+            return TCL_ERROR;
+        }
+
+        std::string mountpoint(Tcl_GetString(objv[1]));
+        while(mountpoint.size() > 1 && mountpoint.back() == '/')
+        {
+            mountpoint.pop_back();
+        }
+
+        int path_count = 0;
+        Tcl_Obj** paths = nullptr;
+        int tcl_error = Tcl_ListObjGetElements(interp, objv[2], &path_count, &paths);
+        if(tcl_error) return tcl_error;
+
+        changeset changes;
+        for(int i = 0; i < path_count; ++i)
+        {
+            const char* path = Tcl_GetString(paths[i]);
+            struct stat sb;
+            if(lstat(path, &sb) != 0)
+            {
+                return path_error(interp, "lstat", path);
+            }
+            changes.add_changed(path, sb);
+        }
+
+        if(changes.missing_links() > 0)
+        {
+            tcl_error = find_links(interp, mountpoint, changes);
+            if(tcl_error) return tcl_error;
+        }
+
+        Tcl_SetObjResult(interp, changes.to_dict());
+        return TCL_OK;
+    }
+}
+
+int Vessel_HardlinksInit(Tcl_Interp* interp)
+{
+    (void)Tcl_CreateObjCommand(interp, "vessel::fs::hardlinks", hardlinks_cmd, nullptr, nullptr);
+    return TCL_OK;
+}
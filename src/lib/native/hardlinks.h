@@ -0,0 +1,8 @@
+#ifndef HARDLINKS_H
+#define HARDLINKS_H
+
+#include <tcl.h>
+
+int Vessel_HardlinksInit(Tcl_Interp* interp);
+
+#endif // HARDLINKS_H
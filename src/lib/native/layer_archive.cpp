@@ -0,0 +1,1658 @@
+#include "layer_archive.h"
+#include "tcl_kqueue.h"
+#include "tcl_util.h"
+#include "whiteouts.h"
+
+#include <algorithm>
+#include <array>
+#include <archive.h>
+#include <archive_entry.h>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <openssl/evp.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    /**
+     * @brief Name of the entry with the paths the layer deletes.  It is the
+     * first entry of a layer so the deletions are applied before any of the
+     * layer's files are extracted.
+     */
+    const char* const WHITEOUTS_ENTRY = "+WHITEOUTS";
+
+    using read_archive_ptr = std::unique_ptr<struct archive, decltype(&archive_read_free)>;
+    using write_archive_ptr = std::unique_ptr<struct archive, decltype(&archive_write_free)>;
+    using entry_ptr = std::unique_ptr<struct archive_entry, decltype(&archive_entry_free)>;
+
+    int archive_error(Tcl_Interp* interp, struct archive* a, const char* operation)
+    {
+        const char* message = archive_error_string(a);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", operation,
+                                               message != nullptr ? message : "unknown error"));
+        Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "EFORMAT", nullptr);
+        return TCL_ERROR;
+    }
+
+    int path_error(Tcl_Interp* interp, const char* operation, const std::string& path)
+    {
+        int error = errno;
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s %s: %s", operation, path.c_str(), Tcl_ErrnoMsg(error)));
+        Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", Tcl_ErrnoId(), nullptr);
+        return TCL_ERROR;
+    }
+
+    std::string to_hex(const unsigned char* data, unsigned int len)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(len * 2);
+        for(unsigned int i = 0; i < len; ++i)
+        {
+            hex.push_back(digits[data[i] >> 4]);
+            hex.push_back(digits[data[i] & 0x0f]);
+        }
+        return hex;
+    }
+
+    int get_strings(Tcl_Interp* interp, Tcl_Obj* list, std::vector<std::string>& strings)
+    {
+        int count = 0;
+        Tcl_Obj** elements = nullptr;
+        int tcl_error = Tcl_ListObjGetElements(interp, list, &count, &elements);
+        if(tcl_error) return tcl_error;
+
+        strings.reserve(count);
+        for(int i = 0; i < count; ++i)
+        {
+            strings.emplace_back(Tcl_GetString(elements[i]));
+        }
+        return TCL_OK;
+    }
+
+    /**
+     * @brief How a layer is compressed.  An empty level is the default
+     * level of the codec and 0 threads is a thread per core.
+     */
+    struct compression_options
+    {
+        std::string codec;
+        std::string level;
+        int threads;
+    };
+
+    std::string sha256_digest(const void* data, size_t length)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        EVP_Digest(data, length, digest, &digest_len, EVP_sha256(), nullptr);
+        return "sha256:" + to_hex(digest, digest_len);
+    }
+
+    /**
+     * @brief Appends the input to the output compressed as a single gzip
+     * member or zstd frame by writing it as the only entry of a raw
+     * archive.  Concatenated members and frames decompress like one stream.
+     */
+    bool compress_chunk(const compression_options& compression, const std::string& input,
+                        std::string& output, std::string& error)
+    {
+        if(compression.codec == "none")
+        {
+            output = input;
+            return true;
+        }
+
+        write_archive_ptr a(archive_write_new(), archive_write_free);
+        archive_write_set_format_raw(a.get());
+        archive_write_set_bytes_in_last_block(a.get(), 1);
+
+        const char* codec = compression.codec.c_str();
+        int status = compression.codec == "gzip" ?
+            archive_write_add_filter_gzip(a.get()) : archive_write_add_filter_zstd(a.get());
+        if(status == ARCHIVE_OK && compression.codec == "gzip")
+        {
+            status = archive_write_set_filter_option(a.get(), codec, "timestamp", nullptr);
+        }
+        if(status == ARCHIVE_OK && !compression.level.empty())
+        {
+            status = archive_write_set_filter_option(a.get(), codec, "compression-level",
+                                                     compression.level.c_str());
+        }
+
+        auto append = [](struct archive*, void* client_data, const void* buffer, size_t length) -> la_ssize_t
+        {
+            static_cast<std::string*>(client_data)->append(static_cast<const char*>(buffer), length);
+            return length;
+        };
+
+        entry_ptr entry(archive_entry_new(), archive_entry_free);
+        archive_entry_set_pathname(entry.get(), "chunk");
+        archive_entry_set_filetype(entry.get(), AE_IFREG);
+        archive_entry_set_size(entry.get(), input.size());
+
+        output.clear();
+        if(status != ARCHIVE_OK ||
+           archive_write_open(a.get(), &output, nullptr, append, nullptr) != ARCHIVE_OK ||
+           archive_write_header(a.get(), entry.get()) < ARCHIVE_WARN ||
+           archive_write_data(a.get(), input.data(), input.size()) < 0 ||
+           archive_write_close(a.get()) != ARCHIVE_OK)
+        {
+            const char* message = archive_error_string(a.get());
+            error = message != nullptr ? message : "unknown error";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Splits the tar stream of a layer at content defined boundaries
+     * and compresses every chunk on its own so the same files make the same
+     * chunks whatever changed around them.  A boundary is where the gear
+     * hash of the last 64 bytes has none of its top bits set under the
+     * mask, the low bits only depend on the last few bytes, so chunks
+     * average about the chunk size and are between a quarter and four
+     * times it.  The chunks are compressed by a pool of threads and written
+     * in order.
+     */
+    class layer_chunker
+    {
+        struct chunk
+        {
+            std::string input;
+            std::string output;
+            std::string digest;
+            std::string error;
+            bool claimed;
+            bool done;
+        };
+
+        compression_options m_compression;
+        size_t m_min_size;
+        size_t m_max_size;
+        uint64_t m_mask;
+        uint64_t m_hash;
+        std::string m_pending;
+
+        std::mutex m_mutex;
+        std::condition_variable m_changed;
+        std::deque<std::shared_ptr<chunk>> m_queue;
+        std::vector<std::thread> m_workers;
+        bool m_stopping;
+
+        /*The digest and size of every written chunk in layer order*/
+        std::vector<std::pair<std::string, size_t>> m_written;
+
+        static const std::array<uint64_t, 256>& gear()
+        {
+            static const std::array<uint64_t, 256> table = []
+            {
+                /*splitmix64 so every build cuts the same boundaries*/
+                std::array<uint64_t, 256> values;
+                uint64_t state = 0x766573736c6c6179;
+                for(uint64_t& value : values)
+                {
+                    uint64_t z = (state += 0x9e3779b97f4a7c15);
+                    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                    value = z ^ (z >> 31);
+                }
+                return values;
+            }();
+            return table;
+        }
+
+    public:
+        layer_chunker(const compression_options& compression, size_t chunk_size)
+            : m_compression(compression),
+              m_min_size(std::max<size_t>(chunk_size / 4, 1)),
+              m_max_size(chunk_size * 4),
+              m_mask(0),
+              m_hash(0),
+              m_stopping(false)
+        {
+            /*A boundary after the minimum size is 1 in 2^bits bytes*/
+            int bits = 0;
+            while((uint64_t(2) << bits) <= chunk_size - m_min_size)
+            {
+                ++bits;
+            }
+            m_mask = bits > 0 ? ~uint64_t(0) << (64 - bits) : 0;
+
+            unsigned threads = compression.threads > 0 ?
+                compression.threads : std::max(1u, std::thread::hardware_concurrency());
+            for(unsigned i = 0; i < threads; ++i)
+            {
+                m_workers.emplace_back([this] { work(); });
+            }
+        }
+
+        ~layer_chunker()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_changed.notify_all();
+            for(std::thread& worker : m_workers)
+            {
+                worker.join();
+            }
+        }
+
+        /**
+         * @brief Adds the bytes of the tar stream and writes the chunks that
+         * are compressed with write_fn
+         */
+        template<typename WriteFn>
+        bool add(const char* data, size_t length, WriteFn write_fn, std::string& error)
+        {
+            const std::array<uint64_t, 256>& table = gear();
+            size_t start = 0;
+            for(size_t i = 0; i < length; ++i)
+            {
+                m_hash = (m_hash << 1) + table[static_cast<unsigned char>(data[i])];
+                size_t size = m_pending.size() + i + 1 - start;
+                if(size >= m_max_size || (size >= m_min_size && (m_hash & m_mask) == 0))
+                {
+                    m_pending.append(data + start, i + 1 - start);
+                    start = i + 1;
+                    if(!submit(write_fn, error))
+                    {
+                        return false;
+                    }
+                }
+            }
+            m_pending.append(data + start, length - start);
+            return true;
+        }
+
+        /**
+         * @brief Compresses what is left of the stream and writes every
+         * chunk that hasn't been written
+         */
+        template<typename WriteFn>
+        bool finish(WriteFn write_fn, std::string& error)
+        {
+            if(!m_pending.empty() && !submit(write_fn, error))
+            {
+                return false;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while(!m_queue.empty())
+            {
+                m_changed.wait(lock, [this] { return m_queue.front()->done; });
+                lock.unlock();
+                if(!write_done(write_fn, error))
+                {
+                    return false;
+                }
+                lock.lock();
+            }
+            return true;
+        }
+
+        Tcl_Obj* chunks_obj() const
+        {
+            Tcl_Obj* chunks = Tcl_NewListObj(0, nullptr);
+            for(const auto& written : m_written)
+            {
+                Tcl_Obj* chunk = Tcl_NewDictObj();
+                Tcl_DictObjPut(nullptr, chunk, Tcl_NewStringObj("digest", -1),
+                               Tcl_NewStringObj(written.first.c_str(), written.first.size()));
+                Tcl_DictObjPut(nullptr, chunk, Tcl_NewStringObj("size", -1),
+                               Tcl_NewWideIntObj(written.second));
+                Tcl_ListObjAppendElement(nullptr, chunks, chunk);
+            }
+            return chunks;
+        }
+
+    private:
+        template<typename WriteFn>
+        bool submit(WriteFn write_fn, std::string& error)
+        {
+            auto next = std::make_shared<chunk>();
+            next->input.swap(m_pending);
+            next->claimed = false;
+            next->done = false;
+            m_hash = 0;
+
+            /*Bounded so a slow disk doesn't buffer the whole layer*/
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while(m_queue.size() >= m_workers.size() * 2)
+            {
+                m_changed.wait(lock, [this] { return m_queue.front()->done; });
+                lock.unlock();
+                if(!write_done(write_fn, error))
+                {
+                    return false;
+                }
+                lock.lock();
+            }
+            m_queue.push_back(next);
+            lock.unlock();
+            m_changed.notify_all();
+            return true;
+        }
+
+        /**
+         * @brief Writes the compressed chunks at the front of the queue
+         */
+        template<typename WriteFn>
+        bool write_done(WriteFn write_fn, std::string& error)
+        {
+            while(true)
+            {
+                std::shared_ptr<chunk> front;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if(m_queue.empty() || !m_queue.front()->done)
+                    {
+                        return true;
+                    }
+                    front = m_queue.front();
+                    m_queue.pop_front();
+                }
+                m_changed.notify_all();
+
+                if(!front->error.empty())
+                {
+                    error = front->error;
+                    return false;
+                }
+                if(!write_fn(front->output.data(), front->output.size(), error))
+                {
+                    return false;
+                }
+                m_written.emplace_back(front->digest, front->output.size());
+            }
+        }
+
+        void work()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while(true)
+            {
+                std::shared_ptr<chunk> next;
+                m_changed.wait(lock, [this, &next]
+                {
+                    for(auto& queued : m_queue)
+                    {
+                        if(!queued->claimed)
+                        {
+                            next = queued;
+                            return true;
+                        }
+                    }
+                    return m_stopping;
+                });
+                if(!next)
+                {
+                    return;
+                }
+                next->claimed = true;
+                lock.unlock();
+
+                std::string output;
+                std::string error;
+                std::string digest;
+                if(compress_chunk(m_compression, next->input, output, error))
+                {
+                    digest = sha256_digest(output.data(), output.size());
+                }
+
+                lock.lock();
+                next->output.swap(output);
+                next->error.swap(error);
+                next->digest.swap(digest);
+                next->input.clear();
+                next->done = true;
+                m_changed.notify_all();
+            }
+        }
+    };
+
+    /**
+     * @brief Where the compressed archive goes.  The digest is computed as
+     * the bytes are written so the layer isn't read again to add it to the
+     * layer store.  With a chunker the archive is written uncompressed to
+     * it and it writes the compressed chunks.
+     */
+    struct layer_output
+    {
+        int fd;
+        EVP_MD_CTX* digest;
+        Tcl_WideInt size;
+        layer_chunker* chunker;
+    };
+
+    bool write_all(layer_output* output, const char* data, size_t length, std::string& error)
+    {
+        const char* next = data;
+        size_t remaining = length;
+        while(remaining > 0)
+        {
+            ssize_t bytes = write(output->fd, next, remaining);
+            if(bytes == -1)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                error = std::string("write: ") + Tcl_ErrnoMsg(errno);
+                return false;
+            }
+            next += bytes;
+            remaining -= bytes;
+        }
+
+        EVP_DigestUpdate(output->digest, data, length);
+        output->size += length;
+        return true;
+    }
+
+    la_ssize_t write_output(struct archive* a, void* client_data, const void* buffer, size_t length)
+    {
+        layer_output* output = static_cast<layer_output*>(client_data);
+        const char* data = static_cast<const char*>(buffer);
+        std::string error;
+        bool written = false;
+        if(output->chunker != nullptr)
+        {
+            written = output->chunker->add(data, length, [output](const char* chunk, size_t size, std::string& error)
+            {
+                return write_all(output, chunk, size, error);
+            }, error);
+        }
+        else
+        {
+            written = write_all(output, data, length, error);
+        }
+
+        if(!written)
+        {
+            archive_set_error(a, EIO, "%s", error.c_str());
+            return -1;
+        }
+        return length;
+    }
+
+    /**
+     * @brief Writes the changed paths of a dataset and its whiteouts into a
+     * single compressed tar archive in one pass.  Files with several links
+     * are stored once and the other paths are hardlink entries.
+     */
+    class layer_writer
+    {
+        std::string m_mountpoint;
+        write_archive_ptr m_archive;
+        read_archive_ptr m_disk;
+        struct archive_entry_linkresolver* m_resolver;
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> m_digest;
+        std::unique_ptr<layer_chunker> m_chunker;
+        layer_output m_output;
+        std::vector<char> m_buffer;
+        int m_entries;
+
+    public:
+        layer_writer(const std::string& mountpoint)
+            : m_mountpoint(mountpoint),
+              m_archive(archive_write_new(), archive_write_free),
+              m_disk(archive_read_disk_new(), archive_read_free),
+              m_resolver(archive_entry_linkresolver_new()),
+              m_digest(EVP_MD_CTX_new(), EVP_MD_CTX_free),
+              m_output{-1, m_digest.get(), 0, nullptr},
+              m_buffer(256 * 1024),
+              m_entries(0)
+        {
+            EVP_DigestInit_ex(m_digest.get(), EVP_sha256(), nullptr);
+            archive_read_disk_set_standard_lookup(m_disk.get());
+        }
+
+        ~layer_writer()
+        {
+            archive_entry_linkresolver_free(m_resolver);
+
+            /*Freeing the archive flushes it so the file is closed after*/
+            m_archive.reset();
+            if(m_output.fd != -1)
+            {
+                close(m_output.fd);
+            }
+        }
+
+        /**
+         * @brief Opens the layer.  With a chunk size the tar stream is
+         * compressed as content defined chunks instead of as a whole.
+         */
+        int open(Tcl_Interp* interp, const char* layer_path, const compression_options& compression,
+                 size_t chunk_size)
+        {
+            struct archive* a = m_archive.get();
+            archive_write_set_format_pax_restricted(a);
+            archive_write_set_bytes_in_last_block(a, 1);
+            archive_entry_linkresolver_set_strategy(m_resolver, archive_format(a));
+
+            const char* codec = compression.codec.c_str();
+            if(chunk_size > 0 && compression.codec != "none" && compression.codec != "gzip" &&
+               compression.codec != "zstd")
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown compression: %s", codec));
+                Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "ECOMPRESSION", nullptr);
+                return TCL_ERROR;
+            }
+            else if(chunk_size > 0)
+            {
+                /*Every chunk is compressed on its own by the chunker*/
+                m_chunker.reset(new layer_chunker(compression, chunk_size));
+                m_output.chunker = m_chunker.get();
+            }
+            else if(compression.codec == "gzip")
+            {
+                archive_write_add_filter_gzip(a);
+
+                /*Without the timestamp the same files always make the same layer*/
+                archive_write_set_filter_option(a, codec, "timestamp", nullptr);
+            }
+            else if(compression.codec == "zstd")
+            {
+                if(archive_write_add_filter_zstd(a) != ARCHIVE_OK ||
+                   archive_write_set_filter_option(a, codec, "threads",
+                                                   std::to_string(compression.threads).c_str()) != ARCHIVE_OK)
+                {
+                    return archive_error(interp, a, codec);
+                }
+            }
+            else if(compression.codec != "none")
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown compression: %s", codec));
+                Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "ECOMPRESSION", nullptr);
+                return TCL_ERROR;
+            }
+
+            if(!compression.level.empty() && compression.codec != "none" && !m_chunker &&
+               archive_write_set_filter_option(a, codec, "compression-level",
+                                               compression.level.c_str()) != ARCHIVE_OK)
+            {
+                archive_error(interp, a, "compression-level");
+                Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "ECOMPRESSION", nullptr);
+                return TCL_ERROR;
+            }
+
+            m_output.fd = ::open(layer_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(m_output.fd == -1)
+            {
+                return path_error(interp, "open", layer_path);
+            }
+
+            if(archive_write_open(a, &m_output, nullptr, write_output, nullptr) != ARCHIVE_OK)
+            {
+                return archive_error(interp, a, "open");
+            }
+            return TCL_OK;
+        }
+
+        int add_whiteouts(Tcl_Interp* interp, const std::vector<std::string>& whiteouts)
+        {
+            std::string contents;
+            for(const std::string& path : whiteouts)
+            {
+                contents += path;
+                contents += '\n';
+            }
+
+            entry_ptr entry(archive_entry_new(), archive_entry_free);
+            archive_entry_set_pathname(entry.get(), WHITEOUTS_ENTRY);
+            archive_entry_set_filetype(entry.get(), AE_IFREG);
+            archive_entry_set_perm(entry.get(), 0644);
+            archive_entry_set_size(entry.get(), contents.size());
+            if(archive_write_header(m_archive.get(), entry.get()) < ARCHIVE_WARN ||
+               archive_write_data(m_archive.get(), contents.data(), contents.size()) < 0)
+            {
+                return archive_error(interp, m_archive.get(), WHITEOUTS_ENTRY);
+            }
+            return TCL_OK;
+        }
+
+        /**
+         * @brief Adds a path relative to the mountpoint
+         */
+        int add_path(Tcl_Interp* interp, const std::string& path)
+        {
+            std::string source = m_mountpoint + "/" + path;
+            struct stat sb;
+            if(lstat(source.c_str(), &sb) != 0)
+            {
+                return path_error(interp, "lstat", source);
+            }
+
+            /*The descriptor is used for the extended attributes, acls and flags*/
+            bool has_fd = S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode);
+            fd_guard fd(has_fd ? ::open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC) : -1);
+            if(has_fd && fd.fd == -1)
+            {
+                return path_error(interp, "open", source);
+            }
+
+            struct archive_entry* entry = archive_entry_new();
+            archive_entry_copy_pathname(entry, path.c_str());
+            archive_entry_copy_sourcepath(entry, source.c_str());
+            if(archive_read_disk_entry_from_file(m_disk.get(), entry, fd.fd, &sb) < ARCHIVE_WARN)
+            {
+                archive_entry_free(entry);
+                return archive_error(interp, m_disk.get(), source.c_str());
+            }
+
+            struct archive_entry* deferred = nullptr;
+            archive_entry_linkify(m_resolver, &entry, &deferred);
+
+            int tcl_error = TCL_OK;
+            while(entry != nullptr)
+            {
+                if(tcl_error == TCL_OK)
+                {
+                    tcl_error = write_entry(interp, entry);
+                }
+                archive_entry_free(entry);
+                entry = deferred;
+                deferred = nullptr;
+            }
+            return tcl_error;
+        }
+
+        /**
+         * @brief Finishes the archive and returns a dict with its digest,
+         * size and number of entries and, when it was chunked, the list of
+         * the digest and size of every chunk.
+         */
+        int finish(Tcl_Interp* interp)
+        {
+            if(archive_write_close(m_archive.get()) != ARCHIVE_OK)
+            {
+                return archive_error(interp, m_archive.get(), "close");
+            }
+
+            std::string error;
+            layer_output* output = &m_output;
+            if(m_chunker && !m_chunker->finish([output](const char* chunk, size_t size, std::string& error)
+            {
+                return write_all(output, chunk, size, error);
+            }, error))
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("close: %s", error.c_str()));
+                Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "EFORMAT", nullptr);
+                return TCL_ERROR;
+            }
+
+            if(close(m_output.fd) != 0)
+            {
+                m_output.fd = -1;
+                return syserror_result(interp, "VESSEL", "ARCHIVE");
+            }
+            m_output.fd = -1;
+
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_len = 0;
+            EVP_DigestFinal_ex(m_digest.get(), digest, &digest_len);
+            std::string hex = "sha256:" + to_hex(digest, digest_len);
+
+            Tcl_Obj* result = Tcl_NewDictObj();
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("digest", -1),
+                           Tcl_NewStringObj(hex.c_str(), hex.size()));
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("size", -1), Tcl_NewWideIntObj(m_output.size));
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("entries", -1), Tcl_NewIntObj(m_entries));
+            if(m_chunker)
+            {
+                Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("chunks", -1), m_chunker->chunks_obj());
+            }
+            Tcl_SetObjResult(interp, result);
+            return TCL_OK;
+        }
+
+    private:
+        int write_entry(Tcl_Interp* interp, struct archive_entry* entry)
+        {
+            if(archive_write_header(m_archive.get(), entry) < ARCHIVE_WARN)
+            {
+                return archive_error(interp, m_archive.get(), archive_entry_pathname(entry));
+            }
+            ++m_entries;
+
+            /*Hardlinks after the first path of a file have no data*/
+            if(archive_entry_filetype(entry) != AE_IFREG || archive_entry_size(entry) == 0 ||
+               archive_entry_hardlink(entry) != nullptr)
+            {
+                return TCL_OK;
+            }
+
+            const char* source = archive_entry_sourcepath(entry);
+            fd_guard fd(::open(source, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            if(fd.fd == -1)
+            {
+                return path_error(interp, "open", source);
+            }
+
+            /*A file that shrinks while it is archived is padded by libarchive*/
+            la_int64_t remaining = archive_entry_size(entry);
+            while(remaining > 0)
+            {
+                ssize_t bytes = read(fd.fd, m_buffer.data(),
+                                     std::min<la_int64_t>(m_buffer.size(), remaining));
+                if(bytes == -1)
+                {
+                    return path_error(interp, "read", source);
+                }
+                else if(bytes == 0)
+                {
+                    break;
+                }
+
+                if(archive_write_data(m_archive.get(), m_buffer.data(), bytes) < 0)
+                {
+                    return archive_error(interp, m_archive.get(), source);
+                }
+                remaining -= bytes;
+            }
+            return TCL_OK;
+        }
+    };
+
+    /**
+     * @brief vessel::archive::write_layer ?-compression gzip|zstd|none? ?-level n? ?-threads n? ?-chunk-size bytes? mountpoint layer_path whiteouts paths
+     *
+     * Writes the whiteouts and the paths, both relative to the mountpoint,
+     * into a compressed tar archive.  zstd compresses with -threads workers,
+     * a thread per core by default.  gzip is always single threaded.
+     * Returns a dict with the digest, size and number of entries of the
+     * layer.
+     *
+     * With -chunk-size the archive is cut into content defined chunks of
+     * about that many bytes that are compressed on their own by -threads
+     * workers, whatever the codec, and the layer is their concatenation.
+     * The result also has the chunks, a list of dicts with the digest and
+     * size of each compressed chunk.
+     */
+    int write_layer_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        compression_options compression{"gzip", std::string(), 0};
+        Tcl_WideInt chunk_size = 0;
+        int arg = 1;
+        while(objc - arg > 4)
+        {
+            const char* option = Tcl_GetString(objv[arg]);
+            if(std::strcmp(option, "-compression") == 0)
+            {
+                compression.codec = Tcl_GetString(objv[arg + 1]);
+            }
+            else if(std::strcmp(option, "-level") == 0)
+            {
+                int level = 0;
+                int tcl_error = Tcl_GetIntFromObj(interp, objv[arg + 1], &level);
+                if(tcl_error) return tcl_error;
+                compression.level = std::to_string(level);
+            }
+            else if(std::strcmp(option, "-threads") == 0)
+            {
+                int tcl_error = Tcl_GetIntFromObj(interp, objv[arg + 1], &compression.threads);
+                if(tcl_error) return tcl_error;
+            }
+            else if(std::strcmp(option, "-chunk-size") == 0)
+            {
+                int tcl_error = Tcl_GetWideIntFromObj(interp, objv[arg + 1], &chunk_size);
+                if(tcl_error) return tcl_error;
+                if(chunk_size < 0 || chunk_size > INT_MAX / 4)
+                {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid chunk size: %s", Tcl_GetString(objv[arg + 1])));
+                    Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", "EINVAL", nullptr);
+                    return TCL_ERROR;
+                }
+            }
+            else
+            {
+                break;
+            }
+            arg += 2;
+        }
+
+        if(objc - arg != 4)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv,
+                             "?-compression gzip|zstd|none? ?-level n? ?-threads n? ?-chunk-size bytes? "
+                             "mountpoint layer_path whiteouts paths");
+            return TCL_ERROR;
+        }
+
+        std::string mountpoint(Tcl_GetString(objv[arg]));
+        while(mountpoint.size() > 1 && mountpoint.back() == '/')
+        {
+            mountpoint.pop_back();
+        }
+        const char* layer_path = Tcl_GetString(objv[arg + 1]);
+
+        std::vector<std::string> whiteouts;
+        std::vector<std::string> paths;
+        int tcl_error = get_strings(interp, objv[arg + 2], whiteouts);
+        if(tcl_error) return tcl_error;
+        tcl_error = get_strings(interp, objv[arg + 3], paths);
+        if(tcl_error) return tcl_error;
+
+        /*Sorted so the same change set always makes the same layer*/
+        std::sort(whiteouts.begin(), whiteouts.end());
+        std::sort(paths.begin(), paths.end());
+
+        {
+            layer_writer writer(mountpoint);
+            tcl_error = writer.open(interp, layer_path, compression, chunk_size);
+            if(tcl_error == TCL_OK)
+            {
+                tcl_error = writer.add_whiteouts(interp, whiteouts);
+            }
+
+            for(auto path = paths.begin(); tcl_error == TCL_OK && path != paths.end(); ++path)
+            {
+                tcl_error = writer.add_path(interp, *path);
+            }
+
+            if(tcl_error == TCL_OK)
+            {
+                tcl_error = writer.finish(interp);
+            }
+        }
+
+        if(tcl_error)
+        {
+            unlink(layer_path);
+        }
+        return tcl_error;
+    }
+
+    /**
+     * @brief Flags of tar -x.  Ownership, permissions, acls, extended
+     * attributes and file flags are only restored by root.
+     */
+    int extract_flags()
+    {
+        int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+        if(geteuid() == 0)
+        {
+            flags |= ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL |
+                ARCHIVE_EXTRACT_XATTR | ARCHIVE_EXTRACT_FFLAGS;
+        }
+        return flags;
+    }
+
+    std::vector<std::string> split_lines(const std::string& contents)
+    {
+        std::vector<std::string> lines;
+        std::string::size_type start = 0;
+        while(start < contents.size())
+        {
+            std::string::size_type end = contents.find('\n', start);
+            if(end == std::string::npos)
+            {
+                end = contents.size();
+            }
+
+            if(end > start)
+            {
+                lines.emplace_back(contents, start, end - start);
+            }
+            start = end + 1;
+        }
+        return lines;
+    }
+
+    /**
+     * @brief Why extracting a layer failed.  It doesn't refer to an
+     * interpreter so layers extracted on another thread report the same
+     * errors as extract_layer.  The code is the last element of
+     * {VESSEL ARCHIVE code}.  A system error keeps its errno which is
+     * formatted with Tcl_ErrnoMsg on the interp thread.
+     */
+    struct extract_error
+    {
+        std::string message;
+        std::string code;
+        int errnum = 0;
+    };
+
+    int set_extract_error(Tcl_Interp* interp, const extract_error& error)
+    {
+        Tcl_Obj* message = Tcl_NewStringObj(error.message.c_str(), error.message.size());
+        if(error.errnum != 0)
+        {
+            Tcl_AppendStringsToObj(message, ": ", Tcl_ErrnoMsg(error.errnum), nullptr);
+        }
+        Tcl_SetObjResult(interp, message);
+        Tcl_SetErrorCode(interp, "VESSEL", "ARCHIVE", error.code.c_str(), nullptr);
+        return TCL_ERROR;
+    }
+
+    /**
+     * @brief Extracts the entries of a layer archive below a root directory.
+     * The root must not contain symlinks because paths through symlinks are
+     * refused.
+     */
+    class layer_extractor
+    {
+        std::string m_root;
+        int m_entries;
+        int m_whiteouts;
+        extract_error m_error;
+        bool m_has_whiteout_stats;
+        whiteout_stats m_whiteout_stats;
+
+    public:
+        /**
+         * @brief Called with the whiteouts of the layer before any file is
+         * extracted.  Returns false to stop the extraction, setting the
+         * error unless it was reported some other way.
+         */
+        using whiteouts_fn = std::function<bool(const std::vector<std::string>& paths, extract_error& error)>;
+
+        layer_extractor(const std::string& root)
+            : m_root(root),
+              m_entries(0),
+              m_whiteouts(0),
+              m_error(),
+              m_has_whiteout_stats(false),
+              m_whiteout_stats{0, 0, 0, 0, 0, {}}
+        {
+        }
+
+        bool extract(struct archive* reader, const std::string& layer_path, const whiteouts_fn& apply_whiteouts)
+        {
+            write_archive_ptr disk(archive_write_disk_new(), archive_write_free);
+            archive_write_disk_set_options(disk.get(), extract_flags());
+            archive_write_disk_set_standard_lookup(disk.get());
+
+            bool first = true;
+            struct archive_entry* entry = nullptr;
+            for(;;)
+            {
+                int status = archive_read_next_header(reader, &entry);
+                if(status == ARCHIVE_EOF)
+                {
+                    break;
+                }
+                else if(status < ARCHIVE_WARN)
+                {
+                    return failed(reader, layer_path);
+                }
+
+                bool is_whiteouts = first && std::strcmp(archive_entry_pathname(entry), WHITEOUTS_ENTRY) == 0;
+                first = false;
+                if(is_whiteouts)
+                {
+                    std::string contents(archive_entry_size(entry), '\0');
+                    if(archive_read_data(reader, &contents[0], contents.size()) != (la_ssize_t)contents.size())
+                    {
+                        return failed(reader, WHITEOUTS_ENTRY);
+                    }
+
+                    std::vector<std::string> paths = split_lines(contents);
+                    m_whiteouts = paths.size();
+                    if(!apply_whiteouts(paths, m_error))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+
+                std::string path = m_root + "/" + archive_entry_pathname(entry);
+                archive_entry_copy_pathname(entry, path.c_str());
+                if(archive_entry_hardlink(entry) != nullptr)
+                {
+                    std::string target = m_root + "/" + archive_entry_hardlink(entry);
+                    archive_entry_copy_hardlink(entry, target.c_str());
+                }
+
+                if(archive_write_header(disk.get(), entry) < ARCHIVE_WARN)
+                {
+                    return failed(disk.get(), path);
+                }
+
+                if(archive_entry_size(entry) > 0)
+                {
+                    const void* buffer = nullptr;
+                    size_t size = 0;
+                    la_int64_t offset = 0;
+                    while((status = archive_read_data_block(reader, &buffer, &size, &offset)) != ARCHIVE_EOF)
+                    {
+                        if(status < ARCHIVE_WARN)
+                        {
+                            return failed(reader, path);
+                        }
+                        if(archive_write_data_block(disk.get(), buffer, size, offset) < ARCHIVE_WARN)
+                        {
+                            return failed(disk.get(), path);
+                        }
+                    }
+                }
+
+                if(archive_write_finish_entry(disk.get()) < ARCHIVE_WARN)
+                {
+                    return failed(disk.get(), path);
+                }
+                ++m_entries;
+            }
+
+            /*Directory times and permissions are set when the archive is closed*/
+            if(archive_write_close(disk.get()) != ARCHIVE_OK)
+            {
+                return failed(disk.get(), "close");
+            }
+            return true;
+        }
+
+        const extract_error& error() const
+        {
+            return m_error;
+        }
+
+        /**
+         * @brief Deletes the whiteouts natively below the root
+         */
+        bool delete_whiteouts(const std::vector<std::string>& paths, extract_error& error)
+        {
+            fd_guard root_fd(::open(m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if(root_fd.fd == -1)
+            {
+                error = extract_error{"open " + m_root, Tcl_ErrnoId(), errno};
+                return false;
+            }
+
+            /*Like file delete -force a whiteout that can't be deleted is skipped*/
+            m_whiteout_stats = apply_whiteouts(root_fd.fd, paths, std::max(1u, std::thread::hardware_concurrency()));
+            m_has_whiteout_stats = true;
+            return true;
+        }
+
+        /**
+         * @brief Sets the result to a dict with the number of entries and
+         * whiteouts in the layer and the whiteout_stats of whiteouts that
+         * were deleted natively.
+         */
+        int set_result(Tcl_Interp* interp) const
+        {
+            Tcl_Obj* result = Tcl_NewDictObj();
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("entries", -1), Tcl_NewIntObj(m_entries));
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("whiteouts", -1), Tcl_NewIntObj(m_whiteouts));
+            if(m_has_whiteout_stats)
+            {
+                Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("whiteout_stats", -1),
+                               whiteout_stats_obj(m_whiteout_stats));
+            }
+            Tcl_SetObjResult(interp, result);
+            return TCL_OK;
+        }
+
+    private:
+        bool failed(struct archive* a, const std::string& operation)
+        {
+            const char* message = archive_error_string(a);
+            m_error.message = operation + ": " + (message != nullptr ? message : "unknown error");
+            m_error.code = "EFORMAT";
+            return false;
+        }
+    };
+
+    /**
+     * @brief Resolves the mountpoint a layer is extracted into.  Paths
+     * through symlinks are refused so the mountpoint itself can't have any.
+     */
+    int get_root(Tcl_Interp* interp, Tcl_Obj* mountpoint, std::string& root)
+    {
+        char resolved[PATH_MAX];
+        if(realpath(Tcl_GetString(mountpoint), resolved) == nullptr)
+        {
+            return path_error(interp, "realpath", Tcl_GetString(mountpoint));
+        }
+        root = resolved;
+        return TCL_OK;
+    }
+
+    /**
+     * @brief vessel::archive::extract_layer layer_path mountpoint ?whiteouts_cmd?
+     *
+     * Extracts a layer written by write_layer below the mountpoint.  The
+     * list of whiteouts is appended to whiteouts_cmd which is called before
+     * any file is extracted.  Without whiteouts_cmd they are deleted like
+     * vessel::fs::whiteouts.  Returns a dict with the number of entries and
+     * whiteouts in the layer and the whiteout_stats of vessel::fs::whiteouts
+     * when they were deleted natively.
+     */
+    int extract_layer_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 3 && objc != 4)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "layer_path mountpoint ?whiteouts_cmd?");
+            return TCL_ERROR;
+        }
+
+        std::string root;
+        int tcl_error = get_root(interp, objv[2], root);
+        if(tcl_error) return tcl_error;
+
+        read_archive_ptr reader(archive_read_new(), archive_read_free);
+        archive_read_support_filter_all(reader.get());
+        archive_read_support_format_tar(reader.get());
+        if(archive_read_open_filename(reader.get(), Tcl_GetString(objv[1]), 256 * 1024) != ARCHIVE_OK)
+        {
+            return archive_error(interp, reader.get(), Tcl_GetString(objv[1]));
+        }
+
+        /*An error of the callback is already the interpreter's result*/
+        bool callback_failed = false;
+        auto call_whiteouts_cmd = [&](const std::vector<std::string>& paths, extract_error& error) {
+            Tcl_Obj* script_obj = Tcl_DuplicateObj(objv[3]);
+            Tcl_IncrRefCount(script_obj);
+            tclobj_ptr script = create_tclobj_ptr(script_obj);
+
+            Tcl_Obj* paths_obj = Tcl_NewListObj(0, nullptr);
+            for(const std::string& path : paths)
+            {
+                Tcl_ListObjAppendElement(nullptr, paths_obj, Tcl_NewStringObj(path.c_str(), path.size()));
+            }
+
+            callback_failed = Tcl_ListObjAppendElement(interp, script.get(), paths_obj) != TCL_OK ||
+                Tcl_EvalObjEx(interp, script.get(), TCL_EVAL_GLOBAL) != TCL_OK;
+            return !callback_failed;
+        };
+
+        layer_extractor extractor(root);
+        auto delete_whiteouts = [&extractor](const std::vector<std::string>& paths, extract_error& error) {
+            return extractor.delete_whiteouts(paths, error);
+        };
+
+        if(!extractor.extract(reader.get(), Tcl_GetString(objv[1]),
+                              objc == 4 ? layer_extractor::whiteouts_fn(call_whiteouts_cmd)
+                                        : layer_extractor::whiteouts_fn(delete_whiteouts)))
+        {
+            return callback_failed ? TCL_ERROR : set_extract_error(interp, extractor.error());
+        }
+        return extractor.set_result(interp);
+    }
+
+    struct stream_context;
+    stream_context& get_context(Tcl_Interp* interp);
+    bool stream_exists(Tcl_Interp* interp, const std::string& handle);
+
+    /**
+     * @brief The stream_done_event struct is queued to the thread that
+     * started a stream when its extraction is over to evaluate the command
+     * given to stream_wait.  The stream may have been cancelled by the time
+     * the event is processed so the handle is looked up again.
+     */
+    struct stream_done_event : public Tcl_Event
+    {
+        Tcl_Interp* interp;
+        std::string handle;
+        tclobj_ptr command;
+
+        static int event_proc(Tcl_Event *evPtr, int flags)
+        {
+            (void)flags;
+            placement_ptr<stream_done_event> _this = create_placement_ptr((stream_done_event*)(evPtr));
+            if(!stream_exists(_this->interp, _this->handle))
+            {
+                return 1;
+            }
+
+            int error = Tcl_EvalObjEx(_this->interp, _this->command.get(), TCL_EVAL_GLOBAL);
+            if(error)
+            {
+                Tcl_BackgroundError(_this->interp);
+            }
+            return 1;
+        }
+
+        stream_done_event(Tcl_Interp* interp, const std::string& handle, Tcl_Obj* command)
+            : Tcl_Event(),
+              interp(interp),
+              handle(handle),
+              command(create_tclobj_ptr(command))
+        {
+            this->proc = event_proc;
+            this->nextPtr = nullptr;
+            Tcl_IncrRefCount(command);
+        }
+    };
+
+    /**
+     * @brief Extracts a layer on its own thread while the layer is still
+     * being downloaded.  Only the bytes the downloader reported as written
+     * are read so the partial file is the buffer between the download and
+     * the extraction.  Whiteouts are deleted natively because the thread
+     * can't call into Tcl.
+     */
+    class layer_stream
+    {
+        std::string m_layer_path;
+        std::string m_root;
+        fd_guard m_fd;
+        std::mutex m_mutex;
+        std::condition_variable m_available_changed;
+        Tcl_WideInt m_available;
+        bool m_complete;
+        bool m_cancelled;
+        Tcl_WideInt m_offset;
+        std::vector<char> m_buffer;
+        layer_extractor m_extractor;
+        bool m_extracted;
+        extract_error m_error;
+        int m_read_errno;
+        Tcl_ThreadId m_owner;
+        bool m_done;
+        tcl_event_ptr m_done_event;
+        std::thread m_thread;
+
+    public:
+        layer_stream(const std::string& layer_path, const std::string& root, int fd)
+            : m_layer_path(layer_path),
+              m_root(root),
+              m_fd(fd),
+              m_mutex(),
+              m_available_changed(),
+              m_available(0),
+              m_complete(false),
+              m_cancelled(false),
+              m_offset(0),
+              m_buffer(256 * 1024),
+              m_extractor(root),
+              m_extracted(false),
+              m_error(),
+              m_read_errno(0),
+              m_owner(Tcl_GetCurrentThread()),
+              m_done(false),
+              m_done_event(nullptr, tclalloc_free<Tcl_Event>),
+              m_thread()
+        {
+            m_thread = std::thread(&layer_stream::run, this);
+        }
+
+        ~layer_stream()
+        {
+            cancel();
+
+            /*The extraction was cancelled before the event was queued*/
+            if(m_done_event)
+            {
+                create_placement_ptr(static_cast<stream_done_event*>(m_done_event.get())).reset();
+            }
+        }
+
+        /**
+         * @brief The first bytes bytes of the layer have been written
+         */
+        void set_available(Tcl_WideInt bytes)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_available = std::max(m_available, bytes);
+            m_available_changed.notify_one();
+        }
+
+        /**
+         * @brief The whole layer has been written.  The done_event is
+         * queued to the thread that started the stream once the rest of it
+         * is extracted.
+         */
+        int complete(Tcl_Interp* interp, tcl_event_ptr done_event)
+        {
+            struct stat sb;
+            if(fstat(m_fd.fd, &sb) != 0)
+            {
+                return path_error(interp, "fstat", m_layer_path);
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_available = sb.st_size;
+            m_complete = true;
+            m_available_changed.notify_one();
+            if(done_event && m_done)
+            {
+                Tcl_QueueEvent(done_event.release(), TCL_QUEUE_TAIL);
+            }
+            else if(done_event)
+            {
+                m_done_event = std::move(done_event);
+            }
+            return TCL_OK;
+        }
+
+        /**
+         * @brief The whole layer has been written.  Waits for the rest of
+         * it to be extracted.
+         */
+        int finish(Tcl_Interp* interp)
+        {
+            int tcl_error = complete(interp, tcl_event_ptr(nullptr, tclalloc_free<Tcl_Event>));
+            if(tcl_error) return tcl_error;
+
+            m_thread.join();
+
+            if(!m_extracted)
+            {
+                return set_extract_error(interp, m_error);
+            }
+            return m_extractor.set_result(interp);
+        }
+
+        void cancel()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_cancelled = true;
+                m_available_changed.notify_one();
+            }
+
+            if(m_thread.joinable())
+            {
+                m_thread.join();
+            }
+        }
+
+    private:
+        static la_ssize_t read_input(struct archive* a, void* client_data, const void** buffer)
+        {
+            return static_cast<layer_stream*>(client_data)->read(a, buffer);
+        }
+
+        la_ssize_t read(struct archive* a, const void** buffer)
+        {
+            Tcl_WideInt available = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_available_changed.wait(lock, [this] {
+                    return m_cancelled || m_complete || m_available > m_offset;
+                });
+                if(m_cancelled)
+                {
+                    archive_set_error(a, ECANCELED, "extraction was cancelled");
+                    return -1;
+                }
+                available = m_available;
+            }
+
+            if(available <= m_offset)
+            {
+                return 0;
+            }
+
+            size_t length = std::min<Tcl_WideInt>(m_buffer.size(), available - m_offset);
+            ssize_t bytes = -1;
+            do
+            {
+                bytes = pread(m_fd.fd, m_buffer.data(), length, m_offset);
+            } while(bytes == -1 && errno == EINTR);
+
+            if(bytes == -1)
+            {
+                m_read_errno = errno;
+                archive_set_error(a, m_read_errno, "read");
+                return -1;
+            }
+            else if(bytes == 0)
+            {
+                archive_set_error(a, EIO, "layer is shorter than the %lld bytes written",
+                                  static_cast<long long>(available));
+                return -1;
+            }
+
+            m_offset += bytes;
+            *buffer = m_buffer.data();
+            return bytes;
+        }
+
+        void run()
+        {
+            extract();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+            if(m_done_event && !m_cancelled)
+            {
+                Tcl_ThreadQueueEvent(m_owner, m_done_event.release(), TCL_QUEUE_TAIL);
+                Tcl_ThreadAlert(m_owner);
+            }
+        }
+
+        void extract()
+        {
+            read_archive_ptr reader(archive_read_new(), archive_read_free);
+            archive_read_support_filter_all(reader.get());
+            archive_read_support_format_tar(reader.get());
+            if(archive_read_open(reader.get(), this, nullptr, read_input, nullptr) != ARCHIVE_OK)
+            {
+                const char* message = archive_error_string(reader.get());
+                m_error = extract_error{m_layer_path + ": " + (message != nullptr ? message : "unknown error"),
+                                        "EFORMAT"};
+                return;
+            }
+
+            auto delete_whiteouts = [this](const std::vector<std::string>& paths, extract_error& error) {
+                return m_extractor.delete_whiteouts(paths, error);
+            };
+
+            m_extracted = m_extractor.extract(reader.get(), m_layer_path, delete_whiteouts);
+            if(!m_extracted)
+            {
+                m_error = m_extractor.error();
+                if(m_read_errno != 0)
+                {
+                    m_error.errnum = m_read_errno;
+                }
+            }
+        }
+    };
+
+    struct stream_context
+    {
+        std::map<std::string, std::unique_ptr<layer_stream>> streams;
+        uint64_t next_id = 0;
+    };
+
+    stream_context& get_context(Tcl_Interp* interp)
+    {
+        return *reinterpret_cast<stream_context*>(Tcl_GetAssocData(interp, "LayerStreamContext", nullptr));
+    }
+
+    bool stream_exists(Tcl_Interp* interp, const std::string& handle)
+    {
+        stream_context& ctx = get_context(interp);
+        return ctx.streams.find(handle) != ctx.streams.end();
+    }
+
+    int get_stream(Tcl_Interp* interp, Tcl_Obj* handle, layer_stream*& stream)
+    {
+        stream_context& ctx = get_context(interp);
+        auto stream_it = ctx.streams.find(Tcl_GetString(handle));
+        if(stream_it == ctx.streams.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown layer stream: %s", Tcl_GetString(handle)));
+            return TCL_ERROR;
+        }
+
+        stream = stream_it->second.get();
+        return TCL_OK;
+    }
+
+    /**
+     * @brief vessel::archive::stream_layer layer_path mountpoint
+     *
+     * Starts extracting a layer that is still being written to layer_path
+     * below the mountpoint.  The writer reports its progress with
+     * stream_available and the extraction is completed with stream_finish
+     * or stream_wait or stopped with stream_cancel.  Whiteouts are deleted without
+     * following symlinks out of the mountpoint.  Returns a handle for
+     * those commands.
+     */
+    int stream_layer_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "layer_path mountpoint");
+            return TCL_ERROR;
+        }
+
+        std::string root;
+        int tcl_error = get_root(interp, objv[2], root);
+        if(tcl_error) return tcl_error;
+
+        const char* layer_path = Tcl_GetString(objv[1]);
+        int fd = ::open(layer_path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+        {
+            return path_error(interp, "open", layer_path);
+        }
+
+        stream_context& ctx = get_context(interp);
+        std::string handle = "layerstream" + std::to_string(ctx.next_id++);
+        ctx.streams[handle] = std::unique_ptr<layer_stream>(new layer_stream(layer_path, root, fd));
+
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.c_str(), handle.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * @brief vessel::archive::stream_available handle bytes
+     *
+     * The first bytes of the layer have been written and can be extracted.
+     */
+    int stream_available_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle bytes");
+            return TCL_ERROR;
+        }
+
+        layer_stream* stream = nullptr;
+        int tcl_error = get_stream(interp, objv[1], stream);
+        if(tcl_error) return tcl_error;
+
+        Tcl_WideInt bytes = 0;
+        tcl_error = Tcl_GetWideIntFromObj(interp, objv[2], &bytes);
+        if(tcl_error) return tcl_error;
+
+        stream->set_available(bytes);
+        return TCL_OK;
+    }
+
+    /**
+     * @brief vessel::archive::stream_wait handle command
+     *
+     * The whole layer has been written.  Returns at once and evaluates the
+     * command with the handle appended once the rest of the layer is
+     * extracted, so the event loop keeps running meanwhile.  The command
+     * gets the result with stream_finish, which no longer waits.  It isn't
+     * evaluated if the stream is cancelled first.
+     */
+    int stream_wait_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle command");
+            return TCL_ERROR;
+        }
+
+        layer_stream* stream = nullptr;
+        int tcl_error = get_stream(interp, objv[1], stream);
+        if(tcl_error) return tcl_error;
+
+        Tcl_Obj* command = Tcl_DuplicateObj(objv[2]);
+        Tcl_IncrRefCount(command);
+        tcl_error = Tcl_ListObjAppendElement(interp, command, objv[1]);
+        if(tcl_error)
+        {
+            Tcl_DecrRefCount(command);
+            return tcl_error;
+        }
+
+        tcl_event_ptr done_event = alloc_tcl_event<stream_done_event>(interp, std::string(Tcl_GetString(objv[1])),
+                                                                      command);
+        Tcl_DecrRefCount(command);
+        return stream->complete(interp, std::move(done_event));
+    }
+
+    /**
+     * @brief vessel::archive::stream_finish handle
+     *
+     * The whole layer has been written.  Waits for the extraction to finish
+     * and returns a dict with the number of entries and whiteouts in the
+     * layer and the whiteout_stats of vessel::fs::whiteouts like
+     * extract_layer.  The handle is closed.
+     */
+    int stream_finish_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        layer_stream* stream = nullptr;
+        int tcl_error = get_stream(interp, objv[1], stream);
+        if(tcl_error) return tcl_error;
+
+        tcl_error = stream->finish(interp);
+        get_context(interp).streams.erase(Tcl_GetString(objv[1]));
+        return tcl_error;
+    }
+
+    /**
+     * @brief vessel::archive::stream_cancel handle
+     *
+     * Stops the extraction and closes the handle.  Whatever was extracted
+     * is left below the mountpoint.
+     */
+    int stream_cancel_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        layer_stream* stream = nullptr;
+        int tcl_error = get_stream(interp, objv[1], stream);
+        if(tcl_error) return tcl_error;
+
+        get_context(interp).streams.erase(Tcl_GetString(objv[1]));
+        return TCL_OK;
+    }
+}
+
+int Vessel_LayerArchiveInit(Tcl_Interp* interp)
+{
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::write_layer", write_layer_cmd, nullptr, nullptr);
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::extract_layer", extract_layer_cmd, nullptr, nullptr);
+
+    Tcl_SetAssocData(interp, "LayerStreamContext", vessel::cpp_delete_with_interp<stream_context>,
+                     new stream_context());
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::stream_layer", stream_layer_cmd, nullptr, nullptr);
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::stream_available", stream_available_cmd,
+                               nullptr, nullptr);
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::stream_finish", stream_finish_cmd, nullptr, nullptr);
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::stream_wait", stream_wait_cmd, nullptr, nullptr);
+    (void)Tcl_CreateObjCommand(interp, "vessel::archive::stream_cancel", stream_cancel_cmd, nullptr, nullptr);
+    return TCL_OK;
+}
@@ -0,0 +1,8 @@
+#ifndef LAYER_ARCHIVE_H
+#define LAYER_ARCHIVE_H
+
+#include <tcl.h>
+
+int Vessel_LayerArchiveInit(Tcl_Interp* interp);
+
+#endif // LAYER_ARCHIVE_H
@@ -10,12 +10,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <tcl.h>
 #include <termios.h>
+#include "tcl_kqueue.h"
 #include "tcl_util.h"
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <memory>
+#include <vector>
 
 namespace {
 
@@ -222,6 +231,523 @@ Pty_TermiosRestore(ClientData clientData,
 
     return TCL_OK;
 }
+
+/**
+ * @brief The terminal_state struct saves the termios settings and file status
+ * flags of an fd so they can be put back when the proxy is finished.
+ */
+struct terminal_state
+{
+    int fd;
+    int flags;
+    bool has_termios;
+    termios tios;
+
+    terminal_state(int fd)
+        : fd(fd),
+          flags(fcntl(fd, F_GETFL)),
+          has_termios(false)
+    {
+        memset(&tios, 0, sizeof(tios));
+        has_termios = (tcgetattr(fd, &tios) == 0);
+    }
+
+    /*Raw mode passes signal characters through to the process on the
+     * slave side of the pty*/
+    void make_raw()
+    {
+        if(has_termios)
+        {
+            termios raw = tios;
+            cfmakeraw(&raw);
+            tcsetattr(fd, TCSANOW, &raw);
+        }
+    }
+
+    void make_nonblocking()
+    {
+        if(flags != -1)
+        {
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+
+    void restore()
+    {
+        if(has_termios)
+        {
+            tcsetattr(fd, TCSANOW, &tios);
+        }
+
+        if(flags != -1)
+        {
+            fcntl(fd, F_SETFL, flags);
+        }
+    }
+};
+
+class pty_proxy;
+
+/**
+ * @brief The pty_proxy_done_event struct runs the completion callback once
+ * the pty has closed.  It is the only Tcl event a proxy queues.
+ */
+struct pty_proxy_done_event : public Tcl_Event
+{
+    std::shared_ptr<pty_proxy> proxy;
+
+    static int event_proc(Tcl_Event *evPtr, int flags);
+
+    pty_proxy_done_event(std::shared_ptr<pty_proxy> proxy)
+        : Tcl_Event(),
+          proxy(proxy)
+    {
+        this->proc = event_proc;
+        this->nextPtr = nullptr;
+    }
+};
+
+/**
+ * @brief The pty_proxy class copies bytes between a terminal and a pty master
+ * directly from the kqueue event source.  Data never becomes a Tcl object.  When
+ * a destination can't keep up, reading from its source is disabled until the
+ * destination is writable again.  The terminal settings are restored and
+ * the callback is invoked when the pty is closed.
+ */
+class pty_proxy : public vessel::tcl_event_factory,
+                  public std::enable_shared_from_this<pty_proxy>
+{
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    /*Reads per kevent so a busy pty can't starve the rest of the event loop*/
+    static const int MAX_READS_PER_EVENT = 16;
+
+    struct direction
+    {
+        int from;
+        int to;
+        std::vector<char> buf;
+        size_t start;
+        size_t end;
+        bool reading;
+        bool blocked;
+
+        direction(int from, int to)
+            : from(from),
+              to(to),
+              buf(BUFFER_SIZE),
+              start(0),
+              end(0),
+              reading(false),
+              blocked(false)
+        {}
+    };
+
+    Tcl_Interp* m_interp;
+    vessel::tclobj_ptr m_callback;
+    terminal_state m_input_state;
+    terminal_state m_output_state;
+    terminal_state m_master_state;
+    direction m_to_master;
+    direction m_from_master;
+    int m_escape; /**< Input byte that ends the proxy or -1*/
+    bool m_escaped;
+    bool m_done;
+
+    void watch(int fd, short filter, u_short flags)
+    {
+        struct kevent event;
+        EV_SET(&event, fd, filter, flags, 0, 0, 0);
+        vessel::Kqueue_Add_Event(m_interp, event, *this);
+    }
+
+    void finish()
+    {
+        if(m_done)
+        {
+            return;
+        }
+        m_done = true;
+
+        for(direction* d : {&m_to_master, &m_from_master})
+        {
+            if(d->reading)
+            {
+                watch(d->from, EVFILT_READ, EV_DELETE);
+                d->reading = false;
+            }
+
+            if(d->blocked)
+            {
+                watch(d->to, EVFILT_WRITE, EV_DELETE);
+                d->blocked = false;
+            }
+        }
+
+        restore();
+    }
+
+    /**
+     * @brief pump Move data from the source to the destination until the source
+     * is drained or the destination is full.
+     */
+    void pump(direction& d)
+    {
+        if(d.blocked)
+        {
+            d.blocked = false;
+            watch(d.from, EVFILT_READ, EV_ENABLE);
+        }
+
+        int reads = 0;
+        while(!m_done)
+        {
+            if(d.start == d.end)
+            {
+                if(m_escaped && &d == &m_to_master)
+                {
+                    /*Input before the escape has been written*/
+                    finish();
+                    return;
+                }
+
+                if(!d.reading || reads == MAX_READS_PER_EVENT)
+                {
+                    return;
+                }
+
+                ssize_t bytes = read(d.from, d.buf.data(), d.buf.size());
+                reads++;
+                if(bytes > 0)
+                {
+                    d.start = 0;
+                    d.end = (size_t)bytes;
+
+                    char* escape = nullptr;
+                    if(&d == &m_to_master && m_escape != -1 &&
+                       (escape = (char*)memchr(d.buf.data(), m_escape, d.end)) != nullptr)
+                    {
+                        d.end = (size_t)(escape - d.buf.data());
+                        m_escaped = true;
+                    }
+                }
+                else if(bytes == -1 && (errno == EAGAIN || errno == EINTR))
+                {
+                    return;
+                }
+                else if(&d == &m_from_master)
+                {
+                    /*EOF or EIO.  The last process on the slave side exited.*/
+                    finish();
+                    return;
+                }
+                else
+                {
+                    /*Nothing more to send to the pty but its output is still
+                     * copied to the terminal.*/
+                    watch(d.from, EVFILT_READ, EV_DELETE);
+                    d.reading = false;
+                    return;
+                }
+            }
+
+            ssize_t written = write(d.to, d.buf.data() + d.start, d.end - d.start);
+            if(written == -1)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+
+                if(errno == EAGAIN)
+                {
+                    d.blocked = true;
+                    watch(d.from, EVFILT_READ, EV_DISABLE);
+                    watch(d.to, EVFILT_WRITE, EV_ADD | EV_ONESHOT);
+                    return;
+                }
+
+                finish();
+                return;
+            }
+            d.start += (size_t)written;
+        }
+    }
+
+public:
+
+    pty_proxy(Tcl_Interp* interp, int input_fd, int output_fd, int master_fd,
+              int escape, Tcl_Obj* callback)
+        : m_interp(interp),
+          m_callback(vessel::create_tclobj_ptr(callback)),
+          m_input_state(input_fd),
+          m_output_state(output_fd),
+          m_master_state(master_fd),
+          m_to_master(input_fd, master_fd),
+          m_from_master(master_fd, output_fd),
+          m_escape(escape),
+          m_escaped(false),
+          m_done(false)
+    {
+        Tcl_IncrRefCount(callback);
+    }
+
+    pty_proxy(const pty_proxy& other) = delete;
+
+    void start()
+    {
+        /*The termios of the master are the settings of the slave so only the
+         * blocking mode of the master is changed*/
+        m_input_state.make_raw();
+        m_output_state.make_raw();
+        m_input_state.make_nonblocking();
+        m_output_state.make_nonblocking();
+        m_master_state.make_nonblocking();
+        copy_window_size();
+
+        m_to_master.reading = true;
+        watch(m_to_master.from, EVFILT_READ, EV_ADD);
+        m_from_master.reading = true;
+        watch(m_from_master.from, EVFILT_READ, EV_ADD);
+    }
+
+    /**
+     * @brief follows_window_size True if the input is a terminal whose size
+     * should be kept in sync with the pty.
+     */
+    bool follows_window_size() const
+    {
+        return !m_done && m_input_state.has_termios && m_master_state.has_termios;
+    }
+
+    /**
+     * @brief copy_window_size Set the size of the pty to the size of the input
+     * terminal.  The kernel sends SIGWINCH to the foreground process group of
+     * the pty when the size changes.
+     */
+    void copy_window_size()
+    {
+        if(!follows_window_size())
+        {
+            return;
+        }
+
+        winsize ws;
+        memset(&ws, 0, sizeof(winsize));
+        if(ioctl(m_input_state.fd, TIOCGWINSZ, &ws) == 0)
+        {
+            (void)ioctl(m_master_state.fd, TIOCSWINSZ, &ws);
+        }
+    }
+
+    void restore()
+    {
+        m_master_state.restore();
+        m_output_state.restore();
+        m_input_state.restore();
+    }
+
+    Tcl_Interp* interp() const
+    {
+        return m_interp;
+    }
+
+    int master_fd() const
+    {
+        return m_master_state.fd;
+    }
+
+    /**
+     * All of the copying happens here when the kqueue reports an fd as ready.
+     * A Tcl event is only returned when the proxy is finished.
+     */
+    vessel::tcl_event_ptr create_tcl_event(const struct kevent& event) override
+    {
+        vessel::tcl_event_ptr no_event(nullptr, vessel::tclalloc_free<Tcl_Event>);
+        if(m_done)
+        {
+            return no_event;
+        }
+
+        int fd = (int)event.ident;
+        if(event.filter == EVFILT_WRITE)
+        {
+            pump(fd == m_from_master.to ? m_from_master : m_to_master);
+        }
+        else
+        {
+            pump(fd == m_from_master.from ? m_from_master : m_to_master);
+        }
+
+        if(m_done)
+        {
+            return vessel::alloc_tcl_event<pty_proxy_done_event>(shared_from_this());
+        }
+        return no_event;
+    }
+
+    void complete()
+    {
+        vessel::tclobj_ptr callback = std::move(m_callback);
+        int error = Tcl_EvalObjEx(m_interp, callback.get(), TCL_EVAL_GLOBAL);
+        if(error)
+        {
+            Tcl_BackgroundError(m_interp);
+        }
+    }
+
+    ~pty_proxy()
+    {
+        /*The interp was deleted while the proxy was running.  The kqueue is
+         * gone too so only the terminal needs to be put back.*/
+        if(!m_done)
+        {
+            restore();
+        }
+    }
+};
+
+/**
+ * @brief The pty_proxy_context class holds the running proxies of an interp.
+ * While any of them has a terminal for input it subscribes to SIGWINCH and
+ * copies the new window size to their ptys from the kqueue event source.
+ */
+class pty_proxy_context : public vessel::tcl_event_factory
+{
+    Tcl_Interp* m_interp;
+    bool m_watching_winch;
+
+public:
+
+    /*Keyed by the master fd*/
+    std::map<int, std::shared_ptr<pty_proxy>> proxies;
+
+    pty_proxy_context(Tcl_Interp* interp)
+        : m_interp(interp),
+          m_watching_winch(false),
+          proxies()
+    {}
+
+    pty_proxy_context(const pty_proxy_context& other) = delete;
+
+    /**
+     * @brief update_winch_watch Call after a proxy is added or removed.
+     */
+    void update_winch_watch()
+    {
+        bool want_winch = false;
+        for(auto& entry : proxies)
+        {
+            want_winch = want_winch || entry.second->follows_window_size();
+        }
+
+        if(want_winch == m_watching_winch)
+        {
+            return;
+        }
+
+        /*SIGWINCH is ignored by default and kqueue records ignored signals
+         * so the disposition doesn't need to change*/
+        struct kevent event;
+        EV_SET(&event, SIGWINCH, EVFILT_SIGNAL, want_winch ? EV_ADD : EV_DELETE, 0, 0, 0);
+        vessel::Kqueue_Add_Event(m_interp, event, *this);
+        m_watching_winch = want_winch;
+    }
+
+    vessel::tcl_event_ptr create_tcl_event(const struct kevent& event) override
+    {
+        (void)event;
+        for(auto& entry : proxies)
+        {
+            entry.second->copy_window_size();
+        }
+        return vessel::tcl_event_ptr(nullptr, vessel::tclalloc_free<Tcl_Event>);
+    }
+};
+
+pty_proxy_context& get_proxy_context(Tcl_Interp* interp)
+{
+    return *reinterpret_cast<pty_proxy_context*>(Tcl_GetAssocData(interp, "PtyProxyContext", nullptr));
+}
+
+int pty_proxy_done_event::event_proc(Tcl_Event *evPtr, int flags)
+{
+    (void)flags;
+    vessel::placement_ptr<pty_proxy_done_event> _this = vessel::create_placement_ptr((pty_proxy_done_event*)(evPtr));
+
+    std::shared_ptr<pty_proxy> proxy = _this->proxy;
+    pty_proxy_context& ctx = get_proxy_context(proxy->interp());
+    ctx.proxies.erase(proxy->master_fd());
+    ctx.update_winch_watch();
+    proxy->complete();
+    return 1;
+}
+
+/**
+ * pty::proxy ?-escape byte? input_chan output_chan master_chan callback
+ *
+ * Copies input_chan to the pty master and the pty master to output_chan
+ * until the pty is closed or the escape byte is read from input_chan.
+ * Terminals are put in raw mode while the proxy runs.  If input_chan is a
+ * terminal the pty follows its window size.  The callback is
+ * invoked after the settings are restored.  The channels shouldn't be
+ * read or written by Tcl while the proxy is running.
+ */
+int
+Pty_Proxy(ClientData clientData,
+         Tcl_Interp *interp,
+         int objc,
+         Tcl_Obj *CONST objv[])
+{
+    int escape = -1;
+    if(objc == 7 && std::string("-escape") == Tcl_GetString(objv[1]))
+    {
+        int tcl_error = Tcl_GetIntFromObj(interp, objv[2], &escape);
+        if(tcl_error) return tcl_error;
+
+        if(escape < 0 || escape > 0xff)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid escape byte: %d", escape));
+            return TCL_ERROR;
+        }
+        objc -= 2;
+        objv += 2;
+    }
+
+    if(objc != 5)
+    {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-escape byte? input_chan output_chan master_chan callback");
+        return TCL_ERROR;
+    }
+
+    long input_handle = -1;
+    int tcl_error = vessel::get_handle_from_channel(interp, objv[1], input_handle);
+    if(tcl_error) return tcl_error;
+
+    long output_handle = -1;
+    tcl_error = vessel::get_handle_from_channel(interp, objv[2], output_handle);
+    if(tcl_error) return tcl_error;
+
+    long master_handle = -1;
+    tcl_error = vessel::get_handle_from_channel(interp, objv[3], master_handle);
+    if(tcl_error) return tcl_error;
+
+    pty_proxy_context& ctx = get_proxy_context(interp);
+    if(ctx.proxies.count((int)master_handle))
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("pty is already being proxied: %s",
+                                               Tcl_GetString(objv[3])));
+        Tcl_SetErrorCode(interp, "PTY", "PROXY", "BUSY", nullptr);
+        return TCL_ERROR;
+    }
+
+    auto proxy = std::make_shared<pty_proxy>(interp, (int)input_handle, (int)output_handle,
+                                             (int)master_handle, escape, objv[4]);
+    ctx.proxies[(int)master_handle] = proxy;
+    proxy->start();
+    ctx.update_winch_watch();
+    return TCL_OK;
+}
 }
 
 extern "C"
@@ -253,6 +779,16 @@ extern "C"
                            (ClientData) NULL,
                            (Tcl_CmdDeleteProc *) NULL);
 
+      Tcl_CreateObjCommand(interp,
+                           "pty::proxy",
+                           Pty_Proxy,
+                           (ClientData) NULL,
+                           (Tcl_CmdDeleteProc *) NULL);
+
+      Tcl_SetAssocData(interp, "PtyProxyContext",
+                       vessel::cpp_delete_with_interp<pty_proxy_context>,
+                       new pty_proxy_context(interp));
+
       if ( Tcl_PkgProvide(interp, "pty", "0.1") != TCL_OK ) {
         return TCL_ERROR;
       }
@@ -0,0 +1,1248 @@
+#include "s3_client.h"
+#include "tcl_kqueue.h"
+#include "tcl_util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <string>
+#include <sys/stat.h>
+#include <tcl.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    const char* const UNSIGNED_PAYLOAD = "UNSIGNED-PAYLOAD";
+
+    using header_list = std::vector<std::pair<std::string, std::string>>;
+
+    std::string to_hex(const unsigned char* data, size_t len)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(len * 2);
+        for(size_t i = 0; i < len; ++i)
+        {
+            hex.push_back(digits[data[i] >> 4]);
+            hex.push_back(digits[data[i] & 0x0f]);
+        }
+        return hex;
+    }
+
+    std::string sha256_hex(const void* data, size_t len)
+    {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char*>(data), len, digest);
+        return to_hex(digest, sizeof(digest));
+    }
+
+    std::string hmac_sha256(const std::string& key, const std::string& data)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        HMAC(EVP_sha256(), key.data(), (int)key.size(),
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+             digest, &digest_len);
+        return std::string(reinterpret_cast<char*>(digest), digest_len);
+    }
+
+    /**
+     * @brief uri_encode Percent encode everything except the RFC 3986 unreserved
+     * characters which is what SigV4 expects in the canonical request.
+     */
+    std::string uri_encode(const std::string& value, bool keep_slash)
+    {
+        static const char digits[] = "0123456789ABCDEF";
+        std::string encoded;
+        for(unsigned char c : value)
+        {
+            if(isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/'))
+            {
+                encoded.push_back(c);
+            }
+            else
+            {
+                encoded.push_back('%');
+                encoded.push_back(digits[c >> 4]);
+                encoded.push_back(digits[c & 0x0f]);
+            }
+        }
+        return encoded;
+    }
+
+    std::string lowercase(std::string value)
+    {
+        std::transform(value.begin(), value.end(), value.begin(),
+                       [](unsigned char c) { return (char)tolower(c); });
+        return value;
+    }
+
+    std::string trim(const std::string& value)
+    {
+        size_t first = value.find_first_not_of(" \t\r\n");
+        if(first == std::string::npos)
+        {
+            return std::string();
+        }
+        size_t last = value.find_last_not_of(" \t\r\n");
+        return value.substr(first, last - first + 1);
+    }
+
+    struct s3_config
+    {
+        std::string scheme = "https";
+        std::string host = "s3.amazonaws.com"; /**< host[:port] of the endpoint*/
+        std::string region = "us-east-1";
+        std::string access_key;
+        std::string secret_key;
+        bool path_style = true;
+        long max_connections = 8;
+    };
+
+    /**
+     * @brief sign_request Add the AWS signature version 4 headers.  Every header in
+     * the list, which must include host, is signed.  Anonymous requests are left
+     * unsigned.
+     */
+    void sign_request(const s3_config& config, const std::string& method,
+                      const std::string& canonical_uri, const std::string& canonical_query,
+                      const std::string& payload_hash, time_t now, header_list& headers)
+    {
+        struct tm utc;
+        gmtime_r(&now, &utc);
+        char amz_date[32];
+        strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &utc);
+        std::string date_stamp(amz_date, 8);
+
+        headers.emplace_back("x-amz-content-sha256", payload_hash);
+        headers.emplace_back("x-amz-date", amz_date);
+        if(config.access_key.empty())
+        {
+            return;
+        }
+
+        header_list canonical;
+        for(auto& header : headers)
+        {
+            canonical.emplace_back(lowercase(header.first), trim(header.second));
+        }
+        std::sort(canonical.begin(), canonical.end());
+
+        std::string canonical_headers;
+        std::string signed_headers;
+        for(auto& header : canonical)
+        {
+            canonical_headers += header.first + ":" + header.second + "\n";
+            signed_headers += (signed_headers.empty() ? "" : ";") + header.first;
+        }
+
+        std::string canonical_request = method + "\n" + canonical_uri + "\n" + canonical_query + "\n" +
+            canonical_headers + "\n" + signed_headers + "\n" + payload_hash;
+
+        std::string scope = date_stamp + "/" + config.region + "/s3/aws4_request";
+        std::string string_to_sign = std::string("AWS4-HMAC-SHA256\n") + amz_date + "\n" + scope + "\n" +
+            sha256_hex(canonical_request.data(), canonical_request.size());
+
+        std::string signing_key = hmac_sha256("AWS4" + config.secret_key, date_stamp);
+        signing_key = hmac_sha256(signing_key, config.region);
+        signing_key = hmac_sha256(signing_key, "s3");
+        signing_key = hmac_sha256(signing_key, "aws4_request");
+        std::string signature = hmac_sha256(signing_key, string_to_sign);
+
+        headers.emplace_back("Authorization", "AWS4-HMAC-SHA256 Credential=" + config.access_key + "/" + scope +
+                             ", SignedHeaders=" + signed_headers +
+                             ", Signature=" + to_hex(reinterpret_cast<const unsigned char*>(signature.data()),
+                                                     signature.size()));
+    }
+
+    /**
+     * @brief The s3_transfer struct is the state of a single request.  The request
+     * body comes from memory or a region of a file and a successful response body
+     * goes to memory or is written at an offset in a file, which lets ranged
+     * requests fill in a single file in parallel.  The file is only opened
+     * once a successful response arrives so a failed request never creates
+     * or changes it.
+     */
+    struct s3_transfer
+    {
+        CURL* easy;
+        curl_slist* request_headers;
+        tclobj_ptr callback;
+
+        std::string body;
+        size_t body_pos;
+        fd_guard infile;
+        off_t in_offset;
+        off_t in_remaining;
+
+        std::string outfile_path;
+        int outfile_flags;
+        fd_guard outfile;
+        off_t out_offset;
+        Tcl_WideInt bytes_written;
+        EVP_MD_CTX* out_digest; /**< Digest of the bytes written to the outfile*/
+
+        header_list response_headers;
+        std::string response_body;
+        std::string write_error;
+        CURLcode result;
+        char error_buf[CURL_ERROR_SIZE];
+
+        s3_transfer(Tcl_Obj* callback)
+            : easy(curl_easy_init()),
+              request_headers(nullptr),
+              callback(create_tclobj_ptr(callback)),
+              body(),
+              body_pos(0),
+              infile(-1),
+              in_offset(0),
+              in_remaining(0),
+              outfile_path(),
+              outfile_flags(0),
+              outfile(-1),
+              out_offset(0),
+              bytes_written(0),
+              out_digest(nullptr),
+              response_headers(),
+              response_body(),
+              write_error(),
+              result(CURLE_OK)
+        {
+            Tcl_IncrRefCount(callback);
+            error_buf[0] = '\0';
+        }
+
+        s3_transfer(const s3_transfer& other) = delete;
+
+        bool open_outfile()
+        {
+            outfile.fd = open(outfile_path.c_str(), outfile_flags, 0644);
+            if(outfile.fd == -1)
+            {
+                write_error = Tcl_ErrnoMsg(errno);
+                return false;
+            }
+            return true;
+        }
+
+        static bool success(long status)
+        {
+            return status >= 200 && status < 300;
+        }
+
+        static size_t read_callback(char* buf, size_t size, size_t nitems, void* userp)
+        {
+            s3_transfer* transfer = reinterpret_cast<s3_transfer*>(userp);
+            size_t max_bytes = size * nitems;
+
+            if(transfer->infile.fd == -1)
+            {
+                size_t bytes = std::min(max_bytes, transfer->body.size() - transfer->body_pos);
+                memcpy(buf, transfer->body.data() + transfer->body_pos, bytes);
+                transfer->body_pos += bytes;
+                return bytes;
+            }
+
+            size_t wanted = std::min(max_bytes, (size_t)transfer->in_remaining);
+            ssize_t bytes = pread(transfer->infile.fd, buf, wanted, transfer->in_offset);
+            if(bytes == -1 || (bytes == 0 && wanted > 0))
+            {
+                transfer->write_error = bytes == -1 ? Tcl_ErrnoMsg(errno) : "Unexpected end of input file";
+                return CURL_READFUNC_ABORT;
+            }
+
+            transfer->in_offset += bytes;
+            transfer->in_remaining -= bytes;
+            return (size_t)bytes;
+        }
+
+        static size_t write_callback(char* data, size_t size, size_t nmemb, void* userp)
+        {
+            s3_transfer* transfer = reinterpret_cast<s3_transfer*>(userp);
+            size_t len = size * nmemb;
+
+            long status = 0;
+            curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &status);
+
+            /*Error documents are always kept in memory so they can be reported*/
+            if(transfer->outfile_path.empty() || !success(status))
+            {
+                transfer->response_body.append(data, len);
+                return len;
+            }
+
+            if(transfer->outfile.fd == -1 && !transfer->open_outfile())
+            {
+                return 0;
+            }
+
+            size_t written = 0;
+            while(written < len)
+            {
+                ssize_t bytes = pwrite(transfer->outfile.fd, data + written, len - written,
+                                       transfer->out_offset + transfer->bytes_written);
+                if(bytes == -1)
+                {
+                    transfer->write_error = Tcl_ErrnoMsg(errno);
+                    return 0;
+                }
+                written += bytes;
+                transfer->bytes_written += bytes;
+            }
+
+            EVP_DigestUpdate(transfer->out_digest, data, len);
+            return len;
+        }
+
+        static size_t header_callback(char* data, size_t size, size_t nitems, void* userp)
+        {
+            s3_transfer* transfer = reinterpret_cast<s3_transfer*>(userp);
+            size_t len = size * nitems;
+            std::string line(data, len);
+
+            if(line.compare(0, 5, "HTTP/") == 0)
+            {
+                /*A new response, possibly after a 100 Continue*/
+                transfer->response_headers.clear();
+            }
+            else
+            {
+                size_t colon = line.find(':');
+                if(colon != std::string::npos)
+                {
+                    transfer->response_headers.emplace_back(lowercase(line.substr(0, colon)),
+                                                            trim(line.substr(colon + 1)));
+                }
+            }
+            return len;
+        }
+
+        Tcl_Obj* result_dict()
+        {
+            long status = 0;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+
+            Tcl_Obj* headers = Tcl_NewDictObj();
+            for(auto& header : response_headers)
+            {
+                Tcl_DictObjPut(nullptr, headers,
+                               Tcl_NewStringObj(header.first.c_str(), header.first.size()),
+                               Tcl_NewStringObj(header.second.c_str(), header.second.size()));
+            }
+
+            std::string error;
+            if(result != CURLE_OK)
+            {
+                if(!write_error.empty())
+                {
+                    error = write_error;
+                }
+                else if(error_buf[0] != '\0')
+                {
+                    error = error_buf;
+                }
+                else
+                {
+                    error = curl_easy_strerror(result);
+                }
+            }
+
+            Tcl_Obj* dict = Tcl_NewDictObj();
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("status", -1), Tcl_NewLongObj(status));
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("headers", -1), headers);
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("body", -1),
+                           Tcl_NewByteArrayObj(reinterpret_cast<const unsigned char*>(response_body.data()),
+                                               (int)response_body.size()));
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj(bytes_written));
+
+            std::string sha256;
+            if(out_digest != nullptr)
+            {
+                unsigned char digest[EVP_MAX_MD_SIZE];
+                unsigned int digest_len = 0;
+                EVP_DigestFinal_ex(out_digest, digest, &digest_len);
+                sha256 = to_hex(digest, digest_len);
+            }
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("sha256", -1),
+                           Tcl_NewStringObj(sha256.c_str(), sha256.size()));
+            Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj("error", -1),
+                           Tcl_NewStringObj(error.c_str(), error.size()));
+            return dict;
+        }
+
+        ~s3_transfer()
+        {
+            EVP_MD_CTX_free(out_digest);
+            curl_easy_cleanup(easy);
+            curl_slist_free_all(request_headers);
+        }
+    };
+
+    /**
+     * @brief The s3_request struct holds the parsed arguments of vessel::s3::request.
+     */
+    struct s3_request
+    {
+        std::string method;
+        std::string bucket;
+        std::string key;
+        std::vector<std::pair<std::string, std::string>> query;
+        header_list headers;
+        std::string body;
+        std::string infile;
+        std::string outfile;
+        Tcl_WideInt offset = 0;
+        bool offset_set = false;
+        Tcl_WideInt length = -1;
+        Tcl_WideInt range_first = -1;
+        Tcl_WideInt range_last = -1;
+    };
+
+    class s3_client;
+
+    /**
+     * @brief The s3_client_event struct is queued when transfers have completed
+     * so their callbacks are evaluated from the event loop.
+     */
+    struct s3_client_event : public Tcl_Event
+    {
+        std::weak_ptr<s3_client> client;
+
+        static int event_proc(Tcl_Event *evPtr, int flags);
+
+        s3_client_event(std::weak_ptr<s3_client> client)
+            : Tcl_Event(),
+              client(client)
+        {
+            this->proc = event_proc;
+            this->nextPtr = nullptr;
+        }
+    };
+
+    /**
+     * @brief The s3_client class drives a curl multi handle from the kqueue event
+     * source.  curl tells us which sockets to watch and when to fire its timeout,
+     * socket io is handled natively and only completed transfers call into Tcl.
+     * Connections are reused between requests and at most max_connections
+     * transfers run at once, the rest are queued by curl.
+     */
+    class s3_client : public tcl_event_factory,
+                      public std::enable_shared_from_this<s3_client>
+    {
+        static const int WATCH_READ = 0x1;
+        static const int WATCH_WRITE = 0x2;
+
+        Tcl_Interp* m_interp;
+        s3_config m_config;
+        CURLM* m_multi;
+        Tcl_TimerToken m_timer;
+        std::map<curl_socket_t, int> m_sockets; /**< Filters watched for each socket*/
+        std::map<CURL*, std::unique_ptr<s3_transfer>> m_transfers;
+        std::vector<std::unique_ptr<s3_transfer>> m_completed;
+        bool m_delivery_queued;
+        bool m_closed;
+
+        void watch(curl_socket_t fd, short filter, u_short flags)
+        {
+            struct kevent event;
+            EV_SET(&event, fd, filter, flags, 0, 0, 0);
+            if(flags & EV_DELETE)
+            {
+                (void)Kqueue_Remove_Event(m_interp, event);
+            }
+            else
+            {
+                (void)Kqueue_Add_Event(m_interp, event, *this);
+            }
+        }
+
+        static int socket_callback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp)
+        {
+            (void)easy;
+            (void)socketp;
+            s3_client* client = reinterpret_cast<s3_client*>(userp);
+            if(client->m_closed)
+            {
+                /*The sockets are closed with the multi handle which removes them from kqueue*/
+                return 0;
+            }
+
+            int wanted = 0;
+            if(what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+            {
+                wanted |= WATCH_READ;
+            }
+            if(what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+            {
+                wanted |= WATCH_WRITE;
+            }
+
+            int current = client->m_sockets.count(fd) ? client->m_sockets[fd] : 0;
+            if((wanted & WATCH_READ) != (current & WATCH_READ))
+            {
+                client->watch(fd, EVFILT_READ, (wanted & WATCH_READ) ? EV_ADD : EV_DELETE);
+            }
+            if((wanted & WATCH_WRITE) != (current & WATCH_WRITE))
+            {
+                client->watch(fd, EVFILT_WRITE, (wanted & WATCH_WRITE) ? EV_ADD : EV_DELETE);
+            }
+
+            if(wanted)
+            {
+                client->m_sockets[fd] = wanted;
+            }
+            else
+            {
+                client->m_sockets.erase(fd);
+            }
+            return 0;
+        }
+
+        static int timer_callback(CURLM* multi, long timeout_ms, void* userp)
+        {
+            (void)multi;
+            s3_client* client = reinterpret_cast<s3_client*>(userp);
+            if(client->m_timer != nullptr)
+            {
+                Tcl_DeleteTimerHandler(client->m_timer);
+                client->m_timer = nullptr;
+            }
+
+            if(timeout_ms >= 0 && !client->m_closed)
+            {
+                client->m_timer = Tcl_CreateTimerHandler((int)timeout_ms, timeout_proc, client);
+            }
+            return 0;
+        }
+
+        static void timeout_proc(void* client_data)
+        {
+            s3_client* client = reinterpret_cast<s3_client*>(client_data);
+            client->m_timer = nullptr;
+            client->perform(CURL_SOCKET_TIMEOUT, 0);
+
+            tcl_event_ptr event = client->completion_event();
+            if(event)
+            {
+                Tcl_QueueEvent(event.release(), TCL_QUEUE_TAIL);
+            }
+        }
+
+        void perform(curl_socket_t fd, int ev_bitmask)
+        {
+            int running = 0;
+            (void)curl_multi_socket_action(m_multi, fd, ev_bitmask, &running);
+
+            int remaining = 0;
+            CURLMsg* msg = nullptr;
+            while((msg = curl_multi_info_read(m_multi, &remaining)) != nullptr)
+            {
+                if(msg->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+
+                auto transfer_it = m_transfers.find(msg->easy_handle);
+                if(transfer_it == m_transfers.end())
+                {
+                    continue;
+                }
+
+                s3_transfer& transfer = *transfer_it->second;
+                transfer.result = msg->data.result;
+
+                /*An empty object still creates the outfile*/
+                long status = 0;
+                curl_easy_getinfo(transfer.easy, CURLINFO_RESPONSE_CODE, &status);
+                if(transfer.result == CURLE_OK && !transfer.outfile_path.empty() &&
+                   transfer.outfile.fd == -1 && s3_transfer::success(status) && !transfer.open_outfile())
+                {
+                    transfer.result = CURLE_WRITE_ERROR;
+                }
+
+                curl_multi_remove_handle(m_multi, msg->easy_handle);
+                m_completed.push_back(std::move(transfer_it->second));
+                m_transfers.erase(transfer_it);
+            }
+        }
+
+        tcl_event_ptr completion_event()
+        {
+            if(m_completed.empty() || m_delivery_queued)
+            {
+                return tcl_event_ptr(nullptr, tclalloc_free<Tcl_Event>);
+            }
+
+            m_delivery_queued = true;
+            return alloc_tcl_event<s3_client_event>(weak_from_this());
+        }
+
+        std::string canonical_uri(const s3_request& request) const
+        {
+            std::string uri = "/";
+            if(m_config.path_style && !request.bucket.empty())
+            {
+                uri += uri_encode(request.bucket, false);
+                if(!request.key.empty())
+                {
+                    uri += "/";
+                }
+            }
+            return uri + uri_encode(request.key, true);
+        }
+
+        std::string canonical_query(const s3_request& request) const
+        {
+            std::vector<std::pair<std::string, std::string>> encoded;
+            for(auto& param : request.query)
+            {
+                encoded.emplace_back(uri_encode(param.first, false), uri_encode(param.second, false));
+            }
+            std::sort(encoded.begin(), encoded.end());
+
+            std::string query;
+            for(auto& param : encoded)
+            {
+                query += (query.empty() ? "" : "&") + param.first + "=" + param.second;
+            }
+            return query;
+        }
+
+    public:
+
+        s3_client(Tcl_Interp* interp, const s3_config& config)
+            : m_interp(interp),
+              m_config(config),
+              m_multi(curl_multi_init()),
+              m_timer(nullptr),
+              m_sockets(),
+              m_transfers(),
+              m_completed(),
+              m_delivery_queued(false),
+              m_closed(false)
+        {
+            curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+            curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+            curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
+            curl_multi_setopt(m_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, m_config.max_connections);
+            curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, m_config.max_connections);
+        }
+
+        s3_client(const s3_client& other) = delete;
+
+        int request(const s3_request& request, Tcl_Obj* callback)
+        {
+            auto transfer = std::make_unique<s3_transfer>(callback);
+            CURL* easy = transfer->easy;
+
+            std::string host = m_config.host;
+            if(!m_config.path_style && !request.bucket.empty())
+            {
+                host = request.bucket + "." + host;
+            }
+
+            std::string uri = canonical_uri(request);
+            std::string query = canonical_query(request);
+            std::string url = m_config.scheme + "://" + host + uri + (query.empty() ? "" : "?" + query);
+
+            header_list headers = request.headers;
+            headers.emplace_back("host", host);
+            if(request.range_first >= 0)
+            {
+                headers.emplace_back("range", "bytes=" + std::to_string(request.range_first) + "-" +
+                                     (request.range_last >= 0 ? std::to_string(request.range_last) : ""));
+            }
+
+            Tcl_WideInt upload_size = 0;
+            std::string payload_hash;
+            if(!request.infile.empty())
+            {
+                transfer->infile.fd = open(request.infile.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat sb;
+                if(transfer->infile.fd == -1 || fstat(transfer->infile.fd, &sb) == -1)
+                {
+                    return syserror_result(m_interp, "S3", "INFILE");
+                }
+
+                upload_size = request.length >= 0 ? request.length : sb.st_size - request.offset;
+                if(request.offset < 0 || upload_size < 0 || request.offset + upload_size > sb.st_size)
+                {
+                    Tcl_SetObjResult(m_interp, Tcl_ObjPrintf("Region is outside of file: %s",
+                                                             request.infile.c_str()));
+                    Tcl_SetErrorCode(m_interp, "S3", "INFILE", "RANGE", nullptr);
+                    return TCL_ERROR;
+                }
+
+                /*Avoid reading the region twice.  The signature still covers the headers.*/
+                transfer->in_offset = request.offset;
+                transfer->in_remaining = upload_size;
+                payload_hash = UNSIGNED_PAYLOAD;
+            }
+            else
+            {
+                transfer->body = request.body;
+                upload_size = request.body.size();
+                payload_hash = sha256_hex(request.body.data(), request.body.size());
+            }
+
+            if(!request.outfile.empty())
+            {
+                /*A whole object replaces the file, ranges are written in place*/
+                transfer->outfile_path = request.outfile;
+                transfer->outfile_flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+                if(!request.offset_set && request.range_first < 0)
+                {
+                    transfer->outfile_flags |= O_TRUNC;
+                }
+                transfer->out_offset = request.offset;
+                transfer->out_digest = EVP_MD_CTX_new();
+                EVP_DigestInit_ex(transfer->out_digest, EVP_sha256(), nullptr);
+            }
+
+            sign_request(m_config, request.method, uri, query, payload_hash, time(nullptr), headers);
+
+            for(auto& header : headers)
+            {
+                std::string line = header.first + ": " + header.second;
+                transfer->request_headers = curl_slist_append(transfer->request_headers, line.c_str());
+            }
+
+            /*The stand-in servers and some proxies don't implement 100-continue*/
+            transfer->request_headers = curl_slist_append(transfer->request_headers, "Expect:");
+
+            curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->request_headers);
+            curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer.get());
+            curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, transfer->error_buf);
+            curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 30L);
+
+            /*Fail transfers that stall instead of waiting forever*/
+            curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, 60L);
+
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, s3_transfer::write_callback);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+            curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, s3_transfer::header_callback);
+            curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer.get());
+
+            if(request.method == "HEAD")
+            {
+                curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+            }
+            else if(request.method == "PUT" || request.method == "POST")
+            {
+                /*Upload mode always sends a content length, even when the body is empty*/
+                curl_easy_setopt(easy, CURLOPT_UPLOAD, 1L);
+                curl_easy_setopt(easy, CURLOPT_INFILESIZE_LARGE, (curl_off_t)upload_size);
+                curl_easy_setopt(easy, CURLOPT_READFUNCTION, s3_transfer::read_callback);
+                curl_easy_setopt(easy, CURLOPT_READDATA, transfer.get());
+                curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+            }
+            else if(request.method != "GET")
+            {
+                curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+            }
+
+            CURLMcode error = curl_multi_add_handle(m_multi, easy);
+            if(error != CURLM_OK)
+            {
+                Tcl_SetObjResult(m_interp, Tcl_NewStringObj(curl_multi_strerror(error), -1));
+                Tcl_SetErrorCode(m_interp, "S3", "REQUEST", "CURL", nullptr);
+                return TCL_ERROR;
+            }
+
+            m_transfers[easy] = std::move(transfer);
+            return TCL_OK;
+        }
+
+        tcl_event_ptr create_tcl_event(const struct kevent& event) override
+        {
+            if(m_closed)
+            {
+                return tcl_event_ptr(nullptr, tclalloc_free<Tcl_Event>);
+            }
+
+            int ev_bitmask = (event.filter == EVFILT_READ) ? CURL_CSELECT_IN : CURL_CSELECT_OUT;
+            if(event.flags & EV_ERROR)
+            {
+                ev_bitmask |= CURL_CSELECT_ERR;
+            }
+
+            perform((curl_socket_t)event.ident, ev_bitmask);
+            return completion_event();
+        }
+
+        /**
+         * @brief deliver Evaluate the callbacks of the completed transfers.  Each
+         * callback is called with the result dictionary appended.
+         */
+        void deliver()
+        {
+            m_delivery_queued = false;
+            std::vector<std::unique_ptr<s3_transfer>> completed;
+            completed.swap(m_completed);
+
+            for(auto& transfer : completed)
+            {
+                if(m_closed)
+                {
+                    return;
+                }
+
+                int callback_length = 0;
+                Tcl_Obj **callback_elements = nullptr;
+                int error = Tcl_ListObjGetElements(m_interp, transfer->callback.get(),
+                                                   &callback_length, &callback_elements);
+                if(error)
+                {
+                    Tcl_BackgroundError(m_interp);
+                    continue;
+                }
+
+                tclobj_ptr eval_params = create_tclobj_ptr(Tcl_NewListObj(callback_length, callback_elements));
+                Tcl_IncrRefCount(eval_params.get());
+                Tcl_ListObjAppendElement(m_interp, eval_params.get(), transfer->result_dict());
+
+                error = Tcl_EvalObjEx(m_interp, eval_params.get(), TCL_EVAL_GLOBAL);
+                if(error)
+                {
+                    Tcl_BackgroundError(m_interp);
+                }
+            }
+        }
+
+        /**
+         * @brief close Cancel outstanding transfers without calling their callbacks.
+         */
+        void close()
+        {
+            for(auto& socket : m_sockets)
+            {
+                if(socket.second & WATCH_READ)
+                {
+                    watch(socket.first, EVFILT_READ, EV_DELETE);
+                }
+                if(socket.second & WATCH_WRITE)
+                {
+                    watch(socket.first, EVFILT_WRITE, EV_DELETE);
+                }
+            }
+            m_sockets.clear();
+            m_closed = true;
+
+            if(m_timer != nullptr)
+            {
+                Tcl_DeleteTimerHandler(m_timer);
+                m_timer = nullptr;
+            }
+
+            for(auto& transfer : m_transfers)
+            {
+                curl_multi_remove_handle(m_multi, transfer.first);
+            }
+            m_transfers.clear();
+            m_completed.clear();
+        }
+
+        ~s3_client()
+        {
+            /*Also reached when the interpreter is deleted so kqueue must not be touched*/
+            m_closed = true;
+            if(m_timer != nullptr)
+            {
+                Tcl_DeleteTimerHandler(m_timer);
+            }
+
+            for(auto& transfer : m_transfers)
+            {
+                curl_multi_remove_handle(m_multi, transfer.first);
+            }
+            m_transfers.clear();
+            curl_multi_cleanup(m_multi);
+        }
+    };
+
+    int s3_client_event::event_proc(Tcl_Event *evPtr, int flags)
+    {
+        (void)flags;
+        placement_ptr<s3_client_event> _this = create_placement_ptr((s3_client_event*)(evPtr));
+
+        /*Keep the client alive while the callbacks run in case one of them closes it*/
+        std::shared_ptr<s3_client> client = _this->client.lock();
+        if(client)
+        {
+            client->deliver();
+        }
+
+        return 1;
+    }
+
+    struct s3_context
+    {
+        std::map<std::string, std::shared_ptr<s3_client>> clients;
+        uint64_t next_id = 0;
+    };
+
+    s3_context& get_context(Tcl_Interp* interp)
+    {
+        s3_context* ctx = reinterpret_cast<s3_context*>(Tcl_GetAssocData(interp, "S3Context", nullptr));
+        return *ctx;
+    }
+
+    int get_client(Tcl_Interp* interp, Tcl_Obj* handle, std::shared_ptr<s3_client>& client)
+    {
+        s3_context& ctx = get_context(interp);
+        auto client_it = ctx.clients.find(Tcl_GetString(handle));
+        if(client_it == ctx.clients.end())
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown s3 client: %s", Tcl_GetString(handle)));
+            return TCL_ERROR;
+        }
+
+        client = client_it->second;
+        return TCL_OK;
+    }
+
+    int get_string_pairs(Tcl_Interp* interp, Tcl_Obj* list,
+                         std::vector<std::pair<std::string, std::string>>& pairs)
+    {
+        int length = 0;
+        Tcl_Obj **elements = nullptr;
+        int tcl_error = Tcl_ListObjGetElements(interp, list, &length, &elements);
+        if(tcl_error) return tcl_error;
+
+        if(length % 2 != 0)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Expected a dictionary: %s", Tcl_GetString(list)));
+            return TCL_ERROR;
+        }
+
+        for(int i = 0; i < length; i += 2)
+        {
+            pairs.emplace_back(Tcl_GetString(elements[i]), Tcl_GetString(elements[i + 1]));
+        }
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::s3::client ?-endpoint url? ?-region region? ?-access-key key? ?-secret-key key?
+     *                    ?-path-style bool? ?-max-connections count?
+     *
+     * Requests are anonymous when no access key is given.
+     * @returns A handle for request and close.
+     */
+    int Vessel_S3Client(void *clientData, Tcl_Interp *interp,
+                        int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc % 2 != 1)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "?-endpoint url? ?-region region? ?-access-key key? "
+                             "?-secret-key key? ?-path-style bool? ?-max-connections count?");
+            return TCL_ERROR;
+        }
+
+        s3_config config;
+        int tcl_error = TCL_OK;
+        for(int i = 1; i < objc; i += 2)
+        {
+            std::string option = Tcl_GetString(objv[i]);
+            std::string value = Tcl_GetString(objv[i + 1]);
+            if(option == "-endpoint")
+            {
+                size_t separator = value.find("://");
+                if(separator == std::string::npos)
+                {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Endpoint is missing a scheme: %s", value.c_str()));
+                    return TCL_ERROR;
+                }
+                config.scheme = value.substr(0, separator);
+                config.host = value.substr(separator + 3);
+                while(!config.host.empty() && config.host.back() == '/')
+                {
+                    config.host.pop_back();
+                }
+            }
+            else if(option == "-region")
+            {
+                config.region = value;
+            }
+            else if(option == "-access-key")
+            {
+                config.access_key = value;
+            }
+            else if(option == "-secret-key")
+            {
+                config.secret_key = value;
+            }
+            else if(option == "-path-style")
+            {
+                int path_style = 1;
+                tcl_error = Tcl_GetBooleanFromObj(interp, objv[i + 1], &path_style);
+                if(tcl_error) return tcl_error;
+                config.path_style = path_style;
+            }
+            else if(option == "-max-connections")
+            {
+                long max_connections = 0;
+                tcl_error = Tcl_GetLongFromObj(interp, objv[i + 1], &max_connections);
+                if(tcl_error) return tcl_error;
+
+                if(max_connections <= 0)
+                {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid connection count: %ld", max_connections));
+                    return TCL_ERROR;
+                }
+                config.max_connections = max_connections;
+            }
+            else
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option: %s", option.c_str()));
+                return TCL_ERROR;
+            }
+        }
+
+        s3_context& ctx = get_context(interp);
+        std::string handle = "s3client" + std::to_string(ctx.next_id++);
+        ctx.clients[handle] = std::make_shared<s3_client>(interp, config);
+
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.c_str(), handle.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::s3::request handle method bucket key ?-query dict? ?-headers dict? ?-range {first last}?
+     *                     ?-body bytes? ?-infile path? ?-outfile path? ?-offset n? ?-length n? callback_prefix
+     *
+     * -offset and -length select the region of -infile that is uploaded.  With
+     * -outfile a successful response body is written starting at -offset.  The
+     * outfile is replaced unless -offset or -range is given and it is left
+     * alone when the response isn't successful.  The
+     * callback prefix is invoked with a dictionary of status, headers, body,
+     * bytes and sha256 (of what was written to the outfile) and error which
+     * is empty unless the transfer itself failed.
+     */
+    int Vessel_S3Request(void *clientData, Tcl_Interp *interp,
+                         int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc < 6 || objc % 2 != 0)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle method bucket key ?-option value ...? callback_prefix");
+            return TCL_ERROR;
+        }
+
+        std::shared_ptr<s3_client> client;
+        int tcl_error = get_client(interp, objv[1], client);
+        if(tcl_error) return tcl_error;
+
+        s3_request request;
+        request.method = Tcl_GetString(objv[2]);
+        request.bucket = Tcl_GetString(objv[3]);
+        request.key = Tcl_GetString(objv[4]);
+        for(int i = 5; i < objc - 1; i += 2)
+        {
+            std::string option = Tcl_GetString(objv[i]);
+            Tcl_Obj* value = objv[i + 1];
+            if(option == "-query")
+            {
+                tcl_error = get_string_pairs(interp, value, request.query);
+            }
+            else if(option == "-headers")
+            {
+                tcl_error = get_string_pairs(interp, value, request.headers);
+            }
+            else if(option == "-range")
+            {
+                int length = 0;
+                Tcl_Obj **elements = nullptr;
+                tcl_error = Tcl_ListObjGetElements(interp, value, &length, &elements);
+                if(tcl_error) return tcl_error;
+
+                if(length < 1 || length > 2)
+                {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Expected {first ?last?}: %s", Tcl_GetString(value)));
+                    return TCL_ERROR;
+                }
+
+                tcl_error = Tcl_GetWideIntFromObj(interp, elements[0], &request.range_first);
+                if(!tcl_error && length == 2)
+                {
+                    tcl_error = Tcl_GetWideIntFromObj(interp, elements[1], &request.range_last);
+                }
+            }
+            else if(option == "-body")
+            {
+                int length = 0;
+                unsigned char* bytes = Tcl_GetByteArrayFromObj(value, &length);
+                request.body.assign(reinterpret_cast<char*>(bytes), length);
+            }
+            else if(option == "-infile")
+            {
+                request.infile = Tcl_GetString(value);
+            }
+            else if(option == "-outfile")
+            {
+                request.outfile = Tcl_GetString(value);
+            }
+            else if(option == "-offset")
+            {
+                tcl_error = Tcl_GetWideIntFromObj(interp, value, &request.offset);
+                request.offset_set = true;
+            }
+            else if(option == "-length")
+            {
+                tcl_error = Tcl_GetWideIntFromObj(interp, value, &request.length);
+            }
+            else
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option: %s", option.c_str()));
+                return TCL_ERROR;
+            }
+
+            if(tcl_error) return tcl_error;
+        }
+
+        return client->request(request, objv[objc - 1]);
+    }
+
+    /**
+     * vessel::s3::sha256 ?-offset n? ?-length n? path
+     *
+     * @returns The hex sha256 digest of the region of the file, which defaults
+     * to the whole file.
+     */
+    int Vessel_S3Sha256(void *clientData, Tcl_Interp *interp,
+                        int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        Tcl_WideInt offset = 0;
+        Tcl_WideInt length = -1;
+        int tcl_error = TCL_OK;
+        while(objc > 2)
+        {
+            std::string option = Tcl_GetString(objv[1]);
+            if(option == "-offset")
+            {
+                tcl_error = Tcl_GetWideIntFromObj(interp, objv[2], &offset);
+            }
+            else if(option == "-length")
+            {
+                tcl_error = Tcl_GetWideIntFromObj(interp, objv[2], &length);
+            }
+            else
+            {
+                break;
+            }
+
+            if(tcl_error) return tcl_error;
+            objc -= 2;
+            objv += 2;
+        }
+
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "?-offset n? ?-length n? path");
+            return TCL_ERROR;
+        }
+
+        fd_guard fd(open(Tcl_GetString(objv[1]), O_RDONLY | O_CLOEXEC));
+        struct stat sb;
+        if(fd.fd == -1 || fstat(fd.fd, &sb) == -1)
+        {
+            return syserror_result(interp, "S3", "SHA256");
+        }
+
+        if(length < 0)
+        {
+            length = sb.st_size - offset;
+        }
+
+        if(offset < 0 || length < 0 || offset + length > sb.st_size)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Region is outside of file: %s", Tcl_GetString(objv[1])));
+            Tcl_SetErrorCode(interp, "S3", "SHA256", "RANGE", nullptr);
+            return TCL_ERROR;
+        }
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+
+        std::vector<char> buf(1024 * 1024);
+        while(length > 0)
+        {
+            ssize_t bytes = pread(fd.fd, buf.data(), std::min((Tcl_WideInt)buf.size(), length), offset);
+            if(bytes == -1)
+            {
+                return syserror_result(interp, "S3", "SHA256");
+            }
+            else if(bytes == 0)
+            {
+                break;
+            }
+
+            EVP_DigestUpdate(ctx.get(), buf.data(), bytes);
+            offset += bytes;
+            length -= bytes;
+        }
+
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        EVP_DigestFinal_ex(ctx.get(), digest, &digest_len);
+        std::string hex = to_hex(digest, digest_len);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(hex.c_str(), hex.size()));
+        return TCL_OK;
+    }
+
+    /**
+     * vessel::s3::close handle
+     *
+     * Outstanding requests are cancelled and their callbacks are not called.
+     */
+    int Vessel_S3Close(void *clientData, Tcl_Interp *interp,
+                       int objc, struct Tcl_Obj *const *objv)
+    {
+        (void)clientData;
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        std::shared_ptr<s3_client> client;
+        int tcl_error = get_client(interp, objv[1], client);
+        if(tcl_error) return tcl_error;
+
+        client->close();
+        get_context(interp).clients.erase(Tcl_GetString(objv[1]));
+        Tcl_ResetResult(interp);
+        return TCL_OK;
+    }
+}
+
+int Vessel_S3Init(Tcl_Interp* interp)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    Tcl_SetAssocData(interp, "S3Context", vessel::cpp_delete_with_interp<s3_context>, new s3_context());
+    Tcl_CreateObjCommand(interp, "vessel::s3::client", Vessel_S3Client, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::s3::request", Vessel_S3Request, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::s3::close", Vessel_S3Close, nullptr, nullptr);
+    Tcl_CreateObjCommand(interp, "vessel::s3::sha256", Vessel_S3Sha256, nullptr, nullptr);
+
+    return TCL_OK;
+}
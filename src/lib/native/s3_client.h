@@ -0,0 +1,8 @@
+#ifndef S3_CLIENT_H
+#define S3_CLIENT_H
+
+#include <tcl.h>
+
+int Vessel_S3Init(Tcl_Interp* interp);
+
+#endif // S3_CLIENT_H
@@ -119,7 +119,12 @@ namespace
              * add do new placement and allocation correctly.*/
             tcl_event_factory* factory = reinterpret_cast<tcl_event_factory*>(events[i].udata);
             tcl_event_ptr event = factory->create_tcl_event(events[i]);
-            Tcl_QueueEvent(event.release(), TCL_QUEUE_TAIL);
+
+            /*Factories that handle the kevent themselves don't need a Tcl event*/
+            if(event)
+            {
+                Tcl_QueueEvent(event.release(), TCL_QUEUE_TAIL);
+            }
         }
     }
 
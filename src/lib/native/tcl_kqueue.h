@@ -21,6 +21,11 @@ namespace vessel
     {
     public:
 
+        /**
+         * @brief create_tcl_event Called from the event source when the kevent is active.
+         * @return The event to queue or a null pointer if the kevent was handled
+         * without needing to call into Tcl.
+         */
         virtual tcl_event_ptr create_tcl_event(const struct kevent& event) = 0;
 
         virtual ~tcl_event_factory()
@@ -0,0 +1,703 @@
+#include "tree_diff.h"
+#include "tcl_util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    enum class change_type
+    {
+        added,
+        deleted,
+        modified
+    };
+
+    /**
+     * @brief A directory to walk.  Directories that are in both trees are
+     * compared, the contents of directories in only one tree are all added
+     * or deleted.
+     */
+    struct diff_job
+    {
+        enum kind_t
+        {
+            compare,
+            added,
+            deleted
+        };
+
+        kind_t kind;
+        std::string path;
+    };
+
+    /**
+     * @brief The jobs of one worker.  The owner works from the back and
+     * idle workers steal from the front which holds the directories closest
+     * to the root and likely the most work.
+     */
+    struct job_queue
+    {
+        std::mutex mutex;
+        std::deque<diff_job> jobs;
+    };
+
+    struct dir_closer
+    {
+        void operator()(DIR* dir) const
+        {
+            closedir(dir);
+        }
+    };
+
+    using dir_ptr = std::unique_ptr<DIR, dir_closer>;
+
+    bool same_time(const struct timespec& a, const struct timespec& b)
+    {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+
+    /**
+     * @brief Compares the trees below two roots with a pool of threads.
+     * Paths are reported relative to the new root.  Directories on another
+     * device than their root, like the mountpoints of child datasets, are
+     * reported but not walked like FTS_XDEV does for vessel::fs::hardlinks.
+     */
+    class tree_diff
+    {
+        int m_old_root;
+        int m_new_root;
+        dev_t m_old_dev;
+        dev_t m_new_dev;
+        std::vector<std::unique_ptr<job_queue>> m_queues;
+        std::vector<std::vector<std::pair<change_type, std::string>>> m_changes;
+        std::atomic<std::size_t> m_pending;
+        std::atomic<std::size_t> m_queued;
+        std::atomic<bool> m_failed;
+        std::mutex m_idle_mutex;
+        std::condition_variable m_work_changed;
+        std::mutex m_error_mutex;
+        int m_errno;
+        std::string m_error_path;
+
+    public:
+        tree_diff(int old_root, dev_t old_dev, int new_root, dev_t new_dev, unsigned threads)
+            : m_old_root(old_root),
+              m_new_root(new_root),
+              m_old_dev(old_dev),
+              m_new_dev(new_dev),
+              m_queues(),
+              m_changes(threads),
+              m_pending(0),
+              m_queued(0),
+              m_failed(false),
+              m_idle_mutex(),
+              m_work_changed(),
+              m_error_mutex(),
+              m_errno(0),
+              m_error_path()
+        {
+            for(unsigned i = 0; i < threads; ++i)
+            {
+                m_queues.emplace_back(new job_queue());
+            }
+        }
+
+        void run()
+        {
+            push(0, {diff_job::compare, std::string()});
+
+            std::vector<std::thread> threads;
+            for(std::size_t i = 1; i < m_queues.size(); ++i)
+            {
+                threads.emplace_back(&tree_diff::work, this, i);
+            }
+            work(0);
+
+            for(std::thread& thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        bool failed(int& error, std::string& path) const
+        {
+            error = m_errno;
+            path = m_error_path;
+            return m_failed;
+        }
+
+        /**
+         * @brief The sorted paths of each change type
+         */
+        std::vector<std::string> changes(change_type type) const
+        {
+            std::vector<std::string> paths;
+            for(const auto& worker_changes : m_changes)
+            {
+                for(const auto& change : worker_changes)
+                {
+                    if(change.first == type)
+                    {
+                        paths.push_back(change.second);
+                    }
+                }
+            }
+            std::sort(paths.begin(), paths.end());
+            return paths;
+        }
+
+    private:
+        static std::string join(const std::string& dir, const char* name)
+        {
+            return dir.empty() ? std::string(name) : dir + "/" + name;
+        }
+
+        void fail(const std::string& path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_error_mutex);
+                if(!m_failed)
+                {
+                    m_errno = errno;
+                    m_error_path = path;
+                    m_failed = true;
+                }
+            }
+            notify_idle(true);
+        }
+
+        /**
+         * @brief Wakes idle workers.  The idle mutex is taken so a worker
+         * that is about to wait sees the change instead of missing it.
+         */
+        void notify_idle(bool all)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_idle_mutex);
+            }
+
+            if(all)
+            {
+                m_work_changed.notify_all();
+            }
+            else
+            {
+                m_work_changed.notify_one();
+            }
+        }
+
+        void push(std::size_t worker, diff_job&& job)
+        {
+            ++m_pending;
+            {
+                job_queue& queue = *m_queues[worker];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.jobs.push_back(std::move(job));
+            }
+            ++m_queued;
+            if(m_queues.size() > 1)
+            {
+                notify_idle(false);
+            }
+        }
+
+        bool pop(std::size_t worker, diff_job& job)
+        {
+            job_queue& queue = *m_queues[worker];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.jobs.empty())
+            {
+                return false;
+            }
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+            --m_queued;
+            return true;
+        }
+
+        bool steal(std::size_t worker, diff_job& job)
+        {
+            for(std::size_t i = 1; i < m_queues.size(); ++i)
+            {
+                job_queue& queue = *m_queues[(worker + i) % m_queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if(!queue.jobs.empty())
+                {
+                    job = std::move(queue.jobs.front());
+                    queue.jobs.pop_front();
+                    --m_queued;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief Runs jobs until every directory is walked.  A worker with
+         * nothing to do waits for another one to queue a directory instead
+         * of spinning.
+         */
+        void work(std::size_t worker)
+        {
+            diff_job job;
+            while(!m_failed)
+            {
+                if(pop(worker, job) || steal(worker, job))
+                {
+                    process(worker, job);
+                    if(--m_pending == 0)
+                    {
+                        notify_idle(true);
+                    }
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(m_idle_mutex);
+                m_work_changed.wait(lock, [this] {
+                    return m_queued > 0 || m_pending == 0 || m_failed;
+                });
+                if(m_pending == 0)
+                {
+                    return;
+                }
+            }
+        }
+
+        bool same_device(bool is_new, const struct stat& sb) const
+        {
+            return sb.st_dev == (is_new ? m_new_dev : m_old_dev);
+        }
+
+        dir_ptr open_dir(int root, const std::string& path)
+        {
+            int fd = openat(root, path.empty() ? "." : path.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if(fd == -1)
+            {
+                fail(path);
+                return dir_ptr();
+            }
+
+            DIR* dir = fdopendir(fd);
+            if(dir == nullptr)
+            {
+                fail(path);
+                close(fd);
+            }
+            return dir_ptr(dir);
+        }
+
+        /**
+         * @brief The sorted names in the directory.  The .zfs directory of
+         * the new root is where the old tree comes from when it is visible.
+         */
+        bool list_dir(DIR* dir, const std::string& path, bool is_new, std::vector<std::string>& names)
+        {
+            errno = 0;
+            struct dirent* entry = nullptr;
+            while((entry = readdir(dir)) != nullptr)
+            {
+                if(std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0 ||
+                   (is_new && path.empty() && std::strcmp(entry->d_name, ".zfs") == 0))
+                {
+                    continue;
+                }
+                names.emplace_back(entry->d_name);
+            }
+
+            if(errno != 0)
+            {
+                fail(path);
+                return false;
+            }
+            std::sort(names.begin(), names.end());
+            return true;
+        }
+
+        bool stat_entry(DIR* dir, const std::string& path, const char* name, struct stat& sb)
+        {
+            if(fstatat(dirfd(dir), name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                fail(join(path, name));
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Byte compares two regular files.  Only used when the
+         * metadata can't tell if a file changed.
+         */
+        bool same_contents(DIR* old_dir, DIR* new_dir, const std::string& path, const char* name)
+        {
+            fd_guard old_fd(openat(dirfd(old_dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            fd_guard new_fd(openat(dirfd(new_dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            if(old_fd.fd == -1 || new_fd.fd == -1)
+            {
+                fail(join(path, name));
+                return false;
+            }
+
+            std::vector<char> old_buffer(64 * 1024);
+            std::vector<char> new_buffer(old_buffer.size());
+            for(;;)
+            {
+                ssize_t old_bytes = read(old_fd.fd, old_buffer.data(), old_buffer.size());
+                ssize_t new_bytes = read(new_fd.fd, new_buffer.data(), new_buffer.size());
+                if(old_bytes == -1 || new_bytes == -1)
+                {
+                    fail(join(path, name));
+                    return false;
+                }
+
+                if(old_bytes != new_bytes ||
+                   std::memcmp(old_buffer.data(), new_buffer.data(), old_bytes) != 0)
+                {
+                    return false;
+                }
+
+                if(old_bytes == 0)
+                {
+                    return true;
+                }
+            }
+        }
+
+        bool same_link(DIR* old_dir, DIR* new_dir, const std::string& path, const char* name)
+        {
+            char old_target[PATH_MAX];
+            char new_target[PATH_MAX];
+            ssize_t old_length = readlinkat(dirfd(old_dir), name, old_target, sizeof(old_target));
+            ssize_t new_length = readlinkat(dirfd(new_dir), name, new_target, sizeof(new_target));
+            if(old_length == -1 || new_length == -1)
+            {
+                fail(join(path, name));
+                return false;
+            }
+            return old_length == new_length && std::memcmp(old_target, new_target, old_length) == 0;
+        }
+
+        /**
+         * @brief A file with the same inode is unchanged when its ctime is
+         * too, which is always the case for unchanged files in a zfs
+         * snapshot.  Any other ctime change, including one to only the
+         * xattrs, flags or ACL, is a modification like in zfs diff.  A file
+         * that was replaced by another inode is compared by its contents or
+         * link target, so only its xattrs and ACL can differ unnoticed.
+         */
+        bool modified(DIR* old_dir, DIR* new_dir, const std::string& path, const char* name,
+                      const struct stat& old_sb, const struct stat& new_sb)
+        {
+            if(old_sb.st_mode != new_sb.st_mode || old_sb.st_uid != new_sb.st_uid ||
+               old_sb.st_gid != new_sb.st_gid || old_sb.st_size != new_sb.st_size ||
+               old_sb.st_flags != new_sb.st_flags || !same_time(old_sb.st_mtim, new_sb.st_mtim))
+            {
+                return true;
+            }
+
+            if(old_sb.st_ino == new_sb.st_ino)
+            {
+                return !same_time(old_sb.st_ctim, new_sb.st_ctim);
+            }
+
+            if(S_ISREG(new_sb.st_mode))
+            {
+                return !same_contents(old_dir, new_dir, path, name);
+            }
+            if(S_ISLNK(new_sb.st_mode))
+            {
+                return !same_link(old_dir, new_dir, path, name);
+            }
+            return false;
+        }
+
+        void add_change(std::size_t worker, change_type type, const std::string& path)
+        {
+            m_changes[worker].emplace_back(type, path);
+        }
+
+        void process(std::size_t worker, const diff_job& job)
+        {
+            if(job.kind == diff_job::compare)
+            {
+                compare_dir(worker, job.path);
+            }
+            else
+            {
+                list_only(worker, job);
+            }
+        }
+
+        /**
+         * @brief Everything below a directory that is only in one tree
+         */
+        void list_only(std::size_t worker, const diff_job& job)
+        {
+            bool is_new = job.kind == diff_job::added;
+            change_type type = is_new ? change_type::added : change_type::deleted;
+            dir_ptr dir = open_dir(is_new ? m_new_root : m_old_root, job.path);
+            std::vector<std::string> names;
+            if(!dir || !list_dir(dir.get(), job.path, is_new, names))
+            {
+                return;
+            }
+
+            for(const std::string& name : names)
+            {
+                struct stat sb;
+                if(!stat_entry(dir.get(), job.path, name.c_str(), sb))
+                {
+                    return;
+                }
+
+                std::string path = join(job.path, name.c_str());
+                add_change(worker, type, path);
+                if(S_ISDIR(sb.st_mode) && same_device(is_new, sb))
+                {
+                    push(worker, {job.kind, path});
+                }
+            }
+        }
+
+        void compare_dir(std::size_t worker, const std::string& dir_path)
+        {
+            dir_ptr old_dir = open_dir(m_old_root, dir_path);
+            dir_ptr new_dir = open_dir(m_new_root, dir_path);
+            std::vector<std::string> old_names;
+            std::vector<std::string> new_names;
+            if(!old_dir || !new_dir ||
+               !list_dir(old_dir.get(), dir_path, false, old_names) ||
+               !list_dir(new_dir.get(), dir_path, true, new_names))
+            {
+                return;
+            }
+
+            auto old_name = old_names.begin();
+            auto new_name = new_names.begin();
+            while(old_name != old_names.end() || new_name != new_names.end())
+            {
+                int order = 0;
+                if(old_name == old_names.end())
+                {
+                    order = 1;
+                }
+                else if(new_name == new_names.end())
+                {
+                    order = -1;
+                }
+                else
+                {
+                    order = old_name->compare(*new_name);
+                }
+
+                struct stat old_sb;
+                struct stat new_sb;
+                if(order < 0)
+                {
+                    if(!stat_entry(old_dir.get(), dir_path, old_name->c_str(), old_sb))
+                    {
+                        return;
+                    }
+
+                    std::string path = join(dir_path, old_name->c_str());
+                    add_change(worker, change_type::deleted, path);
+                    if(S_ISDIR(old_sb.st_mode) && same_device(false, old_sb))
+                    {
+                        push(worker, {diff_job::deleted, path});
+                    }
+                    ++old_name;
+                }
+                else if(order > 0)
+                {
+                    if(!stat_entry(new_dir.get(), dir_path, new_name->c_str(), new_sb))
+                    {
+                        return;
+                    }
+
+                    std::string path = join(dir_path, new_name->c_str());
+                    add_change(worker, change_type::added, path);
+                    if(S_ISDIR(new_sb.st_mode) && same_device(true, new_sb))
+                    {
+                        push(worker, {diff_job::added, path});
+                    }
+                    ++new_name;
+                }
+                else
+                {
+                    const char* name = new_name->c_str();
+                    if(!stat_entry(old_dir.get(), dir_path, name, old_sb) ||
+                       !stat_entry(new_dir.get(), dir_path, name, new_sb))
+                    {
+                        return;
+                    }
+
+                    std::string path = join(dir_path, name);
+                    if(modified(old_dir.get(), new_dir.get(), dir_path, name, old_sb, new_sb))
+                    {
+                        add_change(worker, change_type::modified, path);
+                    }
+
+                    bool old_is_dir = S_ISDIR(old_sb.st_mode);
+                    bool new_is_dir = S_ISDIR(new_sb.st_mode);
+                    if((old_is_dir && !same_device(false, old_sb)) || (new_is_dir && !same_device(true, new_sb)))
+                    {
+                        /*Neither side of a mountpoint is walked*/
+                        old_is_dir = false;
+                        new_is_dir = false;
+                    }
+
+                    if(old_is_dir && new_is_dir)
+                    {
+                        push(worker, {diff_job::compare, path});
+                    }
+                    else if(old_is_dir)
+                    {
+                        push(worker, {diff_job::deleted, path});
+                    }
+                    else if(new_is_dir)
+                    {
+                        push(worker, {diff_job::added, path});
+                    }
+                    ++old_name;
+                    ++new_name;
+                }
+            }
+        }
+    };
+
+    int open_root(Tcl_Interp* interp, Tcl_Obj* path, int& fd, dev_t& dev)
+    {
+        struct stat sb;
+        fd = open(Tcl_GetString(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd == -1 || fstat(fd, &sb) != 0)
+        {
+            if(fd != -1)
+            {
+                int saved_errno = errno;
+                close(fd);
+                errno = saved_errno;
+            }
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("open %s: %s", Tcl_GetString(path),
+                                                   Tcl_ErrnoMsg(errno)));
+            Tcl_SetErrorCode(interp, "VESSEL", "DIFF", Tcl_ErrnoId(), nullptr);
+            return TCL_ERROR;
+        }
+        dev = sb.st_dev;
+        return TCL_OK;
+    }
+
+    /**
+     * @brief vessel::fs::diff ?-threads count? old_root new_root
+     *
+     * Compares the tree below new_root with the tree below old_root, usually
+     * <mountpoint>/.zfs/snapshot/<name> and the mountpoint.  Returns a dict
+     * like vessel::zfs::diff with the added (+), deleted (-) and modified (M)
+     * paths below new_root.  Every path of a file with several links is
+     * reported unlike zfs diff.
+     */
+    int diff_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        int arg = 1;
+        if(objc == 5 && std::strcmp(Tcl_GetString(objv[1]), "-threads") == 0)
+        {
+            int count = 0;
+            int tcl_error = Tcl_GetIntFromObj(interp, objv[2], &count);
+            if(tcl_error) return tcl_error;
+            if(count < 1)
+            {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("-threads must be at least 1", -1));
+                return TCL_ERROR;
+            }
+            threads = count;
+            arg = 3;
+        }
+        else if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "?-threads count? old_root new_root");
+            return TCL_ERROR;
+        }
+
+        int old_fd = -1;
+        dev_t old_dev = 0;
+        int tcl_error = open_root(interp, objv[arg], old_fd, old_dev);
+        if(tcl_error) return tcl_error;
+        fd_guard old_root(old_fd);
+
+        int new_fd = -1;
+        dev_t new_dev = 0;
+        tcl_error = open_root(interp, objv[arg + 1], new_fd, new_dev);
+        if(tcl_error) return tcl_error;
+        fd_guard new_root(new_fd);
+
+        tree_diff diff(old_root.fd, old_dev, new_root.fd, new_dev, threads);
+        diff.run();
+
+        int error = 0;
+        std::string error_path;
+        if(diff.failed(error, error_path))
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", error_path.c_str(), Tcl_ErrnoMsg(error)));
+            Tcl_SetErrorCode(interp, "VESSEL", "DIFF", Tcl_ErrnoId(), nullptr);
+            return TCL_ERROR;
+        }
+
+        std::string prefix(Tcl_GetString(objv[arg + 1]));
+        while(prefix.size() > 1 && prefix.back() == '/')
+        {
+            prefix.pop_back();
+        }
+
+        Tcl_Obj* result = Tcl_NewDictObj();
+        const std::pair<change_type, const char*> keys[] = {
+            {change_type::added, "+"},
+            {change_type::deleted, "-"},
+            {change_type::modified, "M"}
+        };
+        for(const auto& key : keys)
+        {
+            std::vector<std::string> paths = diff.changes(key.first);
+            if(paths.empty())
+            {
+                continue;
+            }
+
+            Tcl_Obj* list = Tcl_NewListObj(0, nullptr);
+            for(const std::string& path : paths)
+            {
+                std::string full_path = prefix + "/" + path;
+                Tcl_ListObjAppendElement(nullptr, list,
+                                         Tcl_NewStringObj(full_path.c_str(), full_path.size()));
+            }
+            Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj(key.second, -1), list);
+        }
+
+        Tcl_SetObjResult(interp, result);
+        return TCL_OK;
+    }
+}
+
+int Vessel_TreeDiffInit(Tcl_Interp* interp)
+{
+    (void)Tcl_CreateObjCommand(interp, "vessel::fs::diff", diff_cmd, nullptr, nullptr);
+    return TCL_OK;
+}
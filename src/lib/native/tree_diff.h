@@ -0,0 +1,8 @@
+#ifndef TREE_DIFF_H
+#define TREE_DIFF_H
+
+#include <tcl.h>
+
+int Vessel_TreeDiffInit(Tcl_Interp* interp);
+
+#endif // TREE_DIFF_H
@@ -42,6 +42,12 @@ FILE *dbg;
 
 #define MAXBUFFERSIZE 4096
 
+/* Datagrams handled per recvmmsg/sendmmsg call and the size of each
+ * receive buffer in the pool.  The pool is big enough for any ipv4
+ * datagram so batched receives are never truncated. */
+#define UDP_BATCH_SLOTS 16
+#define UDP_BATCH_SLOT_SIZE 65536
+
 static char errBuf[256];
 
 /*
@@ -84,6 +90,10 @@ static int udpSetMcastloopOption(UdpState* statePtr, Tcl_Interp *interp, CONST84
 static int udpGetMcastloopOption(UdpState *statePtr, Tcl_Interp *interp, unsigned char * value);
 static int udpSetTtlOption(UdpState* statePtr, Tcl_Interp *interp, CONST84 char *newValue);
 static int udpGetTtlOption(UdpState *statePtr, Tcl_Interp *interp,unsigned int *value);
+static int udpCmd(ClientData clientData, Tcl_Interp *interp,
+                  int objc, Tcl_Obj *CONST objv[]);
+static int UdpResolvePeer(Tcl_Interp *interp, UdpState *statePtr, Tcl_Obj *hostObj,
+                          uint16_t port, struct sockaddr_storage *addr, socklen_t *addrLen);
 
 /*
  * This structure describes the channel type for accessing UDP.
@@ -146,6 +156,8 @@ Udp_Init(Tcl_Interp *interp)
                       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
     Tcl_CreateCommand(interp, "vessel::udp_peek", udpPeek ,
                       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vessel::udp", udpCmd ,
+                      (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
 
     return r;
 }
@@ -529,6 +541,9 @@ udpClose(ClientData instanceData, Tcl_Interp *interp)
     if (closesocket(sock) < 0) {
         errorCode = errno;
     }
+    if (statePtr->batchBuf) {
+        ckfree(statePtr->batchBuf);
+    }
     ckfree((char *) statePtr);
     if (errorCode != 0) {
         sprintf(errBuf, "udp_close: %d, error: %d\n", sock, errorCode);
@@ -591,58 +606,24 @@ udpOutput(ClientData instanceData, CONST84 char *buf, int toWrite, int *errorCod
 {
 	UdpState *statePtr = (UdpState *) instanceData;
     int written;
-    int socksize;
-    struct hostent *name;
-    struct sockaddr_in sendaddrv4;
-    struct sockaddr_in6 sendaddrv6;
-	struct addrinfo hints, *result;
 
     if (toWrite > MAXBUFFERSIZE) {
         UDPTRACE("UDP error - MAXBUFFERSIZE");
         return -1;
     }
- 
- 	if (statePtr->ss_family == AF_INET6) {
-		socksize = sizeof(sendaddrv6);
-		memset(&sendaddrv6, 0, socksize);
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_INET6;
-		hints.ai_socktype = SOCK_DGRAM;
-		hints.ai_protocol = IPPROTO_UDP;
-
-		if (getaddrinfo(statePtr->remotehost, NULL, &hints, &result) != 0) {
-				UDPTRACE("UDP error - getaddrinfo failed");
-				return -1;
-		}
-		memcpy (&sendaddrv6, result->ai_addr, result->ai_addrlen);
-		freeaddrinfo(result);
-
-		sendaddrv6.sin6_family = AF_INET6;
-		sendaddrv6.sin6_port = statePtr->remoteport;
-
-		written = sendto(statePtr->sock, buf, toWrite, 0, (struct sockaddr *)&sendaddrv6, socksize);
-	} else {
-		socksize = sizeof(sendaddrv4);
-		memset(&sendaddrv4, 0, socksize);
-        sendaddrv4.sin_addr.s_addr = inet_addr(statePtr->remotehost);
-
-        if (sendaddrv4.sin_addr.s_addr == -1) {
-            name = gethostbyname(statePtr->remotehost);
-			if (name == NULL) {
-				UDPTRACE("UDP error - gethostbyname");
-				return -1;
-			}
-			memcpy(&sendaddrv4.sin_addr, name->h_addr, sizeof(sendaddrv4.sin_addr));
-		}
-
-		sendaddrv4.sin_family = AF_INET;
-		sendaddrv4.sin_port = statePtr->remoteport;
 
-		written = sendto(statePtr->sock, buf, toWrite, 0, (struct sockaddr *)&sendaddrv4, socksize);
-	}
+    /* The destination is resolved once when -remote is configured */
+    if (statePtr->remoteaddrlen == 0) {
+        UDPTRACE("UDP error - no remote address");
+        *errorCode = EDESTADDRREQ;
+        return -1;
+    }
 
+    written = sendto(statePtr->sock, buf, toWrite, 0,
+                     (struct sockaddr *)&statePtr->remoteaddr, statePtr->remoteaddrlen);
 	if (written < 0) {
 		UDPTRACE("UDP error - sendto");
+		*errorCode = errno;
 		return -1;
 	}
 
@@ -1280,6 +1261,7 @@ udpSetRemoteOption(UdpState *statePtr, Tcl_Interp *interp,CONST84 char *newValue
 	int len;
 	
 	valPtr = Tcl_NewStringObj(newValue, -1);
+	Tcl_IncrRefCount(valPtr);
 	result = Tcl_ListObjLength(interp, valPtr, &len);
 	if (result == TCL_OK) {
 		if (len < 1 || len > 2) {
@@ -1289,15 +1271,25 @@ udpSetRemoteOption(UdpState *statePtr, Tcl_Interp *interp,CONST84 char *newValue
 			Tcl_Obj *hostPtr, *portPtr;
 			
 			Tcl_ListObjIndex(interp, valPtr, 0, &hostPtr);
-			strcpy(statePtr->remotehost, Tcl_GetString(hostPtr));
+			strlcpy(statePtr->remotehost, Tcl_GetString(hostPtr),
+					sizeof(statePtr->remotehost));
 			
 			if (len == 2) {
 				Tcl_ListObjIndex(interp, valPtr, 1, &portPtr);            
 				result = udpGetService(interp, Tcl_GetString(portPtr),
 					&(statePtr->remoteport));
 			}
+
+			/* Resolve now instead of on every write */
+			if (result == TCL_OK) {
+				result = UdpResolvePeer(interp, statePtr, hostPtr,
+										ntohs(statePtr->remoteport),
+										&statePtr->remoteaddr,
+										&statePtr->remoteaddrlen);
+			}
 		}
 	}
+	Tcl_DecrRefCount(valPtr);
 
 	if (result==TCL_ERROR) {
 		Tcl_SetObjResult(interp, Tcl_NewStringObj("error setting -remote",-1));
@@ -1461,6 +1453,485 @@ UdpSockGetPort(interp, string, proto, portPtr)
     return TCL_OK;
 }
 
+/*
+ * ----------------------------------------------------------------------
+ * The peer host returned by vessel::udp recv keeps the sockaddr it was
+ * received from as its internal rep.  Replying to the peer with
+ * vessel::udp send then skips address parsing and resolution entirely.
+ * The string rep is always present so no update proc is needed.
+ * ----------------------------------------------------------------------
+ */
+static void UdpPeerFreeIntRep(Tcl_Obj *objPtr);
+static void UdpPeerDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+
+static const Tcl_ObjType udpPeerType = {
+    "vessel::udppeer",
+    UdpPeerFreeIntRep,
+    UdpPeerDupIntRep,
+    NULL,
+    NULL
+};
+
+static void
+UdpPeerFreeIntRep(Tcl_Obj *objPtr)
+{
+    ckfree((char *) objPtr->internalRep.twoPtrValue.ptr1);
+    objPtr->internalRep.twoPtrValue.ptr1 = NULL;
+    objPtr->typePtr = NULL;
+}
+
+static void
+UdpPeerDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+    struct sockaddr_storage *addr =
+        (struct sockaddr_storage *) ckalloc(sizeof(struct sockaddr_storage));
+    memcpy(addr, srcPtr->internalRep.twoPtrValue.ptr1, sizeof(struct sockaddr_storage));
+    dupPtr->internalRep.twoPtrValue.ptr1 = addr;
+    dupPtr->typePtr = &udpPeerType;
+}
+
+static Tcl_Obj *
+UdpNewPeerObj(const char *host, struct sockaddr_storage *recvaddr)
+{
+    Tcl_Obj *objPtr = Tcl_NewStringObj(host, -1);
+    struct sockaddr_storage *addr =
+        (struct sockaddr_storage *) ckalloc(sizeof(struct sockaddr_storage));
+    memcpy(addr, recvaddr, sizeof(struct sockaddr_storage));
+    objPtr->internalRep.twoPtrValue.ptr1 = addr;
+    objPtr->typePtr = &udpPeerType;
+    return objPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * UdpGetState --
+ *
+ *  Get the UdpState of a channel created by udp_open.
+ * ----------------------------------------------------------------------
+ */
+static int
+UdpGetState(Tcl_Interp *interp, Tcl_Obj *chanObj, UdpState **statePtrPtr)
+{
+    Tcl_Channel chan = Tcl_GetChannel(interp, Tcl_GetString(chanObj), NULL);
+    if (chan == (Tcl_Channel) NULL) {
+        return TCL_ERROR;
+    }
+
+    /* Transforms may be stacked on the udp channel */
+    chan = Tcl_GetTopChannel(chan);
+    while (chan != NULL && Tcl_GetChannelType(chan) != &Udp_ChannelType) {
+        chan = Tcl_GetStackedChannel(chan);
+    }
+
+    if (chan == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s is not a udp channel",
+                                               Tcl_GetString(chanObj)));
+        return TCL_ERROR;
+    }
+
+    *statePtrPtr = (UdpState *) Tcl_GetChannelInstanceData(chan);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * UdpDatagramObj --
+ *
+ *  Create the {payload peerhost peerport} list for a received datagram.
+ *  The peer is also saved so fconfigure -peer stays accurate.
+ * ----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+UdpDatagramObj(UdpState *statePtr, const char *buf, int len,
+               struct sockaddr_storage *recvaddr)
+{
+    Tcl_Obj *elements[3];
+
+    if (recvaddr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*)recvaddr)->sin6_addr, statePtr->peerhost, sizeof(statePtr->peerhost) );
+        statePtr->peerport = ntohs(((struct sockaddr_in6*)recvaddr)->sin6_port);
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in*)recvaddr)->sin_addr, statePtr->peerhost, sizeof(statePtr->peerhost) );
+        statePtr->peerport = ntohs(((struct sockaddr_in*)recvaddr)->sin_port);
+    }
+
+    elements[0] = Tcl_NewByteArrayObj((const unsigned char *) buf, len);
+    elements[1] = UdpNewPeerObj(statePtr->peerhost, recvaddr);
+    elements[2] = Tcl_NewIntObj(statePtr->peerport);
+    return Tcl_NewListObj(3, elements);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * UdpResolvePeer --
+ *
+ *  Fill in the destination address for host and port.  Peer objects
+ *  from vessel::udp recv and numeric addresses don't touch the resolver.
+ * ----------------------------------------------------------------------
+ */
+static int
+UdpResolvePeer(Tcl_Interp *interp, UdpState *statePtr, Tcl_Obj *hostObj,
+               uint16_t port, struct sockaddr_storage *addr, socklen_t *addrLen)
+{
+    struct addrinfo hints, *result;
+    const char *host;
+
+    if (hostObj->typePtr == &udpPeerType) {
+        memcpy(addr, hostObj->internalRep.twoPtrValue.ptr1, sizeof(*addr));
+        if (addr->ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+            *addrLen = sizeof(struct sockaddr_in6);
+        } else {
+            ((struct sockaddr_in *) addr)->sin_port = htons(port);
+            *addrLen = sizeof(struct sockaddr_in);
+        }
+        return TCL_OK;
+    }
+
+    host = Tcl_GetString(hostObj);
+    memset(addr, 0, sizeof(*addr));
+    if (statePtr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        *addrLen = sizeof(struct sockaddr_in6);
+        if (inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1) {
+            return TCL_OK;
+        }
+    } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *) addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        *addrLen = sizeof(struct sockaddr_in);
+        if (inet_pton(AF_INET, host, &addr4->sin_addr) == 1) {
+            return TCL_OK;
+        }
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = statePtr->ss_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't resolve udp peer: %s", host));
+        return TCL_ERROR;
+    }
+
+    if (statePtr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *) addr)->sin6_addr =
+            ((struct sockaddr_in6 *) result->ai_addr)->sin6_addr;
+    } else {
+        ((struct sockaddr_in *) addr)->sin_addr =
+            ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+    }
+    freeaddrinfo(result);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * udpRecv --
+ *
+ *  vessel::udp recv ?-max count? channel
+ *
+ *  Returns a list with a {payload peerhost peerport} element for every
+ *  datagram queued on the socket (up to count).  The list is empty if
+ *  nothing is queued.  Datagrams are read UDP_BATCH_SLOTS at a time with
+ *  recvmmsg into a buffer pool that lives as long as the channel.  This
+ *  bypasses the channel buffers so it shouldn't be mixed with read/gets
+ *  on the same channel.
+ * ----------------------------------------------------------------------
+ */
+static int
+udpRecv(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    UdpState *statePtr;
+    Tcl_Obj *resultObj;
+    struct mmsghdr msgs[UDP_BATCH_SLOTS];
+    struct iovec iovecs[UDP_BATCH_SLOTS];
+    struct sockaddr_storage addrs[UDP_BATCH_SLOTS];
+    int maxCount = 64;
+    int count = 0;
+    int wanted;
+    int received;
+    int i;
+
+    if (objc == 5 && strcmp(Tcl_GetString(objv[2]), "-max") == 0) {
+        if (Tcl_GetIntFromObj(interp, objv[3], &maxCount) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        objc -= 2;
+        objv += 2;
+    }
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-max count? channel");
+        return TCL_ERROR;
+    }
+
+    if (UdpGetState(interp, objv[2], &statePtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (statePtr->batchBuf == NULL) {
+        statePtr->batchBuf = ckalloc(UDP_BATCH_SLOTS * UDP_BATCH_SLOT_SIZE);
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    while (count < maxCount) {
+        wanted = maxCount - count;
+        if (wanted > UDP_BATCH_SLOTS) {
+            wanted = UDP_BATCH_SLOTS;
+        }
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * wanted);
+        for (i = 0; i < wanted; i++) {
+            iovecs[i].iov_base = statePtr->batchBuf + (i * UDP_BATCH_SLOT_SIZE);
+            iovecs[i].iov_len = UDP_BATCH_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        received = recvmmsg(statePtr->sock, msgs, wanted, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+
+            /* Errors like ECONNREFUSED are reported for an earlier send.
+             * Report them only if nothing was received. */
+            if (count == 0) {
+                Tcl_DecrRefCount(resultObj);
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("udp recv failed: %s",
+                                                       Tcl_ErrnoMsg(errno)));
+                Tcl_SetErrorCode(interp, "POSIX", Tcl_ErrnoId(), NULL);
+                return TCL_ERROR;
+            }
+            break;
+        }
+
+        for (i = 0; i < received; i++) {
+            Tcl_ListObjAppendElement(interp, resultObj,
+                                     UdpDatagramObj(statePtr, iovecs[i].iov_base,
+                                                    msgs[i].msg_len, &addrs[i]));
+        }
+        count += received;
+
+        /* The socket is drained */
+        if (received < wanted) {
+            break;
+        }
+    }
+
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * udpSend --
+ *
+ *  vessel::udp send channel payload host port
+ *
+ *  Sends one datagram to host and port without changing -remote.  When
+ *  host is a peer returned by vessel::udp recv its address is reused.
+ * ----------------------------------------------------------------------
+ */
+static int
+udpSend(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    UdpState *statePtr;
+    unsigned char *payload;
+    int payloadLen;
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+
+    if (objc != 6) {
+        Tcl_WrongNumArgs(interp, 2, objv, "channel payload host port");
+        return TCL_ERROR;
+    }
+
+    if (UdpGetState(interp, objv[2], &statePtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    payload = Tcl_GetByteArrayFromObj(objv[3], &payloadLen);
+    if (payloadLen > MAXBUFFERSIZE) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("udp payload is larger than %d bytes",
+                                               MAXBUFFERSIZE));
+        return TCL_ERROR;
+    }
+
+    if (UdpSockGetPort(interp, Tcl_GetString(objv[5]), "udp", &port) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (UdpResolvePeer(interp, statePtr, objv[4], (uint16_t) port,
+                       &addr, &addrLen) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (sendto(statePtr->sock, payload, payloadLen, 0,
+               (struct sockaddr *)&addr, addrLen) < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("udp send failed: %s", Tcl_ErrnoMsg(errno)));
+        Tcl_SetErrorCode(interp, "POSIX", Tcl_ErrnoId(), NULL);
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * udpSendBatch --
+ *
+ *  vessel::udp sendbatch channel datagrams
+ *
+ *  datagrams is a list of {payload host port} elements (the format
+ *  returned by recv).  They are sent UDP_BATCH_SLOTS at a time with
+ *  sendmmsg straight from the payload objects.  Returns the number of
+ *  datagrams sent which is less than the number given if the socket
+ *  buffer fills up.
+ * ----------------------------------------------------------------------
+ */
+static int
+udpSendBatch(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    UdpState *statePtr;
+    struct mmsghdr msgs[UDP_BATCH_SLOTS];
+    struct iovec iovecs[UDP_BATCH_SLOTS];
+    struct sockaddr_storage addrs[UDP_BATCH_SLOTS];
+    Tcl_Obj **datagramObjs;
+    Tcl_Obj **fieldObjs;
+    int datagramCount;
+    int fieldCount;
+    int payloadLen;
+    int port;
+    int total = 0;
+    int batchCount;
+    int sent;
+    int i;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "channel datagrams");
+        return TCL_ERROR;
+    }
+
+    if (UdpGetState(interp, objv[2], &statePtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (Tcl_ListObjGetElements(interp, objv[3], &datagramCount, &datagramObjs) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    while (total < datagramCount) {
+        batchCount = datagramCount - total;
+        if (batchCount > UDP_BATCH_SLOTS) {
+            batchCount = UDP_BATCH_SLOTS;
+        }
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * batchCount);
+        for (i = 0; i < batchCount; i++) {
+            if (Tcl_ListObjGetElements(interp, datagramObjs[total + i],
+                                       &fieldCount, &fieldObjs) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            if (fieldCount != 3) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                                     "datagram must be a list of payload, host and port", -1));
+                return TCL_ERROR;
+            }
+
+            iovecs[i].iov_base = Tcl_GetByteArrayFromObj(fieldObjs[0], &payloadLen);
+            iovecs[i].iov_len = payloadLen;
+            if (payloadLen >= UDP_BATCH_SLOT_SIZE) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("udp payload is larger than %d bytes",
+                                                       UDP_BATCH_SLOT_SIZE - 1));
+                return TCL_ERROR;
+            }
+
+            if (UdpSockGetPort(interp, Tcl_GetString(fieldObjs[2]), "udp", &port) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            if (UdpResolvePeer(interp, statePtr, fieldObjs[1], (uint16_t) port,
+                               &addrs[i], &msgs[i].msg_hdr.msg_namelen) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        sent = sendmmsg(statePtr->sock, msgs, batchCount, 0);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                break;
+            }
+
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("udp send failed: %s", Tcl_ErrnoMsg(errno)));
+            Tcl_SetErrorCode(interp, "POSIX", Tcl_ErrnoId(), NULL);
+            return TCL_ERROR;
+        }
+
+        total += sent;
+        if (sent < batchCount) {
+            break;
+        }
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(total));
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * udpCmd --
+ *
+ *  vessel::udp recv|send|sendbatch ...
+ *
+ *  Message oriented access to a udp channel.  Each datagram is handled
+ *  as a unit with its peer instead of as part of a byte stream.
+ * ----------------------------------------------------------------------
+ */
+static int
+udpCmd(ClientData clientData, Tcl_Interp *interp,
+       int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *const subCommands[] = {
+        "recv", "send", "sendbatch", NULL
+    };
+    enum udpSubCommands {UDP_RECV, UDP_SEND, UDP_SENDBATCH};
+    int index;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], subCommands, "subcommand",
+                            0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch ((enum udpSubCommands) index) {
+    case UDP_RECV:
+        return udpRecv(interp, objc, objv);
+    case UDP_SEND:
+        return udpSend(interp, objc, objv);
+    case UDP_SENDBATCH:
+        return udpSendBatch(interp, objc, objv);
+    }
+
+    return TCL_ERROR;
+}
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -42,6 +42,8 @@ typedef struct UdpState {
   int               sock;
   char              remotehost[256]; /* send packets to */
   uint16_t          remoteport;
+  struct sockaddr_storage remoteaddr; /* remotehost/remoteport resolved when -remote is set */
+  socklen_t         remoteaddrlen;   /* 0 until -remote is set */
   char              peerhost[256];   /* receive packets from */
   uint16_t          peerport;
   uint16_t          localport;
@@ -49,6 +51,7 @@ typedef struct UdpState {
   short				ss_family;		 /* indicator set for ipv4 or ipv6 usage */
   int               multicast;       /* indicator set for multicast add */
   Tcl_Obj          *groupsObj;       /* list of the mcast groups */
+  char             *batchBuf;        /* recvmmsg buffer pool, allocated on first batch recv */
 } UdpState;
 
 
@@ -1,9 +1,12 @@
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cerrno>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -15,11 +18,19 @@
 #include <getopt.h>
 
 #include "../../dns/embdns.h"
+#include "console.h"
 #include "devctl.h"
+#include "dns_tcp.h"
+#include "dns_workers.h"
 #include "exec.h"
+#include "hardlinks.h"
+#include "layer_archive.h"
+#include "s3_client.h"
 #include "tcl_kqueue.h"
 #include "tcl_util.h"
+#include "tree_diff.h"
 #include "url_cmd.h"
+#include "whiteouts.h"
 
 namespace
 {
@@ -221,9 +232,10 @@ namespace
     std::string run_options_help()
     {
         std::ostringstream msg;
-        msg << "vessel run {--name=container_name} {--interactive} {--rm} {--volume=/path/to/hostdir:/path/to/mountdir} \n{--dataset=zfs/dataset:container_mountpoint} image{:tag} {command...}" << std::endl << std::endl
+        msg << "vessel run {--name=container_name} {--interactive} {--console} {--rm} {--volume=/path/to/hostdir:/path/to/mountdir} \n{--dataset=zfs/dataset:container_mountpoint} image{:tag} {command...}" << std::endl << std::endl
             << "--name        Name of the new container" << std::endl
             << "--interactive Start an interactive shell via pty" << std::endl
+            << "--console     Run on a pty that can be attached to later with 'vessel attach'" << std::endl
             << "--rm          Remove the image after it exits" << std::endl
             << "--dataset     Use the specified zfs dataset at the mountpoint.  Creates the dataset if needed." << std::endl
             << "--volume      Path to directory to nullfs mount into the container" << std::endl
@@ -244,6 +256,7 @@ namespace
             {"rm", no_argument, nullptr, 'r'},
             {"help", no_argument, nullptr, 'h'},
             {"interactive", no_argument, nullptr, 'i'},
+            {"console", no_argument, nullptr, 'o'},
             {"name", required_argument, nullptr, 'n'},
             {"dataset", required_argument, nullptr, 'd'},
             {"network", required_argument, nullptr, 'u'},
@@ -260,12 +273,13 @@ namespace
         vessel::tclobj_ptr args_dict(Tcl_NewDictObj(), vessel::unref_tclobj);
         int tcl_error = TCL_OK;
         bool interactive = false;
+        bool console = false;
         std::string network("inherit");
         vessel::tclobj_ptr dataset_list(Tcl_NewListObj(0, nullptr), vessel::unref_tclobj);
         vessel::tclobj_ptr volume_list(Tcl_NewListObj(0, nullptr), vessel::unref_tclobj);
         vessel::tclobj_ptr resource_list(Tcl_NewListObj(0, nullptr), vessel::unref_tclobj);
         std::string ini_file;
-        while((ch = getopt_long(argc, (char* const *)argv.data(), "d:iv:hn:u:f:c:", long_opts, nullptr)) != -1)
+        while((ch = getopt_long(argc, (char* const *)argv.data(), "d:iov:hn:u:f:c:", long_opts, nullptr)) != -1)
         {
             switch(ch)
             {
@@ -299,6 +313,9 @@ namespace
             case 'i':
                 interactive = true;
                 break;
+            case 'o':
+                console = true;
+                break;
             case 'n':
                 tcl_error = Tcl_DictObjPut(interp, args_dict.get(),
                                            Tcl_NewStringObj("name", -1),
@@ -353,6 +370,11 @@ namespace
                                    Tcl_NewBooleanObj(interactive));
         if(tcl_error) return tcl_error;
 
+        tcl_error = Tcl_DictObjPut(interp, args_dict.get(),
+                                   Tcl_NewStringObj("console", -1),
+                                   Tcl_NewBooleanObj(console));
+        if(tcl_error) return tcl_error;
+
         tcl_error = Tcl_DictObjPut(interp, args_dict.get(),
                                    Tcl_NewStringObj("network", -1),
                                    Tcl_NewStringObj(network.c_str(), network.size()));
@@ -589,6 +611,83 @@ namespace
         return TCL_OK;
     }
 
+    std::string attach_options_help()
+    {
+        std::ostringstream msg;
+        msg << "vessel attach container_name" << std::endl
+            << "Attach to the console of a container started with 'vessel run --console'." << std::endl
+            << "Detach with ctrl-]" << std::endl
+            << "--help    Print this help message" << std::endl;
+
+        return msg.str();
+    }
+
+    int parse_attach_options(Tcl_Interp* interp, int argc,
+                             Tcl_Obj** args, Tcl_Obj* options_dict)
+    {
+        assert(argc > 0);
+
+        static const struct option long_opts[] = {
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+        };
+
+        std::vector<const char*> argv = argv_vector_from_command_args(argc, args);
+
+        int ch = -1;
+        vessel::tclobj_ptr args_dict(Tcl_NewDictObj(), vessel::unref_tclobj);
+        int tcl_error = TCL_OK;
+        while((ch = getopt_long(argc, (char* const *)argv.data(), "h", long_opts, nullptr)) != -1)
+        {
+            switch(ch)
+            {
+            case 'h':
+            {
+                std::string help_msg = attach_options_help();
+                tcl_error = Tcl_DictObjPut(interp, args_dict.get(),
+                                           Tcl_NewStringObj("help", -1),
+                                           Tcl_NewStringObj(help_msg.c_str(), help_msg.size()));
+                if(tcl_error) return tcl_error;
+
+                /*Short circuit for help flag*/
+                tcl_error = Tcl_DictObjPut(interp, options_dict,
+                                           Tcl_NewStringObj("args", -1),
+                                           args_dict.release());
+                if(tcl_error) return tcl_error;
+
+                return TCL_OK;
+            }
+            case ':':
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Missing argument for optind: %d", optind));
+                return TCL_ERROR;
+            case '?':
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown argument for optind: %d", optind));
+                return TCL_ERROR;
+            default:
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown error for optind: %d", optind));
+                return TCL_ERROR;
+            }
+        }
+
+        if(optind == argc)
+        {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Missing container name in attach command", -1));
+            return TCL_ERROR;
+        }
+
+        tcl_error = Tcl_DictObjPut(interp, args_dict.get(),
+                       Tcl_NewStringObj("name", -1),
+                       Tcl_NewStringObj(argv[optind], -1));
+        if(tcl_error) return tcl_error;
+
+        tcl_error = Tcl_DictObjPut(interp, options_dict,
+                       Tcl_NewStringObj("args", -1),
+                       args_dict.release());
+        if(tcl_error) return tcl_error;
+
+        return TCL_OK;
+    }
+
     std::string export_options_help()
     {
         std::ostringstream msg;
@@ -845,6 +944,11 @@ namespace
             tcl_error = parse_export_options(interp, arg_count, argument_objs, command_options.get());
             if(tcl_error) return tcl_error;
         }
+        else if(command == "attach")
+        {
+            tcl_error = parse_attach_options(interp, arg_count, argument_objs, command_options.get());
+            if(tcl_error) return tcl_error;
+        }
         else if(command == "help" || command.empty())
         {
             /*'help' command doesn't take any options*/
@@ -864,25 +968,43 @@ namespace
         return TCL_OK;
     }
 
-    int Vessel_DNSParseQuery(void *clientData, Tcl_Interp *interp,
-                           int objc, struct Tcl_Obj *const *objv)
+    /*The dnsquery object type keeps the parsed query behind the Tcl_Obj so
+     * the query is parsed once per packet.  The string rep is the dict that
+     * parse_query used to return so scripts using dict commands on a query
+     * still work.  Once shimmered to a dict the query is parsed again from
+     * its raw_query key.*/
+    void DNSQueryFreeIntRep(Tcl_Obj* obj);
+    void DNSQueryDupIntRep(Tcl_Obj* src, Tcl_Obj* dup);
+    void DNSQueryUpdateString(Tcl_Obj* obj);
+
+    const Tcl_ObjType dns_query_type = {
+        "vessel::dnsquery",
+        DNSQueryFreeIntRep,
+        DNSQueryDupIntRep,
+        DNSQueryUpdateString,
+        nullptr
+    };
+
+    embdns::dns_query* get_query_intrep(Tcl_Obj* obj)
     {
-        /*vessel::dns::parse_query <binary obj>
-         * @returns array with the following keys:
-         *     qname, type, class
-         */
-
-        if(objc != 2)
-        {
-            Tcl_WrongNumArgs(interp, objc, objv, "binary_buffer");
-            return TCL_ERROR;
-        }
+        return reinterpret_cast<embdns::dns_query*>(obj->internalRep.twoPtrValue.ptr1);
+    }
 
-        int buf_len = 0;
-        unsigned char* query_buf = Tcl_GetByteArrayFromObj(objv[1], &buf_len);
+    void DNSQueryFreeIntRep(Tcl_Obj* obj)
+    {
+        delete get_query_intrep(obj);
+        obj->internalRep.twoPtrValue.ptr1 = nullptr;
+        obj->typePtr = nullptr;
+    }
 
-        embdns::dns_query query = embdns::parse_packet(query_buf, (size_t)buf_len);
+    void DNSQueryDupIntRep(Tcl_Obj* src, Tcl_Obj* dup)
+    {
+        dup->internalRep.twoPtrValue.ptr1 = new embdns::dns_query(*get_query_intrep(src));
+        dup->typePtr = &dns_query_type;
+    }
 
+    Tcl_Obj* dns_query_to_dict(Tcl_Interp* interp, const embdns::dns_query& query)
+    {
         Tcl_Obj* query_dict = Tcl_NewDictObj();
         Tcl_DictObjPut(interp, query_dict,
                        Tcl_NewStringObj("qname", -1),
@@ -896,11 +1018,163 @@ namespace
                        Tcl_NewStringObj("class", -1),
                        Tcl_NewIntObj(query.qclass) /*TODO: map int to string*/);
 
+        /*0 if the requestor did not use EDNS0*/
+        Tcl_DictObjPut(interp, query_dict,
+                       Tcl_NewStringObj("edns_size", -1),
+                       Tcl_NewIntObj(query.edns ? query.edns_udp_size : 0));
+
         Tcl_DictObjPut(interp, query_dict,
                        Tcl_NewStringObj("raw_query", -1),
                        Tcl_NewByteArrayObj(query.raw().data(), query.raw().size()));
 
-        Tcl_SetObjResult(interp, query_dict);
+        return query_dict;
+    }
+
+    void DNSQueryUpdateString(Tcl_Obj* obj)
+    {
+        vessel::tclobj_ptr query_dict(dns_query_to_dict(nullptr, *get_query_intrep(obj)), vessel::unref_tclobj);
+        Tcl_IncrRefCount(query_dict.get());
+
+        int length = 0;
+        const char* dict_string = Tcl_GetStringFromObj(query_dict.get(), &length);
+        obj->bytes = Tcl_Alloc(length + 1);
+        memcpy(obj->bytes, dict_string, length + 1);
+        obj->length = length;
+    }
+
+    /**
+     * @brief get_dns_query Get the parsed query from a dnsquery object.  The
+     * raw_query of a query that was shimmered to a dict or any other object
+     * is parsed as a raw query packet into tmp_query.
+     */
+    int get_dns_query(Tcl_Interp* interp, Tcl_Obj* obj,
+                      std::unique_ptr<embdns::dns_query>& tmp_query,
+                      const embdns::dns_query*& query)
+    {
+        if(obj->typePtr == &dns_query_type)
+        {
+            query = get_query_intrep(obj);
+            return TCL_OK;
+        }
+
+        static const Tcl_ObjType* byte_array_type = Tcl_GetObjType("bytearray");
+        if(obj->typePtr != byte_array_type)
+        {
+            vessel::tclobj_ptr raw_key(Tcl_NewStringObj("raw_query", -1), vessel::unref_tclobj);
+            Tcl_IncrRefCount(raw_key.get());
+
+            Tcl_Obj* raw_query = nullptr;
+            if(Tcl_DictObjGet(nullptr, obj, raw_key.get(), &raw_query) == TCL_OK && raw_query != nullptr)
+            {
+                obj = raw_query;
+            }
+        }
+
+        int buf_len = 0;
+        unsigned char* query_buf = Tcl_GetByteArrayFromObj(obj, &buf_len);
+        try
+        {
+            tmp_query = std::make_unique<embdns::dns_query>(embdns::parse_packet(query_buf, (size_t)buf_len));
+        }
+        catch(const std::invalid_argument& e)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid dns query: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "QUERY", "INVALID", nullptr);
+            return TCL_ERROR;
+        }
+
+        query = tmp_query.get();
+        return TCL_OK;
+    }
+
+    int Vessel_DNSParseQuery(void *clientData, Tcl_Interp *interp,
+                           int objc, struct Tcl_Obj *const *objv)
+    {
+        /*vessel::dns::parse_query <binary obj>
+         * @returns a dnsquery object.  Use query_get to read the fields
+         * without converting it to a dict.  The string rep is a dict with
+         * the following keys:
+         *     qname, type, class, edns_size, raw_query
+         */
+
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "binary_buffer");
+            return TCL_ERROR;
+        }
+
+        std::unique_ptr<embdns::dns_query> query;
+        const embdns::dns_query* parsed = nullptr;
+        int tcl_error = get_dns_query(interp, objv[1], query, parsed);
+        if(tcl_error) return tcl_error;
+
+        if(!query)
+        {
+            /*Already a dnsquery*/
+            Tcl_SetObjResult(interp, objv[1]);
+            return TCL_OK;
+        }
+
+        Tcl_Obj* query_obj = Tcl_NewObj();
+        Tcl_InvalidateStringRep(query_obj);
+        query_obj->internalRep.twoPtrValue.ptr1 = query.release();
+        query_obj->typePtr = &dns_query_type;
+
+        Tcl_SetObjResult(interp, query_obj);
+        return TCL_OK;
+    }
+
+    int Vessel_DNSQueryGet(void *clientData, Tcl_Interp *interp,
+                           int objc, struct Tcl_Obj *const *objv)
+    {
+        /*vessel::dns::query_get query key
+         *
+         * key is one of id, qname, type, class, edns_size or raw_query*/
+
+        static const char *const keys[] = {
+            "id", "qname", "type", "class", "edns_size", "raw_query", nullptr
+        };
+        enum query_keys {QUERY_ID, QUERY_QNAME, QUERY_TYPE, QUERY_CLASS, QUERY_EDNS_SIZE, QUERY_RAW};
+
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "query key");
+            return TCL_ERROR;
+        }
+
+        int key_index = 0;
+        int tcl_error = Tcl_GetIndexFromObj(interp, objv[2], keys, "key", TCL_EXACT, &key_index);
+        if(tcl_error) return tcl_error;
+
+        std::unique_ptr<embdns::dns_query> tmp_query;
+        const embdns::dns_query* query = nullptr;
+        tcl_error = get_dns_query(interp, objv[1], tmp_query, query);
+        if(tcl_error) return tcl_error;
+
+        Tcl_Obj* result = nullptr;
+        switch((query_keys)key_index)
+        {
+        case QUERY_ID:
+            result = Tcl_NewIntObj(query->header().id);
+            break;
+        case QUERY_QNAME:
+            result = Tcl_NewStringObj(query->qname.c_str(), query->qname.size());
+            break;
+        case QUERY_TYPE:
+            result = Tcl_NewIntObj(query->qtype);
+            break;
+        case QUERY_CLASS:
+            result = Tcl_NewIntObj(query->qclass);
+            break;
+        case QUERY_EDNS_SIZE:
+            result = Tcl_NewIntObj(query->edns ? query->edns_udp_size : 0);
+            break;
+        case QUERY_RAW:
+            result = Tcl_NewByteArrayObj(query->raw().data(), query->raw().size());
+            break;
+        }
+
+        Tcl_SetObjResult(interp, result);
         return TCL_OK;
     }
 
@@ -909,49 +1183,230 @@ namespace
                                  int objc, struct Tcl_Obj *const *objv)
     {
 
-        /*generate_A_response addr ttl raw_query*/
+        /*generate_A_response ?-tcp? addr_list ttl query
+         *
+         * query is a dnsquery from parse_query or a raw query packet.
+         *
+         * Without -tcp the response is limited to the udp size negotiated by
+         * the query (512 bytes without EDNS0) and the truncation bit is set if
+         * all of the addresses don't fit.*/
+        bool tcp = false;
+        if(objc == 5 && std::string("-tcp") == Tcl_GetString(objv[1]))
+        {
+            tcp = true;
+            objc--;
+            objv++;
+        }
+
         if(objc != 4)
         {
-            Tcl_WrongNumArgs(interp, objc, objv, "addr ttl raw_query");
+            Tcl_WrongNumArgs(interp, objc, objv, "?-tcp? addr_list ttl query");
             return TCL_ERROR;
         }
 
-        std::string addr(Tcl_GetString(objv[1]));
+        int addr_count = 0;
+        Tcl_Obj** addr_objs = nullptr;
+        int tcl_error = Tcl_ListObjGetElements(interp, objv[1], &addr_count, &addr_objs);
+        if(tcl_error) return tcl_error;
+
+        std::vector<std::string> addrs;
+        for(int i = 0; i < addr_count; ++i)
+        {
+            addrs.push_back(Tcl_GetString(addr_objs[i]));
+        }
+
         uint32_t ttl = 0;
-        int tcl_error = Tcl_GetIntFromObj(interp, objv[2], (int*)&ttl);
+        tcl_error = Tcl_GetIntFromObj(interp, objv[2], (int*)&ttl);
         if(tcl_error) return tcl_error;
 
-        int query_size = 0;
-        unsigned char* raw_query = Tcl_GetByteArrayFromObj(objv[3], &query_size);
+        std::unique_ptr<embdns::dns_query> tmp_query;
+        const embdns::dns_query* query = nullptr;
+        tcl_error = get_dns_query(interp, objv[3], tmp_query, query);
+        if(tcl_error) return tcl_error;
 
-        embdns::dns_query query = embdns::parse_packet(raw_query, (size_t)query_size);
-        if(query.qtype != 1)
+        if(query->qtype != 1)
         {
             Tcl_SetObjResult(interp, Tcl_NewStringObj("Attempted to generate dns A record response for non A record query", -1));
             return TCL_ERROR;
         }
 
-        std::array<uint8_t, embdns::dns_message::MAX_SIZE> pkt_buf;
+        std::vector<uint8_t> pkt_buf;
         size_t response_size = 0;
-
-        if(!addr.empty())
+        try
         {
-            response_size = embdns::generate_response(pkt_buf, query, addr, ttl);
+            size_t max_size = tcp ? embdns::dns_message::MAX_TCP_SIZE : query->max_udp_response_size();
+            if(!addrs.empty())
+            {
+                response_size = embdns::generate_response(pkt_buf, *query, addrs, ttl, max_size);
+            }
+            else
+            {
+                response_size = embdns::generate_response(pkt_buf, *query, max_size);
+            }
         }
-        else
+        catch(const std::invalid_argument& e)
         {
-            response_size = embdns::generate_response(pkt_buf, query);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error generating dns response: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "RESPONSE", "INVALID", nullptr);
+            return TCL_ERROR;
         }
+
         Tcl_Obj* response_buf_obj = Tcl_NewByteArrayObj(pkt_buf.data(), (int)response_size);
         Tcl_SetObjResult(interp, response_buf_obj);
         return TCL_OK;
     }
 
+    int Vessel_DNSParseResponse(void *clientData, Tcl_Interp *interp,
+                                int objc, struct Tcl_Obj *const *objv)
+    {
+        /*vessel::dns::parse_response <binary obj>
+         * @returns dict with the following keys:
+         *     id, rcode, tc, qname, type, ttl
+         *
+         * ttl is -1 if the response should not be cached.
+         */
+
+        if(objc != 2)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "binary_buffer");
+            return TCL_ERROR;
+        }
+
+        int buf_len = 0;
+        unsigned char* response_buf = Tcl_GetByteArrayFromObj(objv[1], &buf_len);
+
+        std::unique_ptr<embdns::dns_response_info> info;
+        try
+        {
+            info = std::make_unique<embdns::dns_response_info>(response_buf, (size_t)buf_len);
+        }
+        catch(const std::invalid_argument& e)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid dns response: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "RESPONSE", "INVALID", nullptr);
+            return TCL_ERROR;
+        }
+
+        Tcl_Obj* response_dict = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("id", -1),
+                       Tcl_NewIntObj(info->header.id));
+
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("rcode", -1),
+                       Tcl_NewIntObj(info->header.rcode));
+
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("tc", -1),
+                       Tcl_NewBooleanObj(info->header.tc));
+
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("qname", -1),
+                       Tcl_NewStringObj(info->qname.c_str(), info->qname.size()));
+
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("type", -1),
+                       Tcl_NewIntObj(info->qtype));
+
+        Tcl_DictObjPut(interp, response_dict,
+                       Tcl_NewStringObj("ttl", -1),
+                       Tcl_NewWideIntObj(info->has_ttl ? (Tcl_WideInt)info->ttl : -1));
+
+        Tcl_SetObjResult(interp, response_dict);
+        return TCL_OK;
+    }
+
+    int Vessel_DNSAgeResponse(void *clientData, Tcl_Interp *interp,
+                              int objc, struct Tcl_Obj *const *objv)
+    {
+        /*vessel::dns::age_response raw_response id elapsed_seconds
+         *
+         * Returns a copy of the response with the id replaced and the record
+         * ttls reduced by the number of seconds it was cached.*/
+
+        if(objc != 4)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "raw_response id elapsed_seconds");
+            return TCL_ERROR;
+        }
+
+        int buf_len = 0;
+        unsigned char* response_buf = Tcl_GetByteArrayFromObj(objv[1], &buf_len);
+
+        int id = 0;
+        int tcl_error = Tcl_GetIntFromObj(interp, objv[2], &id);
+        if(tcl_error) return tcl_error;
+
+        Tcl_WideInt elapsed = 0;
+        tcl_error = Tcl_GetWideIntFromObj(interp, objv[3], &elapsed);
+        if(tcl_error) return tcl_error;
+
+        std::vector<uint8_t> pkt(response_buf, response_buf + buf_len);
+        try
+        {
+            embdns::age_response(pkt, (uint16_t)id, (uint32_t)std::max<Tcl_WideInt>(elapsed, 0));
+        }
+        catch(const std::invalid_argument& e)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid dns response: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "RESPONSE", "INVALID", nullptr);
+            return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(pkt.data(), (int)pkt.size()));
+        return TCL_OK;
+    }
+
+    int Vessel_DNSGenerateErrorResponse(void *clientData, Tcl_Interp *interp,
+                                        int objc, struct Tcl_Obj *const *objv)
+    {
+        /*vessel::dns::generate_error_response rcode query*/
+
+        if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, objc, objv, "rcode query");
+            return TCL_ERROR;
+        }
+
+        int rcode = 0;
+        int tcl_error = Tcl_GetIntFromObj(interp, objv[1], &rcode);
+        if(tcl_error) return tcl_error;
+
+        std::unique_ptr<embdns::dns_query> tmp_query;
+        const embdns::dns_query* query = nullptr;
+        tcl_error = get_dns_query(interp, objv[2], tmp_query, query);
+        if(tcl_error) return tcl_error;
+
+        std::vector<uint8_t> pkt_buf;
+        size_t response_size = 0;
+        try
+        {
+            response_size = embdns::generate_error_response(pkt_buf, *query, (uint8_t)rcode);
+        }
+        catch(const std::invalid_argument& e)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error generating dns response: %s", e.what()));
+            Tcl_SetErrorCode(interp, "DNS", "RESPONSE", "INVALID", nullptr);
+            return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(pkt_buf.data(), (int)response_size));
+        return TCL_OK;
+    }
+
     void init_dns(Tcl_Interp* interp)
     {
+        Tcl_RegisterObjType(&dns_query_type);
         (void)Tcl_CreateObjCommand(interp, "vessel::dns::parse_query", Vessel_DNSParseQuery, nullptr, nullptr);
+        (void)Tcl_CreateObjCommand(interp, "vessel::dns::query_get", Vessel_DNSQueryGet, nullptr, nullptr);
         (void)Tcl_CreateObjCommand(interp, "vessel::dns::generate_A_response", Vessel_DNSGenerateAResponse,
                                    nullptr, nullptr);
+        (void)Tcl_CreateObjCommand(interp, "vessel::dns::generate_error_response", Vessel_DNSGenerateErrorResponse,
+                                   nullptr, nullptr);
+        (void)Tcl_CreateObjCommand(interp, "vessel::dns::parse_response", Vessel_DNSParseResponse, nullptr, nullptr);
+        (void)Tcl_CreateObjCommand(interp, "vessel::dns::age_response", Vessel_DNSAgeResponse, nullptr, nullptr);
+        (void)Vessel_DNSTcpInit(interp);
+        (void)Vessel_DNSWorkersInit(interp);
     }
 
     void init_url(Tcl_Interp* interp)
@@ -989,7 +1444,13 @@ extern int Vesseltcl_Init(Tcl_Interp* interp)
     init_exec(interp);
     Pty_Init(interp);
     Udp_Init(interp);
+    Vessel_ConsoleInit(interp);
     Vessel_DevCtlInit(interp);
+    Vessel_S3Init(interp);
+    Vessel_HardlinksInit(interp);
+    Vessel_TreeDiffInit(interp);
+    Vessel_LayerArchiveInit(interp);
+    Vessel_WhiteoutsInit(interp);
     Tcl_PkgProvide(interp, "vessel::native", "1.0.0");
 
     return TCL_OK;
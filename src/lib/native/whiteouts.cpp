@@ -0,0 +1,508 @@
+#include "whiteouts.h"
+#include "tcl_util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace vessel;
+
+namespace
+{
+    enum class outcome
+    {
+        deleted,
+        missing,
+        failed
+    };
+
+    /**
+     * @brief The whiteouts in one directory.  The directory is opened once
+     * for all of them.
+     */
+    struct whiteout_group
+    {
+        std::string parent;
+        std::vector<std::string> names;
+        std::vector<outcome> outcomes;
+        std::vector<std::pair<std::string, int>> failures;
+    };
+
+    /**
+     * @brief Splits a whiteout into its components.  Returns false for
+     * paths that leave the root or name the root itself.
+     */
+    bool split_path(const std::string& path, std::vector<std::string>& components)
+    {
+        std::string::size_type start = 0;
+        while(start <= path.size())
+        {
+            std::string::size_type end = path.find('/', start);
+            if(end == std::string::npos)
+            {
+                end = path.size();
+            }
+
+            std::string component(path, start, end - start);
+            if(component == "..")
+            {
+                return false;
+            }
+            else if(!component.empty() && component != ".")
+            {
+                components.push_back(component);
+            }
+            start = end + 1;
+        }
+        return !components.empty();
+    }
+
+    /**
+     * @brief Opens a directory below parent_fd one component at a time
+     * without following symlinks.
+     */
+    int open_components(int parent_fd, const std::vector<std::string>& components)
+    {
+        int fd = dup(parent_fd);
+        for(const std::string& component : components)
+        {
+            if(fd == -1)
+            {
+                break;
+            }
+            int child_fd = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int error = errno;
+            close(fd);
+            errno = error;
+            fd = child_fd;
+        }
+        return fd;
+    }
+
+    /**
+     * @brief Deletes a directory and everything below it.  The entries are
+     * opened relative to their directory so symlinks are removed rather than
+     * followed.  Only the directory being emptied is open so a deep tree
+     * can't run out of descriptors.  Its parent is opened again from
+     * parent_fd on the way back up.  Entries that are already gone are
+     * skipped and the first error is returned once the rest is deleted.
+     */
+    int remove_directory(int parent_fd, const char* name)
+    {
+        /*The directories from name down to the one being emptied and the
+          subdirectories each of them has left*/
+        std::vector<std::string> components{name};
+        std::vector<std::vector<std::string>> subdirs;
+        int error = 0;
+        auto record = [&error](int entry_error) {
+            if(entry_error != ENOENT && error == 0)
+            {
+                error = entry_error;
+            }
+        };
+
+        fd_guard dir(openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if(dir.fd == -1)
+        {
+            return -1;
+        }
+
+        bool scan = true;
+        while(!components.empty())
+        {
+            if(scan)
+            {
+                /*closedir closes the duplicate*/
+                subdirs.emplace_back();
+                int scan_fd = dup(dir.fd);
+                DIR* entries = scan_fd == -1 ? nullptr : fdopendir(scan_fd);
+                if(entries == nullptr)
+                {
+                    record(errno);
+                    if(scan_fd != -1)
+                    {
+                        close(scan_fd);
+                    }
+                }
+                while(struct dirent* dirent = entries != nullptr ? readdir(entries) : nullptr)
+                {
+                    if(std::strcmp(dirent->d_name, ".") == 0 || std::strcmp(dirent->d_name, "..") == 0)
+                    {
+                        continue;
+                    }
+
+                    struct stat sb;
+                    if(fstatat(dir.fd, dirent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+                    {
+                        record(errno);
+                    }
+                    else if(S_ISDIR(sb.st_mode))
+                    {
+                        subdirs.back().push_back(dirent->d_name);
+                    }
+                    else if(unlinkat(dir.fd, dirent->d_name, 0) != 0)
+                    {
+                        record(errno);
+                    }
+                }
+                if(entries != nullptr)
+                {
+                    closedir(entries);
+                }
+                scan = false;
+            }
+
+            if(!subdirs.back().empty())
+            {
+                std::string subdir = subdirs.back().back();
+                subdirs.back().pop_back();
+                int child_fd = openat(dir.fd, subdir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if(child_fd == -1)
+                {
+                    record(errno);
+                    continue;
+                }
+                close(dir.release());
+                dir.fd = child_fd;
+                components.push_back(subdir);
+                scan = true;
+                continue;
+            }
+
+            /*The directory is as empty as it gets, remove it from its parent*/
+            close(dir.release());
+            std::string emptied = components.back();
+            components.pop_back();
+            subdirs.pop_back();
+
+            fd_guard parent(components.empty() ? dup(parent_fd) : open_components(parent_fd, components));
+            if(parent.fd == -1 || unlinkat(parent.fd, emptied.c_str(), AT_REMOVEDIR) != 0)
+            {
+                record(errno);
+            }
+            if(parent.fd == -1)
+            {
+                break;
+            }
+            if(!components.empty())
+            {
+                dir.fd = parent.release();
+            }
+        }
+
+        if(error != 0)
+        {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Opens the directory of a group relative to the root one
+     * component at a time.  A symlink in the path fails with ELOOP.
+     */
+    int open_parent(int root_fd, const std::string& parent)
+    {
+        int fd = dup(root_fd);
+        std::vector<std::string> components;
+        if(fd == -1 || !split_path(parent, components))
+        {
+            return fd;
+        }
+
+        for(const std::string& component : components)
+        {
+            int child_fd = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if(child_fd == -1)
+            {
+                /*Systems disagree on the errno of O_NOFOLLOW so symlinks are checked*/
+                int error = errno;
+                struct stat sb;
+                if(error != ENOENT && fstatat(fd, component.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                   S_ISLNK(sb.st_mode))
+                {
+                    error = ELOOP;
+                }
+                close(fd);
+                errno = error;
+                return -1;
+            }
+            close(fd);
+            fd = child_fd;
+        }
+        return fd;
+    }
+
+    outcome delete_entry(int dir_fd, const char* name, int& error)
+    {
+        if(unlinkat(dir_fd, name, 0) == 0)
+        {
+            return outcome::deleted;
+        }
+        else if(errno == ENOENT)
+        {
+            return outcome::missing;
+        }
+
+        /*FreeBSD refuses to unlink directories with EPERM and Linux with EISDIR*/
+        error = errno;
+        struct stat sb;
+        if((error == EPERM || error == EISDIR) && fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISDIR(sb.st_mode))
+        {
+            if(remove_directory(dir_fd, name) == 0)
+            {
+                return outcome::deleted;
+            }
+            error = errno;
+        }
+        return outcome::failed;
+    }
+
+    void apply_group(int root_fd, whiteout_group& group)
+    {
+        group.outcomes.assign(group.names.size(), outcome::missing);
+
+        fd_guard dir(open_parent(root_fd, group.parent));
+        if(dir.fd == -1)
+        {
+            /*A parent that doesn't exist or isn't a directory has nothing to delete*/
+            int error = errno;
+            if(error != ENOENT && error != ENOTDIR)
+            {
+                group.outcomes.assign(group.names.size(), outcome::failed);
+                group.failures.emplace_back(group.parent, error);
+            }
+            return;
+        }
+
+        for(size_t i = 0; i < group.names.size(); ++i)
+        {
+            int error = 0;
+            group.outcomes[i] = delete_entry(dir.fd, group.names[i].c_str(), error);
+            if(group.outcomes[i] == outcome::failed)
+            {
+                std::string path = group.parent.empty() ? group.names[i] : group.parent + "/" + group.names[i];
+                group.failures.emplace_back(path, error);
+            }
+        }
+    }
+
+    /**
+     * @brief vessel::fs::whiteouts ?-threads count? mountpoint paths
+     *
+     * Deletes the paths, relative to the mountpoint, like file delete -force
+     * without following symlinks out of the mountpoint.  Returns a dict with
+     * the number of paths that were deleted, missing and failed, the number
+     * of directories they were in, the time it took in microseconds and the
+     * failures as a list of "path: message".
+     */
+    int whiteouts_cmd(void* client_data, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+    {
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        int arg = 1;
+        if(objc == 5 && std::strcmp(Tcl_GetString(objv[1]), "-threads") == 0)
+        {
+            int count = 0;
+            int tcl_error = Tcl_GetIntFromObj(interp, objv[2], &count);
+            if(tcl_error) return tcl_error;
+            if(count < 1)
+            {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("-threads must be at least 1", -1));
+                return TCL_ERROR;
+            }
+            threads = count;
+            arg = 3;
+        }
+        else if(objc != 3)
+        {
+            Tcl_WrongNumArgs(interp, 1, objv, "?-threads count? mountpoint paths");
+            return TCL_ERROR;
+        }
+
+        int count = 0;
+        Tcl_Obj** elements = nullptr;
+        int tcl_error = Tcl_ListObjGetElements(interp, objv[arg + 1], &count, &elements);
+        if(tcl_error) return tcl_error;
+
+        std::vector<std::string> paths;
+        paths.reserve(count);
+        for(int i = 0; i < count; ++i)
+        {
+            paths.emplace_back(Tcl_GetString(elements[i]));
+        }
+
+        const char* mountpoint = Tcl_GetString(objv[arg]);
+        fd_guard root(open(mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if(root.fd == -1)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", mountpoint, Tcl_ErrnoMsg(errno)));
+            Tcl_SetErrorCode(interp, "VESSEL", "WHITEOUTS", Tcl_ErrnoId(), nullptr);
+            return TCL_ERROR;
+        }
+
+        whiteout_stats stats = vessel::apply_whiteouts(root.fd, paths, threads);
+
+        Tcl_Obj* failures = Tcl_NewListObj(0, nullptr);
+        for(const auto& failure : stats.failures)
+        {
+            Tcl_ListObjAppendElement(nullptr, failures,
+                                     Tcl_ObjPrintf("%s: %s", failure.first.c_str(), Tcl_ErrnoMsg(failure.second)));
+        }
+
+        Tcl_Obj* result = whiteout_stats_obj(stats);
+        Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("failures", -1), failures);
+        Tcl_SetObjResult(interp, result);
+        return TCL_OK;
+    }
+}
+
+whiteout_stats vessel::apply_whiteouts(int root_fd, const std::vector<std::string>& paths, unsigned threads)
+{
+    auto start = std::chrono::steady_clock::now();
+    whiteout_stats stats{0, 0, 0, 0, 0, {}};
+
+    std::set<std::string> normalized;
+    for(const std::string& path : paths)
+    {
+        std::vector<std::string> components;
+        if(path.empty())
+        {
+            continue;
+        }
+        else if(!split_path(path, components))
+        {
+            ++stats.failed;
+            stats.failures.emplace_back(path, EINVAL);
+            continue;
+        }
+
+        std::string joined = components[0];
+        for(size_t i = 1; i < components.size(); ++i)
+        {
+            joined += "/" + components[i];
+        }
+        normalized.insert(joined);
+    }
+
+    /*A whiteout below another one is deleted with it so the two are never
+      deleted by different threads at the same time*/
+    std::vector<std::pair<std::string, std::string>> covered;
+    std::vector<whiteout_group> groups;
+    std::map<std::string, size_t> group_indexes;
+    for(const std::string& path : normalized)
+    {
+        std::string::size_type slash = path.find('/');
+        while(slash != std::string::npos && normalized.count(path.substr(0, slash)) == 0)
+        {
+            slash = path.find('/', slash + 1);
+        }
+        if(slash != std::string::npos)
+        {
+            covered.emplace_back(path, path.substr(0, slash));
+            continue;
+        }
+
+        std::string::size_type last = path.rfind('/');
+        std::string parent = last == std::string::npos ? std::string() : path.substr(0, last);
+        auto group_it = group_indexes.find(parent);
+        if(group_it == group_indexes.end())
+        {
+            group_it = group_indexes.emplace(parent, groups.size()).first;
+            groups.push_back(whiteout_group{parent, {}, {}, {}});
+        }
+        groups[group_it->second].names.push_back(last == std::string::npos ? path : path.substr(last + 1));
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for(size_t i = next++; i < groups.size(); i = next++)
+        {
+            apply_group(root_fd, groups[i]);
+        }
+    };
+
+    unsigned workers = std::min<size_t>(threads, groups.size());
+    if(workers <= 1)
+    {
+        work();
+    }
+    else
+    {
+        std::vector<std::thread> pool;
+        for(unsigned i = 0; i < workers; ++i)
+        {
+            pool.emplace_back(work);
+        }
+        for(std::thread& thread : pool)
+        {
+            thread.join();
+        }
+    }
+
+    std::map<std::string, outcome> outcomes;
+    for(const whiteout_group& group : groups)
+    {
+        for(size_t i = 0; i < group.names.size(); ++i)
+        {
+            outcomes[group.parent.empty() ? group.names[i] : group.parent + "/" + group.names[i]] = group.outcomes[i];
+        }
+        stats.failures.insert(stats.failures.end(), group.failures.begin(), group.failures.end());
+    }
+    for(const auto& path : covered)
+    {
+        outcomes[path.first] = outcomes[path.second];
+    }
+
+    for(const auto& path : outcomes)
+    {
+        switch(path.second)
+        {
+        case outcome::deleted:
+            ++stats.deleted;
+            break;
+        case outcome::missing:
+            ++stats.missing;
+            break;
+        case outcome::failed:
+            ++stats.failed;
+            break;
+        }
+    }
+
+    stats.directories = groups.size();
+    stats.microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+Tcl_Obj* vessel::whiteout_stats_obj(const whiteout_stats& stats)
+{
+    Tcl_Obj* result = Tcl_NewDictObj();
+    Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("deleted", -1), Tcl_NewIntObj(stats.deleted));
+    Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("missing", -1), Tcl_NewIntObj(stats.missing));
+    Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("failed", -1), Tcl_NewIntObj(stats.failed));
+    Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("directories", -1), Tcl_NewIntObj(stats.directories));
+    Tcl_DictObjPut(nullptr, result, Tcl_NewStringObj("microseconds", -1), Tcl_NewWideIntObj(stats.microseconds));
+    return result;
+}
+
+int Vessel_WhiteoutsInit(Tcl_Interp* interp)
+{
+    (void)Tcl_CreateObjCommand(interp, "vessel::fs::whiteouts", whiteouts_cmd, nullptr, nullptr);
+    return TCL_OK;
+}
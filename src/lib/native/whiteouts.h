@@ -0,0 +1,46 @@
+#ifndef WHITEOUTS_H
+#define WHITEOUTS_H
+
+#include <string>
+#include <tcl.h>
+#include <utility>
+#include <vector>
+
+namespace vessel
+{
+
+/**
+ * @brief What deleting the whiteouts of a layer did.  Whiteouts below
+ * another whiteout count like the one above them.  The failures are the
+ * paths with their errno so they are formatted on the interp thread with
+ * Tcl_ErrnoMsg rather than by the workers.
+ */
+struct whiteout_stats
+{
+    int deleted;
+    int missing;
+    int failed;
+    int directories;
+    Tcl_WideInt microseconds;
+    std::vector<std::pair<std::string, int>> failures;
+};
+
+/**
+ * @brief Deletes the paths, relative to the directory root_fd, like file
+ * delete -force.  Every component is opened relative to its parent without
+ * following symlinks so nothing outside of the directory is deleted.  The
+ * paths are grouped by their parent directory and the groups are deleted
+ * by a pool of threads.
+ */
+whiteout_stats apply_whiteouts(int root_fd, const std::vector<std::string>& paths, unsigned threads);
+
+/**
+ * @brief The stats as a dict without the failures
+ */
+Tcl_Obj* whiteout_stats_obj(const whiteout_stats& stats);
+
+}
+
+int Vessel_WhiteoutsInit(Tcl_Interp* interp);
+
+#endif // WHITEOUTS_H
@@ -68,11 +68,74 @@ namespace eval vessel::env {
         return [get_from_env VESSEL_S3CMD_CONFIG [file normalize ~/.s3cfg]]
     }
 
+    proc s3_endpoint {} {
+
+        #Empty to use the endpoint from the s3cmd config file or AWS
+        return [get_from_env VESSEL_S3_ENDPOINT]
+    }
+
+    proc s3_concurrency {} {
+        return [get_from_env VESSEL_S3_CONCURRENCY 8]
+    }
+
+    proc s3_part_size {} {
+
+        #16MiB
+        return [get_from_env VESSEL_S3_PART_SIZE 16777216]
+    }
+
+    proc s3_retries {} {
+        return [get_from_env VESSEL_S3_RETRIES 3]
+    }
+
     proc image_download_dir {} {
         set workdir [get_workdir]
         return [get_from_env VESSEL_DOWNLOAD_DIR [file join $workdir {downloaded_images}]]
     }
 
+    proc layer_store_dir {} {
+        set workdir [get_workdir]
+        return [get_from_env VESSEL_LAYER_STORE_DIR [file join $workdir {layers}]]
+    }
+
+    proc layer_compression {} {
+        #zstd or gzip
+        return [get_from_env VESSEL_LAYER_COMPRESSION {zstd}]
+    }
+
+    proc layer_compression_level {} {
+        set default_levels {zstd 3 gzip 6}
+        set codec [layer_compression]
+        set default_level {}
+        if {[dict exists $default_levels $codec]} {
+            set default_level [dict get $default_levels $codec]
+        }
+        return [get_from_env VESSEL_LAYER_COMPRESSION_LEVEL $default_level]
+    }
+
+    proc layer_chunk_size {} {
+        #Average bytes of the content defined chunks layers are compressed
+        # in so a pull only transfers the chunks it doesn't have.  0
+        # compresses a layer as a single stream.
+        return [get_from_env VESSEL_LAYER_CHUNK_SIZE 1048576]
+    }
+
+    proc compression_threads {} {
+        #0 uses a thread per core
+        return [get_from_env VESSEL_COMPRESSION_THREADS 0]
+    }
+
+    proc diff_engine {} {
+        #zfs runs 'zfs diff'.  native compares the snapshot directory with
+        # the mountpoint using vessel::fs::diff
+        return [get_from_env VESSEL_DIFF_ENGINE {zfs}]
+    }
+
+    proc export_cache_dir {} {
+        set workdir [get_workdir]
+        return [get_from_env VESSEL_EXPORT_CACHE_DIR [file join $workdir {export_cache}]]
+    }
+
     proc metadata_db_dir {} {
 
         set workdir [get_workdir]
@@ -83,6 +146,10 @@ namespace eval vessel::env {
         return [get_from_env VESSEL_RUN_DIR {/var/run/vessel/jails}]
     }
 
+    proc console_socket {jail_name} {
+        return [file join [vessel_run_dir] "${jail_name}.console"]
+    }
+
     proc jail_confs_dir {} {
 
         return [get_from_env VESSEL_VAR_RUN_DIR {/var/run/vessel/jails}]
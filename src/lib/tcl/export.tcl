@@ -1,6 +1,8 @@
 # -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
 package require vessel::env
+package require vessel::layer_store
 package require vessel::metadata_db
+package require vessel::native
 package require vessel::zfs
 
 package require fileutil
@@ -14,91 +16,186 @@ namespace eval vessel::export {
 
     namespace eval _ {
 
-        proc create_layer {dataset guid status_channel} {
+        proc create_layer {dataset layer_file} {
 
-            #Create the layer by zfs diff'ing the 'a' snapshot with the
-            # dataset filesystem.  A layer is a zip archive of
-            # the differences in the snapshots.
+            #Create the layer by diff'ing the 'a' snapshot with the
+            # dataset filesystem.  A layer is a single compressed tar
+            # archive of the changed files that starts with the list of
+            # deleted files.  It is compressed with the codec and level
+            # from the environment, as content defined chunks unless the
+            # chunk size is 0.  Returns the digest, size, entries and chunks
+            # of the layer.
 
             set mountpoint [vessel::zfs::get_mountpoint $dataset]
             set diff_dict [vessel::zfs::diff ${dataset}@a ${dataset}]
 
-            set workdir [vessel::env::get_workdir]
-            set build_dir [file join $workdir $guid]
-
-            file mkdir $build_dir
-            set old_dir [pwd]
-            cd $build_dir
-            set whiteout_file [open {whiteouts.txt} {w}]
-
+            set whiteouts {}
             if {[dict exists $diff_dict {-}]} {
                 foreach deleted_file [dict get $diff_dict {-}] {
-                    puts $whiteout_file [fileutil::stripPath $mountpoint $deleted_file]
+                    lappend whiteouts [fileutil::stripPath $mountpoint $deleted_file]
                 }
             }
 
             set modified_links_dict [vessel::zfs::diff_hardlinks $diff_dict $mountpoint]
 
-            set tar_list_file [open {files.txt} {w}]
+            set paths {}
+            dict for {inode inode_paths} $modified_links_dict {
+                foreach path $inode_paths {
+                    lappend paths [fileutil::stripPath $mountpoint $path]
+                }
+            }
+
+            set chunk_option {}
+            if {[vessel::env::layer_chunk_size] > 0} {
+                set chunk_option [list -chunk-size [vessel::env::layer_chunk_size]]
+            }
 
-            #If the first line of the file is a '-C' then tar will chdir to the directory
-            # specified in the second line of the file.
-            puts $tar_list_file {-C}
-            puts $tar_list_file "$mountpoint"
+            return [vessel::archive::write_layer -compression [vessel::env::layer_compression] \
+                        {*}[compression_level_option] -threads [vessel::env::compression_threads] \
+                        {*}$chunk_option $mountpoint $layer_file $whiteouts $paths]
+        }
 
-            dict for {inode paths} $modified_links_dict {
+        proc create_stream {dataset stream_file} {
 
-                #Put all the paths in the file to be tar'd up.
-                foreach path $paths {
-                    puts $tar_list_file [fileutil::stripPath "${mountpoint}" $path]
-                }
+            #Create the layer as an incremental zfs send from the parent
+            # image snapshot the dataset was cloned from to its 'b'
+            # snapshot.  The stream has the 'a' and 'b' snapshots so the
+            # received dataset is laid out like a built one.  Returns the
+            # guid of the parent snapshot which the importer must have.
+
+            set origin [vessel::zfs::get_origin $dataset]
+            if {$origin eq {-}} {
+                return -code error -errorcode {VESSEL EXPORT ENOORIGIN} \
+                    "Dataset is not a clone of a parent image: $dataset"
             }
 
-            flush $tar_list_file
-            close $tar_list_file
-            exec -ignorestderr tar -cavf ${guid}-layer.tgz -n -T {files.txt} >&@ $status_channel
+            vessel::zfs::send_incremental $origin ${dataset}@b $stream_file
+            return [vessel::zfs::snapshot_guid $origin]
+        }
 
-            #TODO: Use a trace to return to the old directory. Or better
-            # yet, don't change directory
-            cd $old_dir
-            return $build_dir
+        proc compression_level_option {} {
+            set level [vessel::env::layer_compression_level]
+            if {$level eq {}} {
+                return {}
+            }
+            return [list -level $level]
         }
 
-        proc create_image {image_name image_tag output_dir status_channel} {
+        # The layers exported from a b snapshot are cached by the
+        # snapshot's guid and creation txg so an image is only exported
+        # again when it was rebuilt.  Tar layers are also keyed by the diff
+        # engine that finds their changes and the codec, level and chunk
+        # size they are written with so changing them exports the image
+        # again.  An entry is a dict of the layer fields of the image
+        # metadata.
+        proc cache_path {identity format} {
+            set key [list $identity $format]
+            if {$format eq {tar}} {
+                lappend key [vessel::env::diff_engine] [vessel::env::layer_compression] \
+                    [vessel::env::layer_compression_level] [vessel::env::layer_chunk_size]
+            }
+            return [file join [vessel::env::export_cache_dir] [join $key -]]
+        }
 
-            #Create the image metadata and zip it with the layer.  An image
-            # is the layer with the metadata zipped together.
+        proc read_cache {identity format} {
+            set path [cache_path $identity $format]
+            if {![file exists $path]} {
+                return {}
+            }
+            set entry [string trim [fileutil::cat $path]]
+            if {[llength [vessel::layer_store::missing [dict get $entry layers]]] > 0} {
+                #The layers were removed from the layer store
+                return {}
+            }
+            return $entry
+        }
 
-            set output_image_path [file join $output_dir "${image_name}:${image_tag}.zip"]
-            if {[file exists $output_image_path]} {
-                #Short circuit if the image already exists.
-                return $output_image_path
+        proc write_cache {identity format entry} {
+            file mkdir [vessel::env::export_cache_dir]
+            set path [cache_path $identity $format]
+            set chan [open "${path}.tmp" w]
+            puts $chan $entry
+            close $chan
+            file rename -force "${path}.tmp" $path
+        }
+
+        proc create_image {image_name image_tag format status_channel} {
+
+            #Create the image layer in the format, tar or zfs, and add it
+            # to the layer store.  An image is its metadata which refers to
+            # its layers by digest.
+
+            if {$format ni {tar zfs}} {
+                return -code error -errorcode {VESSEL EXPORT EFORMAT} \
+                    "Unsupported image format: $format"
             }
-            #Create the image layer.
-            set dataset [vessel::env::get_dataset_from_image_name $image_name $image_tag]
-            set guid [uuid::uuid generate]
-            set image_dir [create_layer $dataset $guid $status_channel]
 
             set metadata_file [vessel::metadata_db::metadata_file_path $image_name $image_tag]
-            file copy $metadata_file $image_dir
-            set workdir [vessel::env::get_workdir]
-
-            #Ensure we cd back to the initial directory. Should probably just
-            # use tcllib::defer
-            trace add variable workdir unset [list apply {{old_pwd _1 _2 _3} {
-                cd $old_pwd
-            } } [pwd]]
-            
-            cd $image_dir
-
-            exec zip -v -r -m $output_image_path . >&@ $status_channel
-            return $output_image_path
+            set metadata_dict [vessel::metadata_db::read_metadata_file $metadata_file]
+            set dataset [vessel::env::get_dataset_from_image_name $image_name $image_tag]
+            set identity [vessel::zfs::snapshot_identity ${dataset}@b]
+            set exported [read_cache $identity $format]
+            if {$exported ne {}} {
+                #Short circuit if the snapshot has already been exported.
+                puts $status_channel "Using the layer exported from ${dataset}@b"
+            } else {
+                set exported [export_layer $dataset $format $status_channel]
+                write_cache $identity $format $exported
+            }
+
+            vessel::metadata_db::write_metadata_file $image_name $image_tag \
+                [dict get $metadata_dict cwd] [dict get $metadata_dict command] \
+                [dict get $metadata_dict parent_images] [dict get $exported layers] \
+                [dict get $exported compression] $format [dict get $exported parent_guid] \
+                [dict get $exported chunks]
+            return $metadata_file
+        }
+
+        proc export_layer {dataset format status_channel} {
+
+            #Create the layer of the dataset and return the layer fields of
+            # its metadata.
+            set layer_file [file join [vessel::env::get_workdir] "[uuid::uuid generate]-layer"]
+            set compression {}
+            set parent_guid {}
+            set chunks {}
+            if {$format eq {zfs}} {
+                set parent_guid [create_stream $dataset $layer_file]
+                set size [file size $layer_file]
+                set digest [vessel::layer_store::add $layer_file]
+                puts $status_channel "Created zfs stream ${digest}: $size bytes"
+            } else {
+                set layer_dict [create_layer $dataset $layer_file]
+                puts $status_channel "Created layer [dict get $layer_dict digest]:\
+                    [dict get $layer_dict entries] entries, [dict get $layer_dict size] bytes"
+
+                #The digest was computed while the layer was written
+                set digest [vessel::layer_store::store $layer_file [dict get $layer_dict digest]]
+                if {[dict exists $layer_dict chunks]} {
+                    dict set chunks $digest [dict get $layer_dict chunks]
+                    vessel::layer_store::write_chunk_index $digest [dict get $layer_dict chunks]
+                    puts $status_channel "Layer has [llength [dict get $layer_dict chunks]] chunks"
+                }
+
+                #The codec is recorded so an importer that can't decompress the
+                #layer fails before it touches the dataset
+                set compression [dict create codec [vessel::env::layer_compression] \
+                                     level [vessel::env::layer_compression_level]]
+            }
+
+            return [dict create layers [list $digest] compression $compression \
+                        parent_guid $parent_guid chunks $chunks]
         }
     }
 
-    proc export_image {image tag output_dir} {
+    # Export the image into the layer store and return the path of its
+    # metadata file.  The format is tar for a layer archive that can be
+    # imported on top of any copy of the parent image or zfs for a zfs
+    # send stream that can only be received where the parent image
+    # snapshot has the same guid, ie it was sent from the exporting pool.
+    proc export_image {image tag {format tar}} {
 
-        return [_::create_image $image $tag $output_dir stderr]
+        return [_::create_image $image $tag $format stderr]
     }
 
     proc export_command {args_dict} {
@@ -113,8 +210,20 @@ namespace eval vessel::export {
             set image_tag [lindex $image_components 1]
         }
 
-        set output_dir [dict get $args_dict dir]
-        return [export_image $image_name $image_tag $output_dir]
+        #The output directory is laid out like a file repository so it can be
+        #used as one to import the image on another machine.
+        set output_dir [file normalize [dict get $args_dict dir]]
+        file mkdir $output_dir
+        set metadata_file [export_image $image_name $image_tag]
+
+        package require vessel::repo
+        set repo [vessel::repo::file_repo new "file://${output_dir}"]
+        try {
+            $repo put_image $metadata_file
+        } finally {
+            $repo destroy
+        }
+        return [file join $output_dir [file tail $metadata_file]]
 
         #TODO: We should get rid of the export command.  It should just be part of
         #the publish command with a file:// scheme
@@ -1,6 +1,7 @@
 # -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
 
 package require vessel::env
+package require vessel::layer_store
 package require vessel::metadata_db
 package require vessel::native
 package require defer
@@ -20,43 +21,32 @@ namespace eval vessel::import {
 
     namespace eval _ {
 
-        proc create_layer {image tag extracted_path status_channel} {
+        # The snapshot of the parent image the image is created from
+        proc parent_snapshot {metadata_dict} {
             variable ::vessel::import::log
 
-            # We don't know the uuid so we glob in the image_dir and
-            # use what should be the only thing there
-            set layer_file_glob [glob "${extracted_path}/*-layer.tgz"]
-            if {[llength $layer_file_glob] != 1} {
-                return -code error -errorcode {VESSEL IMPORT LAYER} \
-                    "Unexpected number of layer files in image: $layer_file_glob"
-            }
-            set layer_file [lindex $layer_file_glob 0]
-
-            #Read parent image from metadata file
-            set extracted_metadata_file [file join ${extracted_path} "${image}:${tag}.json"]
-            set metadata_json [fileutil::cat $extracted_metadata_file]
-            set metadata_dict [json::json2dict $metadata_json]
-
-            #NOTE: The metadata file allows a list of parent images.
-            #We current only support one layer of parent images.  In
-            #the future we can use arbitrarily long chain of parent
-            #images.
+            #NOTE: The metadata file allows a list of parent images but an
+            #image is cloned from the first one.  Its own parent is in its
+            #metadata so chains of images are pulled ancestors first by
+            #vessel::repo.
             ${log}::debug "parsing metadata file"
             set parent_image [lindex [dict get $metadata_dict parent_images] 0]
-            set parent_image_components [split $parent_image :]
-            set parent_image_name [lindex $parent_image_components 0]
-            set parent_image_version [lindex $parent_image_components 1]
-            set parent_image_snapshot [vessel::env::get_dataset_from_image_name $parent_image_name $parent_image_version]
-            set parent_image_snapshot "${parent_image_snapshot}@${parent_image_version}"
+            set parent_image_snapshot [vessel::import::image_snapshot $parent_image]
+            if {$parent_image_snapshot eq {}} {
+                return -code error -errorcode {VESSEL IMPORT ENOPARENT} \
+                    "Parent image is not imported: '$parent_image'"
+            }
 
             ${log}::debug "parent image: $parent_image_snapshot"
+            return $parent_image_snapshot
+        }
 
-            #TODO: fetch the parent image if it doesn't exist.  We can
-            #move the fetch_image command from the vessel_file_commands
-            if {![vessel::zfs::snapshot_exists $parent_image_snapshot]} {
-                return -code error -errorcode {NYI} \
-                    "Pulling parent image is not yet implemented: '$parent_image_snapshot'"
-            }
+        # Creates the dataset of the image as a clone of its parent image
+        # and returns its mountpoint
+        proc create_dataset {image tag metadata_dict} {
+            variable ::vessel::import::log
+
+            set parent_image_snapshot [parent_snapshot $metadata_dict]
 
             #Clone parent filesystem
             set new_dataset [vessel::env::get_dataset_from_image_name $image $tag]
@@ -69,30 +59,20 @@ namespace eval vessel::import {
 
             if {![vessel::zfs::snapshot_exists ${new_dataset}@a]} {
                 vessel::zfs::create_snapshot ${new_dataset} a
+            } else {
+                #Start from the parent image again in case an earlier
+                #import was interrupted part way through its layers
+                ${log}::debug "Rolling back ${new_dataset} to its parent image"
+                vessel::zfs::rollback ${new_dataset}@a
             }
 
-            #Untar layer on top of parent file system
-            set mountpoint [vessel::zfs::get_mountpoint $new_dataset]
-            exec tar -C $mountpoint -xvf $layer_file >&@ $status_channel
-            flush $status_channel
-
-            #Read whiteout file and delete the listed files.
-            # The whiteout file is the list of files from the base image that
-            # need to be deleted.  It's called whiteouts because that's how
-            # unionfs works as it can't delete files in the lower layers.
-            set whiteouts_file_path [file join ${extracted_path} {whiteouts.txt}]
-            set whiteout_chan [open $whiteouts_file_path RDONLY]
-            while {[gets $whiteout_chan deleteme_path] >= 0} {
-
-                set jailed_path [fileutil::jail $mountpoint $deleteme_path]
-                try {
-                    ${log}::debug "Deleting file $jailed_path"
-                    file delete -force $deleteme_path
-                } on error {msg} {
-                    ${log}::debug "Failed to delete file $jailed_path: $msg"
-                }
-            }
+            return [vessel::zfs::get_mountpoint $new_dataset]
+        }
 
+        # Snapshots the dataset with its layers applied and records the
+        # image metadata
+        proc finish_dataset {image tag metadata_dict} {
+            set new_dataset [vessel::env::get_dataset_from_image_name $image $tag]
             if {[vessel::zfs::snapshot_exists ${new_dataset}@b]} {
                 #If the b snapshot already exists then we need to delete it and
                 #make a new one.
@@ -104,13 +84,327 @@ namespace eval vessel::import {
             #instead of copying the file to safeguard against mismatching versions
             vessel::import::import_image_metadata_dict $metadata_dict
         }
+
+        # Deletes the files of the parent image that the layer deleted.
+        # It's called whiteouts because that's how unionfs works as it
+        # can't delete files in the lower layers.
+        proc apply_whiteouts {mountpoint paths} {
+            variable ::vessel::import::log
+
+            set stats [vessel::fs::whiteouts $mountpoint $paths]
+            foreach failure [dict get $stats failures] {
+                ${log}::debug "Failed to delete file $failure"
+            }
+            ${log}::info "Applied [llength $paths] whiteouts: [whiteout_summary $stats]"
+        }
+
+        proc whiteout_summary {stats} {
+            return "[dict get $stats deleted] deleted, [dict get $stats missing] missing,\
+                [dict get $stats failed] failed in [dict get $stats directories] directories,\
+                [dict get $stats microseconds] usec"
+        }
+
+        # Fails before the dataset is touched if the layers are compressed
+        # with a codec the importer can't decompress
+        proc check_codec {metadata_dict} {
+            set codec {}
+            if {[dict exists $metadata_dict compression codec]} {
+                set codec [dict get $metadata_dict compression codec]
+            }
+            if {$codec ni {{} gzip zstd none}} {
+                return -code error -errorcode {VESSEL IMPORT ECODEC} \
+                    "Layers are compressed with an unsupported codec: $codec"
+            }
+        }
+
+        proc print_layer {status_channel digest layer_dict} {
+            set whiteouts "[dict get $layer_dict whiteouts] whiteouts"
+            if {[dict exists $layer_dict whiteout_stats]} {
+                append whiteouts " ([whiteout_summary [dict get $layer_dict whiteout_stats]])"
+            }
+            puts $status_channel "Extracted layer ${digest}: [dict get $layer_dict entries] entries, $whiteouts"
+        }
+
+        # Applies layers written by vessel::archive::write_layer
+        proc import_layers {image tag metadata_dict layers status_channel} {
+            check_codec $metadata_dict
+
+            set mountpoint [create_dataset $image $tag $metadata_dict]
+            foreach digest $layers {
+                set layer_dict [vessel::archive::extract_layer [vessel::layer_store::path $digest] $mountpoint]
+                print_layer $status_channel $digest $layer_dict
+            }
+            flush $status_channel
+
+            finish_dataset $image $tag $metadata_dict
+        }
+
+        # Receives a layer written by zfs send.  The stream is incremental
+        # from the parent image snapshot so it can only be received where
+        # that snapshot has the same guid as where it was sent from.
+        proc receive_stream {image tag metadata_dict layers status_channel} {
+            variable ::vessel::import::log
+
+            if {[llength $layers] != 1} {
+                return -code error -errorcode {VESSEL IMPORT ELAYER} \
+                    "Expected a single zfs stream layer: $layers"
+            }
+
+            set parent_image_snapshot [parent_snapshot $metadata_dict]
+            set parent_guid [vessel::zfs::snapshot_guid $parent_image_snapshot]
+            set stream_parent_guid [dict get $metadata_dict parent_guid]
+            if {$parent_guid ne $stream_parent_guid} {
+                return -code error -errorcode {VESSEL IMPORT EGUID} \
+                    "The zfs stream of ${image}:${tag} applies to a parent image snapshot\
+                     with guid ${stream_parent_guid} but ${parent_image_snapshot} has guid\
+                     ${parent_guid}.  Publish the image in the tar format to import it here."
+            }
+
+            #The stream creates the dataset and its snapshots
+            set new_dataset [vessel::env::get_dataset_from_image_name $image $tag]
+            if {[vessel::zfs::dataset_exists $new_dataset]} {
+                ${log}::debug "Destroying ${new_dataset} to receive it again"
+                vessel::zfs::destroy_recursive $new_dataset
+            }
+
+            set digest [lindex $layers 0]
+            vessel::zfs::receive $new_dataset [vessel::layer_store::path $digest]
+            puts $status_channel "Received zfs stream ${digest} into ${new_dataset}"
+            flush $status_channel
+
+            vessel::import::import_image_metadata_dict $metadata_dict
+        }
+
+        # Applies a zip layer which was extracted into extracted_path.
+        proc create_layer {image tag extracted_path status_channel} {
+
+            # We don't know the uuid so we glob in the image_dir and
+            # use what should be the only thing there
+            set layer_file_glob [glob "${extracted_path}/*layer.tgz"]
+            if {[llength $layer_file_glob] != 1} {
+                return -code error -errorcode {VESSEL IMPORT LAYER} \
+                    "Unexpected number of layer files in image: $layer_file_glob"
+            }
+            set layer_file [lindex $layer_file_glob 0]
+
+            #Read parent image from metadata file
+            set extracted_metadata_file [file join ${extracted_path} "${image}:${tag}.json"]
+            set metadata_json [fileutil::cat $extracted_metadata_file]
+            set metadata_dict [json::json2dict $metadata_json]
+
+            set mountpoint [create_dataset $image $tag $metadata_dict]
+
+            #Untar layer on top of parent file system
+            exec tar -C $mountpoint -xvf $layer_file >&@ $status_channel
+            flush $status_channel
+
+            set whiteouts_file_path [file join ${extracted_path} {whiteouts.txt}]
+            apply_whiteouts $mountpoint [split [string trimright [fileutil::cat $whiteouts_file_path] "\n"] "\n"]
+
+            finish_dataset $image $tag $metadata_dict
+        }
+    }
+
+    # Imports an image while its layers are pulled.  The repository
+    # reports the metadata and the progress of each layer as it is
+    # downloaded and the layer is extracted by vessel::archive::stream_layer
+    # as its bytes arrive, so a pull takes about as long as the slower of
+    # the download and the extraction instead of both.  Layers are
+    # extracted before their digest is checked so the dataset is rolled
+    # back to its parent image when the pull fails.
+    #
+    # Images the pipeline can't stream, those published as zip files or
+    # zfs streams, aren't touched and finish returns 0 so they are
+    # imported after the pull.
+    oo::class create pipeline {
+        variable _image
+        variable _tag
+        variable _status_channel
+        variable _enabled
+        variable _metadata_dict
+        variable _mountpoint
+        variable _stream
+        variable _extracted
+
+        constructor {image tag status_channel} {
+            set _image $image
+            set _tag $tag
+            set _status_channel $status_channel
+            set _enabled 0
+            set _metadata_dict {}
+            set _mountpoint {}
+            set _stream {}
+            set _extracted 0
+        }
+
+        # The image metadata was pulled
+        method metadata {metadata_path} {
+            variable ::vessel::import::log
+
+            set _metadata_dict [vessel::metadata_db::read_metadata_file $metadata_path]
+            set layers [dict get $_metadata_dict layers]
+            set dataset [vessel::env::get_dataset_from_image_name $_image $_tag]
+            if {[llength $layers] == 0 || [dict get $_metadata_dict format] ne {tar} ||
+                ([vessel::zfs::snapshot_exists ${dataset}@b] &&
+                 [vessel::metadata_db::image_layers $_image $_tag] eq $layers)} {
+                return
+            }
+
+            vessel::import::_::check_codec $_metadata_dict
+            ${log}::debug "Extracting the layers of ${_image}:${_tag} as they are pulled"
+            set _enabled 1
+        }
+
+        # Returns 1 if the layers are extracted as they are pulled
+        method enabled {} {
+            return $_enabled
+        }
+
+        # Layers published as zip files are imported after the pull
+        method disable {} {
+            my abort
+            set _enabled 0
+        }
+
+        # The layer is already in the layer store.  done_cmd is passed on
+        # to end_layer.
+        method stored_layer {digest {done_cmd {}}} {
+            if {!$_enabled} {
+                return
+            }
+            if {[vessel::layer_store::is_legacy $digest]} {
+                my disable
+                if {$done_cmd ne {}} {
+                    {*}$done_cmd {}
+                }
+                return
+            }
+
+            set path [vessel::layer_store::path $digest]
+            my begin_layer $digest
+            my layer_progress $path [file size $path]
+            my end_layer $digest $done_cmd
+        }
+
+        # The layer is about to be downloaded
+        method begin_layer {digest} {
+            if {$_enabled && $_mountpoint eq {}} {
+                set _mountpoint [vessel::import::_::create_dataset $_image $_tag $_metadata_dict]
+            }
+        }
+
+        # The first bytes of the layer have been written to path
+        method layer_progress {path bytes} {
+            if {!$_enabled} {
+                return
+            }
+            if {$_stream eq {}} {
+                set _stream [vessel::archive::stream_layer $path $_mountpoint]
+            }
+            vessel::archive::stream_available $_stream $bytes
+        }
+
+        # The layer was downloaded and its digest verified.  Waits for the
+        # rest of it to be extracted unless there is a done_cmd, which is
+        # called from the event loop once it is instead with the error of
+        # the extraction as {message options}, or {} if there wasn't one.
+        method end_layer {digest {done_cmd {}}} {
+            if {!$_enabled} {
+                return
+            }
+            if {$_stream eq {}} {
+                set _stream [vessel::archive::stream_layer [vessel::layer_store::path $digest] $_mountpoint]
+            }
+
+            if {$done_cmd ne {}} {
+                vessel::archive::stream_wait $_stream [namespace code [list my _layer_extracted $digest $done_cmd]]
+                return
+            }
+
+            set stream $_stream
+            set _stream {}
+            vessel::import::_::print_layer $_status_channel $digest [vessel::archive::stream_finish $stream]
+            incr _extracted
+        }
+
+        method _layer_extracted {digest done_cmd stream} {
+            set _stream {}
+            try {
+                vessel::import::_::print_layer $_status_channel $digest [vessel::archive::stream_finish $stream]
+            } on error {msg options} {
+                {*}$done_cmd [list $msg $options]
+                return
+            }
+            incr _extracted
+            {*}$done_cmd {}
+        }
+
+        # Snapshots the dataset once every layer is extracted.  Returns 1
+        # if the image was imported.
+        method finish {} {
+            if {!$_enabled} {
+                return 0
+            }
+
+            set layers [dict get $_metadata_dict layers]
+            if {$_extracted != [llength $layers]} {
+                return -code error -errorcode {VESSEL IMPORT ELAYER} \
+                    "Extracted ${_extracted} of [llength $layers] layers of ${_image}:${_tag}"
+            }
+            flush $_status_channel
+
+            vessel::import::_::finish_dataset $_image $_tag $_metadata_dict
+            return 1
+        }
+
+        # Stops extracting and rolls the dataset back to its parent image
+        method abort {} {
+            variable ::vessel::import::log
+
+            if {$_stream ne {}} {
+                vessel::archive::stream_cancel $_stream
+                set _stream {}
+            }
+
+            if {$_mountpoint ne {}} {
+                set dataset [vessel::env::get_dataset_from_image_name $_image $_tag]
+                if {[catch {vessel::zfs::rollback ${dataset}@a} msg]} {
+                    ${log}::warn "Failed to roll back ${dataset}: $msg"
+                }
+                set _mountpoint {}
+            }
+            set _extracted 0
+        }
+
+        destructor {
+            if {$_stream ne {}} {
+                vessel::archive::stream_cancel $_stream
+            }
+        }
+    }
+
+    # The snapshot images built from the image, <name>:<tag>, are cloned
+    # from.  It's the snapshot named after the tag for base images and the
+    # b snapshot for vessel images.  Returns {} if the image isn't
+    # imported.
+    proc image_snapshot {image_w_tag} {
+        lassign [split $image_w_tag :] name tag
+        set dataset [vessel::env::get_dataset_from_image_name $name $tag]
+        foreach snapshot [list ${dataset}@${tag} ${dataset}@b] {
+            if {[vessel::zfs::snapshot_exists $snapshot]} {
+                return $snapshot
+            }
+        }
+        return {}
     }
 
-    proc import_image_metadata {name tag cwd cmd parent_images} {
+    proc import_image_metadata {name tag cwd cmd parent_images {layers {}} {compression {}}
+                                {format tar} {parent_guid {}} {chunks {}}} {
         #Used when the image already exists (maybe it was built) and
         # we just need to store the metadata.
 
-        vessel::metadata_db::write_metadata_file $name $tag $cwd $cmd $parent_images
+        vessel::metadata_db::write_metadata_file $name $tag $cwd $cmd $parent_images $layers $compression \
+            $format $parent_guid $chunks
     }
 
     proc import_image_metadata_dict {metadata_dict} {
@@ -119,8 +413,15 @@ namespace eval vessel::import {
         set command [dict get $metadata_dict command]
         set cwd [dict get $metadata_dict cwd]
         set parent_images [dict get $metadata_dict parent_images]
+        foreach {key default} {layers {} compression {} format tar parent_guid {} chunks {}} {
+            set $key $default
+            if {[dict exists $metadata_dict $key]} {
+                set $key [dict get $metadata_dict $key]
+            }
+        }
 
-        import_image_metadata $name $tag $cwd $command $parent_images
+        import_image_metadata $name $tag $cwd $command $parent_images $layers $compression \
+            $format $parent_guid $chunks
     }
 
     # Import an image into the vessel environment.
@@ -129,16 +430,61 @@ namespace eval vessel::import {
     #
     # image_w_tag: The name of the image without tag appended
     # tag: The tag of the image
-    # image_dir: The directory where the image file resides
+    # image_dir: The directory where the image metadata file resides.
+    #            The layers it refers to are read from the layer store.
+    #            Images pulled before layers were content addressed are
+    #            a zip file in this directory.
     proc import {image tag image_dir status_channel} {
         variable log
 
         ${log}::debug "import{}: ${image},${tag}"
 
         set extracted_path [file join $image_dir "${image}:${tag}"]
+        set metadata_file [file join $image_dir "${image}:${tag}.json"]
+
+        if {![file exists $metadata_file]} {
+            #Extract files into extracted_path overriding files that already exist.
+            exec unzip -o -d $extracted_path [file join $image_dir "${image}:${tag}.zip"] >&@ $status_channel
+            _::create_layer $image $tag $extracted_path $status_channel
+            return
+        }
+
+        set metadata_dict [vessel::metadata_db::read_metadata_file $metadata_file]
+        set layers [dict get $metadata_dict layers]
+        set dataset [vessel::env::get_dataset_from_image_name $image $tag]
+        if {[vessel::zfs::snapshot_exists ${dataset}@b] &&
+            [vessel::metadata_db::image_layers $image $tag] eq $layers} {
+            ${log}::info "Image ${image}:${tag} already has layers: $layers"
+            return
+        }
+
+        set missing_layers [vessel::layer_store::missing $layers]
+        if {[llength $missing_layers] > 0} {
+            return -code error -errorcode {VESSEL IMPORT ENOLAYER} \
+                "Layers are missing from the layer store: $missing_layers"
+        }
+
+        if {[dict get $metadata_dict format] eq {zfs}} {
+            _::receive_stream $image $tag $metadata_dict $layers $status_channel
+            return
+        }
 
-        #Extract files into extracted_path overriding files that already exist.
-        exec unzip -o -d $extracted_path [file join $image_dir "${image}:${tag}.zip"] >&@ $status_channel
+        if {![vessel::layer_store::is_legacy [lindex $layers 0]]} {
+            _::import_layers $image $tag $metadata_dict $layers $status_channel
+            return
+        }
+
+        #Layers stored as zip files are extracted first
+        file delete -force $extracted_path
+        file mkdir $extracted_path
+        defer::with [list extracted_path] {
+            file delete -force $extracted_path
+        }
+
+        foreach digest $layers {
+            exec unzip -o -d $extracted_path [vessel::layer_store::path $digest] >&@ $status_channel
+        }
+        file copy $metadata_file $extracted_path
         _::create_layer $image $tag $extracted_path $status_channel
     }
 }
@@ -0,0 +1,188 @@
+# -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
+
+package require vessel::env
+package require vessel::native
+package require logger
+
+namespace eval vessel::layer_store {
+    #The layer store keeps the layers of local images keyed by the
+    #sha256 digest of the layer archive.  Image metadata refers to its
+    #layers by digest so a layer shared by several tags is only
+    #transferred and kept once.
+    #
+    #Layout:
+    #  <store>/sha256/<hex>         Layers that have been verified
+    #  <store>/sha256/<hex>.chunks  Chunk index of a chunked layer
+    #  <store>/downloads/<hex>      Layers and chunks that are being
+    #                               downloaded
+    #
+    #A layer is a compressed tar archive written by
+    #vessel::archive::write_layer.  Layers stored before that were zip
+    #files named <hex>.zip.
+    #
+    #Layers written with a chunk size are the concatenation of content
+    #defined chunks that are compressed on their own.  The chunk index, a
+    #list of dicts with the digest and size of every chunk, is kept next
+    #to the layer so the chunks of every stored layer make up the local
+    #chunk store without keeping their bytes twice.
+
+    logger::initNamespace [namespace current] debug
+    variable log [logger::servicecmd [string trimleft [namespace current] :]]
+
+    proc _hex {digest} {
+        if {![regexp {^sha256:([0-9a-f]{64})$} $digest -> hex]} {
+            return -code error -errorcode {LAYER DIGEST EFORMAT} \
+                "Invalid layer digest: $digest"
+        }
+        return $hex
+    }
+
+    # Name of the layer relative to the store.  Repositories use the
+    # same name below their layers directory.
+    proc object_name {digest} {
+        return "sha256/[_hex $digest]"
+    }
+
+    # Name of a layer that was stored as a zip file
+    proc legacy_object_name {digest} {
+        return "[object_name $digest].zip"
+    }
+
+    proc path {digest} {
+        set store_dir [vessel::env::layer_store_dir]
+        set path [file join $store_dir [object_name $digest]]
+        set legacy_path [file join $store_dir [legacy_object_name $digest]]
+        if {![file exists $path] && [file exists $legacy_path]} {
+            return $legacy_path
+        }
+        return $path
+    }
+
+    # Layers written before layers were tar archives are zip files with
+    # the layer tarball and whiteouts.txt
+    proc is_legacy {digest} {
+        set chan [open [path $digest] rb]
+        try {
+            return [expr {[read $chan 4] eq "PK\x03\x04"}]
+        } finally {
+            close $chan
+        }
+    }
+
+    proc write_chunk_index {digest chunks} {
+        set chan [open "[path $digest].chunks" w]
+        try {
+            puts $chan $chunks
+        } finally {
+            close $chan
+        }
+    }
+
+    # The chunks of a layer or an empty list if it wasn't chunked
+    proc chunk_index {digest} {
+        set index_path "[path $digest].chunks"
+        if {![file exists $index_path]} {
+            return {}
+        }
+        set chan [open $index_path]
+        try {
+            return [string trim [read $chan]]
+        } finally {
+            close $chan
+        }
+    }
+
+    # Returns a dict from the digest of every chunk of the stored layers
+    # to the path of a layer that has it and its offset and size there
+    proc local_chunks {} {
+        set chunks [dict create]
+        set layers_dir [file join [vessel::env::layer_store_dir] sha256]
+        foreach index_path [glob -nocomplain -directory $layers_dir *.chunks] {
+            set layer_path [file rootname $index_path]
+            if {![file exists $layer_path]} {
+                continue
+            }
+            set offset 0
+            foreach chunk [chunk_index "sha256:[file tail $layer_path]"] {
+                set size [dict get $chunk size]
+                dict set chunks [dict get $chunk digest] [list $layer_path $offset $size]
+                incr offset $size
+            }
+        }
+        return $chunks
+    }
+
+    # Appends size bytes of the file at path from offset to the channel
+    proc copy_range {path offset size chan} {
+        fconfigure $chan -translation binary
+        set in [open $path rb]
+        try {
+            seek $in $offset
+            fcopy $in $chan -size $size
+        } finally {
+            close $in
+        }
+    }
+
+    # Where a layer is downloaded before it is verified and added
+    proc download_path {digest} {
+        set downloads_dir [file join [vessel::env::layer_store_dir] downloads]
+        file mkdir $downloads_dir
+        return [file join $downloads_dir [_hex $digest]]
+    }
+
+    # Where a chunk is downloaded before it is verified.  A layer with a
+    # single chunk has the same digest as its chunk.
+    proc chunk_download_path {digest} {
+        return "[download_path $digest].chunk"
+    }
+
+    proc exists {digest} {
+        return [file exists [path $digest]]
+    }
+
+    # Returns the digests from the list that aren't in the store
+    proc missing {digests} {
+        set missing {}
+        foreach digest $digests {
+            if {![exists $digest]} {
+                lappend missing $digest
+            }
+        }
+        return $missing
+    }
+
+    proc digest {layer_path} {
+        return "sha256:[vessel::s3::sha256 $layer_path]"
+    }
+
+    # Moves the layer archive into the store and returns its digest.  If
+    # the expected digest is given the layer is only added when it
+    # matches, otherwise the archive is deleted.
+    proc add {layer_path {expected_digest {}}} {
+        variable log
+
+        set digest [digest $layer_path]
+        if {$expected_digest ne {} && $digest ne $expected_digest} {
+            file delete $layer_path
+            return -code error -errorcode {LAYER DIGEST EMISMATCH} \
+                "Layer digest ${digest} doesn't match ${expected_digest}"
+        }
+
+        return [store $layer_path $digest]
+    }
+
+    # Moves a layer archive whose digest is already known into the store.
+    # Used when the digest was computed while the layer was written.
+    proc store {layer_path digest} {
+        variable log
+
+        set store_path [file join [vessel::env::layer_store_dir] [object_name $digest]]
+        file mkdir [file dirname $store_path]
+        file rename -force $layer_path $store_path
+        ${log}::debug "Added layer ${digest}"
+        return $digest
+    }
+}
+
+package provide vessel::layer_store 1.0.0
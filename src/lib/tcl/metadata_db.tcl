@@ -68,6 +68,17 @@ namespace eval vessel::metadata_db {
             #    parent_images: Currently will always be some version of FreeBSD defaults
             #                  to FreeBSD:12.1.  In the future we can make it a sorted list
             #                  of images. This is expected to be a list with a single element
+            #    layers: Digests of the layers applied on top of the parent image in
+            #            the order they are applied.  Empty until the image is exported.
+            #    compression: dict with the codec and level the layers are
+            #                 compressed with.  Empty until the image is exported.
+            #    format: tar when the layers are archives written by
+            #            vessel::archive::write_layer, zfs when they are
+            #            zfs send streams.  Defaults to tar
+            #    parent_guid: guid of the parent image snapshot a zfs stream
+            #                 applies to.  Empty for tar layers
+            #    chunks: dict from the digest of each chunked layer to the list
+            #            of its chunks, dicts with their digest and size
 
             set name [dict_get_value $metadata_dict {name} {}]
             if {$name eq {}} {
@@ -79,6 +90,11 @@ namespace eval vessel::metadata_db {
             set command [dict_get_value $metadata_dict {command} {/etc/rc}]
             set cwd [dict_get_value $metadata_dict {cwd} {/}]
             set parent_images [dict_get_value $metadata_dict {parent_images} {FreeBSD:12.1}]
+            set layers [dict_get_value $metadata_dict {layers} {}]
+            set compression [dict_get_value $metadata_dict {compression} {}]
+            set format [dict_get_value $metadata_dict {format} {tar}]
+            set parent_guid [dict_get_value $metadata_dict {parent_guid} {}]
+            set chunks [dict_get_value $metadata_dict {chunks} {}]
 
             set json_str [json::write object \
                 "name" [json::write string $name] \
@@ -87,7 +103,23 @@ namespace eval vessel::metadata_db {
                 {*}[lmap l $command {json::write string $l}]] \
                 "cwd" [json::write string $cwd] \
                 "parent_images" [json::write array \
-                {*}[lmap l $parent_images {json::write string $l}]]]
+                {*}[lmap l $parent_images {json::write string $l}]] \
+                "layers" [json::write array \
+                {*}[lmap l $layers {json::write string $l}]] \
+                "compression" [json::write object \
+                {*}[dict map {k v} $compression {
+                    expr {[string is integer -strict $v] ? $v : [json::write string $v]}
+                }]] \
+                "format" [json::write string $format] \
+                "parent_guid" [json::write string $parent_guid] \
+                "chunks" [json::write object \
+                {*}[dict map {layer layer_chunks} $chunks {
+                    json::write array {*}[lmap chunk $layer_chunks {
+                        json::write object \
+                            "digest" [json::write string [dict get $chunk digest]] \
+                            "size" [dict get $chunk size]
+                    }]
+                }]]]
 
             return $json_str
         }
@@ -171,7 +203,24 @@ namespace eval vessel::metadata_db {
         return $metadata_file
     }
 
-    proc write_metadata_file {image_name tag cwd cmd parent_images} {
+    proc read_metadata_file {metadata_file} {
+
+        #Returns the metadata as a dict.  Metadata written before images
+        #had layers gets an empty list of layers and no compression and
+        #metadata written before zfs streams has tar layers that aren't
+        #chunked.
+
+        set metadata_dict [json::json2dict [fileutil::cat $metadata_file]]
+        foreach {key default} {layers {} compression {} format tar parent_guid {} chunks {}} {
+            if {![dict exists $metadata_dict $key]} {
+                dict set metadata_dict $key $default
+            }
+        }
+        return $metadata_dict
+    }
+
+    proc write_metadata_file {image_name tag cwd cmd parent_images {layers {}} {compression {}}
+                              {format tar} {parent_guid {}} {chunks {}}} {
 
         #params:
         #
@@ -180,6 +229,11 @@ namespace eval vessel::metadata_db {
         # cwd: current working directory when the container is started
         # cmd: Command to run by default
         # parent_image: The one parent image
+        # layers: Digests of the image layers in the layer store
+        # compression: dict with the codec and level of the layers
+        # format: tar or zfs
+        # parent_guid: guid of the parent image snapshot of a zfs stream
+        # chunks: dict from layer digests to the chunks of the layer
 
 
         set json_content [_::create_metadata_json [dict create \
@@ -187,7 +241,12 @@ namespace eval vessel::metadata_db {
             tag $tag \
             command $cmd \
             cwd $cwd \
-            parent_images $parent_images]]
+            parent_images $parent_images \
+            layers $layers \
+            compression $compression \
+            format $format \
+            parent_guid $parent_guid \
+            chunks $chunks]]
 
         try {
             #Tempfile rename to avoid corruption
@@ -212,6 +271,16 @@ namespace eval vessel::metadata_db {
         return [file exists $metadata_file]
     }
 
+    proc image_layers {image tag} {
+
+        #Layer digests of a local image.  Empty if the image doesn't exist
+        #or hasn't been exported or imported with layers.
+        if {![image_exists $image $tag]} {
+            return {}
+        }
+        return [dict get [read_metadata_file [metadata_file_path $image $tag]] layers]
+    }
+
     proc image_command {args_dict} {
 
         set do_list [_::dict_get_value $args_dict "list" false]
@@ -8,6 +8,7 @@ package ifneeded vessel::env 1.0.0 [list source [file join $dir environment.tcl]
 package ifneeded vessel::export 1.0.0 [list source [file join $dir export.tcl]]
 package ifneeded vessel::import 1.0.0 [list source [file join $dir import.tcl]]
 package ifneeded vessel::jail 1.0.0 [list source [file join $dir jail.tcl]]
+package ifneeded vessel::layer_store 1.0.0 [list source [file join $dir layer_store.tcl]]
 package ifneeded vessel::metadata_db 1.0.0 [list source [file join $dir metadata_db.tcl]]
 package ifneeded vessel::name-gen 1.0.0 [list source [file join $dir name-gen.tcl]]
 package ifneeded vessel::native 1.0.0 [list load [file join $dir libvesseltcl.so]]
@@ -3,10 +3,13 @@
 package require vessel::env
 package require vessel::export
 package require vessel::import
+package require vessel::layer_store
+package require vessel::metadata_db
 package require vessel::native
 
 package require defer
 package require fileutil
+package require inifile
 package require uri
 package require TclOO
 
@@ -20,6 +23,8 @@ namespace eval vessel::repo {
         variable _full_url
         variable _scheme
         variable _path
+        variable _format
+        variable _chain
 
         constructor {url} {
             set _full_url ${url}
@@ -30,31 +35,676 @@ namespace eval vessel::repo {
             set _scheme [dict get $url_dict scheme]
 
             set _path [dict get $url_dict path]
+
+            #The format images are published in is chosen with the query,
+            # eg s3://bucket/images?format=zfs
+            set _format tar
+            foreach parameter [split [dict get $url_dict query] &] {
+                lassign [split $parameter =] key value
+                if {$key eq {format}} {
+                    set _format $value
+                }
+            }
+            if {$_format ni {tar zfs}} {
+                return -code error -errorcode {REPO FORMAT EINVALID} \
+                    "Unsupported image format: ${_format}"
+            }
+        }
+
+        # Objects are named relative to the root of the repository.  An
+        # image is its metadata, <image>:<tag>.json, which refers to its
+        # layers, layers/sha256/<hex>, by digest.  Chunked layers are only
+        # published as their chunks, chunks/sha256/<hex>, which are listed
+        # in the metadata.  Layers published as zip files are
+        # layers/sha256/<hex>.zip and images published before layers were
+        # content addressed are <image>:<tag>.zip.
+
+        # progress_cmd is called with the path being written and the number
+        # of bytes at its start that have been written as the download
+        # progresses so the object can be read before it is complete.
+        method get_object {name path {progress_cmd {}}} {
+            return -code error -errorcode {INTERFACECALL} \
+                "Subclass of repo must implement get_object"
+        }
+
+        method put_object {path name} {
+            return -code error -errorcode {INTERFACECALL} \
+                "Subclass of repo must implement put_object"
+        }
+
+        method object_exists {name} {
+            return -code error -errorcode {INTERFACECALL} \
+                "Subclass of repo must implement object_exists"
+        }
+
+        method delete_object {name} {
+            return -code error -errorcode {INTERFACECALL} \
+                "Subclass of repo must implement delete_object"
+        }
+
+        # Returns the names that aren't in the repository.  Subclasses can
+        # check them concurrently.
+        method missing_objects {names} {
+            set missing {}
+            foreach name $names {
+                if {![my object_exists $name]} {
+                    lappend missing $name
+                }
+            }
+            return $missing
+        }
+
+        # Downloads each name to the path at the same index.  done_cmd is
+        # called with the index of each object once it is downloaded.
+        # Subclasses can download them concurrently.
+        method get_objects {names paths {done_cmd {}}} {
+            set index 0
+            foreach name $names path $paths {
+                my get_object $name $path
+                if {$done_cmd ne {}} {
+                    {*}$done_cmd $index
+                }
+                incr index
+            }
+        }
+
+        # Uploads ranges of the file as objects.  Each range is a list of
+        # the offset, size and name of the object.  Subclasses can upload
+        # them concurrently and straight from the file.
+        method put_object_ranges {path ranges} {
+            foreach range $ranges {
+                lassign $range offset size name
+                set chan [file tempfile range_path]
+                try {
+                    vessel::layer_store::copy_range $path $offset $size $chan
+                } finally {
+                    close $chan
+                }
+
+                try {
+                    my put_object $range_path $name
+                } finally {
+                    file delete $range_path
+                }
+            }
+        }
+
+        method _metadata_name {image tag} {
+            return "${image}:${tag}.json"
+        }
+
+        method _layer_name {digest} {
+            return "layers/[vessel::layer_store::object_name $digest]"
+        }
+
+        method _legacy_layer_name {digest} {
+            return "layers/[vessel::layer_store::legacy_object_name $digest]"
+        }
+
+        method _chunk_name {digest} {
+            return "chunks/[vessel::layer_store::object_name $digest]"
+        }
+
+        # Downloads the image metadata into downloaddir and the layers that
+        # aren't already in the local layer store.  Returns the path of the
+        # downloaded metadata file or zip file for images published before
+        # layers were content addressed.  The importer, a
+        # vessel::import::pipeline, is told about the metadata and the
+        # layers as they arrive so it can extract them during the pull.
+        method pull_image {image tag downloaddir {importer {}}} {
+            variable ::vessel::repo::log
+
+            if {![file exists $downloaddir]} {
+                file mkdir $downloaddir
+            }
+
+            set metadata_name [my _metadata_name $image $tag]
+            set metadata_path [file join $downloaddir $metadata_name]
+            if {![my object_exists $metadata_name]} {
+                set zip_name "${image}:${tag}.zip"
+                if {![my object_exists $zip_name]} {
+                    return -code error -errorcode {REPO PULL ENOIMAGE} \
+                        "Image does not exist: ${image}:${tag}"
+                }
+
+                #Imports use the metadata file when it exists
+                file delete $metadata_path
+                set image_path [file join $downloaddir $zip_name]
+                if {[file exists $image_path]} {
+                    ${log}::warn "Image already exists.  Continuing"
+                } else {
+                    my get_object $zip_name $image_path
+                }
+                return $image_path
+            }
+
+            #Tags can be published again so the metadata is always fetched
+            my get_object $metadata_name $metadata_path
+            if {$importer ne {}} {
+                $importer metadata $metadata_path
+            }
+            set metadata_dict [vessel::metadata_db::read_metadata_file $metadata_path]
+            set chunks [dict get $metadata_dict chunks]
+            foreach digest [dict get $metadata_dict layers] {
+                set layer_chunks {}
+                if {[dict exists $chunks $digest]} {
+                    set layer_chunks [dict get $chunks $digest]
+                }
+                my pull_layer $digest $importer $layer_chunks
+            }
+            return $metadata_path
+        }
+
+        # Pulls the layer into the layer store.  A layer with chunks is
+        # assembled from them.
+        method pull_layer {digest {importer {}} {chunks {}}} {
+            variable ::vessel::repo::log
+
+            if {[vessel::layer_store::exists $digest]} {
+                ${log}::debug "Layer ${digest} is already in the layer store"
+                if {$importer ne {}} {
+                    $importer stored_layer $digest
+                }
+                return
+            }
+
+            if {[llength $chunks] > 0} {
+                set progress_cmd {}
+                if {$importer ne {}} {
+                    $importer begin_layer $digest
+                    set progress_cmd [list $importer layer_progress]
+                }
+
+                vessel::layer_store::add [my _pull_chunks $digest $chunks $progress_cmd] $digest
+                vessel::layer_store::write_chunk_index $digest $chunks
+                if {$importer ne {}} {
+                    $importer end_layer $digest
+                }
+                return
+            }
+
+            set layer_name [my _layer_name $digest]
+            if {![my object_exists $layer_name] &&
+                [my object_exists [my _legacy_layer_name $digest]]} {
+                set layer_name [my _legacy_layer_name $digest]
+                if {$importer ne {}} {
+                    $importer disable
+                    set importer {}
+                }
+            }
+
+            set progress_cmd {}
+            if {$importer ne {}} {
+                $importer begin_layer $digest
+                set progress_cmd [list $importer layer_progress]
+            }
+
+            set download_path [vessel::layer_store::download_path $digest]
+            my get_object $layer_name $download_path $progress_cmd
+            vessel::layer_store::add $download_path $digest
+            if {$importer ne {}} {
+                $importer end_layer $digest
+            }
+        }
+
+        # Assembles a chunked layer at its download path and returns the
+        # path.  Chunks of the layers in the layer store are copied from
+        # them and only the others are downloaded.  The progress of the
+        # layer is reported as each chunk is written in order.
+        method _pull_chunks {digest chunks progress_cmd} {
+            variable ::vessel::repo::log
+
+            set local_chunks [vessel::layer_store::local_chunks]
+            set fetched [my _chunk_downloads $chunks $local_chunks {}]
+            set sizes [dict create]
+            foreach chunk $chunks {
+                if {[dict exists $fetched [dict get $chunk digest]]} {
+                    dict set sizes [dict get $chunk digest] [dict get $chunk size]
+                }
+            }
+            set bytes [tcl::mathop::+ 0 {*}[dict values $sizes]]
+            ${log}::info "Pulling [dict size $fetched] of [llength $chunks] chunks of ${digest}: $bytes bytes"
+
+            try {
+                my get_objects [lmap chunk_digest [dict keys $fetched] {my _chunk_name $chunk_digest}] \
+                    [dict values $fetched]
+                return [my _assemble_chunks $digest $chunks $local_chunks $fetched $progress_cmd]
+            } finally {
+                file delete {*}[dict values $fetched]
+            }
+        }
+
+        # Adds the chunks that are neither local chunks nor already fetched
+        # to fetched, a dict of chunk digest -> download path, and returns
+        # it.
+        method _chunk_downloads {chunks local_chunks fetched} {
+            foreach chunk $chunks {
+                set chunk_digest [dict get $chunk digest]
+                if {[dict exists $local_chunks $chunk_digest] || [dict exists $fetched $chunk_digest]} {
+                    continue
+                }
+
+                set path [vessel::layer_store::chunk_download_path $chunk_digest]
+                file delete $path
+                dict set fetched $chunk_digest $path
+            }
+            return $fetched
+        }
+
+        # Writes a chunked layer to its download path from the fetched and
+        # local chunks and returns the path.  The fetched chunks are checked
+        # against their digest first.
+        method _assemble_chunks {digest chunks local_chunks fetched progress_cmd} {
+            foreach chunk $chunks {
+                set chunk_digest [dict get $chunk digest]
+                if {[dict exists $fetched $chunk_digest] &&
+                    [vessel::layer_store::digest [dict get $fetched $chunk_digest]] ne $chunk_digest} {
+                    return -code error -errorcode {REPO PULL ECHUNK} \
+                        "Chunk ${chunk_digest} of ${digest} doesn't match its digest"
+                }
+            }
+
+            set download_path [vessel::layer_store::download_path $digest]
+            set chan [open $download_path wb]
+            try {
+                set written 0
+                foreach chunk $chunks {
+                    set chunk_digest [dict get $chunk digest]
+                    set size [dict get $chunk size]
+                    if {[dict exists $fetched $chunk_digest]} {
+                        vessel::layer_store::copy_range [dict get $fetched $chunk_digest] 0 $size $chan
+                    } else {
+                        lassign [dict get $local_chunks $chunk_digest] layer_path offset
+                        vessel::layer_store::copy_range $layer_path $offset $size $chan
+                    }
+                    incr written $size
+                    flush $chan
+                    if {$progress_cmd ne {}} {
+                        {*}$progress_cmd $download_path $written
+                    }
+                }
+            } finally {
+                close $chan
+            }
+            return $download_path
+        }
+
+        # Returns the ancestors of the image that aren't imported, root
+        # first, as a list of {image tag}.  The metadata of the image and
+        # of each of them is downloaded into downloaddir.  The chain ends
+        # at the first parent image that is imported so it's empty when
+        # the image can be imported on its own.
+        method resolve_chain {image tag downloaddir} {
+            if {![file exists $downloaddir]} {
+                file mkdir $downloaddir
+            }
+
+            set metadata_name [my _metadata_name $image $tag]
+            if {![my object_exists $metadata_name]} {
+                #Images published as zip files are pulled on their own
+                return {}
+            }
+
+            set chain {}
+            set child "${image}:${tag}"
+            while {1} {
+                set metadata_path [file join $downloaddir $metadata_name]
+                my get_object $metadata_name $metadata_path
+                set parent_image [lindex [dict get [vessel::metadata_db::read_metadata_file $metadata_path] \
+                                              parent_images] 0]
+                if {$parent_image eq {} || [vessel::import::image_snapshot $parent_image] ne {}} {
+                    return $chain
+                }
+
+                lassign [split $parent_image :] image tag
+                if {[lsearch -exact $chain [list $image $tag]] != -1} {
+                    return -code error -errorcode {REPO PULL ECHAIN} \
+                        "Image ${parent_image} is its own ancestor"
+                }
+                set metadata_name [my _metadata_name $image $tag]
+                if {![my object_exists $metadata_name]} {
+                    return -code error -errorcode {REPO PULL ENOPARENT} \
+                        "Parent image ${parent_image} of ${child} is neither imported nor in the repository"
+                }
+                set chain [linsert $chain 0 [list $image $tag]]
+                set child $parent_image
+            }
+        }
+
+        # Pulls and imports the images, a list of {image tag} ancestors
+        # first, whose metadata was downloaded into downloaddir by
+        # resolve_chain.  The chunks of all of them that aren't local are
+        # downloaded as a single batch, which subclasses run concurrently.
+        # Whole layers follow one at a time in chain order with get_object
+        # so they keep its ranged download, resume and digest check.  Each
+        # image gets an importer from importer_cmd, called with the image,
+        # tag and status channel, which is a vessel::import::pipeline by
+        # default.  The layers of an image are extracted on their own
+        # thread as soon as they have arrived and its parent is imported so
+        # the downloads carry on meanwhile.  Images the importer can't
+        # stream are imported once every download is over.
+        method pull_chain {images downloaddir status_channel {importer_cmd {vessel::import::pipeline new}}} {
+            variable ::vessel::repo::log
+
+            set local_chunks [vessel::layer_store::local_chunks]
+            set _chain [dict create images {} next 0 downloaddir $downloaddir \
+                            status_channel $status_channel importer_cmd $importer_cmd \
+                            importer {} layer 0 extracting 0 downloading 1 \
+                            local_chunks $local_chunks fetched {} names {} paths {} waiting {} \
+                            layers {} pending {} chunks {} error {}]
+            try {
+                foreach image_tag $images {
+                    lassign $image_tag image tag
+                    set metadata_dict [vessel::metadata_db::read_metadata_file \
+                                           [file join $downloaddir [my _metadata_name $image $tag]]]
+                    set layers [dict get $metadata_dict layers]
+                    dict lappend _chain images [list $image $tag $layers]
+                    foreach digest $layers {
+                        if {[vessel::layer_store::exists $digest] || [dict exists $_chain pending $digest]} {
+                            continue
+                        }
+                        if {[dict exists $metadata_dict chunks $digest]} {
+                            my _chain_chunks $digest [dict get $metadata_dict chunks $digest]
+                        } else {
+                            my _chain_layer $image $tag $digest
+                        }
+                    }
+                }
+
+                set names [dict get $_chain names]
+                set layers [dict get $_chain layers]
+                ${log}::info "Pulling [llength $names] chunks and [dict size $layers] layers for [llength $images] images"
+
+                #Chunked layers whose chunks are all local are ready already
+                dict for {digest count} [dict get $_chain pending] {
+                    if {$count == 0} {
+                        my _chain_layer_done $digest
+                    }
+                }
+                my _chain_import_ready
+
+                try {
+                    my get_objects $names [dict get $_chain paths] [namespace code [list my _chain_object_done]]
+                    dict for {digest name} $layers {
+                        if {[dict get $_chain error] ne {}} {
+                            break
+                        }
+                        my get_object $name [vessel::layer_store::download_path $digest]
+                        my _chain_layer_done $digest
+                        my _chain_import_ready
+                    }
+                } on error {msg options} {
+                    if {[dict get $_chain error] eq {}} {
+                        dict set _chain error [list $msg $options]
+                    }
+                }
+                dict set _chain downloading 0
+                if {[dict get $_chain error] eq {}} {
+                    my _chain_import_ready
+                }
+
+                #The extraction of the last layers finishes on the event loop
+                while {[dict get $_chain extracting] && [dict get $_chain error] eq {}} {
+                    vwait [my varname _chain]
+                }
+                if {[dict get $_chain error] ne {}} {
+                    return -options [lindex [dict get $_chain error] 1] [lindex [dict get $_chain error] 0]
+                }
+
+                set next [dict get $_chain next]
+                if {$next < [llength $images]} {
+                    return -code error -errorcode {REPO PULL ELAYER} \
+                        "Layers of [join [lindex $images $next] :] were not pulled"
+                }
+            } finally {
+                set importer [dict get $_chain importer]
+                if {$importer ne {}} {
+                    $importer abort
+                    $importer destroy
+                }
+                file delete {*}[dict values [dict get $_chain fetched]]
+                set _chain {}
+            }
         }
 
-        method pull_image {image tag downloaddir} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement pull_image"
+        # Adds the chunks of the layer that aren't local to the batch
+        method _chain_chunks {digest chunks} {
+            set fetched [dict get $_chain fetched]
+            set names [dict create]
+            foreach chunk $chunks {
+                set chunk_digest [dict get $chunk digest]
+                if {[dict exists $_chain local_chunks $chunk_digest]} {
+                    continue
+                }
+
+                set name [my _chunk_name $chunk_digest]
+                if {![dict exists $fetched $chunk_digest]} {
+                    set fetched [my _chunk_downloads [list $chunk] [dict get $_chain local_chunks] $fetched]
+                    dict lappend _chain names $name
+                    dict lappend _chain paths [dict get $fetched $chunk_digest]
+                }
+                if {![dict exists $names $name]} {
+                    dict set names $name 1
+                    dict set _chain waiting $name [concat [my _chain_waiting $name] [list $digest]]
+                }
+            }
+            dict set _chain fetched $fetched
+            dict set _chain chunks $digest $chunks
+            dict set _chain pending $digest [dict size $names]
         }
 
-        method put_image {image_path} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement put_image"
+        # Adds the layer of the image to the whole layers to download
+        method _chain_layer {image tag digest} {
+            set name [my _layer_name $digest]
+            if {![my object_exists $name]} {
+                if {![my object_exists [my _legacy_layer_name $digest]]} {
+                    return -code error -errorcode {REPO PULL ELAYER} \
+                        "Layer ${digest} of ${image}:${tag} is not in the repository"
+                }
+                set name [my _legacy_layer_name $digest]
+            }
+
+            dict set _chain layers $digest $name
+            dict set _chain pending $digest 1
+        }
+
+        method _chain_waiting {name} {
+            if {[dict exists $_chain waiting $name]} {
+                return [dict get $_chain waiting $name]
+            }
+            return {}
+        }
+
+        # An object of the batch was downloaded.  Errors are kept until the
+        # batch is over since the downloads report them on the event loop.
+        method _chain_object_done {index} {
+            if {[dict get $_chain error] ne {}} {
+                return
+            }
+
+            try {
+                set name [lindex [dict get $_chain names] $index]
+                foreach digest [my _chain_waiting $name] {
+                    set count [expr {[dict get $_chain pending $digest] - 1}]
+                    dict set _chain pending $digest $count
+                    if {$count == 0} {
+                        my _chain_layer_done $digest
+                    }
+                }
+                my _chain_import_ready
+            } on error {msg options} {
+                dict set _chain error [list $msg $options]
+            }
+        }
+
+        # Adds a layer whose objects were all downloaded to the layer store
+        method _chain_layer_done {digest} {
+            if {[dict exists $_chain chunks $digest]} {
+                set chunks [dict get $_chain chunks $digest]
+                set path [my _assemble_chunks $digest $chunks [dict get $_chain local_chunks] \
+                              [dict get $_chain fetched] {}]
+                vessel::layer_store::add $path $digest
+                vessel::layer_store::write_chunk_index $digest $chunks
+            } else {
+                vessel::layer_store::add [vessel::layer_store::download_path $digest] $digest
+            }
+        }
+
+        # Imports the next images of the chain as far as their layers have
+        # arrived.  Only one layer is extracted at a time and it is left to
+        # the importer's thread, so this returns as soon as it has started.
+        method _chain_import_ready {} {
+            set images [dict get $_chain images]
+            set status_channel [dict get $_chain status_channel]
+            while {![dict get $_chain extracting] && [dict get $_chain next] < [llength $images]} {
+                lassign [lindex $images [dict get $_chain next]] image tag layers
+                set importer [dict get $_chain importer]
+                if {$importer eq {}} {
+                    puts $status_channel "Importing ${image}:${tag}"
+                    set importer [{*}[dict get $_chain importer_cmd] $image $tag $status_channel]
+                    dict set _chain importer $importer
+                    dict set _chain layer 0
+                    $importer metadata [file join [dict get $_chain downloaddir] [my _metadata_name $image $tag]]
+                }
+
+                if {[$importer enabled]} {
+                    set layer [dict get $_chain layer]
+                    if {$layer < [llength $layers]} {
+                        set digest [lindex $layers $layer]
+                        if {![vessel::layer_store::exists $digest]} {
+                            return
+                        }
+                        dict set _chain extracting 1
+                        $importer stored_layer $digest [namespace code [list my _chain_layer_extracted]]
+                        continue
+                    }
+                    $importer finish
+                } else {
+                    if {[dict get $_chain downloading] || [llength [vessel::layer_store::missing $layers]] > 0} {
+                        return
+                    }
+                    vessel::import::import $image $tag [dict get $_chain downloaddir] $status_channel
+                }
+
+                $importer destroy
+                dict set _chain importer {}
+                dict incr _chain next
+            }
+        }
+
+        # The importer finished extracting a layer of the chain
+        method _chain_layer_extracted {error} {
+            dict set _chain extracting 0
+            if {[dict get $_chain error] ne {}} {
+                return
+            }
+            if {$error ne {}} {
+                dict set _chain error $error
+                return
+            }
+
+            try {
+                dict incr _chain layer
+                my _chain_import_ready
+            } on error {msg options} {
+                dict set _chain error [list $msg $options]
+            }
+        }
+
+        # Publishes the image from its metadata file.  Only the layers and
+        # chunks the repository doesn't have are sent.
+        method put_image {metadata_path} {
+            set extension [file extension $metadata_path]
+            if {$extension ne ".json"} {
+                return -code error -errorcode {REPO PUT EFORMAT} \
+                    "Unexpected image metadata extension: $extension"
+            }
+
+            set metadata_dict [vessel::metadata_db::read_metadata_file $metadata_path]
+            set layers [dict get $metadata_dict layers]
+            set missing_layers [vessel::layer_store::missing $layers]
+            if {[llength $missing_layers] > 0} {
+                return -code error -errorcode {REPO PUT ENOLAYER} \
+                    "Layers are missing from the layer store: $missing_layers"
+            }
+
+            set chunks [dict get $metadata_dict chunks]
+            foreach digest $layers {
+                if {[dict exists $chunks $digest]} {
+                    my _put_chunks $digest [dict get $chunks $digest]
+                } elseif {![my layer_exists $digest]} {
+                    my put_object [vessel::layer_store::path $digest] [my _layer_name $digest]
+                }
+            }
+
+            #The metadata goes last so it never refers to missing layers
+            my put_object $metadata_path [file tail $metadata_path]
+        }
+
+        # Sends the chunks of the layer that the repository doesn't have
+        # straight from the layer
+        method _put_chunks {digest chunks} {
+            variable ::vessel::repo::log
+
+            set ranges [dict create]
+            set offset 0
+            foreach chunk $chunks {
+                set name [my _chunk_name [dict get $chunk digest]]
+                if {![dict exists $ranges $name]} {
+                    dict set ranges $name [list $offset [dict get $chunk size] $name]
+                }
+                incr offset [dict get $chunk size]
+            }
+
+            set missing [my missing_objects [dict keys $ranges]]
+            ${log}::info "Pushing [llength $missing] of [llength $chunks] chunks of ${digest}"
+            my put_object_ranges [vessel::layer_store::path $digest] \
+                [lmap name $missing {dict get $ranges $name}]
         }
 
         method reconfigure {} {
-            return -code error errorcode {INTERFACECALL} \
+            return -code error -errorcode {INTERFACECALL} \
                 "Subclass of repo must implement reconfigure"
         }
 
+        # Layers can be shared by other images so only the metadata is deleted
         method delete_image {image tag} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement delete"
+            my delete_object [my _metadata_name $image $tag]
+        }
+
+        method layer_exists {digest} {
+            return [expr {[my object_exists [my _layer_name $digest]] ||
+                          [my object_exists [my _legacy_layer_name $digest]]}]
         }
 
+        # An image exists when its metadata and all of the layers it refers
+        # to exist.
         method image_exists {image tag} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement image_exists"
+            set metadata_name [my _metadata_name $image $tag]
+            if {![my object_exists $metadata_name]} {
+                return [my object_exists "${image}:${tag}.zip"]
+            }
+
+            close [file tempfile metadata_path]
+            try {
+                my get_object $metadata_name $metadata_path
+                set metadata_dict [vessel::metadata_db::read_metadata_file $metadata_path]
+            } finally {
+                file delete $metadata_path
+            }
+
+            set chunks [dict get $metadata_dict chunks]
+            foreach digest [dict get $metadata_dict layers] {
+                if {[dict exists $chunks $digest]} {
+                    set names [lmap chunk [dict get $chunks $digest] {my _chunk_name [dict get $chunk digest]}]
+                    if {[llength [my missing_objects $names]] > 0} {
+                        return 0
+                    }
+                } elseif {![my layer_exists $digest]} {
+                    return 0
+                }
+            }
+            return 1
         }
 
         method get_url {} {
@@ -71,6 +721,14 @@ namespace eval vessel::repo {
             return $_path
         }
 
+        # tar publishes layer archives that can be pulled on top of any
+        # copy of the parent image.  zfs publishes zfs send streams which
+        # are faster to create and import but can only be pulled where the
+        # parent image snapshot has the same guid.
+        method image_format {} {
+            return $_format
+        }
+
         method get_status_channel {} {
             #subclasses can override if they need to change
             return stderr
@@ -95,112 +753,543 @@ namespace eval vessel::repo {
             }
         }
 
-        method pull_image {image tag downloaddir} {
+        method _object_path {name} {
+            return [file join [my get_path] $name]
+        }
+
+        method get_object {name path {progress_cmd {}}} {
             variable ::vessel::repo::log
 
-            set image_path [file join [my get_path] "${image}:${tag}.zip"]
-            if {![my image_exists $image $tag]} {
-                return -code error -errorcode {REPO PULL ENOIMAGE} \
-                    "Image path does not exist: $image_path"
+            set object_path [my _object_path $name]
+            if {![file exists $object_path]} {
+                return -code error -errorcode {REPO FILE ENOENT} \
+                    "Object does not exist: $object_path"
             }
 
-            if {![file exists $downloaddir]} {
-                file mkdir $downloaddir
-            }
-
-            ${log}::debug "Copying image: ${image_path} -> ${downloaddir}"
-            try {
-                file copy $image_path $downloaddir
-            } trap {POSIX EEXIST} {1 2} {
-                ${log}::warn "Image already exists.  Continuing"
+            ${log}::debug "Copying: ${object_path} -> ${path}"
+            file copy -force $object_path $path
+            if {$progress_cmd ne {}} {
+                {*}$progress_cmd $path [file size $path]
             }
         }
 
-        method put_image {image_path} {
-            set output_path [my get_path]
-
-            #TODO: Parse out image name from image path
-            set repo_url [vessel::env::get_repo_url]
-
-            set image_path_components [file split $image_path]
-            set image_zip_name [lrange $image_path_components end end]
-            puts "$image_path_components,$image_zip_name"
-            set extension [file extension $image_zip_name]
-            if {$extension ne ".zip"} {
-                return -code error -errorcode {REPO PUT EFORMAT} \
-                    "Unexpected image extension: $extension"
-            }
+        method put_object {path name} {
+            set object_path [my _object_path $name]
+            file mkdir [file dirname $object_path]
 
-            exec curl file://localhost/$image_path -o \
-                [file join $output_path $image_zip_name] \
-                >&@ [my get_status_channel]
+            #Copy next to the object and rename it so readers never see a
+            #partial object
+            file copy -force $path "${object_path}.tmp"
+            file rename -force "${object_path}.tmp" $object_path
         }
 
-        method image_exists {image tag} {
+        method object_exists {name} {
+            return [file exists [my _object_path $name]]
+        }
 
-            set image_path [file join [my get_path] "${image}:${tag}.zip"]
-            return [file exists $image_path]
+        method delete_object {name} {
+            file delete [my _object_path $name]
         }
 
         destructor {
+            variable ::vessel::repo::log
             ${log}::debug "destroying repo"
         }
     }
 
     oo::class create s3repo {
         superclass repo
-        variable _config_file
-        variable _s3_cmd
+        variable _client
+        variable _bucket
+        variable _prefix
+        variable _concurrency
+        variable _part_size
+        variable _retries
+        variable _requests
+        variable _attempts
+        variable _on_done
+        variable _manifest
+        variable _pending
+        variable _results
 
-        constructor {url {config_file {}}} {
+        # Options:
+        #   -concurrency count  Transfers run in parallel
+        #   -part-size bytes    Size of the parts of multipart uploads and
+        #                       ranged downloads.  S3 requires at least 5MiB
+        #                       for every part except the last.
+        #   -retries count      Times a failed part is retried
+        constructor {url {config_file {}} args} {
             next $url
-            
-            if {$config_file ne {}} {
-                set _s3_cmd [list s3cmd -c $config_file]
-            } else {
-                set _s3_cmd [list s3cmd]
+
+            set _concurrency [vessel::env::s3_concurrency]
+            set _part_size [vessel::env::s3_part_size]
+            set _retries [vessel::env::s3_retries]
+            foreach {option value} $args {
+                switch -exact -- $option {
+                    -concurrency {set _concurrency $value}
+                    -part-size {set _part_size $value}
+                    -retries {set _retries $value}
+                    default {
+                        return -code error -errorcode {REPO S3 EOPTION} \
+                            "Unknown s3repo option: $option"
+                    }
+                }
             }
 
             if {[my get_scheme] ne {s3}} {
                 return -code error -errorcode {REPO SCHEME ENOTSUPPORTED} \
-                    "Scheme: $scheme is not supported by s3repo"
+                    "Scheme: [my get_scheme] is not supported by s3repo"
             }
+
+            #s3://bucket/optional/prefix
+            set _bucket [dict get [vessel::url::parse $url] host]
+            set _prefix [string trim [my get_path] /]
+
+            set _client [vessel::s3::client {*}[my _client_options $config_file] \
+                             -max-connections $_concurrency]
         }
 
-        method _get_s3_image_url {image tag} {
-            #TODO: this is everywhere
-            set image_name "${image}:${tag}.zip"
-            puts "image_name: $image_name -> $image,$tag"
-            set image_url [join [list [my get_url] $image_name] /]
+        # Builds the native client options from the s3cmd configuration
+        # file.  The environment takes precedence over the file.
+        method _client_options {config_file} {
+            set options [dict create]
+
+            if {$config_file ne {} && [file exists $config_file]} {
+                set fh [ini::open $config_file r]
+                defer::with [list fh] {
+                    ini::close $fh
+                }
+
+                set config [dict create]
+                if {[ini::exists $fh default]} {
+                    set config [ini::get $fh default]
+                }
+
+                if {[dict exists $config access_key]} {
+                    dict set options -access-key [dict get $config access_key]
+                }
+                if {[dict exists $config secret_key]} {
+                    dict set options -secret-key [dict get $config secret_key]
+                }
+                if {[dict exists $config host_base]} {
+                    set scheme https
+                    if {[dict exists $config use_https] &&
+                        ![string is true -strict [dict get $config use_https]]} {
+                        set scheme http
+                    }
+                    dict set options -endpoint "${scheme}://[dict get $config host_base]"
+                }
+                if {[dict exists $config host_bucket]} {
+                    dict set options -path-style \
+                        [expr {[string first {%(bucket)s} [dict get $config host_bucket]] == -1}]
+                }
+                if {[dict exists $config bucket_location] &&
+                    [dict get $config bucket_location] ni {{} US}} {
+                    dict set options -region [dict get $config bucket_location]
+                }
+            }
+
+            set endpoint [vessel::env::s3_endpoint]
+            if {$endpoint ne {}} {
+                #Custom endpoints are generally S3 compatible servers
+                #that only support path style addressing
+                dict set options -endpoint $endpoint
+                dict set options -path-style 1
+            }
+
+            set region [vessel::env::get_from_env AWS_DEFAULT_REGION]
+            if {$region ne {}} {
+                dict set options -region $region
+            }
+
+            set access_key [vessel::env::get_from_env AWS_ACCESS_KEY_ID]
+            if {$access_key ne {}} {
+                dict set options -access-key $access_key
+                dict set options -secret-key [vessel::env::get_from_env AWS_SECRET_ACCESS_KEY]
+            }
+
+            return $options
         }
 
-        method pull_image {image tag downloaddir} {
-            my variable _s3_cmd
-            set image_url [my _get_s3_image_url $image $tag]
-            exec {*}${_s3_cmd} get --skip-existing $image_url $downloaddir >&@ stderr
+        method _object_key {name} {
+            if {$_prefix eq {}} {
+                return $name
+            }
+            return "${_prefix}/${name}"
         }
 
-        method put_image {image_path} {
-            my variable _s3_cmd
-            exec {*}${_s3_cmd} put $image_path [my get_url] >&@stderr
+        # Failed transfers, server errors and short ranged downloads are
+        # worth retrying.  Other client errors will fail again.
+        method _should_retry {request result} {
+            if {[dict get $result error] ne {}} {
+                return 1
+            }
+
+            set status [dict get $result status]
+            if {$status >= 500 || $status == 429 || $status == 408} {
+                return 1
+            }
+
+            set options [lrange $request 3 end]
+            if {[dict exists $options -range] && [dict exists $options -outfile]} {
+                lassign [dict get $options -range] first last
+                return [expr {[dict get $result bytes] != $last - $first + 1}]
+            }
+            return 0
         }
 
-        method reconfigure {} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement reconfigure"
+        method _issue_request {index} {
+            lset _attempts $index [expr {[lindex $_attempts $index] + 1}]
+            if {[catch {
+                vessel::s3::request $_client {*}[lindex $_requests $index] \
+                    [namespace code [list my _request_done $index]]
+            } msg]} {
+                #Report it like a failed transfer so the batch still finishes
+                my _request_done $index [dict create status 0 headers {} body {} bytes 0 error $msg]
+            }
         }
 
-        method delete_image {image tag} {
-            return -code error errorcode {INTERFACECALL} \
-                "Subclass of repo must implement delete"
+        method _request_done {index result} {
+            variable ::vessel::repo::log
+
+            set attempts [lindex $_attempts $index]
+            if {$attempts <= $_retries && [my _should_retry [lindex $_requests $index] $result]} {
+                ${log}::warn "Retrying [lrange [lindex $_requests $index] 0 2] after attempt ${attempts}"
+                after [expr {100 * (1 << ($attempts - 1))}] [namespace code [list my _issue_request $index]]
+                return
+            }
+
+            lset _results $index $result
+            incr _pending -1
+            if {$_on_done ne {}} {
+                {*}$_on_done $index $result
+            }
         }
 
-        method image_exists {image tag} {
-            my variable _s3_cmd
-            
-            set image_url [my _get_s3_image_url $image $tag]
-            set ls_data [exec {*}${_s3_cmd} ls $image_url]
-            return [expr [string length $ls_data] > 0]
+        # Runs the requests concurrently on the native client and waits for
+        # all of them to finish.  At most -concurrency requests are in flight,
+        # curl queues the rest.  Each request is the list of arguments to
+        # vessel::s3::request following the client handle and without the
+        # callback.  on_done is called with the index and result of each
+        # request as it finishes.  Returns the result dictionaries in request
+        # order.
+        method _run_requests {requests {on_done {}}} {
+            set _requests $requests
+            set _on_done $on_done
+            set _pending [llength $requests]
+            set _results [lrepeat $_pending {}]
+            set _attempts [lrepeat $_pending 0]
+
+            for {set index 0} {$index < [llength $requests]} {incr index} {
+                my _issue_request $index
+            }
+
+            while {$_pending > 0} {
+                vwait [my varname _pending]
+            }
+            return $_results
+        }
+
+        # Raise an error for a failed transfer or an unsuccessful status
+        method _check_result {result action} {
+            if {[dict get $result error] ne {}} {
+                return -code error -errorcode {REPO S3 TRANSFER} \
+                    "${action} failed: [dict get $result error]"
+            }
+
+            set status [dict get $result status]
+            if {$status < 200 || $status >= 300} {
+                set code {}
+                regexp {<Code>([^<]*)</Code>} [dict get $result body] -> code
+                return -code error -errorcode [list REPO S3 $status] \
+                    "${action} failed with status ${status} ${code}"
+            }
+        }
+
+        method get_object {name path {progress_cmd {}}} {
+            variable ::vessel::repo::log
+
+            #Download next to the object so an interrupted pull is never
+            #mistaken for a complete object.  The manifest records the
+            #verified chunks of the partial file so a pull can be resumed.
+            set partial_path "${path}.part"
+            set manifest_path "${partial_path}.manifest"
+
+            set key [my _object_key $name]
+            set head [lindex [my _run_requests [list [list HEAD $_bucket $key]]] 0]
+            my _check_result $head "HEAD ${key}"
+            set headers [dict get $head headers]
+            set size [dict get $headers content-length]
+
+            set manifest [dict create etag {} size $size chunk_size $_part_size chunks {}]
+            if {[dict exists $headers etag]} {
+                dict set manifest etag [dict get $headers etag]
+            }
+            set _manifest [my _load_manifest $manifest_path $partial_path $manifest]
+            set chunks [dict get $_manifest chunks]
+            if {[dict size $chunks] == 0} {
+                close [open $partial_path w]
+            } else {
+                ${log}::info "Resuming pull of ${key} with [dict size $chunks] verified chunks"
+            }
+            my _write_manifest $manifest_path
+            my _report_progress $partial_path $progress_cmd
+
+            ${log}::debug "Downloading: s3://${_bucket}/${key} -> ${path}"
+            set requests {}
+            set indexes {}
+            for {set offset 0; set index 0} {$offset < $size} {incr offset $_part_size; incr index} {
+                if {[dict exists $chunks $index]} {
+                    continue
+                }
+
+                #Ranged chunks are written in place in the partial file
+                set last [expr {min($offset + $_part_size, $size) - 1}]
+                lappend requests [list GET $_bucket $key -range [list $offset $last] \
+                                      -outfile $partial_path -offset $offset]
+                lappend indexes $index
+            }
+
+            set results [my _run_requests $requests \
+                             [namespace code [list my _chunk_done $manifest_path $indexes \
+                                                  $partial_path $progress_cmd]]]
+            foreach result $results {
+                my _check_result $result "GET ${key}"
+            }
+
+            if {[file size $partial_path] != $size} {
+                file delete $partial_path $manifest_path
+                return -code error -errorcode {REPO S3 ESIZE} \
+                    "Downloaded [file size $partial_path] bytes of ${key}, expected ${size}"
+            }
+
+            #Objects pushed by vessel carry the digest of the whole object
+            if {[dict exists $headers x-amz-meta-sha256]} {
+                set digest [vessel::s3::sha256 $partial_path]
+                if {$digest ne [dict get $headers x-amz-meta-sha256]} {
+                    file delete $partial_path $manifest_path
+                    return -code error -errorcode {REPO S3 EDIGEST} \
+                        "Digest of ${key} doesn't match: ${digest}"
+                }
+            }
+
+            file rename -force $partial_path $path
+            file delete $manifest_path
+        }
+
+        # Returns the manifest with the chunks of a previous pull which are
+        # still intact in the partial file.  Chunks are only kept if the
+        # object, its size and the chunk size haven't changed.
+        method _load_manifest {manifest_path partial_path manifest} {
+            variable ::vessel::repo::log
+
+            if {![file exists $manifest_path] || ![file exists $partial_path]} {
+                return $manifest
+            }
+
+            if {[catch {
+                set chan [open $manifest_path r]
+                try {
+                    set previous [read $chan]
+                } finally {
+                    close $chan
+                }
+                dict size $previous
+            }]} {
+                ${log}::warn "Ignoring unreadable manifest: ${manifest_path}"
+                return $manifest
+            }
+
+            foreach field {etag size chunk_size} {
+                if {![dict exists $previous $field] ||
+                    [dict get $previous $field] ne [dict get $manifest $field]} {
+                    return $manifest
+                }
+            }
+
+            set chunk_size [dict get $manifest chunk_size]
+            set size [dict get $manifest size]
+            dict for {index digest} [dict get $previous chunks] {
+                set offset [expr {$index * $chunk_size}]
+                set length [expr {min($chunk_size, $size - $offset)}]
+                if {![catch {vessel::s3::sha256 -offset $offset -length $length $partial_path} actual] &&
+                    $actual eq $digest} {
+                    dict set manifest chunks $index $digest
+                }
+            }
+            return $manifest
+        }
+
+        # Replaces the manifest file so it is never seen half written
+        method _write_manifest {manifest_path} {
+            set chan [open "${manifest_path}.tmp" w]
+            puts $chan $_manifest
+            close $chan
+            file rename -force "${manifest_path}.tmp" $manifest_path
+        }
+
+        # Records a downloaded chunk in the manifest along with the digest of
+        # the bytes that were written.
+        method _chunk_done {manifest_path indexes partial_path progress_cmd request_index result} {
+            if {[dict get $result error] ne {} || [dict get $result status] != 206 ||
+                [my _should_retry [lindex $_requests $request_index] $result]} {
+                return
+            }
+
+            dict set _manifest chunks [lindex $indexes $request_index] [dict get $result sha256]
+            my _write_manifest $manifest_path
+            my _report_progress $partial_path $progress_cmd
+        }
+
+        # Reports the bytes at the start of the partial file that are in
+        # verified chunks.  Chunks finish out of order so a chunk only
+        # counts once every chunk before it is done.
+        method _report_progress {partial_path progress_cmd} {
+            if {$progress_cmd eq {}} {
+                return
+            }
+
+            set chunks [dict get $_manifest chunks]
+            set index 0
+            while {[dict exists $chunks $index]} {
+                incr index
+            }
+            set bytes [expr {min($index * [dict get $_manifest chunk_size], [dict get $_manifest size])}]
+            {*}$progress_cmd $partial_path $bytes
+        }
+
+        method put_object {path name} {
+            set key [my _object_key $name]
+            set size [file size $path]
+
+            #Stored with the object so pulls can verify the whole object
+            set metadata [list x-amz-meta-sha256 [vessel::s3::sha256 $path]]
+            if {$size <= $_part_size} {
+                set result [lindex [my _run_requests [list [list PUT $_bucket $key -infile $path \
+                                                                -headers $metadata]]] 0]
+                my _check_result $result "PUT ${key}"
+                return
+            }
+
+            my _multipart_upload $path $key $size $metadata
+        }
+
+        # Uploads the file as parts of -part-size bytes that are sent in
+        # parallel.  The upload is aborted if any part fails so the parts
+        # aren't kept by the server.
+        method _multipart_upload {path key size metadata} {
+            set result [lindex [my _run_requests [list [list POST $_bucket $key -query {uploads {}} \
+                                                            -headers $metadata]]] 0]
+            my _check_result $result "POST ${key}?uploads"
+            if {![regexp {<UploadId>([^<]+)</UploadId>} [dict get $result body] -> upload_id]} {
+                return -code error -errorcode {REPO S3 EPROTO} "Missing upload id for ${key}"
+            }
+
+            try {
+                set requests {}
+                set part_number 0
+                for {set offset 0} {$offset < $size} {incr offset $_part_size} {
+                    lappend requests [list PUT $_bucket $key \
+                                          -query [list partNumber [incr part_number] uploadId $upload_id] \
+                                          -infile $path -offset $offset \
+                                          -length [expr {min($_part_size, $size - $offset)}]]
+                }
+
+                set complete "<CompleteMultipartUpload>"
+                set part_number 0
+                foreach result [my _run_requests $requests] {
+                    incr part_number
+                    my _check_result $result "PUT ${key} part ${part_number}"
+                    append complete "<Part><PartNumber>${part_number}</PartNumber>" \
+                        "<ETag>[dict get $result headers etag]</ETag></Part>"
+                }
+                append complete "</CompleteMultipartUpload>"
+
+                set result [lindex [my _run_requests [list [list POST $_bucket $key \
+                                                                -query [list uploadId $upload_id] \
+                                                                -body $complete]]] 0]
+                my _check_result $result "POST ${key}?uploadId"
+
+                #Completing can fail after the 200 status has been sent
+                if {[regexp {<Error>.*<Code>([^<]*)</Code>} [dict get $result body] -> code]} {
+                    return -code error -errorcode [list REPO S3 $code] \
+                        "Completing the upload of ${key} failed: ${code}"
+                }
+            } on error {msg options} {
+                catch {my _run_requests [list [list DELETE $_bucket $key -query [list uploadId $upload_id]]]}
+                return -options $options $msg
+            }
+        }
+
+        method delete_object {name} {
+            set key [my _object_key $name]
+            set result [lindex [my _run_requests [list [list DELETE $_bucket $key]]] 0]
+            my _check_result $result "DELETE ${key}"
+        }
+
+        method missing_objects {names} {
+            set requests [lmap name $names {list HEAD $_bucket [my _object_key $name]}]
+            set missing {}
+            foreach name $names result [my _run_requests $requests] {
+                if {[dict get $result error] eq {} && [dict get $result status] == 404} {
+                    lappend missing $name
+                    continue
+                }
+                my _check_result $result "HEAD [my _object_key $name]"
+            }
+            return $missing
+        }
+
+        # Small objects like chunks are downloaded whole and concurrently
+        method get_objects {names paths {done_cmd {}}} {
+            set requests {}
+            foreach name $names path $paths {
+                lappend requests [list GET $_bucket [my _object_key $name] -outfile $path]
+            }
+
+            set on_done {}
+            if {$done_cmd ne {}} {
+                set on_done [namespace code [list my _object_done $done_cmd]]
+            }
+            foreach name $names result [my _run_requests $requests $on_done] {
+                my _check_result $result "GET [my _object_key $name]"
+            }
+        }
+
+        # Reports an object of get_objects that was downloaded.  Failed
+        # downloads are raised once all of them are over.
+        method _object_done {done_cmd index result} {
+            set status [dict get $result status]
+            if {[dict get $result error] eq {} && $status >= 200 && $status < 300} {
+                {*}$done_cmd $index
+            }
+        }
+
+        method put_object_ranges {path ranges} {
+            set requests {}
+            foreach range $ranges {
+                lassign $range offset size name
+                lappend requests [list PUT $_bucket [my _object_key $name] \
+                                      -infile $path -offset $offset -length $size]
+            }
+            foreach range $ranges result [my _run_requests $requests] {
+                my _check_result $result "PUT [my _object_key [lindex $range 2]]"
+            }
+        }
+
+        method object_exists {name} {
+            set key [my _object_key $name]
+            set result [lindex [my _run_requests [list [list HEAD $_bucket $key]]] 0]
+            if {[dict get $result error] eq {} && [dict get $result status] == 404} {
+                return 0
+            }
+
+            my _check_result $result "HEAD ${key}"
+            return 1
+        }
+
+        destructor {
+            vessel::s3::close $_client
         }
     }
 
@@ -256,19 +1345,40 @@ namespace eval vessel::repo {
         switch -exact $cmd {
 
             publish {
-                #NOTE: We may want to make export directories something separate
-                #from download directories.  For now, we'll keep it separate.
-                #
                 #vessel publish --tag=local kafka
-                set image_file [vessel::export::export_image $image $tag $downloaddir]
-                if {![$repo image_exists $image $tag]} {
-                    $repo put_image $image_file
-                }
+                #
+                #Layers are exported into the layer store in the format of
+                #the repository and only the ones it doesn't have are sent.
+                set metadata_file [vessel::export::export_image $image $tag [$repo image_format]]
+                $repo put_image $metadata_file
             }
             pull {
-                #Pulls the command.  Basically a GET and an import.
-                $repo pull_image $image $tag $downloaddir
-                vessel::import::import $image $tag $downloaddir stderr
+                #Pulls the command.  Basically a GET and an import.  The
+                #layers are extracted while they download unless the
+                #image was published as zip files.  Parent images that
+                #aren't imported are pulled along with the image.
+                set chain [$repo resolve_chain $image $tag $downloaddir]
+                if {[llength $chain] > 0} {
+                    $repo pull_chain [concat $chain [list [list $image $tag]]] $downloaddir stderr
+                    return
+                }
+
+                set pipeline [vessel::import::pipeline new $image $tag stderr]
+                defer::with [list pipeline] {
+                    $pipeline destroy
+                }
+
+                try {
+                    $repo pull_image $image $tag $downloaddir $pipeline
+                    set imported [$pipeline finish]
+                } on error {msg options} {
+                    $pipeline abort
+                    return -options $options $msg
+                }
+
+                if {!$imported} {
+                    vessel::import::import $image $tag $downloaddir stderr
+                }
             }
         }
     }
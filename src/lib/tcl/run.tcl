@@ -66,6 +66,23 @@ namespace eval vessel::run {
             }
         }
 
+        proc open_console {jail_name} {
+            variable ::vessel::run::log
+
+            lassign [pty::open] master slave_path
+            set slave [open $slave_path r+]
+            set handle [vessel::console::serve $master [vessel::env::console_socket $jail_name]]
+            ${log}::debug "Console for $jail_name: $slave_path"
+
+            return [dict create master $master slave $slave handle $handle]
+        }
+
+        proc close_console {console} {
+            vessel::console::close [dict get $console handle]
+            close [dict get $console slave]
+            close [dict get $console master]
+        }
+
         proc create_run_dict {args_dict} {
 
             # Merge the commandline (args_dict) and sections from the ini file
@@ -342,6 +359,21 @@ namespace eval vessel::run {
         
         set command [dict get $args_dict "command"]
 
+        #The container runs on a pty whose recent output is kept natively
+        #and served on a unix socket for 'vessel attach'.
+        set console {}
+        if {[dict get $args_dict console] && ![dict get $args_dict interactive]} {
+            set console [_::open_console $jail_name]
+            dict set chan_dict stdin [dict get $console slave]
+            dict set chan_dict stdout [dict get $console slave]
+            dict set chan_dict stderr [dict get $console slave]
+        }
+        defer::with [list console] {
+            if {$console ne {}} {
+                vessel::run::_::close_console $console
+            }
+        }
+
         set coro_name [info coroutine]
         set limits [dict get $args_dict "limits"]
         set cpuset [dict get $args_dict "cpuset"]
@@ -388,6 +420,28 @@ namespace eval vessel::run {
 
         ${log}::debug "Finished running container: $jail_name"
     }
+
+    # attach_command connects the current terminal to the console of a
+    # container started with --console until the container exits or the
+    # user detaches with ctrl-]
+    proc attach_command {args_dict} {
+        variable log
+
+        set jail_name [dict get $args_dict name]
+        set socket_path [vessel::env::console_socket $jail_name]
+        if {![file exists $socket_path]} {
+            return -code error -errorcode {VESSEL ATTACH ENOENT} \
+                "No console for container: $jail_name"
+        }
+
+        set console [vessel::console::connect $socket_path]
+        ${log}::info "Attached to $jail_name.  Detach with ctrl-\]"
+
+        variable attached 1
+        pty::proxy -escape 0x1d stdin stdout $console [list set [namespace current]::attached 0]
+        vwait [namespace current]::attached
+        close $console
+    }
 }
 
 package provide vessel::run 1.0.0
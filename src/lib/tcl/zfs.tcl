@@ -1,5 +1,7 @@
 # -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
 package require dicttool
+package require vessel::native
+package require vessel::env
 
 namespace eval vessel::zfs {
     #TODO: Make ensemble
@@ -167,7 +169,11 @@ namespace eval vessel::zfs {
         # 3. Use the inode as the key into the inode,paths dict
         # 4. Output each path to the tar file.
 
-        
+
+        if {[vessel::env::diff_engine] eq {native}} {
+            return [native_diff $snapshot $dataset]
+        }
+
         set diff_output [exec -keepnewline zfs diff -H $snapshot $dataset]
         
         set diff_dict [dict create]
@@ -187,6 +193,18 @@ namespace eval vessel::zfs {
         return $diff_dict
     }
 
+    proc native_diff {snapshot dataset} {
+        # Compares the snapshot directory with the live tree using a thread
+        # per core instead of 'zfs diff'.  The result is the same dict as
+        # diff except every path of a file with several links is included.
+
+        set mountpoint [get_mountpoint $dataset]
+        set snapshot_name [lindex [split $snapshot {@}] 1]
+        set snapshot_dir [file join $mountpoint {.zfs} {snapshot} $snapshot_name]
+
+        return [vessel::fs::diff $snapshot_dir $mountpoint]
+    }
+
     proc diff_hardlinks {diff_dict dataset_mountpoint} {
         # Creates a dict with inodes as keys and a list of
         # paths for those inodes.  This is necessary because zfs diff doesn't
@@ -197,36 +215,13 @@ namespace eval vessel::zfs {
         # dataset_mountpoint: is the mountpoint for the dataset used to generate
         # diff_dict
         #
-        # NOTE: This operation is super expensive.
-
-        #Create a line delimited set of inode path pairs for all inodes under
-        #the dataset_mountpoint
-        set inode_path_pairs [exec find $dataset_mountpoint -exec stat -f "%i%t%N" \{\} \;]
-
-        set inode_dict [dict create]
-        foreach {inode_path_pair} [split $inode_path_pairs \n] {
-
-            foreach {inode path}  [split $inode_path_pair \t] {
-                dict lappend inode_dict $inode $path
-            }
-        }
+        # The mountpoint is only walked when a modified file has more than
+        # one link and the walk stops once every link has been found.
 
         set modified_file_list [list {*}[dict getnull $diff_dict {M}] \
                                     {*}[dict getnull $diff_dict {+}]]
 
-        set output_dict [dict create]
-        foreach path $modified_file_list {
-
-            array set stat_buf {}
-            file lstat $path stat_buf
-
-            #Add the path to the output_dict with inode as key
-            foreach inode_path [dict get $inode_dict $stat_buf(ino)] {
-                dict lappend output_dict $stat_buf(ino) $inode_path
-            }
-        }
-
-        return $output_dict
+        return [vessel::fs::hardlinks $dataset_mountpoint $modified_file_list]
     }
     
     proc destroy {dataset} {
@@ -238,6 +233,48 @@ namespace eval vessel::zfs {
         update_snapshots
     }
 
+    # Rolls the dataset back to the snapshot destroying any later snapshots
+    proc rollback {snapshot} {
+        exec zfs rollback -r $snapshot
+
+        update_snapshots
+    }
+
+    # The guid of a snapshot stays the same when it is sent to another
+    # pool so it identifies the snapshot an incremental stream applies to
+    proc snapshot_guid {snapshot} {
+        return [exec zfs get -H -o value guid $snapshot]
+    }
+
+    # The guid and creation txg of a snapshot.  Taking the snapshot again
+    # changes both so they identify the contents of the snapshot.
+    proc snapshot_identity {snapshot} {
+        return [join [split [exec zfs get -H -p -o value guid,createtxg $snapshot] \n] -]
+    }
+
+    # The snapshot a clone was created from or - if it isn't a clone
+    proc get_origin {dataset} {
+        return [exec zfs get -H -o value origin $dataset]
+    }
+
+    # Writes an incremental stream of every snapshot of the dataset after
+    # from_snapshot up to and including snapshot into path.  from_snapshot
+    # may be the origin of a clone.  Blocks are sent compressed like they
+    # are on disk.
+    proc send_incremental {from_snapshot snapshot path} {
+        exec zfs send -c -I $from_snapshot $snapshot > $path 2>@ stderr
+    }
+
+    # Creates the dataset from the stream in path.  An incremental stream
+    # from the origin of a clone creates a clone of the local snapshot with
+    # the same guid.
+    proc receive {dataset path} {
+        exec zfs receive $dataset < $path >&@ stderr
+
+        update_mountpoints
+        update_snapshots
+    }
+
     proc destroy_recursive {dataset} {
         exec zfs destroy -rf $dataset
 
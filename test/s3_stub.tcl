@@ -0,0 +1,479 @@
+# -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
+#
+# A minimal in memory S3 compatible server used as a stand-in for the
+# repository tests and benchmarks.  It speaks just enough HTTP/1.1 (keep
+# alive, content length bodies) and S3 for the native client: object GET
+# (with ranges), HEAD, PUT, DELETE and multipart uploads.
+#
+# When started with a secret key the SigV4 signature of every request is
+# verified with the openssl command.  -rate and -latency slow down every
+# request as if it was sent over a network where each connection gets
+# rate bytes/sec.
+
+namespace eval s3_stub {
+
+    variable server {}
+    variable access_key {}
+    variable secret_key {}
+    variable region {us-east-1}
+
+    # bucket/key -> object data
+    variable objects [dict create]
+
+    # bucket/key -> ETag and x-amz-meta-* headers of the object
+    variable metadata [dict create]
+    variable next_version 0
+
+    # Every request received as a {method path} pair
+    variable requests {}
+
+    # upload id -> part number -> part data
+    variable uploads [dict create]
+    variable upload_metadata [dict create]
+    variable next_upload_id 0
+
+    # Number of requests that will fail, how they fail and optionally the
+    # only method that fails
+    variable failures 0
+    variable failure_status 500
+    variable failure_method {}
+
+    variable rate 0
+    variable latency 0
+
+    variable buffers
+    array set buffers {}
+
+    variable reasons {
+        200 OK 204 {No Content} 206 {Partial Content} 400 {Bad Request}
+        403 Forbidden 404 {Not Found} 416 {Range Not Satisfiable}
+        500 {Internal Server Error} 501 {Not Implemented}
+    }
+
+    # start ?-port port? ?-access-key key? ?-secret-key key? ?-region region?
+    #       ?-rate bytes/sec? ?-latency ms?
+    #
+    # Returns the port the stand-in is listening on.
+    proc start {args} {
+        variable server
+        variable access_key
+        variable secret_key
+        variable region
+        variable rate
+        variable latency
+
+        set options [dict merge {-port 0 -access-key {} -secret-key {} -region us-east-1
+            -rate 0 -latency 0} $args]
+        set access_key [dict get $options -access-key]
+        set secret_key [dict get $options -secret-key]
+        set region [dict get $options -region]
+        set rate [dict get $options -rate]
+        set latency [dict get $options -latency]
+
+        set server [socket -server [namespace code accept] -myaddr 127.0.0.1 [dict get $options -port]]
+        return [lindex [fconfigure $server -sockname] 2]
+    }
+
+    proc stop {} {
+        variable server
+        variable buffers
+
+        foreach chan [array names buffers] {
+            catch {close $chan}
+        }
+        array unset buffers
+        close $server
+        set server {}
+        reset
+    }
+
+    proc reset {} {
+        variable objects
+        variable requests
+        variable uploads
+        variable failures
+        variable metadata
+        variable upload_metadata
+
+        set objects [dict create]
+        set metadata [dict create]
+        set upload_metadata [dict create]
+        set requests {}
+        set uploads [dict create]
+        set failures 0
+    }
+
+    # Fail the next count requests, or requests with the method, with the
+    # status.  A status of truncate closes the connection half way through
+    # the response body instead.
+    proc fail_requests {count {status 500} {method {}}} {
+        variable failures
+        variable failure_status
+        variable failure_method
+
+        set failures $count
+        set failure_status $status
+        set failure_method $method
+    }
+
+    proc reset_requests {} {
+        variable requests
+        set requests {}
+    }
+
+    proc pending_uploads {} {
+        variable uploads
+        return [dict size $uploads]
+    }
+
+    proc put_object {bucket key data {object_metadata {}}} {
+        store_object "${bucket}/${key}" $data $object_metadata
+    }
+
+    proc store_object {object_path data object_metadata} {
+        variable objects
+        variable metadata
+        variable next_version
+
+        dict set objects $object_path $data
+        dict set metadata $object_path \
+            [dict merge $object_metadata [dict create ETag "\"v[incr next_version]\""]]
+    }
+
+    proc get_object {bucket key} {
+        variable objects
+        return [dict get $objects "${bucket}/${key}"]
+    }
+
+    proc object_exists {bucket key} {
+        variable objects
+        return [dict exists $objects "${bucket}/${key}"]
+    }
+
+    proc get_metadata {bucket key} {
+        variable metadata
+        return [dict get $metadata "${bucket}/${key}"]
+    }
+
+    proc request_metadata {headers} {
+        return [dict filter $headers key x-amz-meta-*]
+    }
+
+    # Replace part of an object without changing its ETag, like a corrupted
+    # disk or a man in the middle
+    proc corrupt_object {bucket key first data} {
+        variable objects
+
+        set object_path "${bucket}/${key}"
+        set object [dict get $objects $object_path]
+        dict set objects $object_path \
+            [string replace $object $first [expr {$first + [string length $data] - 1}] $data]
+    }
+
+    proc accept {chan addr port} {
+        variable buffers
+
+        fconfigure $chan -blocking 0 -translation binary -buffering full
+        set buffers($chan) {}
+        fileevent $chan readable [namespace code [list readable $chan]]
+    }
+
+    proc readable {chan} {
+        variable buffers
+
+        if {[catch {read $chan} data] || ($data eq {} && [eof $chan])} {
+            catch {close $chan}
+            unset buffers($chan)
+            return
+        }
+
+        append buffers($chan) $data
+        while {[info exists buffers($chan)] && [next_request $chan]} {}
+    }
+
+    # Handles the next complete request in the connection buffer.  Returns 0
+    # if more data is needed.
+    proc next_request {chan} {
+        variable buffers
+
+        set header_end [string first "\r\n\r\n" $buffers($chan)]
+        if {$header_end == -1} {
+            return 0
+        }
+
+        set lines [split [string range $buffers($chan) 0 [expr {$header_end - 1}]] "\n"]
+        lassign [string trim [lindex $lines 0]] method target
+        set headers [dict create]
+        foreach line [lrange $lines 1 end] {
+            set colon [string first : $line]
+            dict set headers [string tolower [string range $line 0 [expr {$colon - 1}]]] \
+                [string trim [string range $line [expr {$colon + 1}] end]]
+        }
+
+        set length 0
+        if {[dict exists $headers content-length]} {
+            set length [dict get $headers content-length]
+        }
+
+        set body_start [expr {$header_end + 4}]
+        if {[string length $buffers($chan)] < $body_start + $length} {
+            return 0
+        }
+
+        set body [string range $buffers($chan) $body_start [expr {$body_start + $length - 1}]]
+        set buffers($chan) [string range $buffers($chan) [expr {$body_start + $length}] end]
+
+        handle $chan $method $target $headers $body
+        return 1
+    }
+
+    # Sends the response once the simulated transfer time of the request
+    # and response bodies has passed.
+    proc respond {chan status {headers {}} {body {}} {send_body 1} {request_bytes 0}} {
+        variable reasons
+        variable rate
+        variable latency
+
+        set response "HTTP/1.1 $status [dict get $reasons $status]\r\n"
+        if {![dict exists $headers Content-Length]} {
+            dict set headers Content-Length [string length $body]
+        }
+        dict for {name value} $headers {
+            append response "${name}: ${value}\r\n"
+        }
+        append response "\r\n"
+        if {$send_body} {
+            append response $body
+        }
+
+        set delay $latency
+        if {$rate > 0} {
+            incr delay [expr {(($send_body ? [string length $body] : 0) + $request_bytes) * 1000 / $rate}]
+        }
+
+        if {$delay > 0} {
+            after $delay [namespace code [list send $chan $response]]
+        } else {
+            send $chan $response
+        }
+    }
+
+    proc send {chan response} {
+        #The client may have given up on the connection
+        catch {
+            puts -nonewline $chan $response
+            flush $chan
+        }
+    }
+
+    proc fail {chan method} {
+        variable failure_status
+        variable buffers
+
+        if {$failure_status ne {truncate}} {
+            error_response $chan $failure_status InternalError [expr {$method ne {HEAD}}]
+            return
+        }
+
+        #Promise more than is sent so the client sees a short transfer
+        puts -nonewline $chan "HTTP/1.1 200 OK\r\nContent-Length: 1024\r\n\r\ntruncated"
+        catch {close $chan}
+        unset buffers($chan)
+    }
+
+    proc error_response {chan status code {send_body 1}} {
+        set body "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>${code}</Code></Error>"
+        respond $chan $status [dict create Content-Type application/xml] $body $send_body
+    }
+
+    proc url_decode {value} {
+        return [encoding convertfrom utf-8 \
+                    [subst -novariables -nocommands \
+                         [regsub -all {%([0-9A-Fa-f]{2})} [string map {\\ \\\\} $value] {\\u00\1}]]]
+    }
+
+    proc openssl_hmac {hex_key data} {
+        set digest [exec openssl dgst -sha256 -mac HMAC -macopt hexkey:$hex_key << $data]
+        return [lindex $digest end]
+    }
+
+    # Recomputes the SigV4 signature from the request as it was received.
+    proc signature_valid {method path query headers} {
+        variable access_key
+        variable secret_key
+        variable region
+
+        if {![dict exists $headers authorization] ||
+            ![regexp {^AWS4-HMAC-SHA256 Credential=([^/]+)/(\d{8})/([^/]+)/s3/aws4_request, SignedHeaders=([^,]+), Signature=([0-9a-f]+)$} \
+                  [dict get $headers authorization] -> key date request_region signed_headers signature]} {
+            return 0
+        }
+
+        if {$key ne $access_key || $request_region ne $region} {
+            return 0
+        }
+
+        set canonical_query [join [lsort [lmap param [split $query &] {
+            if {$param eq {}} continue
+            expr {[string first = $param] == -1 ? "${param}=" : $param}
+        }]] &]
+
+        set canonical_headers {}
+        foreach name [split $signed_headers {;}] {
+            append canonical_headers "${name}:[dict get $headers $name]\n"
+        }
+
+        set canonical_request [join [list $method $path $canonical_query $canonical_headers \
+                                         $signed_headers [dict get $headers x-amz-content-sha256]] "\n"]
+        set canonical_hash [lindex [exec openssl dgst -sha256 << $canonical_request] end]
+        set string_to_sign [join [list AWS4-HMAC-SHA256 [dict get $headers x-amz-date] \
+                                      "${date}/${region}/s3/aws4_request" $canonical_hash] "\n"]
+
+        binary scan "AWS4${secret_key}" H* signing_key
+        foreach part [list $date $region s3 aws4_request] {
+            set signing_key [openssl_hmac $signing_key $part]
+        }
+        return [expr {[openssl_hmac $signing_key $string_to_sign] eq $signature}]
+    }
+
+    proc parse_query {query} {
+        set params [dict create]
+        foreach param [split $query &] {
+            if {$param eq {}} {
+                continue
+            }
+            lassign [split $param =] name value
+            dict set params [url_decode $name] [url_decode $value]
+        }
+        return $params
+    }
+
+    proc handle {chan method target headers body} {
+        variable objects
+        variable metadata
+        variable requests
+        variable secret_key
+        variable failures
+        variable failure_method
+
+        set query {}
+        lassign [split $target ?] path query
+        lappend requests [list $method $path]
+
+        set send_body [expr {$method ne {HEAD}}]
+        if {$secret_key ne {} && ![signature_valid $method $path $query $headers]} {
+            error_response $chan 403 SignatureDoesNotMatch $send_body
+            return
+        }
+
+        if {$failures > 0 && $failure_method in [list {} $method]} {
+            incr failures -1
+            fail $chan $method
+            return
+        }
+
+        set object_path [url_decode [string range $path 1 end]]
+        set params [parse_query $query]
+        if {[dict exists $params uploads] || [dict exists $params uploadId]} {
+            handle_multipart $chan $method $object_path $params $headers $body
+            return
+        }
+
+        switch -exact $method {
+            PUT {
+                store_object $object_path $body [request_metadata $headers]
+                respond $chan 200 [dict create ETag [dict get $metadata $object_path ETag]] {} 1 \
+                    [string length $body]
+            }
+            GET -
+            HEAD {
+                if {![dict exists $objects $object_path]} {
+                    error_response $chan 404 NoSuchKey $send_body
+                    return
+                }
+
+                set data [dict get $objects $object_path]
+                set object_headers [dict get $metadata $object_path]
+                set size [string length $data]
+                if {[dict exists $headers range]} {
+                    if {![regexp {^bytes=(\d+)-(\d*)$} [dict get $headers range] -> first last] ||
+                        $first >= $size} {
+                        error_response $chan 416 InvalidRange $send_body
+                        return
+                    }
+
+                    if {$last eq {} || $last >= $size} {
+                        set last [expr {$size - 1}]
+                    }
+                    dict set object_headers Content-Range "bytes ${first}-${last}/${size}"
+                    respond $chan 206 $object_headers [string range $data $first $last] $send_body
+                } else {
+                    respond $chan 200 $object_headers $data $send_body
+                }
+            }
+            DELETE {
+                dict unset objects $object_path
+                dict unset metadata $object_path
+                respond $chan 204
+            }
+            default {
+                error_response $chan 501 NotImplemented
+            }
+        }
+    }
+
+    proc handle_multipart {chan method object_path params headers body} {
+        variable uploads
+        variable upload_metadata
+        variable next_upload_id
+
+        if {$method eq {POST} && [dict exists $params uploads]} {
+            set upload_id "upload[incr next_upload_id]"
+            dict set uploads $upload_id [dict create]
+            dict set upload_metadata $upload_id [request_metadata $headers]
+            respond $chan 200 [dict create Content-Type application/xml] \
+                "<InitiateMultipartUploadResult><UploadId>${upload_id}</UploadId></InitiateMultipartUploadResult>"
+            return
+        }
+
+        set upload_id [dict get $params uploadId]
+        if {![dict exists $uploads $upload_id]} {
+            error_response $chan 404 NoSuchUpload
+            return
+        }
+
+        switch -exact $method {
+            PUT {
+                set part_number [dict get $params partNumber]
+                dict set uploads $upload_id $part_number $body
+                respond $chan 200 [dict create ETag "\"${upload_id}-${part_number}\""] {} 1 [string length $body]
+            }
+            POST {
+                set data {}
+                set parts [regexp -all -inline {<PartNumber>(\d+)</PartNumber><ETag>"[^"]*"</ETag>} $body]
+                foreach {match part_number} $parts {
+                    if {![dict exists $uploads $upload_id $part_number]} {
+                        error_response $chan 400 InvalidPart
+                        return
+                    }
+                    append data [dict get $uploads $upload_id $part_number]
+                }
+
+                store_object $object_path $data [dict get $upload_metadata $upload_id]
+                dict unset uploads $upload_id
+                dict unset upload_metadata $upload_id
+                respond $chan 200 [dict create Content-Type application/xml] \
+                    "<CompleteMultipartUploadResult><Key>${object_path}</Key></CompleteMultipartUploadResult>" \
+                    1 [string length $body]
+            }
+            DELETE {
+                dict unset uploads $upload_id
+                dict unset upload_metadata $upload_id
+                respond $chan 204
+            }
+            default {
+                error_response $chan 501 NotImplemented
+            }
+        }
+    }
+}
@@ -0,0 +1,149 @@
+# -*- mode: tcl; indent-tabs-mode: nil; tab-width: 4; -*-
+#
+# A stand-in for the zfs command used by the zfs stream tests.  It keeps
+# the datasets and snapshots in the file state in ZFS_STUB_DIR as a dict:
+#
+#   datasets  dataset -> {mountpoint path origin snapshot-or-->}
+#   snapshots snapshot -> guid
+#
+# and appends every command to the file log in the same directory.  send
+# writes a stream file that names the guid of the snapshot it is
+# incremental from and the snapshots it carries and receive creates a
+# clone of the snapshot with that guid like zfs does.  The tests run it
+# through a shell script named zfs put first on the PATH.
+
+set stub_dir $env(ZFS_STUB_DIR)
+set state_file [file join $stub_dir state]
+
+proc read_state {} {
+    global state_file
+    set chan [open $state_file]
+    set state [read $chan]
+    close $chan
+    return $state
+}
+
+proc write_state {state} {
+    global state_file
+    set chan [open $state_file w]
+    puts -nonewline $chan $state
+    close $chan
+}
+
+proc fail {message} {
+    puts stderr $message
+    exit 1
+}
+
+set chan [open [file join $stub_dir log] a]
+puts $chan $argv
+close $chan
+
+set state [read_state]
+switch -exact -- [lrange $argv 0 2] {
+    {list -H -t} {
+        dict for {snapshot guid} [dict get $state snapshots] {
+            puts "${snapshot}\t0B\t-\t0B\t-"
+        }
+    }
+    {get -H mountpoint} {
+        dict for {dataset properties} [dict get $state datasets] {
+            puts "${dataset}\tmountpoint\t[dict get $properties mountpoint]\tdefault"
+        }
+    }
+    {get -H -o} -
+    {get -H -p} {
+        lassign [lrange $argv end-1 end] properties name
+        foreach property [split $properties ,] {
+            switch -exact -- $property {
+                guid {
+                    if {![dict exists $state snapshots $name]} {
+                        fail "cannot open '${name}': dataset does not exist"
+                    }
+                    puts [dict get $state snapshots $name]
+                }
+                createtxg {
+                    #Snapshots are kept in the order they were taken
+                    set txg [lsearch -exact [dict keys [dict get $state snapshots]] $name]
+                    if {$txg == -1} {
+                        fail "cannot open '${name}': dataset does not exist"
+                    }
+                    puts [expr {$txg + 1}]
+                }
+                origin {
+                    if {![dict exists $state datasets $name]} {
+                        fail "cannot open '${name}': dataset does not exist"
+                    }
+                    puts [dict get $state datasets $name origin]
+                }
+                default {
+                    fail "unsupported property: $property"
+                }
+            }
+        }
+    }
+    {send -c -I} {
+        lassign [lrange $argv 3 end] from_snapshot snapshot
+        if {![dict exists $state snapshots $from_snapshot] ||
+            ![dict exists $state snapshots $snapshot]} {
+            fail "cannot send: snapshot does not exist"
+        }
+
+        set dataset [lindex [split $snapshot @] 0]
+        set carried {}
+        dict for {name guid} [dict get $state snapshots] {
+            if {[string match ${dataset}@* $name]} {
+                lappend carried [lindex [split $name @] 1] $guid
+            }
+            if {$name eq $snapshot} {
+                break
+            }
+        }
+        fconfigure stdout -translation binary
+        puts [list ZFSSTUB [dict get $state snapshots $from_snapshot] $carried]
+    }
+    default {
+        switch -exact -- [lindex $argv 0] {
+            receive {
+                set dataset [lindex $argv 1]
+                lassign [read stdin] magic from_guid carried
+                if {$magic ne {ZFSSTUB}} {
+                    fail "cannot receive: invalid stream"
+                }
+                if {[dict exists $state datasets $dataset]} {
+                    fail "cannot receive new filesystem stream: destination '${dataset}' exists"
+                }
+
+                set origin {}
+                dict for {name guid} [dict get $state snapshots] {
+                    if {$guid eq $from_guid} {
+                        set origin $name
+                    }
+                }
+                if {$origin eq {}} {
+                    fail "cannot receive: local origin for clone ${dataset}@[lindex $carried 0] does not exist"
+                }
+
+                dict set state datasets $dataset \
+                    [dict create mountpoint [file join $stub_dir mnt $dataset] origin $origin]
+                foreach {name guid} $carried {
+                    dict set state snapshots ${dataset}@${name} $guid
+                }
+                write_state $state
+            }
+            destroy {
+                set dataset [lindex $argv end]
+                dict unset state datasets $dataset
+                dict for {name guid} [dict get $state snapshots] {
+                    if {[string match ${dataset}@* $name]} {
+                        dict unset state snapshots $name
+                    }
+                }
+                write_state $state
+            }
+            default {
+                fail "unsupported command: $argv"
+            }
+        }
+    }
+}
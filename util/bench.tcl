@@ -0,0 +1,17 @@
+# -*- mode: tcl; -*-
+#
+# Helpers sourced by the benchmarks in util.
+package require fileutil
+
+# Evaluates the script in the caller with the variable named var set to a
+# new temporary directory named after the benchmark.  The directory is
+# deleted afterwards even when the script fails.
+proc with_temp_dir {var name script} {
+    upvar 1 $var dir
+    set dir [fileutil::maketempdir -prefix ${name}-]
+    try {
+        uplevel 1 $script
+    } finally {
+        file delete -force $dir
+    }
+}
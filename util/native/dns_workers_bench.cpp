@@ -0,0 +1,142 @@
+/*
+ * Measures the qps of the embdns worker pool over loopback as the number of
+ * worker threads grows.  The clients run in the same process and need cores
+ * too, so the qps can only grow with the workers while the workers and their
+ * clients fit in the host's cores.  Runs that don't fit are marked
+ * oversubscribed and say nothing about how the pool scales.
+ *
+ * usage: dns_workers_bench [max_workers] [seconds_per_run] [port]
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../../src/dns/embdns.h"
+#include "../../src/dns/embdns_workers.h"
+
+namespace
+{
+    const size_t CLIENTS_PER_WORKER = 2;
+    const size_t WINDOW = 32; /**< Queries in flight per client*/
+
+    std::vector<uint8_t> make_query(uint16_t id, const char* name)
+    {
+        std::vector<uint8_t> pkt = {(uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00,
+                                    0, 1, 0, 0, 0, 0, 0, 0};
+        const char* label = name;
+        while(*label)
+        {
+            const char* dot = strchr(label, '.');
+            size_t len = dot ? (size_t)(dot - label) : strlen(label);
+            pkt.push_back((uint8_t)len);
+            pkt.insert(pkt.end(), label, label + len);
+            label += len + (dot ? 1 : 0);
+        }
+        pkt.insert(pkt.end(), {0, 0, 1, 0, 1});
+        return pkt;
+    }
+
+    void client(uint16_t port, std::atomic<bool>& running, std::atomic<uint64_t>& answered)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+
+        std::vector<uint8_t> query = make_query(1, "svc.vessel");
+        std::vector<uint8_t> response(embdns::dns_message::MAX_EDNS_SIZE);
+        struct pollfd pfd = {sock, POLLIN, 0};
+        uint64_t count = 0;
+        while(running.load(std::memory_order_relaxed))
+        {
+            for(size_t i = 0; i < WINDOW; ++i)
+            {
+                (void)send(sock, query.data(), query.size(), 0);
+            }
+
+            /*Lost datagrams are abandoned after the poll timeout*/
+            for(size_t i = 0; i < WINDOW; ++i)
+            {
+                if(poll(&pfd, 1, 50) <= 0)
+                {
+                    break;
+                }
+                if(recv(sock, response.data(), response.size(), 0) > 0)
+                {
+                    count++;
+                }
+            }
+        }
+
+        answered.fetch_add(count);
+        close(sock);
+    }
+
+    double run(uint16_t port, size_t worker_count, int seconds,
+               std::shared_ptr<const embdns::record_table> table)
+    {
+        embdns::worker_pool pool("127.0.0.1", port, worker_count, table);
+
+        std::atomic<bool> running(true);
+        std::atomic<uint64_t> answered(0);
+        std::vector<std::thread> clients;
+        for(size_t i = 0; i < worker_count * CLIENTS_PER_WORKER; ++i)
+        {
+            clients.emplace_back(client, port, std::ref(running), std::ref(answered));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        running = false;
+        for(auto& t : clients)
+        {
+            t.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return answered.load() / elapsed.count();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t max_workers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    uint16_t port = argc > 3 ? (uint16_t)atoi(argv[3]) : 15300;
+
+    auto table = std::make_shared<embdns::record_table>();
+    in_addr addr;
+    inet_pton(AF_INET, "192.168.9.3", &addr);
+    table->records["svc.vessel"] = {{addr.s_addr}, 35};
+
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    printf("%zu cores\n", cores);
+    printf("workers\tqps\tvs 1 worker\n");
+    double base_qps = 0;
+    for(size_t workers = 1; workers <= max_workers; workers *= 2)
+    {
+        double qps = run(port, workers, seconds, table);
+        if(workers == 1)
+        {
+            base_qps = qps;
+        }
+        bool oversubscribed = workers * (1 + CLIENTS_PER_WORKER) > cores;
+        printf("%zu\t%.0f\t%.2fx%s\n", workers, qps, base_qps > 0 ? qps / base_qps : 0.0,
+               oversubscribed ? "\toversubscribed" : "");
+    }
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * dnsperf style load generator for embdns.
+ *
+ * Replays a query mix at a fixed rate over udp and reports the achieved qps,
+ * p50/p99 latency and loss.  Without -s an in process worker pool is started
+ * on loopback so the numbers only measure embdns.
+ *
+ * usage: dnsperf [-s server] [-p port] [-d queryfile] [-Q qps] [-l seconds] [-w workers]
+ *
+ * The query file has one "name type" pair per line where type is A or AAAA.
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../../src/dns/embdns.h"
+#include "../../src/dns/embdns_workers.h"
+
+namespace
+{
+    using steady_clock = std::chrono::steady_clock;
+
+    struct options
+    {
+        std::string server;
+        uint16_t port = 15400;
+        std::string query_file;
+        uint64_t qps = 50000;
+        int seconds = 10;
+        size_t workers = 1;
+    };
+
+    std::vector<uint8_t> make_query(const std::string& name, uint16_t qtype)
+    {
+        std::vector<uint8_t> pkt = {0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+        std::stringstream labels(name);
+        std::string label;
+        while(std::getline(labels, label, '.'))
+        {
+            pkt.push_back((uint8_t)label.size());
+            pkt.insert(pkt.end(), label.begin(), label.end());
+        }
+        pkt.insert(pkt.end(), {0, (uint8_t)(qtype >> 8), (uint8_t)qtype, 0, 1});
+        return pkt;
+    }
+
+    /**
+     * Default mix is mostly hits with some misses and AAAA lookups, which is
+     * what resolvers inside a jail send.
+     */
+    std::vector<std::vector<uint8_t>> default_queries()
+    {
+        std::vector<std::vector<uint8_t>> queries;
+        for(int i = 0; i < 7; ++i)
+        {
+            queries.push_back(make_query("svc" + std::to_string(i) + ".vessel", 1));
+        }
+        queries.push_back(make_query("missing0.vessel", 1));
+        queries.push_back(make_query("missing1.vessel", 1));
+        queries.push_back(make_query("svc0.vessel", 28));
+        return queries;
+    }
+
+    bool load_queries(const std::string& path, std::vector<std::vector<uint8_t>>& queries)
+    {
+        std::ifstream query_file(path);
+        if(!query_file)
+        {
+            return false;
+        }
+
+        std::string name;
+        std::string type;
+        while(query_file >> name >> type)
+        {
+            queries.push_back(make_query(name, type == "AAAA" ? 28 : 1));
+        }
+        return !queries.empty();
+    }
+
+    std::shared_ptr<embdns::record_table> default_table()
+    {
+        auto table = std::make_shared<embdns::record_table>();
+        for(int i = 0; i < 7; ++i)
+        {
+            in_addr addr;
+            std::string ip = "192.168.9." + std::to_string(i + 1);
+            inet_pton(AF_INET, ip.c_str(), &addr);
+            table->records["svc" + std::to_string(i) + ".vessel"] = {{addr.s_addr}, 35};
+        }
+        return table;
+    }
+
+    double percentile(std::vector<double>& sorted_values, double pct)
+    {
+        if(sorted_values.empty())
+        {
+            return 0;
+        }
+        size_t index = (size_t)(pct / 100.0 * (sorted_values.size() - 1));
+        return sorted_values[index];
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "usage: dnsperf [-s server] [-p port] [-d queryfile] [-Q qps] [-l seconds] [-w workers]\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    options opts;
+    int ch;
+    while((ch = getopt(argc, argv, "s:p:d:Q:l:w:")) != -1)
+    {
+        switch(ch)
+        {
+        case 's': opts.server = optarg; break;
+        case 'p': opts.port = (uint16_t)atoi(optarg); break;
+        case 'd': opts.query_file = optarg; break;
+        case 'Q': opts.qps = strtoull(optarg, nullptr, 10); break;
+        case 'l': opts.seconds = atoi(optarg); break;
+        case 'w': opts.workers = strtoul(optarg, nullptr, 10); break;
+        default: usage();
+        }
+    }
+
+    if(opts.qps == 0 || opts.seconds <= 0)
+    {
+        usage();
+    }
+
+    std::vector<std::vector<uint8_t>> queries;
+    if(opts.query_file.empty())
+    {
+        queries = default_queries();
+    }
+    else if(!load_queries(opts.query_file, queries))
+    {
+        fprintf(stderr, "Failed to load queries from %s\n", opts.query_file.c_str());
+        return 1;
+    }
+
+    std::unique_ptr<embdns::worker_pool> pool;
+    if(opts.server.empty())
+    {
+        opts.server = "127.0.0.1";
+        pool = std::make_unique<embdns::worker_pool>(opts.server, opts.port, opts.workers, default_table());
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    if(inet_pton(AF_INET, opts.server.c_str(), &addr.sin_addr) != 1 ||
+       connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "Invalid server address: %s\n", opts.server.c_str());
+        return 1;
+    }
+
+    /*The query id indexes the send time.  Ids are reused every 64k queries
+     * so an answer that takes longer than the id wraps is counted as lost.*/
+    std::vector<steady_clock::time_point> sent_at(0x10000);
+    std::vector<std::atomic<bool>> outstanding(0x10000);
+    std::vector<double> latencies_us;
+    latencies_us.reserve(opts.qps * opts.seconds);
+
+    std::atomic<bool> sending(true);
+    uint64_t sent = 0;
+    uint64_t received = 0;
+
+    std::thread receiver([&]() {
+        std::vector<uint8_t> response(embdns::dns_message::MAX_EDNS_SIZE);
+        struct pollfd pfd = {sock, POLLIN, 0};
+        auto drain_deadline = steady_clock::time_point::max();
+        while(steady_clock::now() < drain_deadline)
+        {
+            if(!sending.load() && drain_deadline == steady_clock::time_point::max())
+            {
+                /*Give in flight answers a second before they are counted as lost*/
+                drain_deadline = steady_clock::now() + std::chrono::seconds(1);
+            }
+
+            if(poll(&pfd, 1, 10) <= 0)
+            {
+                continue;
+            }
+
+            ssize_t bytes = recv(sock, response.data(), response.size(), 0);
+            if(bytes < embdns::dns_header::SIZE)
+            {
+                continue;
+            }
+
+            auto now = steady_clock::now();
+            uint16_t id = (uint16_t)((response[0] << 8) | response[1]);
+            if(outstanding[id].exchange(false))
+            {
+                std::chrono::duration<double, std::micro> latency = now - sent_at[id];
+                latencies_us.push_back(latency.count());
+                received++;
+            }
+        }
+    });
+
+    auto start = steady_clock::now();
+    auto end = start + std::chrono::seconds(opts.seconds);
+    std::chrono::duration<double> interval(1.0 / opts.qps);
+    auto next_send = start;
+    while(next_send < end)
+    {
+        auto now = steady_clock::now();
+        if(now < next_send)
+        {
+            if(next_send - now > std::chrono::microseconds(100))
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            continue;
+        }
+
+        std::vector<uint8_t>& query = queries[sent % queries.size()];
+        uint16_t id = (uint16_t)sent;
+        query[0] = (uint8_t)(id >> 8);
+        query[1] = (uint8_t)id;
+
+        sent_at[id] = steady_clock::now();
+        outstanding[id] = true;
+        if(send(sock, query.data(), query.size(), 0) == -1)
+        {
+            outstanding[id] = false;
+        }
+        sent++;
+        next_send = start + std::chrono::duration_cast<steady_clock::duration>(interval * sent);
+    }
+    std::chrono::duration<double> send_time = steady_clock::now() - start;
+
+    sending = false;
+    receiver.join();
+    close(sock);
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    double loss = sent ? 100.0 * (sent - received) / sent : 0;
+    printf("sent:      %llu\n", (unsigned long long)sent);
+    printf("received:  %llu\n", (unsigned long long)received);
+    printf("loss:      %.3f%%\n", loss);
+    printf("qps:       %.0f\n", received / send_time.count());
+    printf("p50:       %.1fus\n", percentile(latencies_us, 50));
+    printf("p99:       %.1fus\n", percentile(latencies_us, 99));
+
+    return 0;
+}
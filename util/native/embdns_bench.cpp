@@ -0,0 +1,91 @@
+/*
+ * Microbenchmark of embdns query parsing and response generation without
+ * any socket io.
+ *
+ * usage: embdns_bench [iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../../src/dns/embdns.h"
+
+namespace
+{
+    using steady_clock = std::chrono::steady_clock;
+
+    /*Defeats dead code elimination of the measured calls*/
+    volatile size_t sink;
+
+    template<typename F>
+    void measure(const char* name, size_t iterations, F&& f)
+    {
+        auto start = steady_clock::now();
+        for(size_t i = 0; i < iterations; ++i)
+        {
+            sink = f();
+        }
+        std::chrono::duration<double, std::nano> elapsed = steady_clock::now() - start;
+        printf("%-28s %10.1f ns/op\n", name, elapsed.count() / iterations);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+
+    /*svc.vessel A query with and without an EDNS0 OPT record*/
+    std::vector<uint8_t> query = {0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+                                  3, 's', 'v', 'c', 6, 'v', 'e', 's', 's', 'e', 'l', 0,
+                                  0, 1, 0, 1};
+    std::vector<uint8_t> edns_query = query;
+    edns_query[11] = 1;
+    edns_query.insert(edns_query.end(), {0, 0, 41, 0x10, 0x00, 0, 0, 0, 0, 0, 0});
+
+    std::vector<std::string> one_addr = {"192.168.9.3"};
+    std::vector<std::string> many_addrs;
+    for(int i = 0; i < 100; ++i)
+    {
+        many_addrs.push_back("10.0.0." + std::to_string(i + 1));
+    }
+    std::vector<in_addr_t> net_addrs(many_addrs.size(), 0x0100000a);
+
+    embdns::dns_query parsed = embdns::parse_packet(query.data(), query.size());
+    embdns::dns_query parsed_edns = embdns::parse_packet(edns_query.data(), edns_query.size());
+    std::vector<uint8_t> response;
+
+    measure("parse_packet", iterations, [&]() {
+        return embdns::parse_packet(query.data(), query.size()).qname.size();
+    });
+
+    measure("parse_packet edns", iterations, [&]() {
+        return embdns::parse_packet(edns_query.data(), edns_query.size()).qname.size();
+    });
+
+    measure("generate_response empty", iterations, [&]() {
+        return embdns::generate_response(response, parsed, parsed.max_udp_response_size());
+    });
+
+    measure("generate_response 1 addr", iterations, [&]() {
+        return embdns::generate_response(response, parsed, one_addr, 35, parsed.max_udp_response_size());
+    });
+
+    measure("generate_response 100 str", iterations, [&]() {
+        return embdns::generate_response(response, parsed_edns, many_addrs, 35,
+                                         parsed_edns.max_udp_response_size());
+    });
+
+    measure("generate_response 100 net", iterations, [&]() {
+        return embdns::generate_response(response, parsed_edns, net_addrs, 35,
+                                         parsed_edns.max_udp_response_size());
+    });
+
+    measure("parse + generate 1 addr", iterations, [&]() {
+        embdns::dns_query q = embdns::parse_packet(query.data(), query.size());
+        return embdns::generate_response(response, q, one_addr, 35, q.max_udp_response_size());
+    });
+
+    return 0;
+}